@@ -0,0 +1,103 @@
+/*
+ * almacen_cadenas.c: Almacén de cadenas sin repetidas del indexador.
+ * Una tabla hash abierta (sondeo lineal, carga máxima 1/2) indexa los
+ * textos por su xxHash64; las coincidencias de huella se confirman
+ * comparando los bytes.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "almacen_cadenas.h"
+#include "indice.h"
+#include "registros.h"
+
+#define CAP_INICIAL_TABLA 1024
+#define MAX_BYTES_ALMACEN ((size_t)UINT32_MAX) // Los desplazamientos de Registro son de 32 bits
+
+void almacen_iniciar(AlmacenCadenas *a) {
+    memset(a, 0, sizeof(*a));
+}
+
+void almacen_liberar(AlmacenCadenas *a) {
+    free(a->datos);
+    free(a->desps);
+    free(a->huellas);
+    free(a->ordinales);
+    memset(a, 0, sizeof(*a));
+}
+
+const char *almacen_cadena(const AlmacenCadenas *a, uint64_t ordinal, size_t *len) {
+    const char *texto = NULL;
+    registro_cadena_leer((const uint8_t *)a->datos + a->desps[ordinal], a->tam - a->desps[ordinal], &texto, len);
+    return texto;
+}
+
+// Duplica la tabla hash y vuelve a colocar todos los ordinales.
+static int agrandar_tabla(AlmacenCadenas *a) {
+    size_t cap = a->cap_tabla ? a->cap_tabla * 2 : CAP_INICIAL_TABLA;
+    uint64_t *huellas = malloc(cap * sizeof(uint64_t));
+    uint32_t *ordinales = calloc(cap, sizeof(uint32_t));
+    if (!huellas || !ordinales) {
+        free(huellas);
+        free(ordinales);
+        return -1;
+    }
+    for (size_t i = 0; i < a->cap_tabla; i++) {
+        if (!a->ordinales[i]) continue;
+        size_t j = a->huellas[i] & (cap - 1);
+        while (ordinales[j]) j = (j + 1) & (cap - 1);
+        huellas[j] = a->huellas[i];
+        ordinales[j] = a->ordinales[i];
+    }
+    free(a->huellas);
+    free(a->ordinales);
+    a->huellas = huellas;
+    a->ordinales = ordinales;
+    a->cap_tabla = cap;
+    return 0;
+}
+
+// Hace crecer un arreglo al doble hasta que quepan necesarios elementos.
+static int asegurar_capacidad(void **arreglo, size_t *cap, size_t necesarios, size_t tam_elemento) {
+    if (necesarios <= *cap) return 0;
+    size_t nueva = *cap ? *cap : 4096;
+    while (nueva < necesarios) nueva *= 2;
+    void *p = realloc(*arreglo, nueva * tam_elemento);
+    if (!p) return -1;
+    *arreglo = p;
+    *cap = nueva;
+    return 0;
+}
+
+int64_t almacen_agregar(AlmacenCadenas *a, const char *texto, size_t len) {
+    if (len >= REGISTRO_MAX_CADENA) len = REGISTRO_MAX_CADENA - 1;
+    if ((a->num + 1) * 2 > a->cap_tabla && agrandar_tabla(a) != 0) return -1;
+
+    uint64_t huella = hash_clave(texto, len, 0);
+    size_t j = huella & (a->cap_tabla - 1);
+    while (a->ordinales[j]) {
+        if (a->huellas[j] == huella) {
+            uint32_t ordinal = a->ordinales[j] - 1;
+            size_t len_existente;
+            const char *existente = almacen_cadena(a, ordinal, &len_existente);
+            if (len_existente == len && memcmp(existente, texto, len) == 0) return ordinal;
+        }
+        j = (j + 1) & (a->cap_tabla - 1);
+    }
+
+    // Texto nuevo: se codifica al final de datos.
+    size_t necesarios = a->tam + INDICE_VARINT_MAX + len + 1;
+    if (necesarios > MAX_BYTES_ALMACEN || a->num >= UINT32_MAX - 1) return -1;
+    if (asegurar_capacidad((void **)&a->datos, &a->cap, necesarios, 1) != 0 ||
+        asegurar_capacidad((void **)&a->desps, &a->cap_desps, a->num + 1, sizeof(uint64_t)) != 0) {
+        return -1;
+    }
+    a->desps[a->num] = a->tam;
+    a->tam += indice_varint_escribir((uint8_t *)a->datos + a->tam, len);
+    memcpy(a->datos + a->tam, texto, len);
+    a->tam += len;
+    a->datos[a->tam++] = '\0';
+
+    a->huellas[j] = huella;
+    a->ordinales[j] = (uint32_t)a->num + 1;
+    return a->num++;
+}
@@ -0,0 +1,38 @@
+/*
+ * almacen_cadenas.h: Almacén de cadenas sin repetidas del indexador.
+ * Cada texto distinto se guarda una sola vez, en el orden en que aparece
+ * por primera vez, con el formato de cadena de spotify.records
+ * ([longitud en varint][bytes][\0]). Cada texto recibe un ordinal
+ * (0, 1, 2, ...) y un desplazamiento dentro del almacén.
+ */
+#ifndef ALMACEN_CADENAS_H
+#define ALMACEN_CADENAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct AlmacenCadenas {
+    char *datos;            // Cadenas codificadas, una tras otra
+    size_t tam;
+    size_t cap;
+    uint64_t *desps;        // Desplazamiento de cada ordinal en datos
+    size_t num;
+    size_t cap_desps;
+    uint64_t *huellas;      // Tabla hash abierta: huella del texto
+    uint32_t *ordinales;    // y ordinal + 1 (0 = hueco libre)
+    size_t cap_tabla;       // Potencia de 2
+} AlmacenCadenas;
+
+void almacen_iniciar(AlmacenCadenas *a);
+void almacen_liberar(AlmacenCadenas *a);
+
+/*
+ * Devuelve el ordinal del texto (de len bytes), añadiéndolo si es nuevo.
+ * Devuelve -1 si no hay memoria o si el almacén supera los 4 GiB.
+ */
+int64_t almacen_agregar(AlmacenCadenas *a, const char *texto, size_t len);
+
+// Texto (terminado en '\0') del ordinal dado y su longitud.
+const char *almacen_cadena(const AlmacenCadenas *a, uint64_t ordinal, size_t *len);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * arena.c: Arena de memoria de las consultas (ver arena.h).
+ * Los bloques forman una lista del más nuevo al más viejo; cada uno nuevo
+ * duplica al anterior (o alcanza justo para la petición), de modo que una
+ * consulta grande hace pocas reservas.
+ */
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_PRIMER_BLOQUE (64 * 1024)
+#define ARENA_ALINEACION 16
+
+// Cabecera de un bloque. Con dos campos de 8 bytes los datos quedan
+// alineados a 16, como lo que devuelve malloc.
+struct BloqueArena {
+    BloqueArena *anterior;
+    size_t tam;            // Bytes de datos
+    char datos[];
+};
+
+void *arena_pedir(Arena *a, size_t bytes) {
+    if (bytes > SIZE_MAX / 4) return NULL;
+    bytes = (bytes + ARENA_ALINEACION - 1) & ~(size_t)(ARENA_ALINEACION - 1);
+    if (a->bloque && a->bloque->tam - a->usado >= bytes) {
+        void *p = a->bloque->datos + a->usado;
+        a->usado += bytes;
+        return p;
+    }
+
+    // Bloque nuevo: lo que quede del actual se pierde hasta reiniciar.
+    size_t tam = a->bloque ? a->bloque->tam * 2 : ARENA_PRIMER_BLOQUE;
+    if (tam < bytes) tam = bytes;
+    if (a->limite) {
+        size_t libre = a->limite > a->reservado ? a->limite - a->reservado : 0;
+        if (libre < sizeof(BloqueArena) + bytes) {
+            a->rechazos++;
+            return NULL;
+        }
+        if (tam > libre - sizeof(BloqueArena)) tam = libre - sizeof(BloqueArena);
+    }
+    BloqueArena *b = malloc(sizeof(BloqueArena) + tam);
+    if (!b) return NULL;
+    b->anterior = a->bloque;
+    b->tam = tam;
+    a->bloque = b;
+    a->usado = bytes;
+    a->reservado += sizeof(BloqueArena) + tam;
+    if (a->reservado > a->pico) a->pico = a->reservado;
+    return b->datos;
+}
+
+void arena_reiniciar(Arena *a) {
+    while (a->bloque && a->bloque->anterior) {
+        BloqueArena *anterior = a->bloque->anterior;
+        a->reservado -= sizeof(BloqueArena) + a->bloque->tam;
+        free(a->bloque);
+        a->bloque = anterior;
+    }
+    a->usado = 0;
+}
+
+void arena_liberar(Arena *a) {
+    arena_reiniciar(a);
+    free(a->bloque);
+    a->bloque = NULL;
+    a->reservado = 0;
+}
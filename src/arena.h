@@ -0,0 +1,39 @@
+/*
+ * arena.h: Memoria de trabajo de las consultas del servidor.
+ * Los buffers que una consulta necesita solo mientras se ejecuta (la lista
+ * de filas de su clave, los saltos de las listas de trigramas, los rangos
+ * de un lote) se piden a una arena con un simple avance de puntero y se
+ * devuelven todos juntos al reiniciarla cuando la consulta sale de
+ * consulta.c. El primer bloque se conserva entre consultas, así que una
+ * consulta normal no llama a malloc; los bloques que se añadan para una
+ * consulta grande se liberan al reiniciar. Con un límite, la arena nunca
+ * reserva más de esa cantidad y las peticiones que no caben fallan.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct BloqueArena BloqueArena;
+
+typedef struct Arena {
+    BloqueArena *bloque;   // Bloque en uso; los anteriores cuelgan de él
+    size_t usado;          // Bytes usados del bloque en uso
+    size_t reservado;      // Bytes de todos los bloques, con sus cabeceras
+    size_t limite;         // Máximo de reservado (0: sin límite)
+    size_t pico;           // Máximo de reservado alcanzado
+    uint64_t rechazos;     // Peticiones que no cupieron en el límite
+} Arena;
+
+// Devuelve bytes de memoria alineada a 16 o NULL si no caben en el límite
+// (o no hay memoria). Vale hasta el próximo arena_reiniciar.
+void *arena_pedir(Arena *a, size_t bytes);
+
+// Devuelve toda la memoria pedida y libera los bloques salvo el primero.
+void arena_reiniciar(Arena *a);
+
+// Libera también el primer bloque. La arena puede volver a usarse.
+void arena_liberar(Arena *a);
+
+#endif
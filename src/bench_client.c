@@ -0,0 +1,460 @@
+/*
+ * bench_client.c: Generador de carga y medidor de latencia de searcher_s.
+ * Repite las consultas de un archivo (una por línea) o, sin archivo,
+ * claves "album|artista|" reales tomadas al azar de spotify.records, desde
+ * varias conexiones a la vez, y mide cuánto tarda cada respuesta completa.
+ * Por defecto cada conexión se reutiliza con el protocolo de tramas (ver
+ * protocolo.h); con -t cada consulta abre su propia conexión de texto.
+ * En lazo cerrado (por defecto) cada conexión envía la siguiente consulta
+ * al recibir la respuesta anterior. En lazo abierto (-r QPS) las consultas
+ * tienen un instante de salida fijo y la latencia se cuenta desde ese
+ * instante, no desde que se pudo enviar: si el servidor se atasca, las
+ * consultas que debían salir mientras tanto cuentan la espera (se corrige
+ * la omisión coordinada). Las latencias se acumulan en un histograma
+ * log-lineal con precisión relativa fija, como HdrHistogram, y al final se
+ * imprimen las QPS y la distribución por percentiles en su formato.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocolo.h"
+#include "registros.h"
+
+#define MAX_CONEXIONES 1024
+#define MAX_LINEA 2048
+#define BUFFER_RESPUESTA 65536
+// Histograma: cada potencia de 2 se divide en 128 cubetas (error < 1%).
+#define HIST_BITS_SUB 7
+#define HIST_SUB (1 << HIST_BITS_SUB)
+#define HIST_CUBETAS (HIST_SUB * 58) // Cubre cualquier uint64_t
+#define TICKS_POR_MITAD 5 // Líneas de la tabla por cada mitad de la distribución restante
+
+typedef struct Histograma {
+    uint64_t cuentas[HIST_CUBETAS];
+    uint64_t total;
+    uint64_t minimo, maximo;
+    double suma, suma_cuadrados;
+} Histograma;
+
+// Estado de cada hilo: una conexión y lo que midió.
+typedef struct Hilo {
+    pthread_t id;
+    int fd;
+    Histograma hist;
+    uint64_t errores;
+    uint64_t bytes;
+    char *buffer;
+} Hilo;
+
+// Configuración, compartida por todos los hilos.
+static struct sockaddr_in servidor;
+static char **consultas;
+static size_t num_consultas;
+static int num_conexiones = 4;
+static uint64_t total_consultas = 10000; // 0: hasta agotar la duración
+static double duracion = 0;              // Segundos (0: hasta total_consultas)
+static double tasa = 0;                  // QPS objetivo en lazo abierto (0: lazo cerrado)
+static int conexion_por_consulta = 0;
+static double inicio;
+static uint64_t siguiente_turno;          // Turnos repartidos (atómico)
+
+static double ahora(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Histograma ---
+
+static int hist_indice(uint64_t v) {
+    int bits = v ? 64 - __builtin_clzll(v) : 0;
+    int e = bits > HIST_BITS_SUB + 1 ? bits - HIST_BITS_SUB - 1 : 0;
+    return HIST_SUB * e + (int)(v >> e);
+}
+
+// Mayor valor que cae en la cubeta i.
+static uint64_t hist_tope(int i) {
+    if (i < 2 * HIST_SUB) return i;
+    int e = i / HIST_SUB - 1;
+    uint64_t m = i - HIST_SUB * e;
+    return ((m + 1) << e) - 1;
+}
+
+static void hist_agregar(Histograma *h, uint64_t v) {
+    h->cuentas[hist_indice(v)]++;
+    if (h->total == 0 || v < h->minimo) h->minimo = v;
+    if (v > h->maximo) h->maximo = v;
+    h->total++;
+    h->suma += v;
+    h->suma_cuadrados += (double)v * v;
+}
+
+static void hist_unir(Histograma *dst, const Histograma *src) {
+    if (src->total == 0) return;
+    for (int i = 0; i < HIST_CUBETAS; i++) dst->cuentas[i] += src->cuentas[i];
+    if (dst->total == 0 || src->minimo < dst->minimo) dst->minimo = src->minimo;
+    if (src->maximo > dst->maximo) dst->maximo = src->maximo;
+    dst->total += src->total;
+    dst->suma += src->suma;
+    dst->suma_cuadrados += src->suma_cuadrados;
+}
+
+// Valor por debajo del cual (o igual) queda la fracción p de las muestras.
+static uint64_t hist_percentil(const Histograma *h, double p) {
+    uint64_t objetivo = (uint64_t)ceil(p * h->total);
+    if (objetivo == 0) objetivo = 1;
+    uint64_t acumulado = 0;
+    for (int i = 0; i < HIST_CUBETAS; i++) {
+        acumulado += h->cuentas[i];
+        if (acumulado >= objetivo) return hist_tope(i) < h->maximo ? hist_tope(i) : h->maximo;
+    }
+    return h->maximo;
+}
+
+/*
+ * Escribe la distribución con el formato de HdrHistogram
+ * (outputPercentileDistribution, valores en milisegundos): cada mitad de
+ * la distribución que queda se divide en TICKS_POR_MITAD líneas, así que
+ * la cola tiene tanto detalle como la mediana.
+ */
+static void hist_imprimir(const Histograma *h, FILE *f) {
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for (double mitad = 1.0; mitad * h->total >= 0.5; mitad /= 2) {
+        for (int t = 0; t < TICKS_POR_MITAD; t++) {
+            double p = 1.0 - mitad + mitad / 2 * t / TICKS_POR_MITAD;
+            uint64_t cuenta = (uint64_t)ceil(p * h->total);
+            fprintf(f, "%12.3f %14.12f %10llu %14.2f\n", hist_percentil(h, p) / 1e6, p,
+                    (unsigned long long)cuenta, 1.0 / (1.0 - p));
+        }
+    }
+    fprintf(f, "%12.3f %14.12f %10llu\n", h->maximo / 1e6, 1.0, (unsigned long long)h->total);
+    double media = h->total ? h->suma / h->total : 0;
+    double varianza = h->total ? h->suma_cuadrados / h->total - media * media : 0;
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", media / 1e6, sqrt(varianza > 0 ? varianza : 0) / 1e6);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", h->maximo / 1e6, (unsigned long long)h->total);
+    fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_CUBETAS / HIST_SUB, HIST_SUB);
+}
+
+// --- Consultas ---
+
+static int agregar_consulta(size_t *cap, const char *texto) {
+    if (num_consultas == *cap) {
+        size_t nueva_cap = *cap ? *cap * 2 : 1024;
+        char **nuevas = realloc(consultas, sizeof(char *) * nueva_cap);
+        if (!nuevas) return -1;
+        consultas = nuevas;
+        *cap = nueva_cap;
+    }
+    if (!(consultas[num_consultas] = strdup(texto))) return -1;
+    num_consultas++;
+    return 0;
+}
+
+// Lee una consulta por línea; se ignoran las vacías.
+static int leer_consultas(const char *ruta) {
+    FILE *f = fopen(ruta, "r");
+    if (!f) {
+        perror(ruta);
+        return -1;
+    }
+    char linea[MAX_LINEA];
+    size_t cap = 0;
+    while (fgets(linea, sizeof(linea), f)) {
+        linea[strcspn(linea, "\r\n")] = '\0';
+        if (linea[0] && agregar_consulta(&cap, linea) != 0) break;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Lee la cadena del almacén de spotify.records en el desplazamiento dado.
+static const char *leer_cadena(int fd, const RegistrosCabecera *cab, uint32_t desp, char *buffer, size_t tam) {
+    if (desp >= cab->bytes_cadenas) return NULL;
+    size_t pedir = cab->bytes_cadenas - desp < tam ? cab->bytes_cadenas - desp : tam;
+    if (pread(fd, buffer, pedir, cab->desp_cadenas + desp) != (ssize_t)pedir) return NULL;
+    const char *texto;
+    size_t len;
+    return registro_cadena_leer((const uint8_t *)buffer, pedir, &texto, &len) == 0 ? texto : NULL;
+}
+
+// Toma n claves "album|artista|" de registros al azar de spotify.records.
+static int muestrear_claves(size_t n, unsigned semilla) {
+    int fd = open("spotify.records", O_RDONLY);
+    RegistrosCabecera cab;
+    if (fd < 0 || pread(fd, &cab, sizeof(cab), 0) != sizeof(cab) || !registros_cabecera_valida(&cab) ||
+        cab.num_registros == 0) {
+        fprintf(stderr, "No se pudo leer 'spotify.records' para tomar claves; ejecute el indexador o use -f\n");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char album_buf[REGISTRO_MAX_CADENA + INDICE_VARINT_MAX], artista_buf[REGISTRO_MAX_CADENA + INDICE_VARINT_MAX];
+    char clave[2 * REGISTRO_MAX_CADENA + 2];
+    size_t cap = 0;
+    for (size_t i = 0, intentos = 0; i < n && intentos < 4 * n; intentos++) {
+        uint64_t numero = (((uint64_t)rand_r(&semilla) << 31) ^ (uint64_t)rand_r(&semilla)) % cab.num_registros;
+        Registro r;
+        if (pread(fd, &r, sizeof(r), cab.desp_registros + numero * sizeof(Registro)) != sizeof(r)) continue;
+        const char *album = leer_cadena(fd, &cab, r.album, album_buf, sizeof(album_buf));
+        const char *artista = leer_cadena(fd, &cab, r.artista, artista_buf, sizeof(artista_buf));
+        if (!album || !artista || !album[0] || !artista[0]) continue;
+        snprintf(clave, sizeof(clave), "%s|%s|", album, artista);
+        if (agregar_consulta(&cap, clave) != 0) break;
+        i++;
+    }
+    close(fd);
+    return 0;
+}
+
+// --- Conexiones ---
+
+static int conectar(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int uno = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+    if (connect(fd, (struct sockaddr *)&servidor, sizeof(servidor)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int enviar_todo(int fd, const void *datos, size_t len) {
+    const char *p = datos;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recibir_todo(int fd, void *datos, size_t len) {
+    char *p = datos;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Protocolo de texto: una conexión por consulta, respuesta hasta el cierre.
+static int consulta_texto(Hilo *h, const char *texto) {
+    int fd = conectar();
+    if (fd < 0) return -1;
+    int estado = enviar_todo(fd, texto, strlen(texto));
+    while (estado == 0) {
+        ssize_t n = recv(fd, h->buffer, BUFFER_RESPUESTA, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) estado = -1;
+        if (n <= 0) break;
+        h->bytes += n;
+    }
+    close(fd);
+    return estado;
+}
+
+// Recibe tramas hasta la última de la respuesta con el identificador id.
+// Devuelve 0, 1 si el servidor respondió con un error o -1 si la conexión falló.
+static int recibir_respuesta(Hilo *h, uint32_t id) {
+    while (1) {
+        char cabecera[PROTO_CABECERA_TAM];
+        TramaCabecera cab;
+        if (recibir_todo(h->fd, cabecera, sizeof(cabecera)) != 0 || proto_leer_cabecera(cabecera, &cab) != 0) return -1;
+        for (uint32_t resto = cab.longitud; resto > 0;) {
+            uint32_t n = resto < BUFFER_RESPUESTA ? resto : BUFFER_RESPUESTA;
+            if (recibir_todo(h->fd, h->buffer, n) != 0) return -1;
+            resto -= n;
+        }
+        h->bytes += PROTO_CABECERA_TAM + cab.longitud;
+        if (cab.id == id && !(cab.banderas & PROTO_CONTINUA)) return cab.tipo == PROTO_RESPUESTA ? 0 : 1;
+    }
+}
+
+// Protocolo de tramas sobre la conexión del hilo, que se abre si hace falta.
+static int consulta_tramas(Hilo *h, const char *texto, uint32_t id) {
+    size_t len = strlen(texto);
+    if (len > PROTO_MAX_CONSULTA) return -1;
+    if (h->fd < 0 && (h->fd = conectar()) < 0) return -1;
+    char trama[PROTO_CABECERA_TAM + PROTO_MAX_CONSULTA];
+    proto_escribir_cabecera(trama, PROTO_CONSULTA, 0, id, len);
+    memcpy(trama + PROTO_CABECERA_TAM, texto, len);
+    int estado = enviar_todo(h->fd, trama, PROTO_CABECERA_TAM + len);
+    if (estado == 0) estado = recibir_respuesta(h, id);
+    if (estado < 0) {
+        // La conexión quedó en un estado desconocido: se abre otra.
+        close(h->fd);
+        h->fd = -1;
+    }
+    return estado == 0 ? 0 : -1;
+}
+
+// Espera hasta el instante t (segundos de ahora()).
+static void esperar_hasta(double t) {
+    double falta = t - ahora();
+    if (falta <= 0) return;
+    struct timespec ts = {(time_t)falta, (long)((falta - (time_t)falta) * 1e9)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static void *ejecutar_hilo(void *arg) {
+    Hilo *h = arg;
+    while (1) {
+        uint64_t turno = __atomic_fetch_add(&siguiente_turno, 1, __ATOMIC_RELAXED);
+        if (total_consultas && turno >= total_consultas) break;
+        // En lazo abierto el turno fija el instante de salida.
+        double salida = tasa > 0 ? inicio + turno / tasa : ahora();
+        if (duracion > 0 && salida - inicio >= duracion) break;
+        if (tasa > 0) esperar_hasta(salida);
+        const char *texto = consultas[turno % num_consultas];
+        int estado = conexion_por_consulta ? consulta_texto(h, texto) : consulta_tramas(h, texto, (uint32_t)turno);
+        double fin = ahora();
+        if (estado != 0) {
+            h->errores++;
+            continue;
+        }
+        hist_agregar(&h->hist, (uint64_t)((fin - salida) * 1e9));
+    }
+    if (h->fd >= 0) close(h->fd);
+    return NULL;
+}
+
+static void uso(const char *programa) {
+    fprintf(stderr, "Uso: %s [-f ARCHIVO | -k N] [-c CONEXIONES] [-n TOTAL | -d SEGUNDOS] [-r QPS] [-t]\n"
+                    "          [-h IP] [-p PUERTO] [-s SEMILLA] [-o ARCHIVO]\n"
+                    "  -f ARCHIVO  Consultas a repetir, una por línea\n"
+                    "  -k N        Sin -f: toma N claves album|artista al azar de spotify.records (por defecto 1000)\n"
+                    "  -c N        Conexiones (hilos) concurrentes (por defecto 4)\n"
+                    "  -n TOTAL    Consultas a enviar (por defecto 10000)\n"
+                    "  -d SEGUNDOS Envía durante ese tiempo en lugar de un total\n"
+                    "  -r QPS      Lazo abierto: consultas por segundo entre todas las conexiones\n"
+                    "  -t          Protocolo de texto, una conexión por consulta (sin reutilizar)\n"
+                    "  -o ARCHIVO  Guarda también la distribución de latencias (.hgrm)\n",
+            programa);
+}
+
+int main(int argc, char *argv[]) {
+    const char *archivo = NULL, *ip = "127.0.0.1", *salida_hgrm = NULL;
+    int puerto = 8080;
+    int dio_total = 0;
+    size_t num_claves = 1000;
+    unsigned semilla = 1;
+    int opcion;
+    while ((opcion = getopt(argc, argv, "f:k:c:n:d:r:th:p:s:o:")) != -1) {
+        switch (opcion) {
+        case 'f': archivo = optarg; break;
+        case 'k': num_claves = strtoull(optarg, NULL, 10); break;
+        case 'c': num_conexiones = atoi(optarg); break;
+        case 'n':
+            total_consultas = strtoull(optarg, NULL, 10);
+            dio_total = 1;
+            break;
+        case 'd': duracion = atof(optarg); break;
+        case 'r': tasa = atof(optarg); break;
+        case 't': conexion_por_consulta = 1; break;
+        case 'h': ip = optarg; break;
+        case 'p': puerto = atoi(optarg); break;
+        case 's': semilla = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'o': salida_hgrm = optarg; break;
+        default:
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (num_conexiones < 1 || num_conexiones > MAX_CONEXIONES || num_claves == 0 || tasa < 0 || duracion < 0) {
+        uso(argv[0]);
+        return 1;
+    }
+    // Con duración el total deja de limitar, salvo que se diera también -n.
+    if (duracion > 0 && !dio_total) total_consultas = 0;
+    memset(&servidor, 0, sizeof(servidor));
+    servidor.sin_family = AF_INET;
+    servidor.sin_port = htons(puerto);
+    if (inet_pton(AF_INET, ip, &servidor.sin_addr) != 1) {
+        fprintf(stderr, "Dirección IP inválida: %s\n", ip);
+        return 1;
+    }
+
+    if ((archivo ? leer_consultas(archivo) : muestrear_claves(num_claves, semilla)) != 0) return 1;
+    if (num_consultas == 0) {
+        fprintf(stderr, "No hay consultas para enviar\n");
+        return 1;
+    }
+
+    Hilo *hilos = calloc(num_conexiones, sizeof(Hilo));
+    if (!hilos) {
+        perror("calloc");
+        return 1;
+    }
+    printf("%zu consultas distintas%s, %d conexiones, %s, %s\n", num_consultas,
+           archivo ? "" : " (claves de spotify.records)", num_conexiones,
+           conexion_por_consulta ? "una conexión de texto por consulta" : "conexiones reutilizadas (tramas)",
+           tasa > 0 ? "lazo abierto" : "lazo cerrado");
+    fflush(stdout);
+    inicio = ahora();
+    for (int i = 0; i < num_conexiones; i++) {
+        hilos[i].fd = -1;
+        hilos[i].buffer = malloc(BUFFER_RESPUESTA);
+        if (!hilos[i].buffer || pthread_create(&hilos[i].id, NULL, ejecutar_hilo, &hilos[i]) != 0) {
+            fprintf(stderr, "No se pudo lanzar el hilo %d\n", i);
+            return 1;
+        }
+    }
+    Histograma *total = calloc(1, sizeof(Histograma));
+    uint64_t errores = 0, bytes = 0;
+    for (int i = 0; i < num_conexiones; i++) {
+        pthread_join(hilos[i].id, NULL);
+        if (total) hist_unir(total, &hilos[i].hist);
+        errores += hilos[i].errores;
+        bytes += hilos[i].bytes;
+        free(hilos[i].buffer);
+    }
+    double transcurrido = ahora() - inicio;
+    if (!total) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("%llu respuestas y %llu errores en %.2f s: %.0f QPS", (unsigned long long)total->total,
+           (unsigned long long)errores, transcurrido, total->total / transcurrido);
+    if (tasa > 0) printf(" (objetivo %.0f)", tasa);
+    printf(", %.1f MB/s\n", bytes / transcurrido / 1e6);
+    if (total->total > 0) {
+        printf("Latencia (ms): p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  máx %.3f\n\n",
+               hist_percentil(total, 0.5) / 1e6, hist_percentil(total, 0.9) / 1e6,
+               hist_percentil(total, 0.99) / 1e6, hist_percentil(total, 0.999) / 1e6, total->maximo / 1e6);
+        hist_imprimir(total, stdout);
+        if (salida_hgrm) {
+            FILE *f = fopen(salida_hgrm, "w");
+            if (f) {
+                hist_imprimir(total, f);
+                fclose(f);
+            } else {
+                perror(salida_hgrm);
+            }
+        }
+    }
+    for (size_t i = 0; i < num_consultas; i++) free(consultas[i]);
+    free(consultas);
+    free(total);
+    free(hilos);
+    return errores ? 2 : 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * bench_csv.c: Micro-benchmark del separador de campos CSV.
+ * Compara, fila a fila, la extracción de los campos que usa el servidor
+ * (álbum, artistas, canción, duración y popularidad) con el método
+ * anterior (un recorrido carácter a carácter y un malloc por campo) y con
+ * csv_campos.c (una sola pasada vectorizada, sin reservas de memoria).
+ * Usa las líneas de spotify_data.csv si existe; si no, genera filas sintéticas.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csv_campos.h"
+
+#define MAX_LINE_LENGTH 8192
+#define MAX_FILAS 500000
+#define TIEMPO_MINIMO 1.0 // Segundos mínimos de medición por método
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} Linea;
+
+// --- Método anterior (copiado de searcher_s.c antes de csv_campos.c) ---
+
+static char *buscar_campo_legado(const char *line, size_t line_len, int campoABuscar) {
+    char *buffer = malloc(MAX_LINE_LENGTH);
+    if (!buffer) return NULL;
+    int campoActual = 1, in_quotes = 0, buffer_pos = 0;
+    const char *line_ptr = line;
+    const char *line_end = line + line_len;
+    while (line_ptr < line_end && *line_ptr) {
+        if (*line_ptr == '"' && (line_ptr + 1 == line_end || *(line_ptr + 1) != '"')) {
+            in_quotes = !in_quotes;
+        } else if (*line_ptr == ',' && !in_quotes) {
+            if (campoActual == campoABuscar) {
+                buffer[buffer_pos] = '\0';
+                return buffer;
+            }
+            campoActual++;
+            buffer_pos = 0;
+        } else if (campoActual == campoABuscar && buffer_pos < MAX_LINE_LENGTH - 1) {
+            buffer[buffer_pos++] = *line_ptr;
+        }
+        line_ptr++;
+    }
+    if (campoActual == campoABuscar) {
+        buffer[buffer_pos] = '\0';
+        return buffer;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static char *extraer_artista_legado(const char *json_string) {
+    const char *key = "'artist_name': '";
+    const char *comienzo = strstr(json_string, key);
+    if (!comienzo) return strdup(json_string);
+    comienzo += strlen(key);
+    const char *final = strchr(comienzo, '\'');
+    if (!final) return strdup(json_string);
+    return strndup(comienzo, final - comienzo);
+}
+
+static size_t fila_legado(const Linea *l) {
+    static const int columnas[] = {CSV_COL_ALBUM, CSV_COL_ARTISTAS, CSV_COL_CANCION,
+                                   CSV_COL_DURACION, CSV_COL_POPULARIDAD};
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(columnas) / sizeof(columnas[0]); i++) {
+        char *campo = buscar_campo_legado(l->ptr, l->len, columnas[i]);
+        if (!campo) continue;
+        if (columnas[i] == CSV_COL_ARTISTAS) {
+            char *artista = extraer_artista_legado(campo);
+            total += strlen(artista);
+            free(artista);
+        } else {
+            total += strlen(campo);
+        }
+        free(campo);
+    }
+    return total;
+}
+
+// --- Método nuevo ---
+
+static size_t fila_nueva(const Linea *l) {
+    static const int columnas[] = {CSV_COL_ALBUM, CSV_COL_CANCION, CSV_COL_DURACION, CSV_COL_POPULARIDAD};
+    CampoCsv campos[CSV_COL_POPULARIDAD];
+    char copia[MAX_LINE_LENGTH];
+    int n = csv_dividir_linea(l->ptr, l->len, campos, CSV_COL_POPULARIDAD);
+    size_t total = 0;
+    if (n >= CSV_COL_ARTISTAS) {
+        CampoCsv artista = csv_extraer_artista(&campos[CSV_COL_ARTISTAS - 1]);
+        total += csv_campo_copiar(&artista, copia, sizeof(copia));
+    }
+    for (size_t i = 0; i < sizeof(columnas) / sizeof(columnas[0]); i++) {
+        if (columnas[i] <= n) total += csv_campo_copiar(&campos[columnas[i] - 1], copia, sizeof(copia));
+    }
+    return total;
+}
+
+// --- Datos y medición ---
+
+static double ahora(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Carga hasta MAX_FILAS líneas del CSV (sin la cabecera) o genera filas sintéticas.
+static char *cargar_lineas(Linea *lineas, size_t *num_lineas, size_t *bytes) {
+    char *texto = NULL;
+    size_t tam = 0;
+    FILE *f = fopen("spotify_data.csv", "r");
+    if (f) {
+        size_t cap = 64 << 20;
+        texto = malloc(cap);
+        if (texto) tam = fread(texto, 1, cap, f);
+        fclose(f);
+        printf("Usando las primeras filas de spotify_data.csv\n");
+    } else {
+        size_t cap = 64 << 20;
+        texto = malloc(cap);
+        if (!texto) return NULL;
+        for (int i = 0; i < 200000 && tam + 1024 < cap; i++) {
+            tam += snprintf(texto + tam, cap - tam,
+                            "Album %d,%032x,2001-01-01,\"[{'artist_gid': '%032x', 'artist_name': 'Artista %d', "
+                            "'role': 'ARTIST_ROLE_MAIN_ARTIST'}]\",1,%d,False,\"Canción %d, parte \"\"%d\"\"\",%d,%d,%032x,{}\n",
+                            i % 5000, i, i * 7, i % 700, 120000 + i % 240000, i, i % 3, i % 12, i % 101, i * 13);
+        }
+        printf("spotify_data.csv no existe: usando filas sintéticas\n");
+    }
+    if (!texto) return NULL;
+
+    // Se omite la cabecera si el texto viene del CSV real.
+    char *p = texto, *fin = texto + tam;
+    if (f) {
+        char *salto = memchr(p, '\n', fin - p);
+        p = salto ? salto + 1 : fin;
+    }
+    *num_lineas = 0;
+    *bytes = 0;
+    while (p < fin && *num_lineas < MAX_FILAS) {
+        char *salto = memchr(p, '\n', fin - p);
+        if (!salto) break; // Se descarta la última línea si quedó cortada
+        lineas[*num_lineas].ptr = p;
+        lineas[*num_lineas].len = salto - p;
+        *bytes += salto - p + 1;
+        (*num_lineas)++;
+        p = salto + 1;
+    }
+    return texto;
+}
+
+static double medir(const char *nombre, size_t (*fila)(const Linea *), const Linea *lineas,
+                    size_t num_lineas, size_t bytes) {
+    volatile size_t sumidero = 0;
+    size_t pasadas = 0;
+    double inicio = ahora(), transcurrido;
+    do {
+        for (size_t i = 0; i < num_lineas; i++) sumidero += fila(&lineas[i]);
+        pasadas++;
+        transcurrido = ahora() - inicio;
+    } while (transcurrido < TIEMPO_MINIMO);
+    double filas_s = num_lineas * pasadas / transcurrido;
+    printf("%-28s %12.0f filas/s %10.1f MB/s\n", nombre, filas_s, bytes * pasadas / transcurrido / 1e6);
+    (void)sumidero;
+    return filas_s;
+}
+
+int main(void) {
+    Linea *lineas = malloc(sizeof(Linea) * MAX_FILAS);
+    size_t num_lineas, bytes;
+    char *texto = lineas ? cargar_lineas(lineas, &num_lineas, &bytes) : NULL;
+    if (!texto || num_lineas == 0) {
+        fprintf(stderr, "No hay filas para medir\n");
+        return 1;
+    }
+#if defined(__AVX2__)
+    const char *simd = "AVX2";
+#elif defined(__SSE2__)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "escalar";
+#endif
+    printf("%zu filas, %.1f MB, separador compilado con %s\n\n", num_lineas, bytes / 1e6, simd);
+
+    double legado = medir("anterior (malloc por campo)", fila_legado, lineas, num_lineas, bytes);
+    double nuevo = medir("csv_campos (una pasada)", fila_nueva, lineas, num_lineas, bytes);
+    printf("\nMejora: %.1fx\n", nuevo / legado);
+
+    free(texto);
+    free(lineas);
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * bench_indexer.c: Mide el rendimiento del indexador.
+ * Ejecuta "indexer --stats" varias veces sobre el spotify_data.csv del
+ * directorio actual (por ejemplo, uno hecho con generar_csv) y para cada
+ * ejecución informa el tiempo real, el de CPU, la memoria máxima y el
+ * caudal en filas y MB por segundo; al final da la mejor ejecución y la
+ * mediana, el tamaño de cada archivo generado y las estadísticas de
+ * cubetas y largos de lista de la última ejecución.
+ * Las opciones que siguen a "--" se pasan al indexador (p. ej. -- -j 4).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS 32
+#define MAX_REPETICIONES 100
+
+static const char *const archivos_generados[] = {
+    "spotify.index", "spotify.records", "spotify.trigrams", "spotify.artists", "spotify.albums"};
+#define NUM_GENERADOS (sizeof(archivos_generados) / sizeof(archivos_generados[0]))
+
+typedef struct Ejecucion {
+    double segundos;
+    double cpu;           // Usuario más sistema
+    long memoria_kb;      // Máximo de memoria residente
+    uint64_t filas;
+} Ejecucion;
+
+static double ahora(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double segundos_tv(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Ejecuta el indexador con argv y guarda en *salida lo que escribe por
+ * stdout (terminado en '\0'; el llamador lo libera). Devuelve 0 o -1.
+ */
+static int ejecutar_indexador(char *const argv[], Ejecucion *e, char **salida) {
+    int tubo[2];
+    if (pipe(tubo) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    double inicio = ahora();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(tubo[0]);
+        close(tubo[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(tubo[1], STDOUT_FILENO);
+        close(tubo[0]);
+        close(tubo[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(tubo[1]);
+
+    size_t cap = 4096, len = 0;
+    char *texto = malloc(cap);
+    ssize_t n;
+    while (texto) {
+        if (len + 1024 > cap) {
+            char *mayor = realloc(texto, cap * 2);
+            if (!mayor) {
+                free(texto);
+                texto = NULL;
+                break;
+            }
+            texto = mayor;
+            cap *= 2;
+        }
+        n = read(tubo[0], texto + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    close(tubo[0]);
+
+    int estado;
+    struct rusage uso;
+    while (wait4(pid, &estado, 0, &uso) < 0) {
+        if (errno != EINTR) {
+            perror("wait4");
+            free(texto);
+            return -1;
+        }
+    }
+    e->segundos = ahora() - inicio;
+    if (!texto || !WIFEXITED(estado) || WEXITSTATUS(estado) != 0) {
+        fprintf(stderr, "El indexador terminó con error\n");
+        if (texto) fputs(texto, stderr);
+        free(texto);
+        return -1;
+    }
+    texto[len] = '\0';
+    e->cpu = segundos_tv(uso.ru_utime) + segundos_tv(uso.ru_stime);
+    e->memoria_kb = uso.ru_maxrss;
+    const char *procesadas = strstr(texto, "Procesadas ");
+    e->filas = procesadas ? strtoull(procesadas + strlen("Procesadas "), NULL, 10) : 0;
+    *salida = texto;
+    return 0;
+}
+
+static int comparar_segundos(const void *a, const void *b) {
+    double x = ((const Ejecucion *)a)->segundos, y = ((const Ejecucion *)b)->segundos;
+    return (x > y) - (x < y);
+}
+
+static void imprimir_ejecucion(const char *nombre, const Ejecucion *e, double mb_csv) {
+    printf("%-10s %8.2f s  CPU %8.2f s  %8.1f MB RSS  %12.0f filas/s  %8.1f MB/s\n", nombre, e->segundos,
+           e->cpu, e->memoria_kb / 1024.0, e->filas / e->segundos, mb_csv / e->segundos);
+}
+
+static void uso(const char *programa) {
+    fprintf(stderr, "Uso: %s [-r REPETICIONES] [-i INDEXADOR] [-- OPCIONES_DEL_INDEXADOR]\n"
+                    "  -r REPETICIONES  Veces que se ejecuta el indexador (por defecto 3)\n"
+                    "  -i INDEXADOR     Ruta del indexador (por defecto ./indexer)\n",
+            programa);
+}
+
+int main(int argc, char *argv[]) {
+    int repeticiones = 3;
+    const char *indexador = "./indexer";
+    int opcion;
+    while ((opcion = getopt(argc, argv, "r:i:")) != -1) {
+        switch (opcion) {
+        case 'r': repeticiones = atoi(optarg); break;
+        case 'i': indexador = optarg; break;
+        default:
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (repeticiones < 1 || repeticiones > MAX_REPETICIONES || argc - optind > MAX_ARGS - 3) {
+        uso(argv[0]);
+        return 1;
+    }
+
+    char *args[MAX_ARGS];
+    int num_args = 0;
+    args[num_args++] = (char *)indexador;
+    args[num_args++] = "--stats";
+    for (int i = optind; i < argc; i++) args[num_args++] = argv[i];
+    args[num_args] = NULL;
+
+    struct stat st;
+    if (stat("spotify_data.csv", &st) < 0) {
+        perror("spotify_data.csv");
+        fprintf(stderr, "Genere uno con 'make dataset' o descargue el dataset\n");
+        return 1;
+    }
+    double mb_csv = st.st_size / 1e6;
+    printf("CSV: %.1f MB. Indexador:", mb_csv);
+    for (int i = 0; i < num_args; i++) printf(" %s", args[i]);
+    printf("\n\n");
+
+    Ejecucion ejecuciones[MAX_REPETICIONES];
+    char *salida = NULL;
+    for (int r = 0; r < repeticiones; r++) {
+        free(salida);
+        salida = NULL;
+        if (ejecutar_indexador(args, &ejecuciones[r], &salida) != 0) return 1;
+        char nombre[32];
+        snprintf(nombre, sizeof(nombre), "#%d", r + 1);
+        imprimir_ejecucion(nombre, &ejecuciones[r], mb_csv);
+    }
+    uint64_t filas = ejecuciones[0].filas;
+    qsort(ejecuciones, repeticiones, sizeof(Ejecucion), comparar_segundos);
+    printf("\n");
+    imprimir_ejecucion("mejor", &ejecuciones[0], mb_csv);
+    imprimir_ejecucion("mediana", &ejecuciones[repeticiones / 2], mb_csv);
+
+    printf("\nArchivos generados:\n");
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_GENERADOS; i++) {
+        if (stat(archivos_generados[i], &st) < 0) continue;
+        printf("  %-18s %12lld bytes  %7.2f bytes por fila\n", archivos_generados[i], (long long)st.st_size,
+               filas ? (double)st.st_size / filas : 0.0);
+        total += st.st_size;
+    }
+    printf("  %-18s %12llu bytes  %7.2f bytes por fila (%.0f%% del CSV)\n", "total", (unsigned long long)total,
+           filas ? (double)total / filas : 0.0, mb_csv > 0 ? total / 1e6 * 100 / mb_csv : 0.0);
+
+    // Las estadísticas de --stats de la última ejecución: cubetas y largos de lista.
+    const char *estadisticas = strstr(salida, "--- Estadísticas");
+    if (estadisticas) printf("\n%s", estadisticas);
+    free(salida);
+    return 0;
+}
@@ -0,0 +1,425 @@
+/*
+ * cache_consultas.c: Caché de respuestas compartida por los procesos del
+ * servidor.
+ * El segmento se divide en franjas independientes, cada una con su propio
+ * cerrojo (un pthread_mutex_t compartido entre procesos y robusto: si un
+ * proceso muere con él tomado, la franja se vacía y se sigue). La huella
+ * xxHash64 de la clave elige la franja y, dentro de ella, la cubeta de una
+ * tabla con encadenamiento. El contenido de cada entrada (clave y
+ * respuesta, una tras otra) se reparte en bloques de tamaño fijo
+ * enlazados, así que no hay fragmentación. Cuando faltan bloques se
+ * desaloja con el algoritmo CLOCK: la manecilla recorre las entradas,
+ * perdona una vez a las que se leyeron desde su última visita y desaloja
+ * la primera que no. Las entradas nuevas entran sin referencia, de modo
+ * que las consultas que solo llegan una vez se van antes que las populares.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "cache_consultas.h"
+#include "indice.h"
+
+#define CACHE_TAM_BLOQUE 512
+#define CACHE_FRANJAS 16         // Máximo; se usan menos si la caché es pequeña
+#define CACHE_MIN_BLOQUES 64     // Bloques mínimos por franja
+#define CACHE_ALINEACION 64      // Cada franja empieza en su propia línea de caché
+#define NINGUNO UINT32_MAX
+
+typedef struct CacheCabecera {
+    uint64_t generacion;  // Generación de los datos servidos
+    uint64_t aciertos;
+    uint64_t fallos;
+} CacheCabecera;
+
+typedef struct CacheEntrada {
+    uint64_t huella;
+    uint32_t siguiente;     // Siguiente entrada de la cubeta, o de la lista libre
+    uint32_t primer_bloque;
+    uint32_t len_clave;
+    uint32_t len_datos;
+    uint32_t num_bloques;
+    uint8_t en_uso;
+    uint8_t referencia;     // Bit de CLOCK: se leyó desde la última visita
+} CacheEntrada;
+
+// Cabecera de una franja. Le siguen sus cubetas, sus entradas, el enlace
+// al siguiente bloque de cada bloque y los bloques de datos.
+typedef struct Franja {
+    pthread_mutex_t cerrojo;
+    uint64_t generacion;       // Generación de las entradas guardadas
+    uint32_t manecilla;        // Próxima entrada que visita CLOCK
+    uint32_t entradas_libres;  // Lista de entradas sin usar
+    uint32_t bloques_libres;   // Lista de bloques sin usar
+    uint32_t num_bloques_libres;
+    uint32_t num_entradas;     // Entradas en uso
+} Franja;
+
+// Posición dentro del contenido de una entrada.
+typedef struct Cursor {
+    uint32_t bloque;
+    uint32_t pos;
+} Cursor;
+
+// Disposición del segmento. Se calcula antes de fork() y los hijos la heredan.
+static CacheCabecera *cabecera;
+static char *franjas;
+static uint64_t generacion_inicial; // La fijada antes de crear la caché
+static size_t tam_segmento;
+static size_t tam_franja;
+static uint32_t num_franjas;
+static uint32_t num_bloques;   // Por franja; también es el número de entradas
+static uint32_t num_cubetas;   // Por franja (potencia de 2)
+static uint32_t max_bloques_entrada;
+static size_t desp_cubetas, desp_entradas, desp_enlaces, desp_datos;
+
+static volatile sig_atomic_t estadisticas_pedidas;
+
+static size_t alinear(size_t n) {
+    return (n + CACHE_ALINEACION - 1) & ~(size_t)(CACHE_ALINEACION - 1);
+}
+
+static uint32_t cubetas_para(uint32_t bloques) {
+    uint32_t n = 1;
+    while (n < bloques) n <<= 1;
+    return n;
+}
+
+// Calcula los desplazamientos de una franja de bloques bloques y devuelve
+// su tamaño total.
+static size_t disponer_franja(uint32_t bloques) {
+    num_cubetas = cubetas_para(bloques);
+    desp_cubetas = alinear(sizeof(Franja));
+    desp_entradas = alinear(desp_cubetas + (size_t)num_cubetas * sizeof(uint32_t));
+    desp_enlaces = desp_entradas + (size_t)bloques * sizeof(CacheEntrada);
+    desp_datos = alinear(desp_enlaces + (size_t)bloques * sizeof(uint32_t));
+    return alinear(desp_datos + (size_t)bloques * CACHE_TAM_BLOQUE);
+}
+
+static Franja *franja_num(uint32_t i) {
+    return (Franja *)(franjas + (size_t)i * tam_franja);
+}
+
+static uint32_t *cubetas_de(Franja *f) {
+    return (uint32_t *)((char *)f + desp_cubetas);
+}
+
+static CacheEntrada *entradas_de(Franja *f) {
+    return (CacheEntrada *)((char *)f + desp_entradas);
+}
+
+static uint32_t *enlaces_de(Franja *f) {
+    return (uint32_t *)((char *)f + desp_enlaces);
+}
+
+static char *bloque_de(Franja *f, uint32_t bloque) {
+    return (char *)f + desp_datos + (size_t)bloque * CACHE_TAM_BLOQUE;
+}
+
+// Deja la franja vacía y con la generación actual. Se llama con el cerrojo tomado.
+static void vaciar_franja(Franja *f) {
+    uint32_t *cubetas = cubetas_de(f);
+    CacheEntrada *entradas = entradas_de(f);
+    uint32_t *enlaces = enlaces_de(f);
+    for (uint32_t i = 0; i < num_cubetas; i++) cubetas[i] = NINGUNO;
+    for (uint32_t i = 0; i < num_bloques; i++) {
+        entradas[i].en_uso = 0;
+        entradas[i].siguiente = i + 1 < num_bloques ? i + 1 : NINGUNO;
+        enlaces[i] = i + 1 < num_bloques ? i + 1 : NINGUNO;
+    }
+    f->generacion = __atomic_load_n(&cabecera->generacion, __ATOMIC_ACQUIRE);
+    f->manecilla = 0;
+    f->entradas_libres = 0;
+    f->bloques_libres = 0;
+    f->num_bloques_libres = num_bloques;
+    f->num_entradas = 0;
+}
+
+// Toma el cerrojo de la franja. Si su dueño murió con él tomado o si las
+// entradas son de otra generación, la franja se vacía.
+static int bloquear_franja(Franja *f) {
+    int r = pthread_mutex_lock(&f->cerrojo);
+    if (r == EOWNERDEAD) {
+        vaciar_franja(f);
+        pthread_mutex_consistent(&f->cerrojo);
+    } else if (r != 0) {
+        return -1;
+    }
+    if (f->generacion != __atomic_load_n(&cabecera->generacion, __ATOMIC_ACQUIRE)) vaciar_franja(f);
+    return 0;
+}
+
+int cache_iniciar(size_t bytes_max) {
+    size_t disponible = bytes_max > alinear(sizeof(CacheCabecera)) ? bytes_max - alinear(sizeof(CacheCabecera)) : 0;
+    size_t coste_bloque = CACHE_TAM_BLOQUE + sizeof(CacheEntrada) + 3 * sizeof(uint32_t);
+
+    // Con pocas franjas hay más contención, pero con franjas muy pequeñas
+    // no caben las respuestas grandes: se reducen hasta que cada una tenga
+    // al menos CACHE_MIN_BLOQUES bloques.
+    for (num_franjas = CACHE_FRANJAS; num_franjas >= 1; num_franjas /= 2) {
+        size_t presupuesto = disponible / num_franjas;
+        size_t bloques = presupuesto / coste_bloque;
+        if (bloques > UINT32_MAX - 1) bloques = UINT32_MAX - 1;
+        while (bloques >= CACHE_MIN_BLOQUES && disponer_franja(bloques) > presupuesto) bloques--;
+        if (bloques >= CACHE_MIN_BLOQUES) {
+            num_bloques = bloques;
+            break;
+        }
+    }
+    if (num_franjas == 0) {
+        fprintf(stderr, "Caché de respuestas: %zu bytes no alcanzan; se desactiva.\n", bytes_max);
+        return -1;
+    }
+    tam_franja = disponer_franja(num_bloques);
+    // Una sola respuesta no puede quedarse con más de un cuarto de su franja.
+    max_bloques_entrada = num_bloques / 4;
+    tam_segmento = alinear(sizeof(CacheCabecera)) + (size_t)num_franjas * tam_franja;
+
+    void *segmento = mmap(NULL, tam_segmento, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segmento == MAP_FAILED) {
+        fprintf(stderr, "Caché de respuestas: no se pudo crear el segmento compartido: %s\n", strerror(errno));
+        return -1;
+    }
+    cabecera = segmento;
+    cabecera->generacion = generacion_inicial;
+    franjas = (char *)segmento + alinear(sizeof(CacheCabecera));
+
+    pthread_mutexattr_t atributos;
+    pthread_mutexattr_init(&atributos);
+    pthread_mutexattr_setpshared(&atributos, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&atributos, PTHREAD_MUTEX_ROBUST);
+    for (uint32_t i = 0; i < num_franjas; i++) {
+        Franja *f = franja_num(i);
+        if (pthread_mutex_init(&f->cerrojo, &atributos) != 0) {
+            fprintf(stderr, "Caché de respuestas: no se pudo crear el cerrojo de una franja\n");
+            pthread_mutexattr_destroy(&atributos);
+            cache_liberar();
+            return -1;
+        }
+        vaciar_franja(f);
+    }
+    pthread_mutexattr_destroy(&atributos);
+    return 0;
+}
+
+void cache_liberar(void) {
+    if (!cabecera) return;
+    munmap(cabecera, tam_segmento);
+    cabecera = NULL;
+}
+
+void cache_fijar_generacion(uint64_t generacion) {
+    if (cabecera) __atomic_store_n(&cabecera->generacion, generacion, __ATOMIC_RELEASE);
+    else generacion_inicial = generacion;
+}
+
+static Franja *franja_de(uint64_t huella) {
+    return franja_num((uint32_t)((huella >> 32) % num_franjas));
+}
+
+// Devuelve un tramo contiguo de hasta *len bytes desde el cursor, lo avanza
+// y deja en *len la longitud del tramo.
+static char *cursor_tramo(Franja *f, Cursor *c, size_t *len) {
+    if (c->pos == CACHE_TAM_BLOQUE) {
+        c->bloque = enlaces_de(f)[c->bloque];
+        c->pos = 0;
+    }
+    if (*len > CACHE_TAM_BLOQUE - c->pos) *len = CACHE_TAM_BLOQUE - c->pos;
+    char *p = bloque_de(f, c->bloque) + c->pos;
+    c->pos += *len;
+    return p;
+}
+
+static int clave_igual(Franja *f, const CacheEntrada *e, const char *clave, size_t len_clave) {
+    if (e->len_clave != len_clave) return 0;
+    Cursor c = { e->primer_bloque, 0 };
+    while (len_clave > 0) {
+        size_t n = len_clave;
+        const char *p = cursor_tramo(f, &c, &n);
+        if (memcmp(p, clave, n) != 0) return 0;
+        clave += n;
+        len_clave -= n;
+    }
+    return 1;
+}
+
+static uint32_t buscar_entrada(Franja *f, uint64_t huella, const char *clave, size_t len_clave) {
+    CacheEntrada *entradas = entradas_de(f);
+    uint32_t i = cubetas_de(f)[huella & (num_cubetas - 1)];
+    while (i != NINGUNO && !(entradas[i].huella == huella && clave_igual(f, &entradas[i], clave, len_clave))) {
+        i = entradas[i].siguiente;
+    }
+    return i;
+}
+
+int cache_buscar(const char *clave, size_t len_clave, char *resultado, size_t cap, size_t *len) {
+    if (!cabecera) return -1;
+    uint64_t huella = hash_clave(clave, len_clave, 0);
+    Franja *f = franja_de(huella);
+    int estado = -1;
+    if (bloquear_franja(f) == 0) {
+        uint32_t i = buscar_entrada(f, huella, clave, len_clave);
+        CacheEntrada *e = i != NINGUNO ? &entradas_de(f)[i] : NULL;
+        if (e && e->len_datos < cap) {
+            e->referencia = 1;
+            // La respuesta sigue a la clave en los mismos bloques.
+            Cursor c = { e->primer_bloque, 0 };
+            for (size_t resto = e->len_clave; resto > 0;) {
+                size_t n = resto;
+                cursor_tramo(f, &c, &n);
+                resto -= n;
+            }
+            for (size_t copiados = 0; copiados < e->len_datos;) {
+                size_t n = e->len_datos - copiados;
+                const char *p = cursor_tramo(f, &c, &n);
+                memcpy(resultado + copiados, p, n);
+                copiados += n;
+            }
+            resultado[e->len_datos] = '\0';
+            *len = e->len_datos;
+            estado = 0;
+        }
+        pthread_mutex_unlock(&f->cerrojo);
+    }
+    __atomic_fetch_add(estado == 0 ? &cabecera->aciertos : &cabecera->fallos, 1, __ATOMIC_RELAXED);
+    return estado;
+}
+
+// Saca la entrada de su cubeta y devuelve sus bloques y su hueco a las
+// listas libres.
+static void desalojar(Franja *f, uint32_t i) {
+    CacheEntrada *entradas = entradas_de(f);
+    uint32_t *enlaces = enlaces_de(f);
+    CacheEntrada *e = &entradas[i];
+    uint32_t *p = &cubetas_de(f)[e->huella & (num_cubetas - 1)];
+    while (*p != i) p = &entradas[*p].siguiente;
+    *p = e->siguiente;
+
+    uint32_t ultimo = e->primer_bloque;
+    while (enlaces[ultimo] != NINGUNO) ultimo = enlaces[ultimo];
+    enlaces[ultimo] = f->bloques_libres;
+    f->bloques_libres = e->primer_bloque;
+    f->num_bloques_libres += e->num_bloques;
+
+    e->en_uso = 0;
+    e->siguiente = f->entradas_libres;
+    f->entradas_libres = i;
+    f->num_entradas--;
+}
+
+// Avanza la manecilla de CLOCK hasta que haya bloques libres suficientes y
+// un hueco de entrada. Dos vueltas bastan: en la primera se borran todas
+// las referencias.
+static int hacer_sitio(Franja *f, uint32_t bloques) {
+    CacheEntrada *entradas = entradas_de(f);
+    for (uint64_t pasos = 0; pasos <= 2 * (uint64_t)num_bloques; pasos++) {
+        if (f->num_bloques_libres >= bloques && f->entradas_libres != NINGUNO) return 0;
+        CacheEntrada *e = &entradas[f->manecilla];
+        if (e->en_uso) {
+            if (e->referencia) e->referencia = 0;
+            else desalojar(f, f->manecilla);
+        }
+        f->manecilla = f->manecilla + 1 < num_bloques ? f->manecilla + 1 : 0;
+    }
+    return -1;
+}
+
+void cache_guardar(const char *clave, size_t len_clave, const char *respuesta, size_t len) {
+    if (!cabecera) return;
+    size_t total = len_clave + len;
+    size_t bloques = (total + CACHE_TAM_BLOQUE - 1) / CACHE_TAM_BLOQUE;
+    if (bloques == 0) bloques = 1;
+    if (bloques > max_bloques_entrada || len_clave > UINT32_MAX || len > UINT32_MAX) return;
+
+    uint64_t huella = hash_clave(clave, len_clave, 0);
+    Franja *f = franja_de(huella);
+    if (bloquear_franja(f) != 0) return;
+    // Otro proceso pudo guardarla mientras esta se calculaba.
+    if (buscar_entrada(f, huella, clave, len_clave) != NINGUNO || hacer_sitio(f, bloques) != 0) {
+        pthread_mutex_unlock(&f->cerrojo);
+        return;
+    }
+
+    uint32_t *enlaces = enlaces_de(f);
+    uint32_t i = f->entradas_libres;
+    CacheEntrada *e = &entradas_de(f)[i];
+    f->entradas_libres = e->siguiente;
+
+    // Se toman los primeros bloques de la lista libre y se corta tras el último.
+    uint32_t ultimo = f->bloques_libres;
+    for (size_t b = 1; b < bloques; b++) ultimo = enlaces[ultimo];
+    e->primer_bloque = f->bloques_libres;
+    f->bloques_libres = enlaces[ultimo];
+    enlaces[ultimo] = NINGUNO;
+    f->num_bloques_libres -= bloques;
+
+    Cursor c = { e->primer_bloque, 0 };
+    for (size_t hecho = 0; hecho < total;) {
+        size_t n = hecho < len_clave ? len_clave - hecho : total - hecho;
+        char *p = cursor_tramo(f, &c, &n);
+        memcpy(p, hecho < len_clave ? clave + hecho : respuesta + (hecho - len_clave), n);
+        hecho += n;
+    }
+
+    e->huella = huella;
+    e->len_clave = len_clave;
+    e->len_datos = len;
+    e->num_bloques = bloques;
+    e->en_uso = 1;
+    e->referencia = 0;
+    uint32_t *cubeta = &cubetas_de(f)[huella & (num_cubetas - 1)];
+    e->siguiente = *cubeta;
+    *cubeta = i;
+    f->num_entradas++;
+    pthread_mutex_unlock(&f->cerrojo);
+}
+
+// Lectura aproximada: las franjas se recorren sin tomar sus cerrojos.
+void cache_estadisticas(CacheEstadisticas *est) {
+    memset(est, 0, sizeof(*est));
+    if (!cabecera) return;
+    est->aciertos = __atomic_load_n(&cabecera->aciertos, __ATOMIC_RELAXED);
+    est->fallos = __atomic_load_n(&cabecera->fallos, __ATOMIC_RELAXED);
+    est->capacidad = tam_segmento;
+    for (uint32_t i = 0; i < num_franjas; i++) {
+        Franja *f = franja_num(i);
+        est->entradas += f->num_entradas;
+        est->bytes += (uint64_t)(num_bloques - f->num_bloques_libres) * CACHE_TAM_BLOQUE;
+    }
+}
+
+static void manejar_sigusr1(int s) {
+    (void)s;
+    estadisticas_pedidas = 1;
+}
+
+void cache_instalar_senal(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = manejar_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+void cache_atender_senal(void) {
+    if (!estadisticas_pedidas) return;
+    estadisticas_pedidas = 0;
+    if (!cabecera) {
+        printf("Caché de respuestas desactivada\n");
+        fflush(stdout);
+        return;
+    }
+    CacheEstadisticas est;
+    cache_estadisticas(&est);
+    uint64_t consultas = est.aciertos + est.fallos;
+    printf("Caché: %llu aciertos, %llu fallos (%.1f%% de aciertos), %llu respuestas en %llu de %llu bytes\n",
+           (unsigned long long)est.aciertos, (unsigned long long)est.fallos,
+           consultas ? 100.0 * est.aciertos / consultas : 0.0,
+           (unsigned long long)est.entradas, (unsigned long long)est.bytes,
+           (unsigned long long)est.capacidad);
+    fflush(stdout);
+}
@@ -0,0 +1,63 @@
+/*
+ * cache_consultas.h: Caché de respuestas compartida por los procesos del
+ * servidor.
+ * Guarda, para cada consulta normalizada "album|artista|cancion", la
+ * respuesta de texto ya formateada. Vive en un segmento de memoria
+ * anónima compartida que se crea antes de lanzar los procesos hijos o
+ * trabajadores, de modo que todos ven las mismas entradas y los mismos
+ * contadores. El segmento completo (metadatos incluidos) nunca supera el
+ * tamaño pedido al crearlo.
+ */
+#ifndef CACHE_CONSULTAS_H
+#define CACHE_CONSULTAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct CacheEstadisticas {
+    uint64_t aciertos;
+    uint64_t fallos;
+    uint64_t entradas;  // Respuestas guardadas ahora mismo
+    uint64_t bytes;     // Bytes de bloque ocupados por esas respuestas
+    uint64_t capacidad; // Tamaño total del segmento
+} CacheEstadisticas;
+
+/*
+ * Crea la caché con a lo sumo bytes_max bytes. Debe llamarse antes de
+ * fork(), y puede llamarse después de cargar los datos: toma la última
+ * generación fijada. Devuelve 0 si la caché quedó creada y -1 (tras informar por
+ * stderr) si no; sin caché, cache_buscar siempre falla y cache_guardar no
+ * hace nada.
+ */
+int cache_iniciar(size_t bytes_max);
+void cache_liberar(void);
+
+/*
+ * Cambia la generación de los datos servidos. Las entradas guardadas con
+ * otra generación dejan de ser válidas; cada franja se vacía la próxima
+ * vez que se usa.
+ */
+void cache_fijar_generacion(uint64_t generacion);
+
+/*
+ * Busca la clave (de len_clave bytes). Si está y su respuesta cabe en cap
+ * bytes con el '\0', la copia a resultado, deja su longitud en *len y
+ * devuelve 0. Si no, devuelve -1. Cuenta un acierto o un fallo.
+ */
+int cache_buscar(const char *clave, size_t len_clave, char *resultado, size_t cap, size_t *len);
+
+// Guarda la respuesta de la clave, desalojando otras entradas si hace falta.
+void cache_guardar(const char *clave, size_t len_clave, const char *respuesta, size_t len);
+
+void cache_estadisticas(CacheEstadisticas *est);
+
+/*
+ * Instala un manejador de SIGUSR1 que pide imprimir las estadísticas, y
+ * las imprime por stdout si se pidieron desde la última llamada. El
+ * manejador no usa SA_RESTART para que accept() y waitpid() regresen con
+ * EINTR y el bucle que espera pueda atender la petición.
+ */
+void cache_instalar_senal(void);
+void cache_atender_senal(void);
+
+#endif
@@ -0,0 +1,2087 @@
+/*
+ * consulta.c: Resolución de consultas del servidor de búsqueda.
+ * Carga (o mapea) el índice y el almacén de registros y, dada una consulta
+ * "album|artista|cancion", busca la clave en el directorio de su cubeta,
+ * lee su lista de registros de una vez y arma la respuesta de texto con
+ * las columnas guardadas en spotify.records, sin leer el CSV. Una consulta
+ * "||cancion", sin álbum ni artista, se resuelve con el índice de
+ * trigramas de spotify.trigrams, y una con solo el álbum o solo el artista
+ * con los índices secundarios spotify.albums y spotify.artists. Un cuarto
+ * campo opcional pide una página, un límite, un offset o un cursor. La
+ * respuesta se escribe en una Salida que el llamador envía a medida que se
+ * llena, así que no tiene tamaño máximo. Lo usan tanto el modo fork() por
+ * conexión como los trabajadores con epoll.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "arena.h"
+#include "cache_consultas.h"
+#include "consulta.h"
+#include "delta.h"
+#include "indice.h"
+#include "lecturas.h"
+#include "metricas.h"
+#include "presupuesto.h"
+#include "registros.h"
+#include "secundarios.h"
+#include "trigramas.h"
+
+#define MAX_LINE_LENGTH 8192
+#define CLAVES_POR_LECTURA 16 // Entradas del directorio que se leen a la vez
+#define VENTANA_CADENA 256    // Bytes que se leen de una vez al buscar una cadena con pread
+#define TAM_BUFFER_CADENA (REGISTRO_MAX_CADENA + INDICE_VARINT_MAX)
+#define MAX_LISTAS_TRIGRAMAS 8 // Listas que se cruzan: las de los trigramas menos frecuentes
+#define MAX_BYTES_BLOQUE (TRIGRAMAS_TAM_BLOQUE * 5) // Diferencias de 32 bits en varint
+#define RESULTADOS_POR_PAGINA 100
+#define MAX_PAGINA 1000000
+#define RESERVA_PIE 160        // Bytes de la respuesta que se guardan para el pie de página
+#define MAX_TOP 1000           // K máximo de top=K
+#define HUECO_FUSION 4096      // Rangos de un lote a menos de esto se piden juntos
+#define MAX_FILAS_ANTICIPADAS 64 // Filas de cada clave de un lote que se anticipan
+#define FILAS_POR_TANDA 32     // Filas de una lista cuyos registros y cadenas se leen juntos
+
+// Índices secundarios de artistas y de álbumes (opcionales). Se leen igual
+// que spotify.index: la tabla en memoria o mapeada, el resto con pread o
+// desde el mapeo.
+typedef struct IndiceSecundario {
+    const char *ruta;
+    uint32_t campo;
+    int cargado;
+    const uint32_t *tabla;
+    uint32_t tam_tabla;
+    uint64_t semilla;
+    uint64_t desp_directorio;
+    int fd;
+    const char *map;
+    size_t map_tam;
+} IndiceSecundario;
+
+// Filas añadidas después del índice (spotify.delta, ver delta.h), mapeado
+// completo en ambos modos. Continúan la numeración de los registros y los
+// desplazamientos de las cadenas de spotify.records, así que leer_registro
+// y leer_cadena las atienden según el número o el desplazamiento pedido.
+typedef struct Delta {
+    const char *map;
+    size_t map_tam;
+    const DeltaCabecera *cabecera;
+    const uint32_t *tabla;
+    const ClaveIndice *directorio;
+    const Registro *registros;
+    const uint8_t *cadenas;
+    uint64_t num_filas;      // 0 si no hay delta
+    uint64_t generacion;
+} Delta;
+
+/*
+ * Datos servidos: el índice, los registros, los índices opcionales y el
+ * delta. Una recarga (SIGHUP) o un delta nuevo no los modifican: crean
+ * otros y los ponen como vigentes. Cada consulta toma una referencia a los
+ * vigentes al empezar y la suelta al terminar, así que una consulta a
+ * medias sigue con los datos con los que empezó (sus cursores y listas
+ * apuntan a ellos) y unos datos reemplazados se liberan cuando termina la
+ * última consulta que los usaba. Un cambio de delta comparte los archivos
+ * del índice con los datos anteriores a través de base.
+ */
+typedef struct Datos {
+    unsigned referencias;    // La de vigentes más una por consulta en curso
+    struct Datos *base;      // Dueño del índice y los registros (NULL: estos mismos)
+    uint64_t generacion;     // Generación para la caché de respuestas (índice y delta)
+    uint32_t *hash_table;
+    uint32_t tam_tabla;      // Cubetas de la tabla, leídas de la cabecera
+    uint64_t semilla;        // Semilla del hash con la que se generó el índice
+    uint64_t desp_directorio;
+    uint64_t desp_listas;
+    const BloqueFiltro *filtro; // Filtro de claves del índice (ver indice.h)
+    uint64_t bloques_filtro;
+    uint64_t num_registros;
+    uint64_t desp_cadenas;
+    uint64_t bytes_cadenas;
+    uint64_t huella_indice;  // delta_huella_base() del índice
+    uint64_t generacion_base; // Generación del índice y los registros, sin el delta
+    // Modo stdio: el directorio, las listas y los registros se leen con
+    // pread, que no depende de la posición compartida del descriptor entre
+    // procesos.
+    int indice_fd;
+    int registros_fd;
+    // Modo mapeado en memoria: regiones compartidas por todos los procesos hijos.
+    const char *indice_map;
+    size_t indice_map_tam;
+    const char *registros_map;
+    size_t registros_map_tam;
+    // Índice de trigramas de los nombres de canción (opcional). En modo
+    // stdio la tabla de prefijos se copia a memoria y el resto se lee con
+    // pread.
+    int hay_trigramas;
+    const uint32_t *tabla_trigramas;
+    uint64_t desp_dir_trigramas;
+    int trigramas_fd;
+    const char *trigramas_map;
+    size_t trigramas_map_tam;
+    IndiceSecundario indice_artistas;
+    IndiceSecundario indice_albumes;
+    Delta delta;
+} Datos;
+
+static int modo_mmap = 0;
+static Datos *vigentes; // Los últimos cargados: los toman las consultas nuevas
+static Datos *datos;    // Los de la consulta que se está resolviendo
+
+// Archivo de spotify.delta cargado (o rechazado) y última vez que se buscó
+// una generación nueva.
+static dev_t delta_dispositivo;
+static ino_t delta_inodo;
+static time_t delta_revisado;
+
+// Medición de la consulta que se está resolviendo. Fuera de una consulta
+// (por ejemplo, al anticipar un lote) apunta a una que nunca se vuelca.
+static Medicion sin_consulta;
+static Medicion *medicion = &sin_consulta;
+
+// Memoria de trabajo de la consulta que se está resolviendo o del lote que
+// se anticipa: se reinicia al terminar cada una (ver arena.h). Su límite
+// es el del presupuesto de memoria.
+static Arena arena;
+
+// Criterios de top=K
+enum { ORDEN_POPULARIDAD, ORDEN_DURACION };
+
+// Un candidato a los K mejores: solo su valor y su número de registro; el
+// texto se lee al final, para los que quedaron.
+typedef struct EntradaTop {
+    int64_t valor;
+    uint64_t numero;
+} EntradaTop;
+
+void formato_resultado(char *dest, size_t dest_size, const Registro *registro,
+                       const char *album, const char *artista, const char *cancion);
+static int cargar_archivos(void);
+static int mapear_archivos(void);
+static void cargar_trigramas(const IndiceCabecera *indice);
+static void cargar_secundario(IndiceSecundario *s, const IndiceCabecera *indice);
+static void liberar_secundario(IndiceSecundario *s);
+static void revisar_delta(int forzar);
+
+// Pide memoria de trabajo a la arena y la cuenta en la medición.
+static void *pedir_memoria(size_t bytes) {
+    void *p = arena_pedir(&arena, bytes);
+    if (p) medicion->contadores[CONTADOR_BYTES_ARENA] += bytes;
+    else medicion->contadores[CONTADOR_SIN_MEMORIA]++;
+    return p;
+}
+
+// Crea unos datos vacíos, con una referencia (la de quien los crea).
+static Datos *crear_datos(void) {
+    Datos *d = calloc(1, sizeof(Datos));
+    if (!d) return NULL;
+    d->referencias = 1;
+    d->indice_fd = d->registros_fd = d->trigramas_fd = -1;
+    d->indice_artistas = (IndiceSecundario){"spotify.artists", SECUNDARIO_ARTISTA, 0, NULL, 0, 0, 0, -1, NULL, 0};
+    d->indice_albumes = (IndiceSecundario){"spotify.albums", SECUNDARIO_ALBUM, 0, NULL, 0, 0, 0, -1, NULL, 0};
+    return d;
+}
+
+// Suelta una referencia; con la última se liberan el delta y, si son
+// suyos, el índice y los registros.
+static void soltar_datos(Datos *d) {
+    if (!d || --d->referencias > 0) return;
+    if (d->delta.map) munmap((void *)d->delta.map, d->delta.map_tam);
+    if (d->base) {
+        soltar_datos(d->base);
+        free(d);
+        return;
+    }
+    if (modo_mmap) {
+        munmap((void *)d->indice_map, d->indice_map_tam);
+        munmap((void *)d->registros_map, d->registros_map_tam);
+        if (d->hay_trigramas) munmap((void *)d->trigramas_map, d->trigramas_map_tam);
+    } else {
+        free(d->hash_table);
+        free((void *)d->filtro);
+        close(d->indice_fd);
+        close(d->registros_fd);
+        if (d->hay_trigramas) {
+            free((void *)d->tabla_trigramas);
+            close(d->trigramas_fd);
+        }
+    }
+    liberar_secundario(&d->indice_artistas);
+    liberar_secundario(&d->indice_albumes);
+    free(d);
+}
+
+// Pone d como vigentes (d trae la referencia que se queda vigentes).
+static void publicar_datos(Datos *d) {
+    soltar_datos(vigentes);
+    vigentes = datos = d;
+    cache_fijar_generacion(d->generacion);
+}
+
+// Pide al núcleo, sin esperar, las páginas que usa toda consulta: la
+// tabla hash, el filtro y los registros (pequeños frente al CSV). El
+// directorio se visita en orden aleatorio: no sirve la lectura anticipada.
+static void calentar_datos(const Datos *d) {
+    if (modo_mmap) {
+        madvise((void *)d->indice_map, d->desp_directorio, MADV_WILLNEED);
+        madvise((void *)d->filtro, d->bloques_filtro * sizeof(BloqueFiltro), MADV_WILLNEED);
+        madvise((void *)d->registros_map, d->registros_map_tam, MADV_WILLNEED);
+    } else {
+        readahead(d->indice_fd, 0, d->desp_directorio);
+        readahead(d->registros_fd, 0, d->desp_cadenas + d->bytes_cadenas);
+    }
+}
+
+// Carga el índice, los registros y los índices opcionales en unos datos
+// nuevos. Devuelve NULL si el índice o los registros no se pudieron cargar.
+static Datos *cargar_todo(void) {
+    Datos *d = crear_datos();
+    if (!d) {
+        perror("FATAL: No se pudo alocar memoria para los datos");
+        return NULL;
+    }
+    Datos *anteriores = datos;
+    datos = d;
+    int estado = modo_mmap ? mapear_archivos() : cargar_archivos();
+    datos = anteriores;
+    if (estado != 0) {
+        free(d);
+        return NULL;
+    }
+    d->generacion = d->generacion_base;
+    calentar_datos(d);
+    return d;
+}
+
+int cargar_datos(int usar_mmap) {
+    modo_mmap = usar_mmap;
+    Datos *d = cargar_todo();
+    if (!d) return -1;
+    publicar_datos(d);
+    revisar_delta(1);
+    return 0;
+}
+
+int recargar_datos(void) {
+    Datos *d = cargar_todo();
+    if (!d) {
+        fprintf(stderr, "No se pudieron recargar los datos; se siguen sirviendo los anteriores\n");
+        return -1;
+    }
+    publicar_datos(d);
+    // El delta se vuelve a comprobar contra el índice nuevo.
+    delta_dispositivo = 0;
+    delta_inodo = 0;
+    revisar_delta(1);
+    printf("Datos recargados: %llu registros%s\n", (unsigned long long)d->num_registros,
+           vigentes->delta.num_filas ? " más el delta" : "");
+    fflush(stdout);
+    return 0;
+}
+
+static volatile sig_atomic_t recarga_pedida;
+
+static void manejar_sighup(int s) {
+    (void)s;
+    recarga_pedida = 1;
+}
+
+void instalar_senal_recarga(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = manejar_sighup;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+int atender_senal_recarga(void) {
+    if (!recarga_pedida) return 0;
+    recarga_pedida = 0;
+    recargar_datos();
+    return 1;
+}
+
+void actualizar_datos(void) {
+    revisar_delta(0);
+}
+
+void liberar_datos(void) {
+    if (!modo_mmap) lecturas_liberar();
+    arena_liberar(&arena);
+    soltar_datos(vigentes);
+    vigentes = datos = NULL;
+}
+
+// Valida la cabecera de spotify.records contra la del índice cargado y toma
+// sus desplazamientos. tam es el tamaño del archivo. Las dos cabeceras
+// identifican la generación de los datos para la caché de respuestas.
+static int usar_registros(const RegistrosCabecera *cabecera, const IndiceCabecera *indice, size_t tam) {
+    if (!registros_cabecera_valida(cabecera) || tam < cabecera->desp_cadenas + cabecera->bytes_cadenas) {
+        fprintf(stderr, "FATAL: 'spotify.records' no tiene el formato esperado (versión %d). Vuelva a ejecutar el indexador.\n", REGISTROS_VERSION);
+        return -1;
+    }
+    if (!indice_mismo_indexado(indice, cabecera->num_registros, cabecera->bytes_csv, cabecera->huella_csv)) {
+        fprintf(stderr, "FATAL: 'spotify.records' no corresponde a 'spotify.index'. Vuelva a ejecutar el indexador.\n");
+        return -1;
+    }
+    datos->num_registros = cabecera->num_registros;
+    datos->desp_cadenas = cabecera->desp_cadenas;
+    datos->bytes_cadenas = cabecera->bytes_cadenas;
+    datos->huella_indice = delta_huella_base(indice);
+    datos->generacion_base = hash_clave((const char *)indice, sizeof(*indice),
+                                        hash_clave((const char *)cabecera, sizeof(*cabecera), 0));
+    return 0;
+}
+
+// Mapea el delta abierto en fd y, si corresponde al índice vigente, publica
+// unos datos que comparten ese índice con el delta nuevo. Devuelve 0 si lo
+// cambió.
+static int cambiar_delta(int fd, const struct stat *st) {
+    if ((size_t)st->st_size < sizeof(DeltaCabecera)) return -1;
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    const DeltaCabecera *cab = map;
+    Datos *d = malloc(sizeof(Datos));
+    if (!d || !delta_cabecera_valida(cab, st->st_size) || cab->huella_base != vigentes->huella_indice ||
+        cab->primera_fila != vigentes->num_registros || cab->base_cadenas != vigentes->bytes_cadenas) {
+        free(d);
+        munmap(map, st->st_size);
+        return -1;
+    }
+    *d = *vigentes;
+    d->referencias = 1;
+    d->base = vigentes->base ? vigentes->base : vigentes;
+    d->base->referencias++;
+    d->delta.map = map;
+    d->delta.map_tam = st->st_size;
+    d->delta.cabecera = cab;
+    d->delta.tabla = (const uint32_t *)(d->delta.map + sizeof(DeltaCabecera));
+    d->delta.directorio = (const ClaveIndice *)(d->delta.map + cab->desp_directorio);
+    d->delta.registros = (const Registro *)(d->delta.map + cab->desp_registros);
+    d->delta.cadenas = (const uint8_t *)d->delta.map + cab->desp_cadenas;
+    d->delta.num_filas = cab->num_filas;
+    d->delta.generacion = cab->generacion;
+    d->generacion = d->generacion_base + cab->generacion;
+    publicar_datos(d);
+    return 0;
+}
+
+/*
+ * Carga la última generación de spotify.delta si el indexador publicó otra
+ * (el archivo se reemplaza con rename, así que cambia su inodo). Se revisa
+ * como mucho una vez por segundo, salvo con forzar. Las consultas a medias
+ * siguen con la generación con la que empezaron.
+ */
+static void revisar_delta(int forzar) {
+    time_t ahora = time(NULL);
+    if (!forzar && ahora == delta_revisado) return;
+    delta_revisado = ahora;
+    struct stat st;
+    int fd = open("spotify.delta", O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (st.st_dev == delta_dispositivo && st.st_ino == delta_inodo) {
+        close(fd);
+        return;
+    }
+    delta_dispositivo = st.st_dev;
+    delta_inodo = st.st_ino;
+    if (cambiar_delta(fd, &st) == 0) {
+        printf("Cargada la generación %llu de 'spotify.delta' (%llu filas nuevas)\n",
+               (unsigned long long)vigentes->delta.generacion, (unsigned long long)vigentes->delta.num_filas);
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "'spotify.delta' no corresponde al índice cargado; se ignora\n");
+    }
+    close(fd);
+}
+
+// Carga la tabla hash en memoria dinámica y abre el índice y los registros
+// para leerlos con pread.
+static int cargar_archivos(void) {
+    FILE *index_file = fopen("spotify.index", "rb");
+    if (!index_file) {
+        perror("FATAL: No se pudo abrir 'spotify.index'. Ejecute el indexador primero.");
+        return -1;
+    }
+    IndiceCabecera cabecera;
+    if (fread(&cabecera, sizeof(cabecera), 1, index_file) != 1 || !indice_cabecera_valida(&cabecera)) {
+        fprintf(stderr, "FATAL: 'spotify.index' no tiene el formato esperado (versión %d). Vuelva a ejecutar el indexador.\n", INDICE_VERSION);
+        fclose(index_file);
+        return -1;
+    }
+    datos->tam_tabla = cabecera.tam_tabla;
+    datos->semilla = cabecera.semilla;
+    datos->desp_directorio = cabecera.desp_directorio;
+    datos->desp_listas = cabecera.desp_listas;
+    datos->bloques_filtro = cabecera.bloques_filtro;
+    size_t bytes_filtro = cabecera.bloques_filtro * sizeof(BloqueFiltro);
+    datos->hash_table = (uint32_t *)malloc(sizeof(uint32_t) * ((size_t)datos->tam_tabla + 1));
+    BloqueFiltro *filtro = aligned_alloc(sizeof(BloqueFiltro), bytes_filtro);
+    if (!datos->hash_table || !filtro) {
+        perror("FATAL: No se pudo alocar memoria para la tabla hash");
+        free(datos->hash_table);
+        free(filtro);
+        fclose(index_file);
+        return -1;
+    }
+    if (fread(datos->hash_table, sizeof(uint32_t), (size_t)datos->tam_tabla + 1, index_file) != (size_t)datos->tam_tabla + 1 ||
+        pread(fileno(index_file), filtro, bytes_filtro, cabecera.desp_filtro) != (ssize_t)bytes_filtro) {
+        fprintf(stderr, "FATAL: 'spotify.index' está truncado. Vuelva a ejecutar el indexador.\n");
+        free(datos->hash_table);
+        free(filtro);
+        fclose(index_file);
+        return -1;
+    }
+    datos->filtro = filtro;
+    // El directorio y las listas se quedan en disco.
+    datos->indice_fd = dup(fileno(index_file));
+    fclose(index_file);
+
+    datos->registros_fd = open("spotify.records", O_RDONLY);
+    RegistrosCabecera reg_cabecera;
+    struct stat st;
+    if (datos->registros_fd < 0) {
+        perror("FATAL: No se pudo abrir 'spotify.records'. Ejecute el indexador primero.");
+    } else if (pread(datos->registros_fd, &reg_cabecera, sizeof(reg_cabecera), 0) != sizeof(reg_cabecera) ||
+               fstat(datos->registros_fd, &st) < 0) {
+        fprintf(stderr, "FATAL: 'spotify.records' no se puede leer\n");
+    } else if (usar_registros(&reg_cabecera, &cabecera, st.st_size) == 0) {
+        cargar_trigramas(&cabecera);
+        cargar_secundario(&datos->indice_artistas, &cabecera);
+        cargar_secundario(&datos->indice_albumes, &cabecera);
+        return 0;
+    }
+    free(datos->hash_table);
+    free(filtro);
+    close(datos->indice_fd);
+    if (datos->registros_fd >= 0) close(datos->registros_fd);
+    return -1;
+}
+
+// Mapea un archivo completo en memoria de solo lectura (MAP_SHARED), de modo
+// que todos los procesos hijos comparten las mismas páginas de la caché.
+static const char *mapear_archivo(const char *ruta, size_t *tam) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "FATAL: No se pudo abrir '%s': %s\n", ruta, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "FATAL: '%s' está vacío o no se puede leer\n", ruta);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // El mapeo sigue siendo válido sin el descriptor.
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "FATAL: No se pudo mapear '%s': %s\n", ruta, strerror(errno));
+        return NULL;
+    }
+    *tam = st.st_size;
+    return map;
+}
+
+// Mapea el índice y los registros. La tabla hash se usa directamente desde
+// el mapeo, sin copiarla a memoria privada.
+static int mapear_archivos(void) {
+    datos->indice_map = mapear_archivo("spotify.index", &datos->indice_map_tam);
+    if (!datos->indice_map) return -1;
+    const IndiceCabecera *cabecera = (const IndiceCabecera *)datos->indice_map;
+    if (datos->indice_map_tam < sizeof(IndiceCabecera) || !indice_cabecera_valida(cabecera) ||
+        datos->indice_map_tam < cabecera->desp_filtro + cabecera->bloques_filtro * sizeof(BloqueFiltro)) {
+        fprintf(stderr, "FATAL: 'spotify.index' no tiene el formato esperado (versión %d). Vuelva a ejecutar el indexador.\n", INDICE_VERSION);
+        munmap((void *)datos->indice_map, datos->indice_map_tam);
+        return -1;
+    }
+    datos->hash_table = (uint32_t *)(datos->indice_map + sizeof(IndiceCabecera));
+    datos->tam_tabla = cabecera->tam_tabla;
+    datos->semilla = cabecera->semilla;
+    datos->desp_directorio = cabecera->desp_directorio;
+    datos->desp_listas = cabecera->desp_listas;
+    datos->filtro = (const BloqueFiltro *)(datos->indice_map + cabecera->desp_filtro);
+    datos->bloques_filtro = cabecera->bloques_filtro;
+
+    datos->registros_map = mapear_archivo("spotify.records", &datos->registros_map_tam);
+    if (!datos->registros_map || datos->registros_map_tam < sizeof(RegistrosCabecera) ||
+        usar_registros((const RegistrosCabecera *)datos->registros_map, cabecera, datos->registros_map_tam) != 0) {
+        if (datos->registros_map) munmap((void *)datos->registros_map, datos->registros_map_tam);
+        munmap((void *)datos->indice_map, datos->indice_map_tam);
+        return -1;
+    }
+
+    // El directorio se visita en orden aleatorio; la tabla hash y los
+    // registros se piden después con calentar_datos.
+    madvise((void *)datos->indice_map, datos->indice_map_tam, MADV_RANDOM);
+    cargar_trigramas(cabecera);
+    cargar_secundario(&datos->indice_artistas, cabecera);
+    cargar_secundario(&datos->indice_albumes, cabecera);
+    return 0;
+}
+
+// Abre (o mapea) spotify.trigrams. Sin él el servidor funciona igual, pero
+// no acepta búsquedas solo por canción.
+static void cargar_trigramas(const IndiceCabecera *indice) {
+    int fd = open("spotify.trigrams", O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Aviso: no se pudo abrir 'spotify.trigrams'; no habrá búsqueda solo por canción.\n");
+        return;
+    }
+    TrigramasCabecera cabecera;
+    struct stat st;
+    size_t tam_tabla_trig = sizeof(uint32_t) * (TRIGRAMAS_TAM_TABLA + 1);
+    if (pread(fd, &cabecera, sizeof(cabecera), 0) != sizeof(cabecera) || fstat(fd, &st) < 0 ||
+        !trigramas_cabecera_valida(&cabecera) ||
+        !indice_mismo_indexado(indice, cabecera.num_filas, cabecera.bytes_csv, cabecera.huella_csv) ||
+        (uint64_t)st.st_size < cabecera.desp_listas) {
+        fprintf(stderr, "Aviso: 'spotify.trigrams' no corresponde al índice (versión %d); no habrá búsqueda solo por canción.\n",
+                TRIGRAMAS_VERSION);
+        close(fd);
+        return;
+    }
+    datos->desp_dir_trigramas = cabecera.desp_directorio;
+    if (modo_mmap) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Aviso: no se pudo mapear 'spotify.trigrams': %s\n", strerror(errno));
+            return;
+        }
+        datos->trigramas_map = map;
+        datos->trigramas_map_tam = st.st_size;
+        datos->tabla_trigramas = (const uint32_t *)(datos->trigramas_map + sizeof(TrigramasCabecera));
+        madvise(map, datos->trigramas_map_tam, MADV_RANDOM);
+    } else {
+        uint32_t *tabla = malloc(tam_tabla_trig);
+        if (!tabla || pread(fd, tabla, tam_tabla_trig, sizeof(TrigramasCabecera)) != (ssize_t)tam_tabla_trig) {
+            fprintf(stderr, "Aviso: no se pudo leer 'spotify.trigrams'; no habrá búsqueda solo por canción.\n");
+            free(tabla);
+            close(fd);
+            return;
+        }
+        datos->tabla_trigramas = tabla;
+        datos->trigramas_fd = fd;
+    }
+    datos->hay_trigramas = 1;
+}
+
+// Abre (o mapea) un índice secundario. Sin él no se acepta la búsqueda
+// solo por ese campo.
+static void cargar_secundario(IndiceSecundario *s, const IndiceCabecera *indice) {
+    int fd = open(s->ruta, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Aviso: no se pudo abrir '%s'; no habrá búsqueda solo por %s.\n", s->ruta,
+                s->campo == SECUNDARIO_ALBUM ? "álbum" : "artista");
+        return;
+    }
+    SecundarioCabecera cabecera;
+    struct stat st;
+    if (pread(fd, &cabecera, sizeof(cabecera), 0) != sizeof(cabecera) || fstat(fd, &st) < 0 ||
+        !secundario_cabecera_valida(&cabecera, s->campo) ||
+        !indice_mismo_indexado(indice, cabecera.num_filas, cabecera.bytes_csv, cabecera.huella_csv) ||
+        (uint64_t)st.st_size < cabecera.desp_listas) {
+        fprintf(stderr, "Aviso: '%s' no corresponde al índice (versión %d); no habrá búsqueda solo por %s.\n",
+                s->ruta, SECUNDARIO_VERSION, s->campo == SECUNDARIO_ALBUM ? "álbum" : "artista");
+        close(fd);
+        return;
+    }
+    s->tam_tabla = cabecera.tam_tabla;
+    s->semilla = cabecera.semilla;
+    s->desp_directorio = cabecera.desp_directorio;
+    size_t bytes_tabla = sizeof(uint32_t) * ((size_t)s->tam_tabla + 1);
+    if (modo_mmap) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Aviso: no se pudo mapear '%s': %s\n", s->ruta, strerror(errno));
+            return;
+        }
+        s->map = map;
+        s->map_tam = st.st_size;
+        s->tabla = (const uint32_t *)(s->map + sizeof(SecundarioCabecera));
+        madvise(map, s->map_tam, MADV_RANDOM);
+    } else {
+        uint32_t *tabla = malloc(bytes_tabla);
+        if (!tabla || pread(fd, tabla, bytes_tabla, sizeof(SecundarioCabecera)) != (ssize_t)bytes_tabla) {
+            fprintf(stderr, "Aviso: no se pudo leer '%s'.\n", s->ruta);
+            free(tabla);
+            close(fd);
+            return;
+        }
+        s->tabla = tabla;
+        s->fd = fd;
+    }
+    s->cargado = 1;
+}
+
+static void liberar_secundario(IndiceSecundario *s) {
+    if (!s->cargado) return;
+    if (modo_mmap) {
+        munmap((void *)s->map, s->map_tam);
+    } else {
+        free((void *)s->tabla);
+        close(s->fd);
+    }
+    s->cargado = 0;
+}
+
+// Devuelve len bytes de un archivo desde el desplazamiento dado: en modo
+// mmap un puntero a su mapeo y en modo stdio una única lectura en buffer.
+static const void *leer_archivo(int fd, const char *map, size_t map_tam, uint64_t desplazamiento,
+                                size_t len, void *buffer) {
+    medicion->contadores[CONTADOR_BYTES_INDICE] += len;
+    if (modo_mmap) {
+        if (desplazamiento > map_tam || len > map_tam - desplazamiento) return NULL;
+        return map + desplazamiento;
+    }
+    return pread(fd, buffer, len, desplazamiento) == (ssize_t)len ? buffer : NULL;
+}
+
+static const void *leer_indice(uint64_t desplazamiento, size_t len, void *buffer) {
+    return leer_archivo(datos->indice_fd, datos->indice_map, datos->indice_map_tam, desplazamiento, len, buffer);
+}
+
+static const void *leer_trigramas(uint64_t desplazamiento, size_t len, void *buffer) {
+    return leer_archivo(datos->trigramas_fd, datos->trigramas_map, datos->trigramas_map_tam, desplazamiento, len, buffer);
+}
+
+// Dice si la huella puede estar en el índice. Las que el filtro descarta
+// se cuentan y no se buscan en el directorio.
+static int clave_posible(uint64_t huella) {
+    if (indice_filtro_contiene(datos->filtro, datos->bloques_filtro, huella)) return 1;
+    medicion->contadores[CONTADOR_FILTRADAS]++;
+    return 0;
+}
+
+// Busca la huella en el directorio de su cubeta. Devuelve 0 y deja su
+// lista en *lista si la encuentra.
+static int buscar_clave(uint64_t huella, ListaIndice *lista) {
+    if (!clave_posible(huella)) return -1;
+    uint32_t cubeta = indice_cubeta(huella, datos->tam_tabla);
+    uint32_t primera = datos->hash_table[cubeta], fin = datos->hash_table[cubeta + 1];
+    // Cada lectura incluye la entrada siguiente, donde termina la lista de la última.
+    ClaveIndice buffer[CLAVES_POR_LECTURA + 1];
+    while (primera < fin) {
+        uint32_t n = fin - primera < CLAVES_POR_LECTURA ? fin - primera : CLAVES_POR_LECTURA;
+        const ClaveIndice *claves = leer_indice(datos->desp_directorio + (uint64_t)primera * sizeof(ClaveIndice),
+                                                (n + 1) * sizeof(ClaveIndice), buffer);
+        if (!claves) return -1;
+        for (uint32_t i = 0; i < n; i++) {
+            if (claves[i].huella == huella) {
+                medicion->contadores[CONTADOR_NODOS] += i + 1;
+                *lista = indice_lista(&claves[i], datos->desp_listas);
+                return 0;
+            }
+        }
+        medicion->contadores[CONTADOR_NODOS] += n;
+        primera += n;
+    }
+    medicion->contadores[CONTADOR_FALSOS_POSITIVOS]++;
+    return -1;
+}
+
+// Copia el registro con el número dado.
+static int leer_registro(uint64_t numero, Registro *registro) {
+    if (numero >= datos->num_registros) {
+        if (numero - datos->num_registros >= datos->delta.num_filas) return -1;
+        memcpy(registro, &datos->delta.registros[numero - datos->num_registros], sizeof(Registro));
+        return 0;
+    }
+    uint64_t desp = sizeof(RegistrosCabecera) + numero * sizeof(Registro);
+    medicion->contadores[CONTADOR_BYTES_REGISTROS] += sizeof(Registro);
+    if (modo_mmap) {
+        memcpy(registro, datos->registros_map + desp, sizeof(Registro));
+        return 0;
+    }
+    return pread(datos->registros_fd, registro, sizeof(Registro), desp) == sizeof(Registro) ? 0 : -1;
+}
+
+// Devuelve el texto de la cadena del almacén en el desplazamiento dado. En
+// modo mmap apunta al mapeo; en modo stdio se lee en buffer (de
+// TAM_BUFFER_CADENA bytes), casi siempre con una sola lectura.
+static const char *leer_cadena(uint32_t desp, char *buffer) {
+    const char *texto;
+    size_t len;
+    if (desp >= datos->bytes_cadenas) {
+        // Cadena del delta, siempre en memoria.
+        uint64_t en_delta = desp - datos->bytes_cadenas;
+        if (!datos->delta.num_filas || en_delta >= datos->delta.cabecera->bytes_cadenas) return NULL;
+        return registro_cadena_leer(datos->delta.cadenas + en_delta, datos->delta.cabecera->bytes_cadenas - en_delta,
+                                    &texto, &len) == 0 ? texto : NULL;
+    }
+    size_t disponible = datos->bytes_cadenas - desp;
+    if (modo_mmap) {
+        const uint8_t *p = (const uint8_t *)datos->registros_map + datos->desp_cadenas + desp;
+        if (registro_cadena_leer(p, disponible, &texto, &len) != 0) return NULL;
+        medicion->contadores[CONTADOR_BYTES_REGISTROS] += len;
+        return texto;
+    }
+    size_t pedir = disponible < VENTANA_CADENA ? disponible : VENTANA_CADENA;
+    medicion->contadores[CONTADOR_BYTES_REGISTROS] += pedir;
+    if (pread(datos->registros_fd, buffer, pedir, datos->desp_cadenas + desp) != (ssize_t)pedir) return NULL;
+    if (registro_cadena_leer((const uint8_t *)buffer, pedir, &texto, &len) == 0) return texto;
+    // Cadena más larga que la ventana: se lee completa.
+    if (len == 0 || len >= REGISTRO_MAX_CADENA) return NULL;
+    pedir = INDICE_VARINT_MAX + len + 1;
+    if (pedir > disponible) pedir = disponible;
+    medicion->contadores[CONTADOR_BYTES_REGISTROS] += pedir;
+    if (pread(datos->registros_fd, buffer, pedir, datos->desp_cadenas + desp) != (ssize_t)pedir) return NULL;
+    return registro_cadena_leer((const uint8_t *)buffer, pedir, &texto, &len) == 0 ? texto : NULL;
+}
+
+// Lista de un trigrama que se recorre en orden creciente. Solo se
+// decodifica el bloque en el que está el recorrido.
+typedef struct ListaTrigrama {
+    TrigramaClave clave;
+    const TrigramaSalto *saltos;  // Apunta al mapeo o a la arena
+    uint32_t num_bloques;
+    uint32_t bloque;              // Bloque decodificado (num_bloques si ninguno)
+    uint32_t valores[TRIGRAMAS_TAM_BLOQUE];
+    uint32_t num_valores;
+    uint32_t pos;                 // Siguiente valor del bloque
+} ListaTrigrama;
+
+// Busca el trigrama en el directorio. Los trigramas de un mismo prefijo de
+// 2 bytes son como mucho 256 y están ordenados: se leen de una vez y se
+// buscan por bisección.
+static int buscar_trigrama(uint32_t trigrama, TrigramaClave *clave) {
+    uint32_t prefijo = trigrama >> 8;
+    uint32_t primera = datos->tabla_trigramas[prefijo], fin = datos->tabla_trigramas[prefijo + 1];
+    if (fin <= primera || fin - primera > 256) return -1;
+    TrigramaClave buffer[256];
+    const TrigramaClave *claves = leer_trigramas(datos->desp_dir_trigramas + (uint64_t)primera * sizeof(TrigramaClave),
+                                                 (fin - primera) * sizeof(TrigramaClave), buffer);
+    if (!claves) return -1;
+    uint32_t bajo = 0, alto = fin - primera;
+    while (bajo < alto) {
+        uint32_t medio = bajo + (alto - bajo) / 2;
+        if (claves[medio].trigrama < trigrama) bajo = medio + 1;
+        else alto = medio;
+    }
+    if (bajo == fin - primera || claves[bajo].trigrama != trigrama) return -1;
+    *clave = claves[bajo];
+    return 0;
+}
+
+// Devuelve 0, -1 si la lista no se pudo leer o -2 si no hubo memoria para
+// sus saltos.
+static int abrir_lista(ListaTrigrama *l, const TrigramaClave *clave) {
+    l->clave = *clave;
+    l->num_bloques = trigramas_num_bloques(clave->num_filas);
+    l->bloque = l->num_bloques;
+    size_t bytes_saltos = (size_t)l->num_bloques * sizeof(TrigramaSalto);
+    if (l->num_bloques == 0 || bytes_saltos > clave->bytes_lista) return -1;
+    TrigramaSalto *buffer = NULL;
+    if (!modo_mmap && !(buffer = pedir_memoria(bytes_saltos))) return -2;
+    l->saltos = leer_trigramas(clave->desp_lista, bytes_saltos, buffer);
+    return l->saltos ? 0 : -1;
+}
+
+static int decodificar_bloque(ListaTrigrama *l, uint32_t b) {
+    uint32_t desde = l->saltos[b].desp;
+    uint32_t hasta = b + 1 < l->num_bloques ? l->saltos[b + 1].desp : l->clave.bytes_lista;
+    uint32_t cuantos = l->clave.num_filas - b * TRIGRAMAS_TAM_BLOQUE;
+    if (cuantos > TRIGRAMAS_TAM_BLOQUE) cuantos = TRIGRAMAS_TAM_BLOQUE;
+    uint8_t buffer[MAX_BYTES_BLOQUE];
+    if (hasta < desde || hasta - desde > sizeof(buffer)) return -1;
+    uint64_t inicio = metricas_ahora();
+    const uint8_t *p = leer_trigramas(l->clave.desp_lista + desde, hasta - desde, buffer);
+    metricas_medir(medicion, ETAPA_INDICE, inicio);
+    if (!p) return -1;
+    const uint8_t *fin = p + (hasta - desde);
+    l->valores[0] = l->saltos[b].primero;
+    for (uint32_t i = 1; i < cuantos; i++) {
+        uint64_t diferencia;
+        if (indice_varint_leer(&p, fin, &diferencia) != 0) return -1;
+        l->valores[i] = l->valores[i - 1] + (uint32_t)diferencia;
+    }
+    l->bloque = b;
+    l->num_valores = cuantos;
+    l->pos = 0;
+    return 0;
+}
+
+/*
+ * Avanza la lista hasta el primer valor >= objetivo (los objetivos nunca
+ * retroceden) y lo deja en *valor. Devuelve -1 si la lista se acabó. Sobre
+ * los saltos se galopa: se prueban bloques a distancia 1, 2, 4, ... hasta
+ * pasarse y luego se biseca, así que saltar muchos bloques cuesta
+ * O(log distancia) y solo se decodifica el bloque de destino.
+ */
+static int avanzar_lista(ListaTrigrama *l, uint32_t objetivo, uint32_t *valor) {
+    int decodificado = l->bloque < l->num_bloques;
+    if (!decodificado || l->valores[l->num_valores - 1] < objetivo) {
+        uint32_t inicio = decodificado ? l->bloque + 1 : 0;
+        if (inicio >= l->num_bloques) return -1;
+        uint32_t b = inicio;
+        if (l->saltos[inicio].primero <= objetivo) {
+            uint32_t bajo = inicio, alto, paso = 1;
+            while (1) {
+                alto = bajo + paso;
+                if (alto >= l->num_bloques || l->saltos[alto].primero > objetivo) break;
+                bajo = alto;
+                paso *= 2;
+            }
+            if (alto > l->num_bloques) alto = l->num_bloques;
+            while (alto - bajo > 1) {
+                uint32_t medio = bajo + (alto - bajo) / 2;
+                if (l->saltos[medio].primero <= objetivo) bajo = medio;
+                else alto = medio;
+            }
+            b = bajo;
+        }
+        if (decodificar_bloque(l, b) != 0) return -1;
+        // Todo el bloque es menor que el objetivo: la respuesta es el
+        // primero del siguiente.
+        if (l->valores[l->num_valores - 1] < objetivo) {
+            if (b + 1 >= l->num_bloques || decodificar_bloque(l, b + 1) != 0) return -1;
+        }
+    }
+    while (l->valores[l->pos] < objetivo) l->pos++;
+    *valor = l->valores[l->pos];
+    return 0;
+}
+
+/*
+ * Busca en el índice secundario la clave cuyo texto es exactamente texto.
+ * Las huellas iguales se confirman leyendo la cadena del diccionario: una
+ * comparación por clave, no por fila. Devuelve 0 y copia la entrada en
+ * *clave si la encuentra.
+ */
+static int buscar_secundario(const IndiceSecundario *s, const char *texto, ClaveSecundaria *clave) {
+    uint64_t huella = hash_clave(texto, strlen(texto), s->semilla);
+    uint32_t cubeta = indice_cubeta(huella, s->tam_tabla);
+    uint32_t primera = s->tabla[cubeta], fin = s->tabla[cubeta + 1];
+    ClaveSecundaria buffer[CLAVES_POR_LECTURA];
+    while (primera < fin) {
+        uint32_t n = fin - primera < CLAVES_POR_LECTURA ? fin - primera : CLAVES_POR_LECTURA;
+        const ClaveSecundaria *claves = leer_archivo(s->fd, s->map, s->map_tam,
+                                                     s->desp_directorio + (uint64_t)primera * sizeof(ClaveSecundaria),
+                                                     n * sizeof(ClaveSecundaria), buffer);
+        if (!claves) return -1;
+        for (uint32_t i = 0; i < n; i++) {
+            medicion->contadores[CONTADOR_NODOS]++;
+            if (claves[i].huella != huella) continue;
+            char cadena_buf[TAM_BUFFER_CADENA];
+            const char *cadena = leer_cadena(claves[i].cadena, cadena_buf);
+            if (cadena && strcmp(cadena, texto) == 0) {
+                *clave = claves[i];
+                return 0;
+            }
+            medicion->contadores[CONTADOR_COLISIONES]++;
+        }
+        primera += n;
+    }
+    return -1;
+}
+
+// Agrega n bytes a la salida dejando libres reserva bytes para el pie. Si
+// no caben y la salida se puede vaciar, la vacía primero. Devuelve -1 si
+// no caben o si falló el envío (salida->vaciada queda en -1).
+static int escribir_salida(Salida *salida, const char *datos, size_t n, size_t reserva) {
+    if (salida->len + n + reserva > salida->cap) {
+        if (!salida->vaciar || salida->len == 0) return -1;
+        if (salida->vaciar(salida) != 0) {
+            salida->vaciada = -1;
+            return -1;
+        }
+        salida->vaciada = 1;
+        if (n + reserva > salida->cap) return -1;
+    }
+    memcpy(salida->buffer + salida->len, datos, n);
+    salida->len += n;
+    return 0;
+}
+
+// Escribe un mensaje de error como respuesta de la consulta.
+static void escribir_error(Consulta *c, Salida *salida, const char *mensaje) {
+    c->error = 1;
+    escribir_salida(salida, mensaje, strlen(mensaje), 0);
+}
+
+// La memoria de trabajo de la consulta no cabe en el límite de la arena. No
+// se guarda en la caché: con más memoria la consulta tendría respuesta.
+static void escribir_sin_memoria(Consulta *c, Salida *salida) {
+    c->completa = 0;
+    escribir_error(c, salida, "Error: La consulta necesita más memoria de la que permite el presupuesto del servidor.");
+}
+
+// Valor por el que se ordena un registro en top=K. Sin el dato (o con una
+// popularidad que no es un número) queda detrás de todos.
+static int64_t valor_orden(const Consulta *c, const Registro *registro) {
+    if (c->orden == ORDEN_DURACION) {
+        return (registro->banderas & REG_SIN_DURACION) ? INT64_MIN : registro->duracion_ms;
+    }
+    return (registro->banderas & (REG_SIN_POPULARIDAD | REG_POPULARIDAD_TEXTO)) ? INT64_MIN : registro->popularidad;
+}
+
+// Indica si a es peor que b: menor valor o, a igual valor, más tarde en el CSV.
+static int peor_que(const EntradaTop *a, const EntradaTop *b) {
+    return a->valor < b->valor || (a->valor == b->valor && a->numero > b->numero);
+}
+
+/*
+ * Indica si el registro todavía puede entrar entre los K mejores. Los
+ * recorridos avanzan por número de registro creciente, así que con el
+ * montículo lleno solo entra un valor estrictamente mayor que el peor. Se
+ * consulta antes de leer ninguna cadena del registro.
+ */
+static int puede_entrar_en_top(const Consulta *c, const Registro *registro) {
+    return c->num_mejores < c->top || valor_orden(c, registro) > c->mejores[0].valor;
+}
+
+// Mete el registro en el montículo de mínimos de los K mejores: la raíz es
+// el peor, que sale cuando llega uno mejor.
+static void meter_en_top(Consulta *c, uint64_t numero, const Registro *registro) {
+    EntradaTop nueva = {valor_orden(c, registro), numero};
+    EntradaTop *m = c->mejores;
+    uint32_t i;
+    if (c->num_mejores < c->top) {
+        i = c->num_mejores++;
+        while (i > 0 && peor_que(&nueva, &m[(i - 1) / 2])) {
+            m[i] = m[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        m[i] = nueva;
+        return;
+    }
+    if (!peor_que(&m[0], &nueva)) return;
+    i = 0;
+    while (1) {
+        uint32_t hijo = 2 * i + 1;
+        if (hijo >= c->num_mejores) break;
+        if (hijo + 1 < c->num_mejores && peor_que(&m[hijo + 1], &m[hijo])) hijo++;
+        if (!peor_que(&m[hijo], &nueva)) break;
+        m[i] = m[hijo];
+        i = hijo;
+    }
+    m[i] = nueva;
+}
+
+// De mejor a peor, para qsort.
+static int comparar_mejores(const void *a, const void *b) {
+    const EntradaTop *x = a, *y = b;
+    return peor_que(x, y) - peor_que(y, x);
+}
+
+/*
+ * Agrega a la respuesta el registro numero, que coincide con la búsqueda:
+ * se salta si todavía no se llegó al offset pedido. Devuelve -1 cuando hay
+ * que dejar de buscar, porque se alcanzó el límite (y entonces hay más
+ * resultados) o porque la salida se llenó; en ambos casos c->desde queda
+ * en este registro para seguir desde él.
+ */
+static int agregar_resultado(Consulta *c, Salida *salida, uint64_t numero, const Registro *registro,
+                             const char *album, const char *artista, const char *cancion) {
+    if (c->top) {
+        meter_en_top(c, numero, registro);
+        return 0;
+    }
+    if (c->saltar > 0) {
+        c->saltar--;
+        return 0;
+    }
+    c->desde = numero;
+    if (c->limite && c->agregados == c->limite) {
+        c->hay_mas = 1;
+        return -1;
+    }
+    char formatted_line[MAX_LINE_LENGTH];
+    uint64_t inicio = metricas_ahora();
+    formato_resultado(formatted_line, sizeof(formatted_line), registro, album, artista, cancion);
+    metricas_medir(medicion, ETAPA_FORMATO, inicio);
+    if (escribir_salida(salida, formatted_line, strlen(formatted_line), RESERVA_PIE) != 0) {
+        c->interrumpida = salida->vaciada >= 0;
+        return -1;
+    }
+    c->agregados++;
+    c->desde = numero + 1;
+    return 0;
+}
+
+// Columnas de texto de un registro, en el orden en que se guardan en una tanda.
+enum { CADENA_ALBUM, CADENA_ARTISTA, CADENA_CANCION, NUM_CADENAS };
+
+#define LEER_ALBUM_ARTISTA ((1 << CADENA_ALBUM) | (1 << CADENA_ARTISTA))
+#define LEER_CANCION (1 << CADENA_CANCION)
+
+// Lista de filas en bloques (ver indice.h) que se decodifica de a un
+// bloque a medida que se recorre.
+typedef struct CursorLista {
+    const uint8_t *p, *fin;
+    uint32_t restantes;   // Filas sin decodificar
+    uint32_t pos, tam;    // Siguiente fila del bloque decodificado y sus filas
+    uint64_t bloque[INDICE_TAM_BLOQUE];
+} CursorLista;
+
+static void iniciar_cursor(CursorLista *l, const uint8_t *lista, uint64_t bytes, uint32_t num_filas) {
+    l->p = lista;
+    l->fin = lista ? lista + bytes : NULL;
+    l->restantes = lista ? num_filas : 0;
+    l->pos = l->tam = 0;
+}
+
+// Deja en *numero la siguiente fila. Devuelve -1 al terminar la lista o si
+// está cortada.
+static inline int siguiente_fila(CursorLista *l, uint64_t *numero) {
+    if (l->pos == l->tam) {
+        if (l->restantes == 0) return -1;
+        uint32_t cuantos = l->restantes < INDICE_TAM_BLOQUE ? l->restantes : INDICE_TAM_BLOQUE;
+        uint64_t anterior = l->tam ? l->bloque[l->tam - 1] : 0;
+        if (indice_bloque_leer(&l->p, l->fin, cuantos, anterior, l->bloque) != 0) {
+            l->restantes = 0;
+            return -1;
+        }
+        l->restantes -= cuantos;
+        l->tam = cuantos;
+        l->pos = 0;
+    }
+    *numero = l->bloque[l->pos++];
+    return 0;
+}
+
+// Recorrido de la lista de filas de una clave por tandas. Al terminarla
+// sigue con la lista de la misma clave en el delta, cuyas filas son todas
+// posteriores.
+typedef struct Recorrido {
+    CursorLista lista;
+    CursorLista delta;
+} Recorrido;
+
+/*
+ * Filas consecutivas de una lista con sus registros y, en modo pread, las
+ * primeras VENTANA_CADENA bytes de sus cadenas. Todas esas lecturas se
+ * conocen de antemano, así que se piden juntas a lecturas_ejecutar en dos
+ * rondas (registros y luego cadenas) en lugar de una tras otra.
+ */
+typedef struct Tanda {
+    uint32_t n;
+    uint64_t numeros[FILAS_POR_TANDA];
+    Registro registros[FILAS_POR_TANDA];
+    int leido[FILAS_POR_TANDA];
+    const char *cadenas[FILAS_POR_TANDA][NUM_CADENAS]; // NULL: leer con leer_cadena
+    char ventanas[FILAS_POR_TANDA][NUM_CADENAS][VENTANA_CADENA];
+} Tanda;
+
+static uint32_t cadena_de_registro(const Registro *registro, int campo) {
+    return campo == CADENA_ALBUM ? registro->album : campo == CADENA_ARTISTA ? registro->artista : registro->cancion;
+}
+
+// Lee juntos los registros de la tanda y las cadenas indicadas en campos de
+// las filas que pueden entrar en el resultado.
+static void leer_tanda(Tanda *t, const Consulta *c, int campos) {
+    memset(t->cadenas, 0, sizeof(t->cadenas[0]) * t->n);
+    if (modo_mmap) {
+        for (uint32_t i = 0; i < t->n; i++) t->leido[i] = leer_registro(t->numeros[i], &t->registros[i]) == 0;
+        return;
+    }
+    Lectura lecturas[FILAS_POR_TANDA * NUM_CADENAS];
+    size_t n = 0;
+    for (uint32_t i = 0; i < t->n; i++) {
+        if (t->numeros[i] >= datos->num_registros) {
+            t->leido[i] = leer_registro(t->numeros[i], &t->registros[i]) == 0; // Fila del delta
+            continue;
+        }
+        t->leido[i] = 0;
+        lecturas[n++] = (Lectura){datos->registros_fd, &t->registros[i], sizeof(Registro),
+                                  sizeof(RegistrosCabecera) + t->numeros[i] * sizeof(Registro), 0};
+    }
+    medicion->contadores[CONTADOR_BYTES_REGISTROS] += n * sizeof(Registro);
+    lecturas_ejecutar(lecturas, n);
+    for (size_t k = 0; k < n; k++) {
+        t->leido[(Registro *)lecturas[k].buffer - t->registros] = lecturas[k].resultado == sizeof(Registro);
+    }
+
+    // Ventanas de las cadenas; las que no quepan se leen después completas.
+    uint8_t destino[FILAS_POR_TANDA * NUM_CADENAS][2];
+    n = 0;
+    for (uint32_t i = 0; i < t->n; i++) {
+        const Registro *registro = &t->registros[i];
+        if (!t->leido[i] || (c->top && !puede_entrar_en_top(c, registro))) continue;
+        for (int campo = 0; campo < NUM_CADENAS; campo++) {
+            uint32_t desp = cadena_de_registro(registro, campo);
+            if (!(campos & (1 << campo)) || desp >= datos->bytes_cadenas) continue;
+            if (campo == CADENA_CANCION && (registro->banderas & REG_SIN_CANCION)) continue;
+            size_t disponible = datos->bytes_cadenas - desp;
+            lecturas[n] = (Lectura){datos->registros_fd, t->ventanas[i][campo],
+                                    disponible < VENTANA_CADENA ? disponible : VENTANA_CADENA,
+                                    datos->desp_cadenas + desp, 0};
+            destino[n][0] = i;
+            destino[n][1] = campo;
+            medicion->contadores[CONTADOR_BYTES_REGISTROS] += lecturas[n].len;
+            n++;
+        }
+    }
+    lecturas_ejecutar(lecturas, n);
+    for (size_t k = 0; k < n; k++) {
+        const char *texto;
+        size_t len;
+        if (lecturas[k].resultado != lecturas[k].len ||
+            registro_cadena_leer(lecturas[k].buffer, lecturas[k].len, &texto, &len) != 0) continue;
+        t->cadenas[destino[k][0]][destino[k][1]] = texto;
+    }
+}
+
+// Decodifica las siguientes filas desde c->desde (como mucho las que aún
+// pueden hacer falta) y las lee. Devuelve cuántas son; 0 al terminar la lista.
+static uint32_t siguiente_tanda(Recorrido *r, const Consulta *c, Tanda *t, int campos) {
+    uint64_t maximo = FILAS_POR_TANDA;
+    if (c->limite && !c->top) {
+        // Con limit basta con una fila más de las que faltan para saber si hay más.
+        uint64_t faltan = c->saltar + (c->limite - c->agregados) + 1;
+        if (faltan < maximo) maximo = faltan;
+    }
+    t->n = 0;
+    uint64_t numero;
+    while (t->n < maximo) {
+        if (siguiente_fila(&r->lista, &numero) != 0 && siguiente_fila(&r->delta, &numero) != 0) break;
+        if (numero >= c->desde) t->numeros[t->n++] = numero;
+    }
+    if (t->n > 0) {
+        uint64_t inicio = metricas_ahora();
+        leer_tanda(t, c, campos);
+        metricas_medir(medicion, ETAPA_REGISTROS, inicio);
+    }
+    return t->n;
+}
+
+// Busca una clave del tipo dado en el delta. Devuelve su lista de filas (y
+// deja su tamaño y sus filas en *lista) o NULL si no está.
+static const uint8_t *buscar_en_delta(int tipo, const char *texto, size_t len, ListaIndice *lista) {
+    if (!datos->delta.num_filas) return NULL;
+    uint64_t huella = hash_clave(texto, len, delta_semilla(datos->semilla, tipo));
+    uint32_t cubeta = indice_cubeta(huella, datos->delta.cabecera->tam_tabla);
+    for (uint32_t k = datos->delta.tabla[cubeta]; k < datos->delta.tabla[cubeta + 1]; k++) {
+        medicion->contadores[CONTADOR_NODOS]++;
+        if (datos->delta.directorio[k].huella != huella) continue;
+        *lista = indice_lista(&datos->delta.directorio[k], datos->delta.cabecera->desp_listas);
+        if (lista->desp > datos->delta.cabecera->desp_registros ||
+            lista->bytes > datos->delta.cabecera->desp_registros - lista->desp) return NULL;
+        return (const uint8_t *)datos->delta.map + lista->desp;
+    }
+    return NULL;
+}
+
+/*
+ * Añade al recorrido la lista del delta para el texto (de len bytes) como
+ * clave del tipo dado. Las de artista y álbum se confirman una vez por
+ * clave, con su primera fila, como en los índices secundarios; la
+ * compuesta se confirma fila por fila al recorrerla.
+ */
+static void encadenar_delta(Recorrido *r, int tipo, const char *texto, size_t len) {
+    ListaIndice clave;
+    const uint8_t *lista = buscar_en_delta(tipo, texto, len, &clave);
+    if (!lista) return;
+    if (tipo == DELTA_ARTISTA || tipo == DELTA_ALBUM) {
+        // La primera fila de la lista es el primer valor de su primer bloque.
+        const uint8_t *p = lista;
+        uint64_t primera;
+        Registro registro;
+        char cadena_buf[TAM_BUFFER_CADENA];
+        if (indice_varint_leer(&p, lista + clave.bytes, &primera) != 0 ||
+            leer_registro(primera, &registro) != 0) return;
+        const char *cadena = leer_cadena(tipo == DELTA_ARTISTA ? registro.artista : registro.album, cadena_buf);
+        if (!cadena || strcmp(cadena, texto) != 0) {
+            medicion->contadores[CONTADOR_COLISIONES] += cadena != NULL;
+            return;
+        }
+    }
+    iniciar_cursor(&r->delta, lista, clave.bytes, clave.num_filas);
+}
+
+// Texto de una columna de la fila i de la tanda: la ventana ya leída o,
+// si no la hay, una lectura en buffer (de TAM_BUFFER_CADENA bytes).
+static const char *cadena_de_tanda(const Tanda *t, uint32_t i, int campo, char *buffer) {
+    if (t->cadenas[i][campo]) return t->cadenas[i][campo];
+    uint64_t inicio = metricas_ahora();
+    const char *texto = leer_cadena(cadena_de_registro(&t->registros[i], campo), buffer);
+    metricas_medir(medicion, ETAPA_REGISTROS, inicio);
+    return texto;
+}
+
+/*
+ * Búsqueda solo por álbum o solo por artista, con filtro opcional por
+ * canción como en la búsqueda compuesta. La lista de la clave tiene
+ * exactamente los registros de ese texto, en el orden del CSV, así que no
+ * hace falta confirmar cada fila.
+ */
+static void buscar_campo(Consulta *c, Salida *salida) {
+    const IndiceSecundario *s = c->tipo == CONSULTA_ALBUM ? &datos->indice_albumes : &datos->indice_artistas;
+    if (!s->cargado) {
+        c->completa = 0;
+        escribir_error(c, salida, s->campo == SECUNDARIO_ALBUM
+                                      ? "Error: La búsqueda solo por álbum no está disponible en este servidor."
+                                      : "Error: La búsqueda solo por artista no está disponible en este servidor.");
+        return;
+    }
+    const char *texto = c->tipo == CONSULTA_ALBUM ? c->album : c->artista;
+    ClaveSecundaria clave;
+    uint64_t inicio = metricas_ahora();
+    int hay_clave = buscar_secundario(s, texto, &clave) == 0;
+
+    void *lista_buffer = hay_clave && !modo_mmap ? pedir_memoria(clave.bytes_lista + 1) : NULL;
+    if (hay_clave && !modo_mmap && !lista_buffer) {
+        metricas_medir(medicion, ETAPA_INDICE, inicio);
+        escribir_sin_memoria(c, salida);
+        return;
+    }
+    const uint8_t *lista = NULL;
+    if (hay_clave) lista = leer_archivo(s->fd, s->map, s->map_tam, clave.desp_lista, clave.bytes_lista, lista_buffer);
+    if (hay_clave && !lista) {
+        c->completa = 0;
+        metricas_medir(medicion, ETAPA_INDICE, inicio);
+        return;
+    }
+    // Con filtro por canción, el álbum y el artista solo se leen de las
+    // filas que pasan el filtro.
+    Recorrido recorrido;
+    iniciar_cursor(&recorrido.lista, lista, clave.bytes_lista, clave.num_filas);
+    iniciar_cursor(&recorrido.delta, NULL, 0, 0);
+    encadenar_delta(&recorrido, c->tipo == CONSULTA_ALBUM ? DELTA_ALBUM : DELTA_ARTISTA, texto, strlen(texto));
+    metricas_medir(medicion, ETAPA_INDICE, inicio);
+    int campos = c->cancion[0] ? LEER_CANCION : LEER_CANCION | LEER_ALBUM_ARTISTA;
+    Tanda tanda;
+    int seguir = 1;
+    while (seguir && siguiente_tanda(&recorrido, c, &tanda, campos) > 0) {
+        for (uint32_t i = 0; i < tanda.n; i++) {
+            const Registro *registro = &tanda.registros[i];
+            if (!tanda.leido[i]) {
+                seguir = 0;
+                break;
+            }
+            if (c->top && !puede_entrar_en_top(c, registro)) continue;
+
+            char cancion_buf[TAM_BUFFER_CADENA];
+            const char *cancion = (registro->banderas & REG_SIN_CANCION) ? NULL : cadena_de_tanda(&tanda, i, CADENA_CANCION, cancion_buf);
+            if (c->cancion[0] && (!cancion || !strcasestr(cancion, c->cancion))) continue;
+
+            char album_buf[TAM_BUFFER_CADENA], artista_buf[TAM_BUFFER_CADENA];
+            const char *album = cadena_de_tanda(&tanda, i, CADENA_ALBUM, album_buf);
+            const char *artista = cadena_de_tanda(&tanda, i, CADENA_ARTISTA, artista_buf);
+            if (agregar_resultado(c, salida, tanda.numeros[i], registro, album ? album : "N/A",
+                                  artista ? artista : "N/A", cancion) != 0) {
+                seguir = 0;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Búsqueda por álbum y artista exactos, con filtro opcional por canción
+ * (parcial, sin distinguir mayúsculas). c->completa queda en 0 si falló
+ * una lectura y la respuesta no debe guardarse en la caché.
+ */
+static void buscar_album_artista(Consulta *c, Salida *salida) {
+    char composite_key[MAX_KEY_LENGTH];
+    int key_len = snprintf(composite_key, sizeof(composite_key), "%s|%s", c->album, c->artista);
+    if (key_len >= (int)sizeof(composite_key)) key_len = sizeof(composite_key) - 1;
+
+    uint64_t inicio = metricas_ahora();
+    uint64_t huella = hash_clave(composite_key, key_len, datos->semilla);
+    ListaIndice clave;
+    int hay_clave = buscar_clave(huella, &clave) == 0;
+
+    // En modo mmap no se reserva ningún buffer: la lista se lee directamente
+    // del mapeo.
+    void *lista_buffer = NULL;
+    const uint8_t *lista = NULL;
+    if (hay_clave && !modo_mmap && !(lista_buffer = pedir_memoria(clave.bytes + 1))) {
+        metricas_medir(medicion, ETAPA_INDICE, inicio);
+        escribir_sin_memoria(c, salida);
+        return;
+    }
+    if (hay_clave) {
+        // Toda la lista de registros de la clave sale de una sola lectura.
+        lista = leer_indice(clave.desp, clave.bytes, lista_buffer);
+    }
+    // Si no se pudo leer la lista no se guarda: la próxima consulta reintenta.
+    if (hay_clave && !lista) c->completa = 0;
+
+    // Los registros de cada tanda de filas, y luego sus cadenas, se leen
+    // juntos (ver leer_tanda). Tras la lista del índice sigue la del delta.
+    Recorrido recorrido;
+    iniciar_cursor(&recorrido.lista, lista, clave.bytes, clave.num_filas);
+    iniciar_cursor(&recorrido.delta, NULL, 0, 0);
+    encadenar_delta(&recorrido, DELTA_COMPUESTA, composite_key, key_len);
+    metricas_medir(medicion, ETAPA_INDICE, inicio);
+    Tanda tanda;
+    int seguir = 1;
+    while (seguir && siguiente_tanda(&recorrido, c, &tanda, LEER_ALBUM_ARTISTA | LEER_CANCION) > 0) {
+        for (uint32_t i = 0; i < tanda.n; i++) {
+            const Registro *registro = &tanda.registros[i];
+            if (!tanda.leido[i]) {
+                seguir = 0;
+                break;
+            }
+            if (c->top && !puede_entrar_en_top(c, registro)) continue;
+
+            // La huella puede coincidir por casualidad: se confirma la clave.
+            char album_buf[TAM_BUFFER_CADENA], artista_buf[TAM_BUFFER_CADENA];
+            const char *album = cadena_de_tanda(&tanda, i, CADENA_ALBUM, album_buf);
+            const char *artista = cadena_de_tanda(&tanda, i, CADENA_ARTISTA, artista_buf);
+            if (!album || !artista || strcmp(album, c->album) != 0 || strcmp(artista, c->artista) != 0) {
+                medicion->contadores[CONTADOR_COLISIONES] += album && artista;
+                continue;
+            }
+
+            char cancion_buf[TAM_BUFFER_CADENA];
+            const char *cancion = (registro->banderas & REG_SIN_CANCION) ? NULL : cadena_de_tanda(&tanda, i, CADENA_CANCION, cancion_buf);
+            int match = 0;
+            if (strlen(c->cancion) == 0) {
+                match = 1;
+            } else if (cancion && strcasestr(cancion, c->cancion) != NULL) {
+                match = 1;
+            }
+
+            if (match && agregar_resultado(c, salida, tanda.numeros[i], registro, album, artista, cancion) != 0) {
+                seguir = 0;
+                break;
+            }
+        }
+    }
+}
+
+// Confirma un candidato de la búsqueda por canción con su nombre completo
+// y lo agrega. Devuelve lo mismo que agregar_resultado.
+static int confirmar_cancion(Consulta *c, Salida *salida, uint64_t candidato, const char *buscado, size_t len_buscado) {
+    Registro registro;
+    char cancion_buf[TAM_BUFFER_CADENA];
+    const char *cancion = NULL;
+    uint64_t inicio = metricas_ahora();
+    if (leer_registro(candidato, &registro) == 0 && !(registro.banderas & REG_SIN_CANCION) &&
+        (!c->top || puede_entrar_en_top(c, &registro))) {
+        cancion = leer_cadena(registro.cancion, cancion_buf);
+    }
+    metricas_medir(medicion, ETAPA_REGISTROS, inicio);
+    char normalizado[TRIGRAMAS_MAX_TEXTO];
+    size_t len_normalizado = cancion ? trigramas_normalizar(cancion, strlen(cancion), normalizado, sizeof(normalizado)) : 0;
+    if (!cancion || !memmem(normalizado, len_normalizado, buscado, len_buscado)) {
+        medicion->contadores[CONTADOR_DESCARTADOS] += cancion != NULL;
+        return 0;
+    }
+    char album_buf[TAM_BUFFER_CADENA], artista_buf[TAM_BUFFER_CADENA];
+    inicio = metricas_ahora();
+    const char *album = leer_cadena(registro.album, album_buf);
+    const char *artista = leer_cadena(registro.artista, artista_buf);
+    metricas_medir(medicion, ETAPA_REGISTROS, inicio);
+    return agregar_resultado(c, salida, candidato, &registro, album ? album : "N/A",
+                             artista ? artista : "N/A", cancion);
+}
+
+// Lista de un trigrama en el delta, en memoria, que se recorre en orden.
+typedef struct ListaDelta {
+    CursorLista cursor;
+    uint32_t num_filas;
+    int empezada;
+    uint64_t valor;      // Último valor decodificado
+} ListaDelta;
+
+// Avanza la lista hasta el primer valor >= objetivo. Devuelve -1 si no hay.
+static int avanzar_lista_delta(ListaDelta *l, uint64_t objetivo, uint64_t *valor) {
+    while (!l->empezada || l->valor < objetivo) {
+        if (siguiente_fila(&l->cursor, &l->valor) != 0) return -1;
+        l->empezada = 1;
+    }
+    *valor = l->valor;
+    return 0;
+}
+
+/*
+ * Búsqueda por canción en las filas del delta, después de las del índice:
+ * el mismo cruce de las listas de los trigramas menos frecuentes, que aquí
+ * ya están en memoria. Devuelve -1 si la consulta se detuvo.
+ */
+static int buscar_cancion_delta(Consulta *c, Salida *salida, const char *buscado, size_t len_buscado,
+                                const uint32_t *trigramas, size_t num_trigramas) {
+    ListaDelta listas[MAX_LISTAS_TRIGRAMAS];
+    int num_listas = 0;
+    for (size_t i = 0; i < num_trigramas; i++) {
+        char texto[3];
+        ListaIndice clave;
+        delta_texto_trigrama(trigramas[i], texto);
+        const uint8_t *lista = buscar_en_delta(DELTA_TRIGRAMA, texto, 3, &clave);
+        if (!lista) return 0; // Un trigrama ausente: ninguna fila nueva coincide
+        ListaDelta l = {.num_filas = clave.num_filas};
+        iniciar_cursor(&l.cursor, lista, clave.bytes, clave.num_filas);
+        int j = num_listas < MAX_LISTAS_TRIGRAMAS ? num_listas++ : MAX_LISTAS_TRIGRAMAS;
+        while (j > 0 && listas[j - 1].num_filas > l.num_filas) {
+            if (j < MAX_LISTAS_TRIGRAMAS) listas[j] = listas[j - 1];
+            j--;
+        }
+        if (j < MAX_LISTAS_TRIGRAMAS) listas[j] = l;
+    }
+
+    uint64_t candidato;
+    int coinciden = 1, i = 1;
+    if (avanzar_lista_delta(&listas[0], c->desde, &candidato) != 0) return 0;
+    while (1) {
+        if (coinciden < num_listas) {
+            uint64_t valor;
+            if (avanzar_lista_delta(&listas[i], candidato, &valor) != 0) return 0;
+            if (valor == candidato) {
+                coinciden++;
+            } else {
+                candidato = valor;
+                coinciden = 1;
+            }
+            i = (i + 1) % num_listas;
+            continue;
+        }
+        if (confirmar_cancion(c, salida, candidato, buscado, len_buscado) != 0) return -1;
+        if (avanzar_lista_delta(&listas[0], candidato + 1, &candidato) != 0) return 0;
+        coinciden = 1;
+        i = 1 % num_listas;
+    }
+}
+
+/*
+ * Búsqueda solo por canción: registros cuyo nombre de canción normalizado
+ * contiene el texto buscado normalizado (sin distinguir mayúsculas ni
+ * acentos; incluye los que empiezan por él). Se cruzan, con saltos
+ * galopantes, las listas de los MAX_LISTAS_TRIGRAMAS trigramas menos
+ * frecuentes del texto, y cada candidato se confirma con su nombre
+ * completo. Los resultados salen en el orden del CSV, empezando por el
+ * cursor de la consulta, y siguen con las filas del delta.
+ */
+static void buscar_cancion(Consulta *c, Salida *salida) {
+    if (!datos->hay_trigramas) {
+        c->completa = 0;
+        escribir_error(c, salida, "Error: La búsqueda solo por canción no está disponible en este servidor.");
+        return;
+    }
+    char buscado[TRIGRAMAS_MAX_TEXTO];
+    size_t len_buscado = trigramas_normalizar(c->cancion, strlen(c->cancion), buscado, sizeof(buscado));
+    if (len_buscado < 3) {
+        escribir_error(c, salida, "Error: La búsqueda solo por canción necesita al menos 3 caracteres.");
+        return;
+    }
+
+    // Se quedan las listas más cortas, ordenadas de menor a mayor: la
+    // primera propone candidatos y las demás los confirman.
+    uint32_t trigramas[TRIGRAMAS_MAX_TEXTO];
+    size_t num_trigramas = trigramas_extraer(buscado, len_buscado, trigramas);
+    TrigramaClave claves[MAX_LISTAS_TRIGRAMAS];
+    int num_listas = 0;
+    uint64_t inicio = metricas_ahora();
+    for (size_t i = 0; i < num_trigramas; i++) {
+        TrigramaClave clave;
+        if (buscar_trigrama(trigramas[i], &clave) != 0) {
+            // Un trigrama ausente: no hay resultados en el índice.
+            metricas_medir(medicion, ETAPA_INDICE, inicio);
+            buscar_cancion_delta(c, salida, buscado, len_buscado, trigramas, num_trigramas);
+            return;
+        }
+        int j = num_listas < MAX_LISTAS_TRIGRAMAS ? num_listas++ : MAX_LISTAS_TRIGRAMAS;
+        while (j > 0 && claves[j - 1].num_filas > clave.num_filas) {
+            if (j < MAX_LISTAS_TRIGRAMAS) claves[j] = claves[j - 1];
+            j--;
+        }
+        if (j < MAX_LISTAS_TRIGRAMAS) claves[j] = clave;
+    }
+
+    ListaTrigrama *listas = pedir_memoria(sizeof(ListaTrigrama) * num_listas);
+    int abiertas = 0, estado = listas ? 0 : -2;
+    while (estado == 0 && abiertas < num_listas) {
+        estado = abrir_lista(&listas[abiertas], &claves[abiertas]);
+        if (estado == 0) abiertas++;
+    }
+    metricas_medir(medicion, ETAPA_INDICE, inicio);
+    if (estado == -2) {
+        escribir_sin_memoria(c, salida);
+        return;
+    }
+    if (abiertas < num_listas) c->completa = 0;
+
+    // Intersección "leapfrog": el candidato avanza al mayor valor visto
+    // hasta que todas las listas lo contienen.
+    uint32_t candidato;
+    int coinciden = 1, i = 1, detenida = 0;
+    int sigue = abiertas == num_listas && c->desde <= UINT32_MAX &&
+                avanzar_lista(&listas[0], (uint32_t)c->desde, &candidato) == 0;
+    while (sigue) {
+        if (coinciden < num_listas) {
+            uint32_t valor;
+            if (avanzar_lista(&listas[i], candidato, &valor) != 0) break;
+            if (valor == candidato) {
+                coinciden++;
+            } else {
+                candidato = valor;
+                coinciden = 1;
+            }
+            i = (i + 1) % num_listas;
+            continue;
+        }
+
+        if (confirmar_cancion(c, salida, candidato, buscado, len_buscado) != 0) {
+            detenida = 1;
+            break;
+        }
+        sigue = avanzar_lista(&listas[0], candidato + 1, &candidato) == 0;
+        coinciden = 1;
+        i = 1 % num_listas;
+    }
+    if (!detenida && abiertas == num_listas) buscar_cancion_delta(c, salida, buscado, len_buscado, trigramas, num_trigramas);
+}
+
+
+// Archivos que lee un lote, para agrupar sus rangos.
+enum { ARCHIVO_INDICE, ARCHIVO_ALBUMES, ARCHIVO_ARTISTAS, ARCHIVO_REGISTROS };
+
+// Rango de bytes de un archivo que un lote va a leer.
+typedef struct Rango {
+    uint64_t desp;
+    uint32_t len;
+    uint32_t archivo;
+} Rango;
+
+static int comparar_rangos(const void *a, const void *b) {
+    const Rango *x = a, *y = b;
+    if (x->archivo != y->archivo) return x->archivo < y->archivo ? -1 : 1;
+    return (x->desp > y->desp) - (x->desp < y->desp);
+}
+
+/*
+ * Pide al núcleo todos los rangos de una vez, ordenados por archivo y
+ * desplazamiento y fusionando los que están a menos de HUECO_FUSION bytes:
+ * en modo stdio con readahead(), que encola la lectura en la caché de
+ * páginas sin copiar nada, y en modo mmap con madvise(MADV_WILLNEED). El
+ * disco recibe las lecturas juntas y en orden en lugar de una búsqueda por
+ * consulta, y las lecturas normales que siguen las encuentran en memoria.
+ */
+static void anticipar_rangos(Rango *rangos, size_t n) {
+    qsort(rangos, n, sizeof(Rango), comparar_rangos);
+    size_t i = 0;
+    while (i < n) {
+        uint32_t archivo = rangos[i].archivo;
+        uint64_t desde = rangos[i].desp, hasta = desde + rangos[i].len;
+        for (i++; i < n && rangos[i].archivo == archivo && rangos[i].desp <= hasta + HUECO_FUSION; i++) {
+            if (rangos[i].desp + rangos[i].len > hasta) hasta = rangos[i].desp + rangos[i].len;
+        }
+        int fd = archivo == ARCHIVO_INDICE ? datos->indice_fd
+               : archivo == ARCHIVO_ALBUMES ? datos->indice_albumes.fd
+               : archivo == ARCHIVO_ARTISTAS ? datos->indice_artistas.fd : datos->registros_fd;
+        const char *map = archivo == ARCHIVO_INDICE ? datos->indice_map
+                        : archivo == ARCHIVO_ALBUMES ? datos->indice_albumes.map
+                        : archivo == ARCHIVO_ARTISTAS ? datos->indice_artistas.map : datos->registros_map;
+        if (modo_mmap) {
+            uint64_t pagina = desde & ~(uint64_t)4095;
+            madvise((void *)(map + pagina), hasta - pagina, MADV_WILLNEED);
+        } else {
+            readahead(fd, desde, hasta - desde);
+        }
+    }
+}
+
+// Agrega un rango a la lista si queda sitio.
+static void agregar_rango(Rango *rangos, size_t *n, size_t max, uint32_t archivo, uint64_t desp, uint64_t len) {
+    if (*n < max) rangos[(*n)++] = (Rango){desp, (uint32_t)len, archivo};
+}
+
+// Clave distinta de un lote: la búsqueda compuesta o por un solo campo de
+// alguna de sus consultas.
+typedef struct ClaveLote {
+    uint64_t huella;
+    uint32_t archivo;
+    uint32_t consulta;      // Primera consulta con esta clave
+    uint64_t desp_lista;
+    uint32_t bytes_lista;
+    uint32_t num_filas;
+} ClaveLote;
+
+static int comparar_claves_lote(const void *a, const void *b) {
+    const ClaveLote *x = a, *y = b;
+    if (x->archivo != y->archivo) return x->archivo < y->archivo ? -1 : 1;
+    return (x->huella > y->huella) - (x->huella < y->huella);
+}
+
+// Deja en texto el campo (0 álbum, 1 artista) de una consulta de lote.
+static void campo_de_consulta(const char *consulta, int campo, char *texto, size_t cap) {
+    for (int i = 0; i < campo && consulta; i++) {
+        consulta = strchr(consulta, '|');
+        if (consulta) consulta++;
+    }
+    size_t len = consulta ? strcspn(consulta, "|") : 0;
+    if (len >= cap) len = cap - 1;
+    memcpy(texto, consulta ? consulta : "", len);
+    texto[len] = '\0';
+}
+
+void anticipar_lote(const char *const *consultas, size_t n) {
+    revisar_delta(0);
+    datos = vigentes;
+    arena.limite = presupuesto.arena;
+    ClaveLote *claves = pedir_memoria(sizeof(ClaveLote) * n + 1);
+    size_t max_rangos = n * MAX_FILAS_ANTICIPADAS * 3 + 1;
+    Rango *rangos = pedir_memoria(sizeof(Rango) * max_rangos);
+    if (!claves || !rangos) {
+        arena_reiniciar(&arena);
+        return;
+    }
+
+    // Huellas de las claves, sin repetir. Las búsquedas solo por canción
+    // van por trigramas y no se anticipan, ni las claves compuestas que el
+    // filtro del índice descarta.
+    size_t num_claves = 0;
+    for (size_t i = 0; i < n; i++) {
+        char album[MAX_KEY_LENGTH], artista[MAX_KEY_LENGTH], clave[MAX_KEY_LENGTH];
+        campo_de_consulta(consultas[i], 0, album, sizeof(album));
+        campo_de_consulta(consultas[i], 1, artista, sizeof(artista));
+        ClaveLote *c = &claves[num_claves];
+        c->consulta = i;
+        if (album[0] && artista[0]) {
+            int len = snprintf(clave, sizeof(clave), "%s|%s", album, artista);
+            if (len >= (int)sizeof(clave)) len = sizeof(clave) - 1;
+            c->archivo = ARCHIVO_INDICE;
+            c->huella = hash_clave(clave, len, datos->semilla);
+            if (!indice_filtro_contiene(datos->filtro, datos->bloques_filtro, c->huella)) continue;
+        } else if (album[0] && datos->indice_albumes.cargado) {
+            c->archivo = ARCHIVO_ALBUMES;
+            c->huella = hash_clave(album, strlen(album), datos->indice_albumes.semilla);
+        } else if (artista[0] && !album[0] && datos->indice_artistas.cargado) {
+            c->archivo = ARCHIVO_ARTISTAS;
+            c->huella = hash_clave(artista, strlen(artista), datos->indice_artistas.semilla);
+        } else {
+            continue;
+        }
+        num_claves++;
+    }
+    qsort(claves, num_claves, sizeof(ClaveLote), comparar_claves_lote);
+    size_t distintas = 0;
+    for (size_t i = 0; i < num_claves; i++) {
+        if (distintas == 0 || comparar_claves_lote(&claves[i], &claves[distintas - 1]) != 0) claves[distintas++] = claves[i];
+    }
+    num_claves = distintas;
+
+    // 1. Las entradas del directorio de cada cubeta.
+    size_t num_rangos = 0;
+    for (size_t i = 0; i < num_claves; i++) {
+        const ClaveLote *c = &claves[i];
+        if (c->archivo == ARCHIVO_INDICE) {
+            uint32_t b = indice_cubeta(c->huella, datos->tam_tabla);
+            agregar_rango(rangos, &num_rangos, max_rangos, c->archivo,
+                          datos->desp_directorio + (uint64_t)datos->hash_table[b] * sizeof(ClaveIndice),
+                          (uint64_t)(datos->hash_table[b + 1] - datos->hash_table[b] + 1) * sizeof(ClaveIndice));
+        } else {
+            const IndiceSecundario *s = c->archivo == ARCHIVO_ALBUMES ? &datos->indice_albumes : &datos->indice_artistas;
+            uint32_t b = indice_cubeta(c->huella, s->tam_tabla);
+            agregar_rango(rangos, &num_rangos, max_rangos, c->archivo,
+                          s->desp_directorio + (uint64_t)s->tabla[b] * sizeof(ClaveSecundaria),
+                          (uint64_t)(s->tabla[b + 1] - s->tabla[b]) * sizeof(ClaveSecundaria));
+        }
+    }
+    anticipar_rangos(rangos, num_rangos);
+
+    // 2. Las listas de las claves que existen.
+    num_rangos = 0;
+    for (size_t i = 0; i < num_claves; i++) {
+        ClaveLote *c = &claves[i];
+        c->num_filas = 0;
+        if (c->archivo == ARCHIVO_INDICE) {
+            ListaIndice clave;
+            if (buscar_clave(c->huella, &clave) != 0) continue;
+            c->desp_lista = clave.desp;
+            c->bytes_lista = (uint32_t)clave.bytes;
+            c->num_filas = clave.num_filas;
+        } else {
+            char texto[MAX_KEY_LENGTH];
+            campo_de_consulta(consultas[c->consulta], c->archivo == ARCHIVO_ALBUMES ? 0 : 1, texto, sizeof(texto));
+            ClaveSecundaria clave;
+            if (buscar_secundario(c->archivo == ARCHIVO_ALBUMES ? &datos->indice_albumes : &datos->indice_artistas, texto, &clave) != 0) continue;
+            c->desp_lista = clave.desp_lista;
+            c->bytes_lista = clave.bytes_lista;
+            c->num_filas = clave.num_filas;
+        }
+        agregar_rango(rangos, &num_rangos, max_rangos, c->archivo, c->desp_lista, c->bytes_lista);
+    }
+    anticipar_rangos(rangos, num_rangos);
+
+    // 3. Los registros de las primeras filas de cada lista y, 4., sus cadenas.
+    size_t max_filas = n * MAX_FILAS_ANTICIPADAS;
+    uint64_t *filas = pedir_memoria(sizeof(uint64_t) * max_filas + 1);
+    size_t num_filas = 0;
+    num_rangos = 0;
+    for (size_t i = 0; filas && i < num_claves; i++) {
+        const ClaveLote *c = &claves[i];
+        if (c->num_filas == 0) continue;
+        const IndiceSecundario *s = c->archivo == ARCHIVO_ALBUMES ? &datos->indice_albumes : &datos->indice_artistas;
+        void *buffer = modo_mmap ? NULL : pedir_memoria(c->bytes_lista + 1);
+        const uint8_t *lista = NULL;
+        if (c->archivo == ARCHIVO_INDICE) {
+            if (modo_mmap || buffer) lista = leer_indice(c->desp_lista, c->bytes_lista, buffer);
+        } else if (modo_mmap || buffer) {
+            lista = leer_archivo(s->fd, s->map, s->map_tam, c->desp_lista, c->bytes_lista, buffer);
+        }
+        CursorLista cursor;
+        iniciar_cursor(&cursor, lista, c->bytes_lista, c->num_filas);
+        uint64_t numero;
+        for (uint32_t f = 0; f < MAX_FILAS_ANTICIPADAS && num_filas < max_filas; f++) {
+            if (siguiente_fila(&cursor, &numero) != 0 || numero >= datos->num_registros) break;
+            filas[num_filas++] = numero;
+            agregar_rango(rangos, &num_rangos, max_rangos, ARCHIVO_REGISTROS,
+                          sizeof(RegistrosCabecera) + numero * sizeof(Registro), sizeof(Registro));
+        }
+    }
+    anticipar_rangos(rangos, num_rangos);
+
+    num_rangos = 0;
+    for (size_t i = 0; i < num_filas; i++) {
+        Registro registro;
+        if (leer_registro(filas[i], &registro) != 0) continue;
+        agregar_rango(rangos, &num_rangos, max_rangos, ARCHIVO_REGISTROS, datos->desp_cadenas + registro.album, VENTANA_CADENA);
+        agregar_rango(rangos, &num_rangos, max_rangos, ARCHIVO_REGISTROS, datos->desp_cadenas + registro.artista, VENTANA_CADENA);
+        if (!(registro.banderas & REG_SIN_CANCION)) {
+            agregar_rango(rangos, &num_rangos, max_rangos, ARCHIVO_REGISTROS, datos->desp_cadenas + registro.cancion, VENTANA_CADENA);
+        }
+    }
+    anticipar_rangos(rangos, num_rangos);
+    arena_reiniciar(&arena);
+}
+
+// Lee las opciones del cuarto campo de la consulta: un número de página o
+// "limit=N", "offset=N", "cursor=N", "top=K" y "sort=..." separados por
+// espacios o comas. Devuelve -1 si alguna no se entiende.
+static int leer_opciones(Consulta *c, char *opciones) {
+    char *fin;
+    if (!opciones[0]) return 0;
+    if (opciones[0] >= '0' && opciones[0] <= '9') {
+        unsigned long n = strtoul(opciones, &fin, 10);
+        if (*fin || n == 0 || n > MAX_PAGINA) return -1;
+        c->pagina = n;
+        return 0;
+    }
+    char *resto;
+    for (char *op = strtok_r(opciones, " ,", &resto); op; op = strtok_r(NULL, " ,", &resto)) {
+        char *valor = strchr(op, '=');
+        if (!valor) return -1;
+        *valor++ = '\0';
+        if (strcmp(op, "sort") == 0) {
+            if (strcmp(valor, "popularity") == 0) c->orden = ORDEN_POPULARIDAD;
+            else if (strcmp(valor, "duration") == 0) c->orden = ORDEN_DURACION;
+            else return -1;
+            continue;
+        }
+        if (valor[0] < '0' || valor[0] > '9') return -1;
+        errno = 0;
+        unsigned long long n = strtoull(valor, &fin, 10);
+        if (*fin || errno) return -1;
+        if (strcmp(op, "limit") == 0 && n > 0) {
+            c->limite = n;
+        } else if (strcmp(op, "offset") == 0) {
+            c->saltar = n;
+        } else if (strcmp(op, "cursor") == 0) {
+            c->desde = n;
+        } else if (strcmp(op, "top") == 0 && n > 0 && n <= MAX_TOP) {
+            c->top = n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Cierra la respuesta: avisa si no hubo resultados y, si se pidió una
+// página o un límite, indica cómo seguir. Cabe en el espacio reservado.
+static void escribir_pie(Consulta *c, Salida *salida) {
+    char pie[RESERVA_PIE];
+    unsigned long long agregados = c->agregados, cursor = c->desde;
+    if (c->error) return;
+    if (c->agregados == 0 && c->pagina > 1) {
+        snprintf(pie, sizeof(pie), "No hay resultados en la página %u de la búsqueda.", c->pagina);
+    } else if (c->agregados == 0) {
+        snprintf(pie, sizeof(pie), "No se encontraron resultados para la búsqueda.");
+    } else if (c->pagina) {
+        unsigned long long primero = (unsigned long long)(c->pagina - 1) * RESULTADOS_POR_PAGINA + 1;
+        if (c->hay_mas) {
+            snprintf(pie, sizeof(pie), "Página %u (resultados %llu a %llu). Hay más resultados: pida la página %u (cursor=%llu).\n",
+                     c->pagina, primero, primero + agregados - 1, c->pagina + 1, cursor);
+        } else {
+            snprintf(pie, sizeof(pie), "Página %u (resultados %llu a %llu). No hay más resultados.\n",
+                     c->pagina, primero, primero + agregados - 1);
+        }
+    } else if (c->top) {
+        snprintf(pie, sizeof(pie), "Los %llu resultados con más %s, de mayor a menor (top=%u).\n", agregados,
+                 c->orden == ORDEN_DURACION ? "duración" : "popularidad", c->top);
+    } else if (c->limite) {
+        if (c->hay_mas) {
+            snprintf(pie, sizeof(pie), "%llu resultados. Hay más resultados: continúe con cursor=%llu.\n", agregados, cursor);
+        } else {
+            snprintf(pie, sizeof(pie), "%llu resultados. No hay más resultados.\n", agregados);
+        }
+    } else {
+        return;
+    }
+    escribir_salida(salida, pie, strlen(pie), 0);
+}
+
+/*
+ * Escribe los K mejores, de mayor a menor, a partir del primero que falta.
+ * Si la salida se llena sin poder vaciarse deja la consulta interrumpida.
+ */
+static void escribir_mejores(Consulta *c, Salida *salida) {
+    for (; c->emitidos < c->num_mejores; c->emitidos++) {
+        Registro registro;
+        uint64_t inicio = metricas_ahora();
+        if (leer_registro(c->mejores[c->emitidos].numero, &registro) != 0) {
+            c->completa = 0;
+            continue;
+        }
+        char album_buf[TAM_BUFFER_CADENA], artista_buf[TAM_BUFFER_CADENA], cancion_buf[TAM_BUFFER_CADENA];
+        const char *album = leer_cadena(registro.album, album_buf);
+        const char *artista = leer_cadena(registro.artista, artista_buf);
+        const char *cancion = (registro.banderas & REG_SIN_CANCION) ? NULL : leer_cadena(registro.cancion, cancion_buf);
+        metricas_medir(medicion, ETAPA_REGISTROS, inicio);
+        char formatted_line[MAX_LINE_LENGTH];
+        inicio = metricas_ahora();
+        formato_resultado(formatted_line, sizeof(formatted_line), &registro, album ? album : "N/A",
+                          artista ? artista : "N/A", cancion);
+        metricas_medir(medicion, ETAPA_FORMATO, inicio);
+        if (escribir_salida(salida, formatted_line, strlen(formatted_line), RESERVA_PIE) != 0) {
+            c->interrumpida = salida->vaciada >= 0 && salida->len > 0;
+            if (c->interrumpida) return;
+            continue;
+        }
+        c->agregados++;
+    }
+}
+
+/*
+ * Vuelca la medición de la consulta en las métricas compartidas (una sola
+ * vez: después queda cerrada). de_cache indica que la respuesta salió de
+ * la caché y abandonada que el cliente se fue antes de recibirla completa.
+ */
+static void terminar_medicion(Consulta *c, int de_cache, int abandonada) {
+    Medicion *m = &c->medicion;
+    if (m->inicio) {
+        metricas_medir(m, ETAPA_TOTAL, m->inicio);
+        ResumenConsulta resumen = {c->tipo, c->origen, c->album, c->artista, c->cancion, c->agregados,
+                                   de_cache, c->hay_mas, c->error, abandonada};
+        metricas_registrar(m, &resumen);
+        m->inicio = 0;
+    }
+    medicion = &sin_consulta;
+}
+
+void liberar_consulta(Consulta *c) {
+    terminar_medicion(c, 0, 1);
+    free(c->mejores);
+    c->mejores = NULL;
+    if (c->datos) {
+        soltar_datos(c->datos);
+        c->datos = NULL;
+    }
+}
+
+int iniciar_consulta(Consulta *c, const char *texto, const char *origen, Salida *salida) {
+    memset(&c->medicion, 0, sizeof(c->medicion));
+    c->medicion.inicio = metricas_ahora();
+    medicion = &c->medicion;
+    c->origen = origen;
+    revisar_delta(0);
+    snprintf(c->texto, sizeof(c->texto), "%s", texto);
+    c->pagina = 0;
+    c->desde = c->saltar = c->limite = c->agregados = 0;
+    c->hay_mas = c->interrumpida = c->error = c->tramos = 0;
+    c->top = c->num_mejores = c->emitidos = 0;
+    c->orden = ORDEN_POPULARIDAD;
+    c->ordenados = 0;
+    c->mejores = NULL;
+    c->datos = NULL;
+    c->completa = 1;
+    c->len_cache = -1;
+    salida->len = 0;
+    salida->vaciada = 0;
+
+    // Campos "album|artista|cancion|opciones"; los que faltan quedan vacíos.
+    char *campos[4] = {"", "", "", ""};
+    char *p = c->texto;
+    for (int i = 0; i < 4 && p; i++) {
+        campos[i] = p;
+        p = strchr(p, '|');
+        if (p) *p++ = '\0';
+    }
+    c->album = campos[0];
+    c->artista = campos[1];
+    c->cancion = campos[2];
+
+    // La consulta ya no se imprime aquí: el registrador imprime las que le
+    // tocan según el muestreo (ver metricas.h).
+    if (!c->album[0] && !c->artista[0] && c->cancion[0]) {
+        c->tipo = CONSULTA_CANCION;
+    } else if (c->album[0] && c->artista[0]) {
+        c->tipo = CONSULTA_COMPUESTA;
+    } else if (c->album[0]) {
+        c->tipo = CONSULTA_ALBUM;
+    } else if (c->artista[0]) {
+        c->tipo = CONSULTA_ARTISTA;
+    } else {
+        c->tipo = CONSULTA_INVALIDA;
+        escribir_error(c, salida, "Error: Consulta inválida.");
+        terminar_medicion(c, 0, 0);
+        return 0;
+    }
+    const char *error = NULL;
+    if (leer_opciones(c, campos[3]) != 0) {
+        error = "Error: Opciones inválidas (use un número de página, limit=N, offset=N y cursor=N, o top=K con sort=popularity o sort=duration).";
+    } else if (c->top && (c->pagina || c->limite || c->saltar || c->desde)) {
+        error = "Error: top=K no se combina con páginas, limit, offset ni cursor.";
+    } else if (c->top && !(c->mejores = malloc(sizeof(EntradaTop) * c->top))) {
+        error = "Error: No hay memoria para top=K.";
+    }
+    if (error) {
+        escribir_error(c, salida, error);
+        terminar_medicion(c, 0, 0);
+        return 0;
+    }
+
+    // Sin página ni límite se responde todo, salvo en las búsquedas que
+    // pueden tener miles de filas, que empiezan por la primera página.
+    if (!c->pagina && !c->limite && !c->top && c->tipo != CONSULTA_COMPUESTA) c->pagina = 1;
+    if (c->pagina) {
+        c->saltar = (uint64_t)(c->pagina - 1) * RESULTADOS_POR_PAGINA;
+        c->limite = RESULTADOS_POR_PAGINA;
+    }
+
+    // Clave de la caché: el álbum y el artista se comparan tal cual, pero la
+    // canción se busca sin distinguir mayúsculas (ASCII, como strcasestr en
+    // el locale C) y vacía equivale a no darla. Solo se guardan respuestas
+    // completas de una sola vez en un buffer del tamaño que fija el
+    // presupuesto de memoria.
+    int len_cache;
+    if (c->top) {
+        len_cache = snprintf(c->clave_cache, sizeof(c->clave_cache), "%s|%s|%s|top%u,%d",
+                             c->album, c->artista, c->cancion, c->top, c->orden);
+    } else if (c->pagina || c->limite || c->saltar || c->desde) {
+        len_cache = snprintf(c->clave_cache, sizeof(c->clave_cache), "%s|%s|%s|%u,%llu,%llu,%llu",
+                             c->album, c->artista, c->cancion, c->pagina, (unsigned long long)c->desde,
+                             (unsigned long long)c->saltar, (unsigned long long)c->limite);
+    } else {
+        len_cache = snprintf(c->clave_cache, sizeof(c->clave_cache), "%s|%s|%s", c->album, c->artista, c->cancion);
+    }
+    // Otro proceso puede servir otros datos (aún no recibió la recarga o el
+    // delta nuevo): las respuestas de cada generación se guardan aparte.
+    if (len_cache < (int)sizeof(c->clave_cache)) {
+        len_cache += snprintf(c->clave_cache + len_cache, sizeof(c->clave_cache) - len_cache, "#%llx",
+                              (unsigned long long)vigentes->generacion);
+    }
+    if (salida->cap == presupuesto.salida && len_cache < (int)sizeof(c->clave_cache)) {
+        for (char *k = c->clave_cache + strlen(c->album) + strlen(c->artista) + 2; *k; k++) {
+            if (*k >= 'A' && *k <= 'Z') *k += 'a' - 'A';
+        }
+        c->len_cache = len_cache;
+        uint64_t inicio = metricas_ahora();
+        int acierto = cache_buscar(c->clave_cache, len_cache, salida->buffer, salida->cap, &salida->len) == 0;
+        metricas_medir(medicion, ETAPA_CACHE, inicio);
+        if (acierto) {
+            terminar_medicion(c, 1, 0);
+            liberar_consulta(c);
+            return 0;
+        }
+    }
+    // La consulta usa estos datos hasta terminar, aunque lleguen otros.
+    c->datos = vigentes;
+    c->datos->referencias++;
+    return continuar_consulta(c, salida);
+}
+
+// Ejecuta un tramo de la consulta: hasta que termina o se interrumpe con
+// la salida llena. Devuelve lo mismo que continuar_consulta.
+static int ejecutar_tramo(Consulta *c, Salida *salida) {
+    datos = c->datos;
+    medicion = &c->medicion;
+    c->interrumpida = 0;
+    c->tramos++;
+    // Con top=K la búsqueda no escribe nada: llena el montículo, que al
+    // terminar se ordena y se escribe (por partes si hace falta).
+    if (!c->ordenados) {
+        switch (c->tipo) {
+        case CONSULTA_COMPUESTA:
+            buscar_album_artista(c, salida);
+            break;
+        case CONSULTA_CANCION:
+            buscar_cancion(c, salida);
+            break;
+        default:
+            buscar_campo(c, salida);
+            break;
+        }
+    }
+    if (c->top && !c->error) {
+        if (!c->ordenados) qsort(c->mejores, c->num_mejores, sizeof(EntradaTop), comparar_mejores);
+        c->ordenados = 1;
+        escribir_mejores(c, salida);
+    }
+    if (salida->vaciada < 0) {
+        liberar_consulta(c);
+        return -1;
+    }
+    if (c->interrumpida) {
+        medicion = &sin_consulta;
+        return 1;
+    }
+    escribir_pie(c, salida);
+    if (salida->vaciada < 0) {
+        liberar_consulta(c);
+        return -1;
+    }
+    if (c->len_cache >= 0 && c->completa && c->tramos == 1 && !salida->vaciada) {
+        uint64_t inicio = metricas_ahora();
+        cache_guardar(c->clave_cache, c->len_cache, salida->buffer, salida->len);
+        metricas_medir(medicion, ETAPA_CACHE, inicio);
+    }
+    terminar_medicion(c, 0, 0);
+    liberar_consulta(c);
+    return 0;
+}
+
+// Lo que un tramo pidió a la arena no pasa al siguiente: un tramo retoma la
+// búsqueda desde el cursor de la consulta y vuelve a leer su lista.
+int continuar_consulta(Consulta *c, Salida *salida) {
+    arena.limite = presupuesto.arena;
+    int estado = ejecutar_tramo(c, salida);
+    arena_reiniciar(&arena);
+    return estado;
+}
+
+void formato_resultado(char *dest, size_t dest_size, const Registro *registro,
+                       const char *album, const char *artista, const char *cancion) {
+    char duration_formatted[32] = "N/A";
+    if (!(registro->banderas & REG_SIN_DURACION)) {
+        int minutes = registro->duracion_ms / 60000;
+        int seconds = (registro->duracion_ms % 60000) / 1000;
+        snprintf(duration_formatted, sizeof(duration_formatted), "%d min %d seg", minutes, seconds);
+    }
+
+    char popularidad_buf[TAM_BUFFER_CADENA];
+    const char *popularidad = "N/A";
+    if (registro->banderas & REG_POPULARIDAD_TEXTO) {
+        popularidad = leer_cadena(registro->popularidad, popularidad_buf);
+        if (!popularidad) popularidad = "N/A";
+    } else if (!(registro->banderas & REG_SIN_POPULARIDAD)) {
+        snprintf(popularidad_buf, sizeof(popularidad_buf), "%u", registro->popularidad);
+        popularidad = popularidad_buf;
+    }
+
+    snprintf(dest, dest_size,
+             "Álbum: %s\n"
+             "Artista: %s\n"
+             "Canción: %s\n"
+             "Duración: %s\n"
+             "Popularidad: %s\n"
+             "--------------------------------------------------\n",
+             album,
+             artista,
+             cancion ? cancion : "N/A",
+             duration_formatted,
+             popularidad);
+}
@@ -0,0 +1,128 @@
+/*
+ * consulta.h: Interfaz del motor de consultas del servidor de búsqueda.
+ */
+#ifndef CONSULTA_H
+#define CONSULTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "metricas.h"
+
+#define MAX_KEY_LENGTH 512
+#define MAX_RESULTS_BUFFER 65536 // Buffer de salida de una consulta (el presupuesto de memoria puede reducirlo)
+
+/*
+ * Destino de la respuesta de una consulta: un buffer de cap bytes que el
+ * llamador reutiliza entre consultas. Cuando se llena se llama a vaciar,
+ * que debe enviar los len bytes acumulados (vendrán más después) y dejar
+ * len en 0; devuelve 0 o -1 si el envío falló. Si vaciar es NULL la
+ * consulta se interrumpe con el buffer lleno y se retoma con
+ * continuar_consulta una vez enviado su contenido. Así la memoria de una
+ * consulta no depende de cuántos resultados tenga.
+ */
+typedef struct Salida {
+    char *buffer;
+    size_t cap;
+    size_t len;
+    int (*vaciar)(struct Salida *salida);
+    void *ctx;       // Libre para vaciar
+    int vaciada;     // Ya se envió parte de la respuesta
+} Salida;
+
+// Tipos de consulta según los campos que se dieron.
+enum { CONSULTA_COMPUESTA, CONSULTA_CANCION, CONSULTA_ALBUM, CONSULTA_ARTISTA, CONSULTA_INVALIDA, NUM_TIPOS_CONSULTA };
+
+struct EntradaTop;
+struct Datos;
+
+// Estado de una consulta en curso: sus campos y hasta dónde llegó.
+typedef struct Consulta {
+    char texto[MAX_KEY_LENGTH * 2];
+    const char *album, *artista, *cancion;
+    int tipo;
+    uint32_t pagina;     // Número de página pedido (0 si no se pagina por páginas)
+    uint64_t desde;      // Cursor: primer número de registro que falta considerar
+    uint64_t saltar;     // Coincidencias que faltan saltar (offset)
+    uint64_t limite;     // Resultados pedidos (0: todos)
+    uint64_t agregados;
+    int hay_mas;
+    int interrumpida;    // El buffer se llenó sin vaciar
+    int completa;        // No falló ninguna lectura
+    int error;           // La respuesta es un mensaje de error
+    int tramos;          // Veces que se ejecutó
+    uint32_t top;        // top=K: los K mejores según orden (0: sin ranking)
+    int orden;           // sort=popularity o sort=duration
+    struct EntradaTop *mejores; // Montículo de los K mejores y luego su orden final
+    uint32_t num_mejores;
+    uint32_t emitidos;   // Mejores ya escritos en la salida
+    int ordenados;       // La búsqueda terminó y los mejores están ordenados
+    struct Datos *datos; // Datos con los que empezó, retenidos hasta que termine
+    const char *origen;  // Dirección del cliente, para el registro
+    Medicion medicion;   // Tiempos y contadores, que se vuelcan al terminar
+    char clave_cache[MAX_KEY_LENGTH * 2 + 64];
+    int len_cache;
+} Consulta;
+
+/*
+ * Carga el índice y abre el almacén de registros. Con usar_mmap distinto
+ * de cero ambos se mapean en memoria de solo lectura en lugar de leerse
+ * con pread.
+ * Devuelve 0 si todo salió bien y -1 (tras informar por stderr) si no.
+ */
+int cargar_datos(int usar_mmap);
+void liberar_datos(void);
+
+/*
+ * Vuelve a cargar el índice, los registros y los índices opcionales (por
+ * ejemplo, tras un indexado completo) y los pone en lugar de los actuales
+ * sin cortar conexiones: las consultas a medias terminan con los datos con
+ * los que empezaron, que se liberan cuando acaba la última. Si la carga
+ * falla se siguen sirviendo los anteriores. Devuelve 0 o -1.
+ */
+int recargar_datos(void);
+
+/*
+ * Instala un manejador de SIGHUP que pide recargar los datos, y los recarga
+ * si se pidió desde la última llamada; devuelve 1 en ese caso. Como el de
+ * SIGUSR1, no usa SA_RESTART, para que la espera del bucle regrese con EINTR.
+ */
+void instalar_senal_recarga(void);
+int atender_senal_recarga(void);
+
+/*
+ * Carga la última generación de spotify.delta si el indexador publicó una
+ * nueva (lo revisa como mucho una vez por segundo). iniciar_consulta ya lo
+ * hace; el proceso que hace fork() lo llama para que los hijos la hereden.
+ */
+void actualizar_datos(void);
+
+/*
+ * Empieza a resolver una consulta "album|artista|cancion[|opciones]"
+ * (terminada en '\0') y escribe la respuesta de texto para el cliente en
+ * salida, que se vacía al empezar. origen solo se usa para el registro y
+ * debe seguir válido hasta que la consulta termine.
+ * Las opciones son un número de página o "limit=N", "offset=N" y
+ * "cursor=N" separados por espacios o comas, o bien "top=K" con
+ * "sort=popularity" (por defecto) o "sort=duration" para recibir solo los
+ * K resultados con más popularidad o duración, de mayor a menor.
+ * Devuelve 0 si la respuesta terminó, 1 si se interrumpió con el buffer
+ * lleno (salida sin vaciar) y -1 si vaciar falló.
+ */
+int iniciar_consulta(Consulta *consulta, const char *texto, const char *origen, Salida *salida);
+
+// Sigue una consulta interrumpida. Devuelve lo mismo que iniciar_consulta.
+int continuar_consulta(Consulta *consulta, Salida *salida);
+
+/*
+ * Prepara un lote de n consultas antes de resolverlas una por una: calcula
+ * sus claves sin repetir y pide juntas, ordenadas por desplazamiento, las
+ * lecturas del directorio, de las listas, de los registros y de sus
+ * cadenas, para que las consultas las encuentren ya en memoria.
+ */
+void anticipar_lote(const char *const *consultas, size_t n);
+
+// Libera lo que reservó una consulta que se abandona a medias (y la
+// cuenta como abandonada en las métricas).
+void liberar_consulta(Consulta *consulta);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * csv_campos.c: Separador de campos CSV de una sola pasada.
+ *
+ * La línea se procesa en bloques de 64 bytes. Para cada bloque se obtienen
+ * dos máscaras de bits (posiciones con comillas y posiciones con comas) y
+ * el XOR prefijo de la máscara de comillas marca qué bytes quedan dentro
+ * de un campo entrecomillado. Las comas fuera de comillas son los
+ * separadores, que se recorren bit a bit. Las comillas duplicadas ("")
+ * se anulan solas en el XOR prefijo, así que no necesitan trato especial.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include "csv_campos.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define TAM_BLOQUE 64
+
+// Calcula las máscaras de comillas y comas de un bloque de 64 bytes.
+static inline void mascaras_bloque(const char *p, uint64_t *comillas, uint64_t *comas) {
+#if defined(__AVX2__)
+    const __m256i q = _mm256_set1_epi8('"');
+    const __m256i c = _mm256_set1_epi8(',');
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    *comillas = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, q)) |
+                ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, q)) << 32);
+    *comas = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, c)) |
+             ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, c)) << 32);
+#elif defined(__SSE2__)
+    const __m128i q = _mm_set1_epi8('"');
+    const __m128i c = _mm_set1_epi8(',');
+    uint64_t mq = 0, mc = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        mq |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (16 * i);
+        mc |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c)) << (16 * i);
+    }
+    *comillas = mq;
+    *comas = mc;
+#else
+    uint64_t mq = 0, mc = 0;
+    for (int i = 0; i < TAM_BLOQUE; i++) {
+        mq |= (uint64_t)(p[i] == '"') << i;
+        mc |= (uint64_t)(p[i] == ',') << i;
+    }
+    *comillas = mq;
+    *comas = mc;
+#endif
+}
+
+// XOR prefijo: el bit i queda a 1 si hay un número impar de bits a 1 en [0, i].
+static inline uint64_t xor_prefijo(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Ajusta la vista de un campo: quita las comillas exteriores y detecta "".
+static inline void cerrar_campo(CampoCsv *campo, const char *p, size_t len) {
+    campo->escapes = 0;
+    if (len >= 2 && p[0] == '"' && p[len - 1] == '"') {
+        p++;
+        len -= 2;
+        campo->escapes = memchr(p, '"', len) != NULL;
+    }
+    campo->ptr = p;
+    campo->len = (uint32_t)len;
+}
+
+int csv_dividir_linea(const char *linea, size_t len, CampoCsv *campos, int max_campos) {
+    if (max_campos <= 0) return 0;
+    // Un '\r' final (líneas CRLF) no forma parte del último campo.
+    if (len > 0 && linea[len - 1] == '\r') len--;
+
+    int n = 0;
+    size_t inicio = 0;
+    uint64_t dentro = 0; // Todo unos si el bloque empieza dentro de comillas
+    char resto[TAM_BLOQUE];
+    for (size_t base = 0; base < len; base += TAM_BLOQUE) {
+        uint64_t comillas, comas;
+        if (len - base >= TAM_BLOQUE) {
+            mascaras_bloque(linea + base, &comillas, &comas);
+        } else {
+            // Último bloque incompleto: se rellena con ceros para no leer fuera.
+            memset(resto, 0, sizeof(resto));
+            memcpy(resto, linea + base, len - base);
+            mascaras_bloque(resto, &comillas, &comas);
+        }
+        uint64_t en_comillas = xor_prefijo(comillas) ^ dentro;
+        dentro = (uint64_t)((int64_t)en_comillas >> 63);
+
+        uint64_t separadores = comas & ~en_comillas;
+        while (separadores) {
+            size_t pos = base + __builtin_ctzll(separadores);
+            cerrar_campo(&campos[n++], linea + inicio, pos - inicio);
+            if (n == max_campos) return n;
+            inicio = pos + 1;
+            separadores &= separadores - 1;
+        }
+    }
+    cerrar_campo(&campos[n++], linea + inicio, len - inicio);
+    return n;
+}
+
+size_t csv_campo_copiar(const CampoCsv *campo, char *dest, size_t cap) {
+    if (cap == 0) return 0;
+    size_t n = 0;
+    if (!campo->escapes) {
+        n = campo->len < cap - 1 ? campo->len : cap - 1;
+        memcpy(dest, campo->ptr, n);
+    } else {
+        for (uint32_t i = 0; i < campo->len && n < cap - 1; i++) {
+            dest[n++] = campo->ptr[i];
+            if (campo->ptr[i] == '"' && i + 1 < campo->len && campo->ptr[i + 1] == '"') i++;
+        }
+    }
+    dest[n] = '\0';
+    return n;
+}
+
+int csv_campo_igual(const CampoCsv *campo, const char *s, size_t len) {
+    if (!campo->escapes) {
+        return campo->len == len && memcmp(campo->ptr, s, len) == 0;
+    }
+    size_t j = 0;
+    for (uint32_t i = 0; i < campo->len; i++, j++) {
+        if (j >= len || campo->ptr[i] != s[j]) return 0;
+        if (campo->ptr[i] == '"' && i + 1 < campo->len && campo->ptr[i + 1] == '"') i++;
+    }
+    return j == len;
+}
+
+CampoCsv csv_extraer_artista(const CampoCsv *json) {
+    static const char clave[] = "'artist_name': '";
+    const char *inicio = memmem(json->ptr, json->len, clave, sizeof(clave) - 1);
+    if (!inicio) return *json;
+    inicio += sizeof(clave) - 1;
+
+    const char *fin = memchr(inicio, '\'', json->ptr + json->len - inicio);
+    if (!fin) return *json;
+
+    CampoCsv artista;
+    artista.ptr = inicio;
+    artista.len = (uint32_t)(fin - inicio);
+    artista.escapes = json->escapes && memchr(inicio, '"', artista.len) != NULL;
+    return artista;
+}
@@ -0,0 +1,56 @@
+/*
+ * csv_campos.h: Separador de campos CSV sin reservas de memoria.
+ * Lo comparten el indexador y el servidor. Recorre una línea una sola vez
+ * y devuelve cada campo como una vista (puntero + longitud) sobre la propia
+ * línea, sin copiarla. La búsqueda de comillas y comas usa SSE2/AVX2 cuando
+ * el compilador los tiene disponibles y un recorrido escalar si no.
+ *
+ * Sigue RFC 4180: un campo entre comillas puede contener comas y las
+ * comillas internas van duplicadas (""). La vista de un campo entre
+ * comillas excluye las comillas exteriores; si además contiene comillas
+ * duplicadas, 'escapes' vale 1 y hay que usar csv_campo_copiar() o
+ * csv_campo_igual() para obtener el texto real.
+ */
+#ifndef CSV_CAMPOS_H
+#define CSV_CAMPOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Columnas (contando desde 1) del CSV de Spotify que usa el proyecto.
+#define CSV_COL_ALBUM 1
+#define CSV_COL_ARTISTAS 4
+#define CSV_COL_DURACION 6
+#define CSV_COL_CANCION 8
+#define CSV_COL_POPULARIDAD 10
+
+typedef struct CampoCsv {
+    const char *ptr;
+    uint32_t len;
+    uint8_t escapes; // Contiene comillas duplicadas ("")
+} CampoCsv;
+
+/*
+ * Divide una línea de len bytes (sin el salto de línea; no necesita '\0')
+ * en campos. Se detiene tras max_campos campos. Devuelve cuántos encontró.
+ * campos[0] es la columna 1.
+ */
+int csv_dividir_linea(const char *linea, size_t len, CampoCsv *campos, int max_campos);
+
+/*
+ * Copia el texto real del campo en dest (con '\0' final), deshaciendo las
+ * comillas duplicadas y truncando a cap - 1 bytes. Devuelve la longitud.
+ */
+size_t csv_campo_copiar(const CampoCsv *campo, char *dest, size_t cap);
+
+// Compara el texto real del campo con s (de len bytes). Devuelve 1 si son iguales.
+int csv_campo_igual(const CampoCsv *campo, const char *s, size_t len);
+
+/*
+ * Extrae el nombre del primer artista ('artist_name': '...') del campo
+ * JSON de artistas, como vista dentro del mismo campo. Si no lo encuentra
+ * devuelve el campo completo, igual que hacía extraer_artista().
+ */
+CampoCsv csv_extraer_artista(const CampoCsv *json);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * delta.h: Formato del archivo spotify.delta, con las filas que se
+ * añadieron al final del CSV después de generar spotify.index.
+ * "indexer -a" analiza solo la cola del CSV (desde el byte que guardó en
+ * la cabecera del índice) y escribe un delta nuevo en spotify.delta.tmp,
+ * que luego renombra sobre spotify.delta: el servidor ve el delta anterior
+ * o el nuevo completo, nunca uno a medias, y lo recarga sin reiniciarse.
+ * Cada ejecución vuelve a cubrir toda la cola desde el índice base, así
+ * que los números de registro de una fila no cambian entre generaciones;
+ * un indexado completo la incorpora al índice y borra el delta.
+ *
+ * Disposición del archivo:
+ *   [DeltaCabecera][uint32_t tabla[tam_tabla + 1]][relleno hasta 8]
+ *   [ClaveIndice directorio[num_claves + 1]][listas de filas]
+ *   [Registro registros[num_filas]][cadenas]
+ * La tabla, el directorio y las listas son como los de spotify.index (ver
+ * indice.h), pero con cuatro tipos de clave en la misma tabla, cada uno
+ * con su semilla (ver delta_semilla): la clave compuesta "album|artista",
+ * el artista, el álbum y cada trigrama del nombre de canción normalizado.
+ * Los registros continúan la numeración de spotify.records (el primero es
+ * el número primera_fila) y sus cadenas, con el formato de registros.h,
+ * continúan sus desplazamientos (la primera está en base_cadenas).
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <string.h>
+#include "indice.h"
+#include "registros.h"
+
+#define DELTA_MAGIA "SPOTDLT"
+#define DELTA_VERSION 2
+
+// Tipos de clave del delta
+#define DELTA_COMPUESTA 0
+#define DELTA_ARTISTA 1
+#define DELTA_ALBUM 2
+#define DELTA_TRIGRAMA 3
+
+typedef struct DeltaCabecera {
+    char magia[8];            // "SPOTDLT\0"
+    uint32_t version;         // DELTA_VERSION
+    uint32_t tam_tabla;
+    uint64_t huella_base;     // delta_huella_base() del spotify.index que amplía
+    uint64_t generacion;      // Crece con cada actualización sobre el mismo índice
+    uint64_t primera_fila;    // num_filas del índice base
+    uint64_t base_cadenas;    // bytes_cadenas de spotify.records
+    uint64_t bytes_csv;       // Bytes del CSV cubiertos por el índice y el delta
+    uint64_t num_filas;
+    uint64_t num_claves;
+    uint64_t desp_directorio;
+    uint64_t desp_listas;
+    uint64_t desp_registros;
+    uint64_t desp_cadenas;
+    uint64_t bytes_cadenas;
+} DeltaCabecera;
+
+// Semilla del hash de cada tipo de clave; la compuesta usa la del índice.
+static inline uint64_t delta_semilla(uint64_t semilla, int tipo) {
+    return tipo == DELTA_COMPUESTA ? semilla : semilla ^ (0x9E3779B97F4A7C15ULL * (uint64_t)tipo);
+}
+
+// Texto de la clave de un trigrama: sus 3 bytes, el primero en los bits altos.
+static inline void delta_texto_trigrama(uint32_t trigrama, char texto[3]) {
+    texto[0] = (char)(trigrama >> 16);
+    texto[1] = (char)(trigrama >> 8);
+    texto[2] = (char)trigrama;
+}
+
+// Identifica el índice base: la huella de su cabecera.
+static inline uint64_t delta_huella_base(const IndiceCabecera *indice) {
+    return hash_clave((const char *)indice, sizeof(*indice), 0);
+}
+
+// Desplazamiento del directorio: tras la tabla, alineado a 8 bytes.
+static inline uint64_t delta_desp_directorio(uint32_t tam_tabla) {
+    uint64_t desp = sizeof(DeltaCabecera) + sizeof(uint32_t) * ((uint64_t)tam_tabla + 1);
+    return (desp + 7) & ~(uint64_t)7;
+}
+
+// Comprueba la cabecera y que sus secciones caben en un archivo de tam_archivo bytes.
+static inline int delta_cabecera_valida(const DeltaCabecera *cab, uint64_t tam_archivo) {
+    return memcmp(cab->magia, DELTA_MAGIA, sizeof(DELTA_MAGIA)) == 0 &&
+           cab->version == DELTA_VERSION &&
+           cab->tam_tabla != 0 && (cab->tam_tabla & (cab->tam_tabla - 1)) == 0 &&
+           cab->desp_directorio == delta_desp_directorio(cab->tam_tabla) &&
+           cab->desp_listas == cab->desp_directorio + (cab->num_claves + 1) * sizeof(ClaveIndice) &&
+           cab->desp_registros >= cab->desp_listas &&
+           cab->desp_cadenas == cab->desp_registros + cab->num_filas * sizeof(Registro) &&
+           cab->desp_cadenas + cab->bytes_cadenas <= tam_archivo;
+}
+
+#endif
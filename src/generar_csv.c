@@ -0,0 +1,300 @@
+/*
+ * generar_csv.c: Generador de un spotify_data.csv sintético.
+ * Escribe un CSV con las mismas columnas que el volcado de Hugging Face
+ * (ver csv_campos.h), del tamaño pedido y sin red ni dependencias, para
+ * probar y medir el indexador y el servidor sin el archivo de 7 GB.
+ * Imita lo que afecta al índice:
+ *   - Los artistas siguen una ley de Zipf: unos pocos acumulan muchas
+ *     filas y la mayoría tiene pocas, como en el volcado real.
+ *   - Las filas van por álbumes (todas las canciones de un álbum seguidas)
+ *     y un álbum puede volver a aparecer más adelante (reediciones).
+ *   - La columna de artistas es el texto JSON con 'artist_name': '...' que
+ *     analiza csv_extraer_artista, a veces con varios artistas.
+ *   - Hay campos entre comillas con comas y con comillas duplicadas, texto
+ *     UTF-8 con acentos, y de vez en cuando duración o popularidad vacías.
+ * Con la misma semilla el archivo generado es siempre el mismo.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+
+#define MAX_LINEA 4096
+#define MAX_CANCIONES_ALBUM 20
+#define MAX_ALBUMES_ARTISTA 12
+#define VISITAS_POR_ALBUM 3
+
+static const char *const silabas[] = {
+    "la", "mo", "ri", "ta", "ne", "so", "qu", "el", "ár", "bö", "ñu", "ça", "zé", "ka", "lo", "ve",
+    "ni", "gh", "ro", "fi", "re", "sa", "tu", "mi", "da", "ké", "on", "an", "lu", "pé", "ol", "ist"};
+#define NUM_SILABAS (sizeof(silabas) / sizeof(silabas[0]))
+
+static const char *const palabras[] = {
+    "love", "night", "fire", "dance", "heart", "rain", "blue", "dream", "light", "road", "home", "gold",
+    "amor", "noche", "corazón", "canción", "vida", "sueño", "mar", "cielo", "straße", "été", "Ōkami", "ciel"};
+#define NUM_PALABRAS (sizeof(palabras) / sizeof(palabras[0]))
+
+// Generador xorshift64*: rápido y con el mismo resultado en cualquier plataforma.
+static uint64_t azar_estado;
+
+static uint64_t azar(void) {
+    azar_estado ^= azar_estado >> 12;
+    azar_estado ^= azar_estado << 25;
+    azar_estado ^= azar_estado >> 27;
+    return azar_estado * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t azar_hasta(uint32_t n) {
+    return (uint32_t)((azar() >> 32) * n >> 32);
+}
+
+// Mezcla de 64 bits para derivar valores fijos de un artista o un álbum.
+static uint64_t mezclar(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+// Escribe una palabra inventada de 1 a 4 sílabas con generador propio g.
+static size_t inventar_palabra(char *dest, size_t cap, uint64_t *g, int mayuscula) {
+    size_t len = 0;
+    int n = 1 + (int)(*g % 4);
+    *g = mezclar(*g);
+    for (int i = 0; i < n && len + 4 < cap; i++) {
+        len += snprintf(dest + len, cap - len, "%s", silabas[*g % NUM_SILABAS]);
+        *g = mezclar(*g);
+    }
+    if (mayuscula && len > 0 && dest[0] >= 'a' && dest[0] <= 'z') dest[0] -= 'a' - 'A';
+    return len;
+}
+
+// Nombre fijo del artista de rango r.
+static void nombre_artista(uint32_t r, char *dest, size_t cap) {
+    uint64_t g = mezclar(r * 2 + 1);
+    size_t len = inventar_palabra(dest, cap, &g, 1);
+    if (g % 3 != 0) {
+        dest[len++] = ' ';
+        inventar_palabra(dest + len, cap - len, &g, 1);
+    } else {
+        dest[len] = '\0';
+    }
+}
+
+// Nombre fijo del álbum número a del artista de rango r. Algunos llevan
+// comas o comillas, que obligan a escribir el campo entre comillas.
+static void nombre_album(uint32_t r, uint32_t a, char *dest, size_t cap) {
+    uint64_t g = mezclar(((uint64_t)r << 20) ^ (a + 7));
+    char palabra[64], otra[64];
+    inventar_palabra(palabra, sizeof(palabra), &g, 1);
+    inventar_palabra(otra, sizeof(otra), &g, 0);
+    switch (g % 8) {
+    case 0:
+        snprintf(dest, cap, "%s, Vol. %u", palabra, a + 1);
+        break;
+    case 1:
+        snprintf(dest, cap, "The \"%s\" Sessions", palabra);
+        break;
+    case 2:
+        snprintf(dest, cap, "%s %s (Deluxe Edition)", palabra, otra);
+        break;
+    case 3:
+        snprintf(dest, cap, "%s de %s", palabra, palabras[(g >> 8) % NUM_PALABRAS]);
+        break;
+    default:
+        snprintf(dest, cap, "%s %s", palabra, otra);
+        break;
+    }
+}
+
+// Título de una canción: palabras comunes (para las búsquedas por
+// trigramas) e inventadas, a veces con coma o comillas.
+static void nombre_cancion(char *dest, size_t cap) {
+    size_t len = 0;
+    int n = 1 + azar_hasta(4);
+    for (int i = 0; i < n && len + 80 < cap; i++) {
+        if (i > 0) dest[len++] = ' ';
+        if (azar_hasta(2)) {
+            len += snprintf(dest + len, cap - len, "%s", palabras[azar_hasta(NUM_PALABRAS)]);
+        } else {
+            uint64_t g = azar();
+            len += inventar_palabra(dest + len, cap - len, &g, i == 0);
+        }
+    }
+    uint32_t extra = azar_hasta(20);
+    if (extra == 0) {
+        snprintf(dest + len, cap - len, ", Pt. %u", 1 + azar_hasta(3));
+    } else if (extra == 1) {
+        snprintf(dest + len, cap - len, " (\"Live\")");
+    } else if (extra == 2) {
+        snprintf(dest + len, cap - len, " - Remastered");
+    } else {
+        dest[len] = '\0';
+    }
+}
+
+// Escribe un campo CSV: entre comillas (duplicando las internas) solo si
+// contiene coma, comillas o salto de línea.
+static size_t campo_csv(char *dest, size_t cap, const char *texto) {
+    if (!strpbrk(texto, ",\"\n")) return snprintf(dest, cap, "%s", texto);
+    size_t len = 0;
+    dest[len++] = '"';
+    for (const char *p = texto; *p && len + 3 < cap; p++) {
+        if (*p == '"') dest[len++] = '"';
+        dest[len++] = *p;
+    }
+    dest[len++] = '"';
+    dest[len] = '\0';
+    return len;
+}
+
+// Tabla acumulada de Zipf para num_artistas rangos con exponente s.
+static double *tabla_zipf(uint32_t num_artistas, double s) {
+    double *acumulada = malloc(sizeof(double) * num_artistas);
+    if (!acumulada) return NULL;
+    double suma = 0;
+    for (uint32_t r = 0; r < num_artistas; r++) {
+        suma += 1.0 / pow(r + 1, s);
+        acumulada[r] = suma;
+    }
+    for (uint32_t r = 0; r < num_artistas; r++) acumulada[r] /= suma;
+    return acumulada;
+}
+
+static uint32_t elegir_zipf(const double *acumulada, uint32_t n) {
+    double u = (azar() >> 11) * (1.0 / 9007199254740992.0);
+    uint32_t bajo = 0, alto = n - 1;
+    while (bajo < alto) {
+        uint32_t medio = bajo + (alto - bajo) / 2;
+        if (acumulada[medio] < u) bajo = medio + 1;
+        else alto = medio;
+    }
+    return bajo;
+}
+
+static void uso(const char *programa) {
+    fprintf(stderr, "Uso: %s [-n FILAS | -m MB] [-a ARTISTAS] [-z EXPONENTE] [-s SEMILLA] [-o ARCHIVO] [-f]\n"
+                    "  -n FILAS     Filas a generar (por defecto 1000000)\n"
+                    "  -m MB        Genera filas hasta alcanzar ese tamaño en lugar de un número de filas\n"
+                    "  -a ARTISTAS  Artistas distintos (por defecto, una vigésima parte de las filas)\n"
+                    "  -z EXPONENTE Exponente de Zipf de la popularidad de los artistas (por defecto 1.0)\n"
+                    "  -s SEMILLA   Semilla del generador (por defecto 1)\n"
+                    "  -o ARCHIVO   Archivo de salida (por defecto spotify_data.csv)\n"
+                    "  -f           Sobrescribe el archivo de salida si ya existe\n",
+            programa);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t num_filas = 1000000, max_bytes = 0;
+    uint32_t num_artistas = 0;
+    double exponente = 1.0;
+    const char *ruta = "spotify_data.csv";
+    int sobrescribir = 0;
+    azar_estado = 1;
+    int opcion;
+    while ((opcion = getopt(argc, argv, "n:m:a:z:s:o:f")) != -1) {
+        switch (opcion) {
+        case 'n': num_filas = strtoull(optarg, NULL, 10); break;
+        case 'm': max_bytes = strtoull(optarg, NULL, 10) << 20; break;
+        case 'a': num_artistas = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'z': exponente = atof(optarg); break;
+        case 's': azar_estado = strtoull(optarg, NULL, 10); break;
+        case 'o': ruta = optarg; break;
+        case 'f': sobrescribir = 1; break;
+        default:
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (max_bytes) num_filas = UINT64_MAX;
+    if (num_filas == 0 || exponente < 0) {
+        uso(argv[0]);
+        return 1;
+    }
+    azar_estado = mezclar(azar_estado) | 1; // xorshift no admite el estado 0
+    uint64_t estimadas = max_bytes ? max_bytes / 250 : num_filas;
+    if (num_artistas == 0) {
+        num_artistas = estimadas / 20 > 100 ? (estimadas / 20 < 5000000 ? estimadas / 20 : 5000000) : 100;
+    }
+    double *acumulada = tabla_zipf(num_artistas, exponente);
+    if (!acumulada) {
+        perror("No se pudo reservar la tabla de Zipf");
+        return 1;
+    }
+    // Sin -f no se pisa un CSV existente (podría ser el volcado real).
+    FILE *f = fopen(ruta, sobrescribir ? "w" : "wx");
+    if (!f) {
+        int existe = errno == EEXIST;
+        perror(ruta);
+        if (existe) fprintf(stderr, "Use -f para sobrescribirlo u -o para elegir otro archivo\n");
+        free(acumulada);
+        return 1;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    fputs("album_name,album_gid,release_date,artists,disc_number,duration_ms,explicit,name,"
+          "track_number,popularity,gid,external_ids\n", f);
+
+    uint64_t filas = 0, bytes = 0;
+    char linea[MAX_LINEA], artista[128], invitado[128], album[256], cancion[512];
+    char album_csv[600], cancion_csv[1100], artistas_json[512], artistas_csv[1100];
+    while (filas < num_filas && (!max_bytes || bytes < max_bytes)) {
+        // Un álbum de un artista elegido por Zipf, con todas sus canciones.
+        // Los artistas populares tienen más álbumes: cada uno sale unas
+        // VISITAS_POR_ALBUM veces en promedio (un álbum por cada ~10 filas).
+        uint32_t r = elegir_zipf(acumulada, num_artistas);
+        double probabilidad = acumulada[r] - (r > 0 ? acumulada[r - 1] : 0);
+        uint32_t albumes = 1 + (uint32_t)(mezclar(r + 1) % MAX_ALBUMES_ARTISTA) +
+                           (uint32_t)(probabilidad * (estimadas / 10) / VISITAS_POR_ALBUM);
+        uint32_t a = azar_hasta(albumes);
+        uint64_t id_album = mezclar(((uint64_t)r << 20) ^ a);
+        nombre_artista(r, artista, sizeof(artista));
+        nombre_album(r, a, album, sizeof(album));
+        campo_csv(album_csv, sizeof(album_csv), album);
+        uint32_t canciones = azar_hasta(5) == 0 ? 1 : 4 + azar_hasta(MAX_CANCIONES_ALBUM - 3);
+        unsigned anio = 1950 + (unsigned)(id_album % 75);
+        for (uint32_t c = 0; c < canciones && filas < num_filas; c++) {
+            // Primer artista: el del álbum; a veces hay invitados.
+            size_t len = snprintf(artistas_json, sizeof(artistas_json),
+                                  "[{'artist_gid': '%016llx', 'artist_name': '%s', 'role': 'ARTIST_ROLE_MAIN_ARTIST'}",
+                                  (unsigned long long)mezclar(r), artista);
+            if (azar_hasta(8) == 0) {
+                uint32_t otro = elegir_zipf(acumulada, num_artistas);
+                nombre_artista(otro, invitado, sizeof(invitado));
+                len += snprintf(artistas_json + len, sizeof(artistas_json) - len,
+                                ", {'artist_gid': '%016llx', 'artist_name': '%s', 'role': 'ARTIST_ROLE_FEATURED_ARTIST'}",
+                                (unsigned long long)mezclar(otro), invitado);
+            }
+            snprintf(artistas_json + len, sizeof(artistas_json) - len, "]");
+            campo_csv(artistas_csv, sizeof(artistas_csv), artistas_json);
+            nombre_cancion(cancion, sizeof(cancion));
+            campo_csv(cancion_csv, sizeof(cancion_csv), cancion);
+
+            char duracion[16] = "", popularidad[16] = "";
+            if (azar_hasta(200) != 0) snprintf(duracion, sizeof(duracion), "%u", 30000 + azar_hasta(570000));
+            if (azar_hasta(100) != 0) snprintf(popularidad, sizeof(popularidad), "%u", azar_hasta(101));
+            int n = snprintf(linea, sizeof(linea), "%s,%016llx,%u-%02u-%02u,%s,1,%s,%s,%s,%u,%s,%016llx%016llx,{'isrc': 'XX%010llu'}\n",
+                             album_csv, (unsigned long long)id_album, anio, 1 + (unsigned)(id_album >> 8) % 12,
+                             1 + (unsigned)(id_album >> 16) % 28, artistas_csv, duracion,
+                             azar_hasta(10) == 0 ? "True" : "False", cancion_csv, c + 1, popularidad,
+                             (unsigned long long)azar(), (unsigned long long)azar(),
+                             (unsigned long long)(azar() % 10000000000ULL));
+            if (n <= 0 || (size_t)n >= sizeof(linea)) continue;
+            fwrite(linea, 1, n, f);
+            bytes += n;
+            filas++;
+        }
+    }
+    free(acumulada);
+    if (fclose(f) != 0) {
+        perror(ruta);
+        return 1;
+    }
+    printf("'%s': %llu filas, %.1f MB, %u artistas (Zipf con exponente %.2f)\n", ruta,
+           (unsigned long long)filas, bytes / 1e6, num_artistas, exponente);
+    return 0;
+}
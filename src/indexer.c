@@ -3,200 +3,1770 @@ Proceso de Indexación de Datos de Spotify
 * Este proceso lee un archivo CSV de Spotify, extrae información relevante y crea un índice
 * que se almacena en un archivo binario. Utiliza una tabla hash para optimizar
 * la búsqueda de álbumes y artistas.
-* El índice se compone de nodos que contienen punteros a las líneas del CSV.
+* Además escribe spotify.records, con las columnas que muestra el servidor
+* de cada fila (ver registros.h). Cada clave "album|artista" tiene en el
+* índice una lista contigua con sus números de registro, ordenados y
+* comprimidos (ver indice.h).
+* El análisis del CSV se reparte entre varios hilos (opción -j); las listas
+* se arman después en el orden del archivo, así que el índice resultante
+* es el mismo con cualquier número de hilos.
+* Antes de agrupar se cuentan las claves distintas y la tabla se dimensiona
+* a una potencia de 2 con la carga objetivo (opción -c); --stats muestra los
+* histogramas de claves por cubeta y de filas por clave del índice generado.
+* Los nombres de canción se indexan aparte por trigramas en spotify.trigrams
+* (ver trigramas.h), para poder buscar una canción sin su álbum ni artista,
+* y se generan los índices secundarios de artistas y de álbumes
+* (spotify.artists y spotify.albums, ver secundarios.h).
+* Los archivos se escriben con el sufijo .tmp y se renombran al terminar,
+* así que un servidor en marcha sigue con los anteriores hasta que se le
+* pide recargar (SIGHUP).
+* Con -a solo se indexan las filas añadidas al final del CSV desde el
+* último indexado completo, en spotify.delta (ver delta.h).
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "almacen_cadenas.h"
+#include "csv_campos.h"
+#include "delta.h"
+#include "indice.h"
+#include "registros.h"
+#include "secundarios.h"
+#include "trigramas.h"
 
-#define HASH_TABLE_SIZE 500000
-#define MAX_LINE_LENGTH 4096
 #define MAX_KEY_LENGTH 512
+#define MAX_HILOS 256
+#define TAM_BLOQUE_LISTAS (1 << 20) // Bytes de listas que se acumulan antes de cada fwrite
+#define PARTICIONES 256        // Particiones por bits altos de la huella al contar claves
+#define MAX_HISTOGRAMA 16      // Clases del histograma: 0, 1, 2-3, 4-7, ...
+#define MUESTRAS_FILTRO (1 << 20) // Huellas al azar con que --stats mide el filtro
+#define MAX_NUMERO 32          // Copia de un campo numérico (como el servidor anterior)
 
+//Declaración de la tabla hash y del directorio de claves (se reservan al
+// conocer su tamaño)
+uint32_t *hash_table;
+uint32_t tam_tabla;
+ClaveIndice *directorio;
+uint32_t *filas_por_clave; // Largo de la lista de cada clave del directorio
+// Bytes del CSV del indexado completo y su huella: van en la cabecera de
+// todos los archivos que genera (ver indice.h).
+uint64_t bytes_csv_indexados;
+uint64_t huella_csv_indexados;
 
-typedef struct Nodo
-{
-    long csv_puntero; // Puntero al inicio de la línea en el CSV
-    long siguiente_nodo_puntero; // Puntero al siguiente nodo en la lista enlazada
-} Nodo;
+// Entrada del índice producida por un hilo: una por fila válida del CSV.
+typedef union Entrada {
+    uint64_t huella; // Al analizar el CSV
+    uint64_t clave;  // Tras resolver_claves(): posición en el directorio
+} Entrada;
 
-//Declaración de la tabla hash
-long hash_table[HASH_TABLE_SIZE];
+// Trabajo de un hilo: un rango de bytes del CSV alineado a inicio de línea.
+// registros[k] es el registro de entradas[k]; mientras el tramo no se une
+// al almacén global, sus cadenas son ordinales de 'cadenas'.
+typedef struct Tramo {
+    const char *inicio;
+    const char *fin;
+    Entrada *entradas;
+    Registro *registros;
+    size_t num_entradas;
+    size_t cap_entradas;
+    AlmacenCadenas cadenas;
+    long lineas;
+    int error;
+} Tramo;
 
-char *get_campo(const char *line, int field_index);
-unsigned long hash_function(const char *str);
+// Ordinal local del texto real de un campo (sin comillas de escape).
+static uint32_t cadena_local(Tramo *tramo, const CampoCsv *campo)
+{
+    char texto[REGISTRO_MAX_CADENA];
+    size_t len = csv_campo_copiar(campo, texto, sizeof(texto));
+    int64_t ordinal = almacen_agregar(&tramo->cadenas, texto, len);
+    if (ordinal < 0)
+        tramo->error = 1;
+    return (uint32_t)ordinal;
+}
 
-/* * Función para extraer el nombre del artista de un JSON.
- * Esta función unicamente extrae la primera coincidencia del campo 'artist_name'.
- * con un formato de Ejemplo: {
-    "artist_gid": "f81b117976f14636ba5caea759b82e67",
-    "artist_name": "NormanBate$",
-    "role": "ARTIST_ROLE_MAIN_ARTIST"
-  }
-]
-*/ 
-char *extraer_artista(const char *json_string)
+// Un número sin signo escrito sin ceros a la izquierda (para que al
+// imprimirlo salga el mismo texto). Devuelve -1 si no lo es.
+static int64_t numero_canonico(const char *texto)
 {
-    const char *key = "'artist_name': '"; 
-    const char *start = strstr(json_string, key);
-    if (!start)
+    size_t len = strlen(texto);
+    if (len == 0 || len > 9 || (texto[0] == '0' && len > 1))
+        return -1;
+    int64_t valor = 0;
+    for (size_t i = 0; i < len; i++)
     {
-        //Hace malloc interno y copia el json en un nuevo string.
-        //Esto es importante para evitar problemas de memoria.
-        //Si devuelve el mismo puntero al final del main habrá un
-        //problema de memoria.
-        return strdup(json_string);
+        if (texto[i] < '0' || texto[i] > '9')
+            return -1;
+        valor = valor * 10 + (texto[i] - '0');
     }
-    start += strlen(key);
+    return valor;
+}
 
-    const char *end = strchr(start, '\''); 
-    if (!end)
-    {   
-        //Hace malloc interno y copia el json en un nuevo string.
-        //Esto es importante para evitar problemas de memoria.
-        //Si devuelve el mismo puntero al final del main habrá un
-        //problema de memoria.
-        return strdup(json_string);
+// Llena el registro de una fila: las columnas que muestra el servidor.
+static void llenar_registro(Tramo *tramo, Registro *r, const CampoCsv *campos, int num_campos,
+                            const CampoCsv *artista)
+{
+    char numero[MAX_NUMERO];
+    memset(r, 0, sizeof(*r));
+    r->album = cadena_local(tramo, &campos[CSV_COL_ALBUM - 1]);
+    r->artista = cadena_local(tramo, artista);
+    if (num_campos >= CSV_COL_CANCION)
+        r->cancion = cadena_local(tramo, &campos[CSV_COL_CANCION - 1]);
+    else
+        r->banderas |= REG_SIN_CANCION;
+    if (num_campos >= CSV_COL_DURACION)
+    {
+        csv_campo_copiar(&campos[CSV_COL_DURACION - 1], numero, sizeof(numero));
+        r->duracion_ms = (int32_t)atol(numero);
     }
-
-    size_t length = end - start;
-    char *name = malloc(length + 1);
-    if (name)
+    else
+        r->banderas |= REG_SIN_DURACION;
+    if (num_campos >= CSV_COL_POPULARIDAD)
     {
-        strncpy(name, start, length);
-        name[length] = '\0';
+        csv_campo_copiar(&campos[CSV_COL_POPULARIDAD - 1], numero, sizeof(numero));
+        int64_t valor = numero_canonico(numero);
+        if (valor >= 0)
+            r->popularidad = (uint32_t)valor;
+        else
+        {
+            // Texto que no es un número: se guarda tal cual.
+            int64_t ordinal = almacen_agregar(&tramo->cadenas, numero, strlen(numero));
+            if (ordinal < 0)
+                tramo->error = 1;
+            r->popularidad = (uint32_t)ordinal;
+            r->banderas |= REG_POPULARIDAD_TEXTO;
+        }
     }
-    return name;
+    else
+        r->banderas |= REG_SIN_POPULARIDAD;
 }
 
-int main(int argc, char *argv[])
+// Añade una entrada (y su registro) al tramo, haciéndolo crecer si hace falta.
+static int agregar_entrada(Tramo *tramo, const char *composite_key, size_t key_len,
+                           const CampoCsv *campos, int num_campos, const CampoCsv *artista)
 {
-    
-    FILE *csv_file = fopen("spotify_data.csv", "r");
-    if (!csv_file)
+    if (tramo->num_entradas == tramo->cap_entradas)
     {
-        perror("Error al abrir spotify_data.csv");
-        return 1;
+        size_t cap = tramo->cap_entradas ? tramo->cap_entradas * 2 : 65536;
+        Entrada *nuevas = realloc(tramo->entradas, cap * sizeof(Entrada));
+        if (!nuevas)
+            return -1;
+        tramo->entradas = nuevas;
+        Registro *nuevos = realloc(tramo->registros, cap * sizeof(Registro));
+        if (!nuevos)
+            return -1;
+        tramo->registros = nuevos;
+        tramo->cap_entradas = cap;
     }
-    FILE *index_file = fopen("spotify.index", "wb");
-    if (!index_file)
+    size_t k = tramo->num_entradas++;
+    tramo->entradas[k].huella = hash_clave(composite_key, key_len, INDICE_SEMILLA);
+    llenar_registro(tramo, &tramo->registros[k], campos, num_campos, artista);
+    return tramo->error ? -1 : 0;
+}
+
+// Arma la clave compuesta "album|artista" a partir de los campos del CSV,
+// truncada a MAX_KEY_LENGTH - 1 bytes igual que el snprintf del servidor.
+static size_t construir_clave(char *clave, const CampoCsv *album, const CampoCsv *artista)
+{
+    size_t n = csv_campo_copiar(album, clave, MAX_KEY_LENGTH);
+    if (n < MAX_KEY_LENGTH - 1)
     {
-        perror("Error al crear spotify.index");
-        fclose(csv_file);
-        return 1;
+        clave[n++] = '|';
+        n += csv_campo_copiar(artista, clave + n, MAX_KEY_LENGTH - n);
     }
-    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    return n;
+}
+
+// Cuerpo de cada hilo: recorre las líneas de su tramo, calcula la huella
+// de cada clave "album|artista" y arma su registro. No toca la tabla hash
+// ni el almacén global; eso se hace después, en orden, para que el
+// resultado no dependa de los hilos.
+static void *procesar_tramo(void *arg)
+{
+    Tramo *tramo = arg;
+    const char *linea = tramo->inicio;
+    while (linea < tramo->fin)
     {
-        hash_table[i] = -1;
-    }
-    char *line = malloc(MAX_LINE_LENGTH);
-    // --- 4.2: Preparación del Archivo de Índice ---
-    // Mueve el cursor de escritura del archivo de índice hacia adelante.
-    // Deja un espacio en blanco al principio del tamaño de la tabla hash.
-    fseek(index_file, sizeof(long) * HASH_TABLE_SIZE, SEEK_SET);
-    // Lee la primera línea del CSV (la cabecera) y la descarta.
-    fgets(line, MAX_LINE_LENGTH, csv_file);
-    // Guarda las posiciones iniciales en bytes de ambos archivos.
-    long puntero_actual_csv = ftell(csv_file);
-    long puntero_actual_index = ftell(index_file);
-    printf("Generando index...\n");
-    int count = 0;
-    while (fgets(line, MAX_LINE_LENGTH, csv_file) != NULL)
-    {
-        char *album_nombre = get_campo(line, 1);
-        char *artista_json = get_campo(line, 4);
-        if (album_nombre != NULL && artista_json != NULL)
-        {
-            char *artist_name = extraer_artista(artista_json);
-            if (artist_name)
+        const char *salto = memchr(linea, '\n', tramo->fin - linea);
+        const char *fin_linea = salto ? salto : tramo->fin;
+        size_t line_len = fin_linea - linea;
+
+        CampoCsv campos[CSV_COL_POPULARIDAD];
+        int num_campos = csv_dividir_linea(linea, line_len, campos, CSV_COL_POPULARIDAD);
+        if (num_campos >= CSV_COL_ARTISTAS)
+        {
+            CampoCsv artista = csv_extraer_artista(&campos[CSV_COL_ARTISTAS - 1]);
+            char composite_key[MAX_KEY_LENGTH];
+            size_t key_len = construir_clave(composite_key, &campos[CSV_COL_ALBUM - 1], &artista);
+            if (key_len > 1 &&
+                agregar_entrada(tramo, composite_key, key_len, campos, num_campos, &artista) != 0)
             {
-                char composite_key[MAX_KEY_LENGTH];
-                snprintf(composite_key, sizeof(composite_key), "%s|%s", album_nombre, artist_name);
-                if (strlen(composite_key) > 1)
-                {
-                    unsigned long index = hash_function(composite_key);
-                    Nodo new_node = {puntero_actual_csv, hash_table[index]};
-                    fwrite(&new_node, sizeof(Nodo), 1, index_file);
-                    hash_table[index] = puntero_actual_index;
-                    puntero_actual_index = ftell(index_file);
-                }
-                free(artist_name);
+                tramo->error = 1;
             }
         }
-        if (album_nombre)
-            free(album_nombre);
-        if (artista_json)
-            free(artista_json);
-        puntero_actual_csv = ftell(csv_file);
-        if (++count % 100000 == 0)
+        tramo->lineas++;
+        if (tramo->error)
+            break;
+        linea = fin_linea + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Une las cadenas del tramo al almacén global (en orden de aparición, así
+ * el resultado no depende de los hilos) y cambia los ordinales locales de
+ * sus registros por desplazamientos en el almacén global.
+ */
+static int unir_cadenas(Tramo *tramo, AlmacenCadenas *global)
+{
+    uint32_t *desp = malloc(sizeof(uint32_t) * tramo->cadenas.num + 1);
+    if (!desp)
+        return -1;
+    for (size_t i = 0; i < tramo->cadenas.num; i++)
+    {
+        size_t len;
+        const char *texto = almacen_cadena(&tramo->cadenas, i, &len);
+        int64_t ordinal = almacen_agregar(global, texto, len);
+        if (ordinal < 0)
         {
-            printf("Procesadas %d líneas...\n", count);
-            fflush(stdout);
+            free(desp);
+            return -1;
         }
+        desp[i] = (uint32_t)global->desps[ordinal];
     }
-    // Volver a donde estaba el espacio el blanco.
-    fseek(index_file, 0, SEEK_SET);
-    fwrite(hash_table, sizeof(long), HASH_TABLE_SIZE, index_file);
-    printf("¡Índice final creado exitosamente en 'spotify.index'!\n");
-    free(line);
-    fclose(csv_file);
-    fclose(index_file);
+    for (size_t k = 0; k < tramo->num_entradas; k++)
+    {
+        Registro *r = &tramo->registros[k];
+        r->album = desp[r->album];
+        r->artista = desp[r->artista];
+        if (!(r->banderas & REG_SIN_CANCION))
+            r->cancion = desp[r->cancion];
+        if (r->banderas & REG_POPULARIDAD_TEXTO)
+            r->popularidad = desp[r->popularidad];
+    }
+    free(desp);
+    almacen_liberar(&tramo->cadenas);
     return 0;
 }
 
-// Las implementaciones de get_campo y hash_function no cambian
-unsigned long hash_function(const char *str)
+// Cierra un archivo generado después de llevarlo al disco, para que un
+// corte no deje publicado uno a medias. Devuelve -1 si falló alguna
+// escritura anterior (los fwrite no se comprueban uno por uno) o el cierre.
+static int cerrar_en_disco(FILE *f)
 {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++))
-    {   
-        //Desplazamiento de bits por izquierda 
-        hash = ((hash << 5) + hash) + c; //Lo mismo que hash * 33 + c
+    int error = ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0;
+    return fclose(f) != 0 || error ? -1 : 0;
+}
+
+/*
+ * Escribe spotify.records: la cabecera, los registros de todos los tramos
+ * en el orden del CSV (el número de registro es la posición de la
+ * entrada) y el almacén de cadenas.
+ */
+static int escribir_registros(Tramo *tramos, long num_hilos, uint64_t num_registros, const AlmacenCadenas *global)
+{
+    FILE *f = fopen("spotify.records.tmp", "wb");
+    if (!f)
+    {
+        perror("Error al crear spotify.records");
+        return -1;
+    }
+    RegistrosCabecera cabecera = {0};
+    memcpy(cabecera.magia, REGISTROS_MAGIA, sizeof(REGISTROS_MAGIA));
+    cabecera.version = REGISTROS_VERSION;
+    cabecera.tam_registro = sizeof(Registro);
+    cabecera.num_registros = num_registros;
+    cabecera.desp_registros = sizeof(RegistrosCabecera);
+    cabecera.desp_cadenas = cabecera.desp_registros + num_registros * sizeof(Registro);
+    cabecera.bytes_cadenas = global->tam;
+    cabecera.bytes_csv = bytes_csv_indexados;
+    cabecera.huella_csv = huella_csv_indexados;
+    fwrite(&cabecera, sizeof(cabecera), 1, f);
+    for (long t = 0; t < num_hilos; t++)
+    {
+        fwrite(tramos[t].registros, sizeof(Registro), tramos[t].num_entradas, f);
+        free(tramos[t].registros);
+        tramos[t].registros = NULL;
+    }
+    fwrite(global->datos, 1, global->tam, f);
+    if (cerrar_en_disco(f) != 0)
+    {
+        perror("Error al escribir spotify.records");
+        return -1;
     }
-    return hash % HASH_TABLE_SIZE;
+    return 0;
+}
+
+// Mueve p al inicio de la siguiente línea (o a fin si no hay más).
+static const char *siguiente_linea(const char *p, const char *fin)
+{
+    const char *salto = memchr(p, '\n', fin - p);
+    return salto ? salto + 1 : fin;
 }
-char *get_campo(const char *line, int field_index)
+
+// Reparte las líneas de datos .. fin en num_hilos tramos de tamaño
+// parecido, cada uno empezando en una línea.
+static void repartir_tramos(Tramo *tramos, long num_hilos, const char *datos, const char *fin)
 {
-    char *buffer = malloc(MAX_LINE_LENGTH);
-    if (!buffer)
+    const char *inicio = datos;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        const char *corte = (t == num_hilos - 1) ? fin : datos + (size_t)(fin - datos) * (t + 1) / num_hilos;
+        if (corte < inicio)
+            corte = inicio;
+        if (corte > datos && corte < fin && corte[-1] != '\n')
+            corte = siguiente_linea(corte, fin);
+        tramos[t] = (Tramo){.inicio = inicio, .fin = corte};
+        inicio = corte;
+    }
+}
+
+// Ejecuta funcion(&args[t]) en num_hilos hilos y espera a que terminen. Si
+// no se puede crear un hilo, su trabajo se hace en el hilo principal.
+static void ejecutar_en_hilos(void *(*funcion)(void *), void *args, size_t tam_arg, long num_hilos)
+{
+    pthread_t hilos[MAX_HILOS];
+    for (long t = 0; t < num_hilos; t++)
+    {
+        void *arg = (char *)args + t * tam_arg;
+        if (pthread_create(&hilos[t], NULL, funcion, arg) != 0)
+        {
+            funcion(arg);
+            hilos[t] = pthread_self();
+        }
+    }
+    for (long t = 0; t < num_hilos; t++)
+    {
+        if (!pthread_equal(hilos[t], pthread_self()))
+            pthread_join(hilos[t], NULL);
+    }
+}
+
+// Huellas de una partición (bits altos comunes) que ordena un hilo.
+typedef struct Conteo {
+    uint64_t *huellas;
+    const size_t *inicio;   // inicio[p]..inicio[p + 1] es la partición p
+    size_t *distintas;      // Claves distintas de cada partición
+    int primera;
+    int paso;
+} Conteo;
+
+static int comparar_huellas(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Ordena las particiones que le tocan al hilo y deja las huellas únicas
+// al principio de cada una.
+static void *contar_particiones(void *arg)
+{
+    Conteo *c = arg;
+    for (int p = c->primera; p < PARTICIONES; p += c->paso)
+    {
+        uint64_t *h = c->huellas + c->inicio[p];
+        size_t n = c->inicio[p + 1] - c->inicio[p];
+        qsort(h, n, sizeof(uint64_t), comparar_huellas);
+        size_t unicas = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (unicas == 0 || h[i] != h[unicas - 1])
+                h[unicas++] = h[i];
+        }
+        c->distintas[p] = unicas;
+    }
+    return NULL;
+}
+
+/*
+ * Reúne las huellas distintas de todas las entradas, ordenadas de menor a
+ * mayor. Las huellas se reparten por sus 8 bits altos en PARTICIONES
+ * grupos que se ordenan en paralelo y luego se juntan. Devuelve NULL si
+ * no hay memoria.
+ */
+static uint64_t *reunir_claves(const Tramo *tramos, long num_hilos, size_t total, uint64_t *num_claves)
+{
+    uint64_t *huellas = malloc(total * sizeof(uint64_t) + 1);
+    if (!huellas)
         return NULL;
-    // Columna actual, bandera y posición del buffer
-    int get_campo = 1, in_quotes = 0, buffer_pos = 0;
-    const char *line_ptr = line;
-    while (*line_ptr)
+
+    size_t inicio[PARTICIONES + 1] = {0};
+    size_t distintas[PARTICIONES];
+    for (long t = 0; t < num_hilos; t++)
+        for (size_t k = 0; k < tramos[t].num_entradas; k++)
+            inicio[(tramos[t].entradas[k].huella >> 56) + 1]++;
+    for (int p = 0; p < PARTICIONES; p++)
+        inicio[p + 1] += inicio[p];
+    size_t pos[PARTICIONES];
+    memcpy(pos, inicio, sizeof(pos));
+    for (long t = 0; t < num_hilos; t++)
+        for (size_t k = 0; k < tramos[t].num_entradas; k++)
+        {
+            uint64_t h = tramos[t].entradas[k].huella;
+            huellas[pos[h >> 56]++] = h;
+        }
+
+    Conteo conteos[MAX_HILOS];
+    for (long t = 0; t < num_hilos; t++)
+        conteos[t] = (Conteo){huellas, inicio, distintas, (int)t, (int)num_hilos};
+    ejecutar_en_hilos(contar_particiones, conteos, sizeof(Conteo), num_hilos);
+
+    // Las particiones van en orden de bits altos: al juntarlas quedan ordenadas.
+    size_t n = 0;
+    for (int p = 0; p < PARTICIONES; p++)
+    {
+        memmove(huellas + n, huellas + inicio[p], distintas[p] * sizeof(uint64_t));
+        n += distintas[p];
+    }
+    *num_claves = n;
+    return huellas;
+}
+
+/*
+ * Llena la tabla y el directorio a partir de las huellas ordenadas: el
+ * directorio queda ordenado por cubeta (reparto por conteo) y, dentro de
+ * cada cubeta, por huella.
+ */
+static void construir_directorio(const uint64_t *unicas, uint64_t num_claves)
+{
+    memset(hash_table, 0, sizeof(uint32_t) * ((size_t)tam_tabla + 1));
+    for (uint64_t i = 0; i < num_claves; i++)
+        hash_table[indice_cubeta(unicas[i], tam_tabla) + 1]++;
+    for (uint32_t b = 0; b < tam_tabla; b++)
+        hash_table[b + 1] += hash_table[b];
+    for (uint64_t i = 0; i < num_claves; i++)
+    {
+        uint32_t b = indice_cubeta(unicas[i], tam_tabla);
+        directorio[hash_table[b]++] = (ClaveIndice){.huella = unicas[i]};
+    }
+    // Ahora hash_table[b] marca el final de la cubeta b: se corre una posición.
+    for (uint32_t b = tam_tabla; b > 0; b--)
+        hash_table[b] = hash_table[b - 1];
+    hash_table[0] = 0;
+}
+
+// Cambia la huella de cada entrada del tramo por la posición de su clave
+// en el directorio.
+static void *resolver_claves(void *arg)
+{
+    Tramo *tramo = arg;
+    for (size_t k = 0; k < tramo->num_entradas; k++)
+    {
+        Entrada *e = &tramo->entradas[k];
+        uint32_t c = hash_table[indice_cubeta(e->huella, tam_tabla)];
+        while (directorio[c].huella != e->huella)
+            c++;
+        e->clave = c;
+    }
+    return NULL;
+}
+
+// Trabajo de un hilo: un índice secundario completo (de artistas o de
+// álbumes). Los dos se generan a la vez.
+typedef struct TrabajoSecundario {
+    const char *ruta;              // Archivo temporal (ver publicar_archivos)
+    uint32_t campo;               // SECUNDARIO_*
+    const Tramo *tramos;
+    long num_tramos;
+    const AlmacenCadenas *cadenas;
+    uint64_t num_registros;
+    uint64_t num_claves;
+    int error;
+} TrabajoSecundario;
+
+// Huella y ordinal de una cadena del diccionario que es clave del índice.
+typedef struct ClaveOrdenada {
+    uint64_t huella;
+    uint32_t ordinal;
+} ClaveOrdenada;
+
+static int comparar_claves_ordenadas(const void *a, const void *b)
+{
+    const ClaveOrdenada *x = a, *y = b;
+    if (x->huella != y->huella)
+        return x->huella > y->huella ? 1 : -1;
+    return (x->ordinal > y->ordinal) - (x->ordinal < y->ordinal);
+}
+
+// Ordinal de la cadena que empieza en desp. Los desplazamientos del
+// almacén crecen con el ordinal, así que se busca por bisección.
+static uint32_t ordinal_de_cadena(const AlmacenCadenas *a, uint32_t desp)
+{
+    size_t bajo = 0, alto = a->num;
+    while (alto - bajo > 1)
     {
-        if (*line_ptr == '"' && *(line_ptr + 1) != '"')
+        size_t medio = bajo + (alto - bajo) / 2;
+        if (a->desps[medio] <= desp)
+            bajo = medio;
+        else
+            alto = medio;
+    }
+    return (uint32_t)bajo;
+}
+
+// Anota el ordinal del texto indexado de cada registro y cuántos
+// registros tiene cada ordinal. Devuelve el número de claves distintas.
+static uint64_t agrupar_por_cadena(const TrabajoSecundario *t, uint32_t *ordinales, uint32_t *por_cadena)
+{
+    uint64_t k = 0;
+    for (long s = 0; s < t->num_tramos; s++)
+    {
+        for (size_t i = 0; i < t->tramos[s].num_entradas; i++)
         {
-            in_quotes = !in_quotes;
+            const Registro *r = &t->tramos[s].registros[i];
+            uint32_t ordinal = ordinal_de_cadena(t->cadenas, t->campo == SECUNDARIO_ALBUM ? r->album : r->artista);
+            ordinales[k++] = ordinal;
+            por_cadena[ordinal]++;
         }
-        else if (*line_ptr == ',' && !in_quotes)
+    }
+    uint64_t num_claves = 0;
+    for (size_t o = 0; o < t->cadenas->num; o++)
+        if (por_cadena[o])
+            num_claves++;
+    return num_claves;
+}
+
+/*
+ * Agrega a bloque la lista de filas (crecientes) en los bloques de
+ * INDICE_TAM_BLOQUE filas de indice.h y vuelca bloque en f cuando se llena.
+ * Devuelve los bytes de la lista.
+ */
+static uint64_t escribir_lista(FILE *f, uint8_t *bloque, size_t *en_bloque, const uint32_t *filas,
+                               uint32_t num_filas)
+{
+    uint64_t bytes = 0;
+    uint32_t anterior = 0;
+    for (uint32_t i = 0; i < num_filas; i += INDICE_TAM_BLOQUE)
+    {
+        if (*en_bloque + INDICE_MAX_BYTES_BLOQUE > TAM_BLOQUE_LISTAS)
         {
-            if (get_campo == field_index)
-            {
-                buffer[buffer_pos] = '\0';
-                return buffer;
-            }
-            get_campo++;
-            buffer_pos = 0;
+            fwrite(bloque, 1, *en_bloque, f);
+            *en_bloque = 0;
         }
+        uint32_t cuantos = num_filas - i < INDICE_TAM_BLOQUE ? num_filas - i : INDICE_TAM_BLOQUE;
+        size_t n = indice_bloque_escribir(bloque + *en_bloque, filas + i, cuantos, anterior);
+        anterior = filas[i + cuantos - 1];
+        *en_bloque += n;
+        bytes += n;
+    }
+    return bytes;
+}
+
+/*
+ * Llena la tabla (de tam cubetas) y el directorio ordenado por cubeta y
+ * huella. Cambia la cuenta de cada ordinal de por_cadena por la posición
+ * de su clave en el directorio.
+ */
+static int armar_directorio_secundario(const TrabajoSecundario *t, uint32_t *por_cadena, uint64_t num_claves,
+                                       uint32_t tam, uint32_t *tabla, ClaveSecundaria *dir)
+{
+    const AlmacenCadenas *cadenas = t->cadenas;
+    ClaveOrdenada *claves = malloc(sizeof(ClaveOrdenada) * num_claves + 1);
+    if (!claves)
+        return -1;
+    uint64_t c = 0;
+    for (size_t o = 0; o < cadenas->num; o++)
+    {
+        if (!por_cadena[o])
+            continue;
+        size_t len;
+        const char *texto = almacen_cadena(cadenas, o, &len);
+        claves[c++] = (ClaveOrdenada){hash_clave(texto, len, INDICE_SEMILLA), (uint32_t)o};
+    }
+    qsort(claves, num_claves, sizeof(ClaveOrdenada), comparar_claves_ordenadas);
+
+    // Reparto por conteo en cubetas: dentro de cada una quedan por huella.
+    for (c = 0; c < num_claves; c++)
+        tabla[indice_cubeta(claves[c].huella, tam) + 1]++;
+    for (uint32_t b = 0; b < tam; b++)
+        tabla[b + 1] += tabla[b];
+    for (c = 0; c < num_claves; c++)
+    {
+        uint32_t p = tabla[indice_cubeta(claves[c].huella, tam)]++;
+        uint32_t o = claves[c].ordinal;
+        dir[p].huella = claves[c].huella;
+        dir[p].cadena = (uint32_t)cadenas->desps[o];
+        dir[p].num_filas = por_cadena[o];
+        por_cadena[o] = p;
+    }
+    for (uint32_t b = tam; b > 0; b--)
+        tabla[b] = tabla[b - 1];
+    tabla[0] = 0;
+    free(claves);
+    return 0;
+}
+
+// Escribe el archivo: las listas (registros de cada clave en el orden del
+// CSV) y después la cabecera, la tabla y el directorio.
+static int escribir_archivo_secundario(const TrabajoSecundario *t, uint32_t tam, const uint32_t *tabla,
+                                       ClaveSecundaria *dir, uint64_t num_claves,
+                                       const uint32_t *ordinales, const uint32_t *posicion)
+{
+    uint64_t *siguiente = malloc(sizeof(uint64_t) * num_claves + 1);
+    uint32_t *filas = malloc(sizeof(uint32_t) * t->num_registros + 1);
+    uint8_t *bloque = malloc(TAM_BLOQUE_LISTAS);
+    FILE *f = (siguiente && filas && bloque) ? fopen(t->ruta, "wb") : NULL;
+    if (!f)
+    {
+        perror(t->ruta);
+        free(siguiente);
+        free(filas);
+        free(bloque);
+        return -1;
+    }
+    uint64_t acumulado = 0;
+    for (uint64_t p = 0; p < num_claves; p++)
+    {
+        siguiente[p] = acumulado;
+        acumulado += dir[p].num_filas;
+    }
+    for (uint64_t k = 0; k < t->num_registros; k++)
+        filas[siguiente[posicion[ordinales[k]]]++] = (uint32_t)k;
+    free(siguiente);
+
+    uint64_t desp_directorio = secundario_desp_directorio(tam);
+    uint64_t desp_listas = desp_directorio + sizeof(ClaveSecundaria) * num_claves;
+    fseek(f, desp_listas, SEEK_SET);
+    uint64_t desp_actual = desp_listas;
+    size_t en_bloque = 0;
+    uint64_t fila = 0;
+    for (uint64_t p = 0; p < num_claves; p++)
+    {
+        dir[p].desp_lista = desp_actual;
+        dir[p].bytes_lista = (uint32_t)escribir_lista(f, bloque, &en_bloque, filas + fila, dir[p].num_filas);
+        desp_actual += dir[p].bytes_lista;
+        fila += dir[p].num_filas;
+    }
+    fwrite(bloque, 1, en_bloque, f);
+    free(bloque);
+    free(filas);
+
+    SecundarioCabecera cabecera = {0};
+    memcpy(cabecera.magia, SECUNDARIO_MAGIA, sizeof(SECUNDARIO_MAGIA));
+    cabecera.version = SECUNDARIO_VERSION;
+    cabecera.tam_tabla = tam;
+    cabecera.num_filas = t->num_registros;
+    cabecera.semilla = INDICE_SEMILLA;
+    cabecera.num_claves = num_claves;
+    cabecera.desp_directorio = desp_directorio;
+    cabecera.desp_listas = desp_listas;
+    cabecera.campo = t->campo;
+    cabecera.bytes_csv = bytes_csv_indexados;
+    cabecera.huella_csv = huella_csv_indexados;
+    static const char relleno[8] = {0};
+    fseek(f, 0, SEEK_SET);
+    fwrite(&cabecera, sizeof(cabecera), 1, f);
+    fwrite(tabla, sizeof(uint32_t), (size_t)tam + 1, f);
+    fwrite(relleno, 1, desp_directorio - sizeof(cabecera) - sizeof(uint32_t) * ((uint64_t)tam + 1), f);
+    fwrite(dir, sizeof(ClaveSecundaria), num_claves, f);
+    if (cerrar_en_disco(f) != 0)
+    {
+        perror(t->ruta);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Cuerpo del hilo de un índice secundario: agrupa los registros por el
+ * identificador de su álbum o artista en el diccionario de cadenas, en el
+ * orden del CSV, con el mismo esquema de tabla, directorio y listas que
+ * spotify.index.
+ */
+static void *escribir_secundario(void *arg)
+{
+    TrabajoSecundario *t = arg;
+    uint32_t *ordinales = malloc(sizeof(uint32_t) * t->num_registros + 1);
+    uint32_t *por_cadena = calloc(t->cadenas->num + 1, sizeof(uint32_t));
+    t->error = 1;
+    if (ordinales && por_cadena)
+    {
+        t->num_claves = agrupar_por_cadena(t, ordinales, por_cadena);
+        uint32_t tam = indice_tam_para(t->num_claves, INDICE_CARGA_OBJETIVO);
+        uint32_t *tabla = calloc((size_t)tam + 1, sizeof(uint32_t));
+        ClaveSecundaria *dir = calloc(t->num_claves + 1, sizeof(ClaveSecundaria));
+        if (tabla && dir && armar_directorio_secundario(t, por_cadena, t->num_claves, tam, tabla, dir) == 0 &&
+            escribir_archivo_secundario(t, tam, tabla, dir, t->num_claves, ordinales, por_cadena) == 0)
+        {
+            t->error = 0;
+        }
+        free(tabla);
+        free(dir);
+    }
+    free(ordinales);
+    free(por_cadena);
+    return NULL;
+}
+
+// Clase del histograma de una cantidad: 0, 1, 2-3, 4-7, ... (potencias de 2).
+static int clase_histograma(uint32_t n)
+{
+    int clase = n ? 64 - __builtin_clzll(n) : 0;
+    return clase < MAX_HISTOGRAMA ? clase : MAX_HISTOGRAMA - 1;
+}
+
+static void imprimir_histograma(const char *titulo, const char *unidad, const uint64_t *clases, uint64_t total)
+{
+    printf("%s\n", titulo);
+    for (int c = 0; c < MAX_HISTOGRAMA; c++)
+    {
+        if (!clases[c])
+            continue;
+        char rango[32];
+        if (c <= 1)
+            snprintf(rango, sizeof(rango), "%d", c);
+        else if (c == MAX_HISTOGRAMA - 1)
+            snprintf(rango, sizeof(rango), ">= %u", 1u << (c - 1));
         else
+            snprintf(rango, sizeof(rango), "%u-%u", 1u << (c - 1), (1u << c) - 1);
+        printf("  %12s %12llu %s (%6.2f%%)\n", rango, (unsigned long long)clases[c], unidad,
+               100.0 * clases[c] / total);
+    }
+}
+
+static int comparar_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Trabajo de un hilo al indexar los trigramas de los nombres de canción:
+// un tramo de registros (pasadas de conteo y reparto) o un rango de listas
+// del directorio (ordenación).
+typedef struct TrabajoTrigramas {
+    const Registro *registros;
+    size_t num_registros;
+    uint32_t primer_registro;    // Número de registro de registros[0]
+    const AlmacenCadenas *cadenas;
+    uint32_t *por_trigrama;      // Cuenta de cada trigrama y luego su posición en el directorio
+    uint64_t *siguiente;         // Próximo hueco de cada lista en filas
+    uint32_t *filas;
+    const uint64_t *inicio_lista; // Primera fila de cada lista
+    uint64_t desde, hasta;       // Listas que ordena el hilo
+} TrabajoTrigramas;
+
+// Trigramas distintos del nombre de canción del registro, normalizado.
+static size_t trigramas_registro(const Registro *r, const AlmacenCadenas *cadenas, uint32_t *trigramas)
+{
+    const char *texto;
+    size_t len;
+    if ((r->banderas & REG_SIN_CANCION) ||
+        registro_cadena_leer((const uint8_t *)cadenas->datos + r->cancion, cadenas->tam - r->cancion, &texto, &len) != 0)
+        return 0;
+    char normalizado[TRIGRAMAS_MAX_TEXTO];
+    size_t n = trigramas_normalizar(texto, len, normalizado, sizeof(normalizado));
+    return trigramas_extraer(normalizado, n, trigramas);
+}
+
+// Primera pasada: cuántos registros contienen cada trigrama.
+static void *contar_trigramas(void *arg)
+{
+    TrabajoTrigramas *t = arg;
+    uint32_t trigramas[TRIGRAMAS_MAX_TEXTO];
+    for (size_t k = 0; k < t->num_registros; k++)
+    {
+        size_t n = trigramas_registro(&t->registros[k], t->cadenas, trigramas);
+        for (size_t i = 0; i < n; i++)
+            __atomic_fetch_add(&t->por_trigrama[trigramas[i]], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Segunda pasada: cada registro se anota en la lista de sus trigramas. Los
+// hilos escriben a la vez en las mismas listas, así que cada una se ordena
+// después.
+static void *repartir_trigramas(void *arg)
+{
+    TrabajoTrigramas *t = arg;
+    uint32_t trigramas[TRIGRAMAS_MAX_TEXTO];
+    for (size_t k = 0; k < t->num_registros; k++)
+    {
+        size_t n = trigramas_registro(&t->registros[k], t->cadenas, trigramas);
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t pos = __atomic_fetch_add(&t->siguiente[t->por_trigrama[trigramas[i]]], 1, __ATOMIC_RELAXED);
+            t->filas[pos] = t->primer_registro + (uint32_t)k;
+        }
+    }
+    return NULL;
+}
+
+static void *ordenar_listas_trigramas(void *arg)
+{
+    TrabajoTrigramas *t = arg;
+    for (uint64_t c = t->desde; c < t->hasta; c++)
+        qsort(t->filas + t->inicio_lista[c], t->inicio_lista[c + 1] - t->inicio_lista[c], sizeof(uint32_t), comparar_u32);
+    return NULL;
+}
+
+/*
+ * Codifica la lista en buffer (que crece si hace falta): los saltos de sus
+ * bloques y luego las diferencias de cada bloque. Devuelve los bytes
+ * usados o 0 si no hay memoria.
+ */
+static size_t codificar_lista_trigrama(const uint32_t *filas, uint32_t num_filas, uint8_t **buffer, size_t *cap)
+{
+    uint32_t num_bloques = trigramas_num_bloques(num_filas);
+    size_t necesarios = num_bloques * sizeof(TrigramaSalto) + (size_t)num_filas * INDICE_VARINT_MAX;
+    if (necesarios > *cap)
+    {
+        uint8_t *nuevo = realloc(*buffer, necesarios);
+        if (!nuevo)
+            return 0;
+        *buffer = nuevo;
+        *cap = necesarios;
+    }
+    size_t n = num_bloques * sizeof(TrigramaSalto);
+    for (uint32_t b = 0; b < num_bloques; b++)
+    {
+        uint32_t primera = b * TRIGRAMAS_TAM_BLOQUE;
+        uint32_t ultima = primera + TRIGRAMAS_TAM_BLOQUE < num_filas ? primera + TRIGRAMAS_TAM_BLOQUE : num_filas;
+        TrigramaSalto salto = {filas[primera], (uint32_t)n};
+        memcpy(*buffer + b * sizeof(TrigramaSalto), &salto, sizeof(salto));
+        for (uint32_t i = primera + 1; i < ultima; i++)
+            n += indice_varint_escribir(*buffer + n, filas[i] - filas[i - 1]);
+    }
+    return n;
+}
+
+/*
+ * Escribe spotify.trigrams a partir de los registros de los tramos (con
+ * las cadenas ya unidas al almacén global). Las pasadas sobre los
+ * registros y la ordenación de las listas se reparten entre los hilos;
+ * como cada lista queda ordenada, el archivo no depende del número de
+ * hilos. Devuelve 0 o -1 si algo falla.
+ */
+static int escribir_trigramas(const Tramo *tramos, long num_hilos, const AlmacenCadenas *cadenas, uint64_t num_registros)
+{
+    uint32_t *por_trigrama = calloc((size_t)1 << 24, sizeof(uint32_t));
+    uint32_t *tabla = calloc(TRIGRAMAS_TAM_TABLA + 1, sizeof(uint32_t));
+    if (!por_trigrama || !tabla)
+    {
+        free(por_trigrama);
+        free(tabla);
+        return -1;
+    }
+    TrabajoTrigramas trabajos[MAX_HILOS];
+    uint32_t primer_registro = 0;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        trabajos[t] = (TrabajoTrigramas){.registros = tramos[t].registros, .num_registros = tramos[t].num_entradas,
+                                         .primer_registro = primer_registro, .cadenas = cadenas,
+                                         .por_trigrama = por_trigrama};
+        primer_registro += tramos[t].num_entradas;
+    }
+    ejecutar_en_hilos(contar_trigramas, trabajos, sizeof(TrabajoTrigramas), num_hilos);
+
+    // Directorio en orden de trigrama; por_trigrama pasa a ser la posición
+    // de cada trigrama en él.
+    uint64_t num_trigramas = 0, total = 0;
+    for (uint32_t g = 0; g < (1u << 24); g++)
+        if (por_trigrama[g])
+            num_trigramas++;
+    TrigramaClave *claves = calloc(num_trigramas + 1, sizeof(TrigramaClave));
+    uint64_t *inicio_lista = malloc((num_trigramas + 1) * sizeof(uint64_t));
+    uint64_t *siguiente = malloc((num_trigramas + 1) * sizeof(uint64_t));
+    if (!claves || !inicio_lista || !siguiente)
+    {
+        free(claves);
+        free(inicio_lista);
+        free(siguiente);
+        free(por_trigrama);
+        free(tabla);
+        return -1;
+    }
+    uint64_t c = 0;
+    for (uint32_t g = 0; g < (1u << 24); g++)
+    {
+        if (!por_trigrama[g])
+            continue;
+        claves[c].trigrama = g;
+        claves[c].num_filas = por_trigrama[g];
+        inicio_lista[c] = siguiente[c] = total;
+        total += por_trigrama[g];
+        tabla[(g >> 8) + 1]++;
+        por_trigrama[g] = (uint32_t)c++;
+    }
+    inicio_lista[num_trigramas] = total;
+    for (uint32_t p = 0; p < TRIGRAMAS_TAM_TABLA; p++)
+        tabla[p + 1] += tabla[p];
+
+    uint32_t *filas = malloc(total * sizeof(uint32_t) + 1);
+    if (!filas)
+    {
+        free(claves);
+        free(inicio_lista);
+        free(siguiente);
+        free(por_trigrama);
+        free(tabla);
+        return -1;
+    }
+    for (long t = 0; t < num_hilos; t++)
+    {
+        trabajos[t].siguiente = siguiente;
+        trabajos[t].filas = filas;
+    }
+    ejecutar_en_hilos(repartir_trigramas, trabajos, sizeof(TrabajoTrigramas), num_hilos);
+    free(siguiente);
+    free(por_trigrama);
+
+    // Cada hilo ordena listas consecutivas con una parte parecida de las filas.
+    uint64_t desde = 0;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        uint64_t hasta = desde;
+        uint64_t objetivo = total * (t + 1) / num_hilos;
+        while (hasta < num_trigramas && (t == num_hilos - 1 || inicio_lista[hasta] < objetivo))
+            hasta++;
+        trabajos[t].inicio_lista = inicio_lista;
+        trabajos[t].desde = desde;
+        trabajos[t].hasta = hasta;
+        desde = hasta;
+    }
+    ejecutar_en_hilos(ordenar_listas_trigramas, trabajos, sizeof(TrabajoTrigramas), num_hilos);
+
+    FILE *f = fopen("spotify.trigrams.tmp", "wb");
+    if (!f)
+    {
+        perror("Error al crear spotify.trigrams");
+        free(claves);
+        free(inicio_lista);
+        free(filas);
+        free(tabla);
+        return -1;
+    }
+    uint64_t desp_directorio = trigramas_desp_directorio();
+    uint64_t desp_listas = desp_directorio + num_trigramas * sizeof(TrigramaClave);
+    fseek(f, desp_listas, SEEK_SET);
+    uint8_t *buffer = NULL;
+    size_t cap = 0;
+    uint64_t desp_actual = desp_listas;
+    int error = 0;
+    for (c = 0; c < num_trigramas && !error; c++)
+    {
+        size_t n = codificar_lista_trigrama(filas + inicio_lista[c], claves[c].num_filas, &buffer, &cap);
+        error = n == 0 || fwrite(buffer, 1, n, f) != n;
+        claves[c].desp_lista = desp_actual;
+        claves[c].bytes_lista = (uint32_t)n;
+        desp_actual += n;
+    }
+    free(buffer);
+    free(filas);
+    free(inicio_lista);
+
+    TrigramasCabecera cabecera = {0};
+    memcpy(cabecera.magia, TRIGRAMAS_MAGIA, sizeof(TRIGRAMAS_MAGIA));
+    cabecera.version = TRIGRAMAS_VERSION;
+    cabecera.tam_bloque = TRIGRAMAS_TAM_BLOQUE;
+    cabecera.num_filas = num_registros;
+    cabecera.num_trigramas = num_trigramas;
+    cabecera.desp_directorio = desp_directorio;
+    cabecera.desp_listas = desp_listas;
+    cabecera.bytes_csv = bytes_csv_indexados;
+    cabecera.huella_csv = huella_csv_indexados;
+    static const char relleno[8] = {0};
+    fseek(f, 0, SEEK_SET);
+    fwrite(&cabecera, sizeof(cabecera), 1, f);
+    fwrite(tabla, sizeof(uint32_t), TRIGRAMAS_TAM_TABLA + 1, f);
+    fwrite(relleno, 1, desp_directorio - sizeof(cabecera) - sizeof(uint32_t) * (TRIGRAMAS_TAM_TABLA + 1), f);
+    fwrite(claves, sizeof(TrigramaClave), num_trigramas, f);
+    free(claves);
+    free(tabla);
+    if (cerrar_en_disco(f) != 0 || error)
+    {
+        perror("Error al escribir spotify.trigrams");
+        return -1;
+    }
+    printf("%llu trigramas de canciones (%llu bytes de listas) en 'spotify.trigrams'\n",
+           (unsigned long long)num_trigramas, (unsigned long long)(desp_actual - desp_listas));
+    return 0;
+}
+
+// Par (clave, fila) del delta: una fila aparece en la lista de su clave
+// compuesta, de su artista, de su álbum y de cada trigrama de su canción.
+typedef struct ParDelta
+{
+    uint64_t huella;
+    uint64_t numero;
+} ParDelta;
+
+typedef struct ParesDelta
+{
+    ParDelta *pares;
+    size_t num;
+    size_t cap;
+} ParesDelta;
+
+static int comparar_pares(const void *a, const void *b)
+{
+    const ParDelta *x = a, *y = b;
+    if (x->huella != y->huella)
+        return x->huella < y->huella ? -1 : 1;
+    return (x->numero > y->numero) - (x->numero < y->numero);
+}
+
+static int agregar_par(ParesDelta *p, uint64_t huella, uint64_t numero)
+{
+    if (p->num == p->cap)
+    {
+        size_t cap = p->cap ? p->cap * 2 : 65536;
+        ParDelta *nuevos = realloc(p->pares, cap * sizeof(ParDelta));
+        if (!nuevos)
+            return -1;
+        p->pares = nuevos;
+        p->cap = cap;
+    }
+    p->pares[p->num++] = (ParDelta){huella, numero};
+    return 0;
+}
+
+// Huella de la cadena del almacén en el desplazamiento dado como clave del tipo dado.
+static uint64_t huella_cadena(const AlmacenCadenas *cadenas, uint32_t desp, int tipo)
+{
+    const char *texto;
+    size_t len;
+    if (registro_cadena_leer((const uint8_t *)cadenas->datos + desp, cadenas->tam - desp, &texto, &len) != 0)
+        len = 0;
+    return hash_clave(len ? texto : "", len, delta_semilla(INDICE_SEMILLA, tipo));
+}
+
+// Anota las claves de un registro del delta (aún con desplazamientos del
+// almacén del delta).
+static int pares_de_registro(ParesDelta *p, const Registro *r, uint64_t huella_compuesta, uint64_t numero,
+                             const AlmacenCadenas *cadenas)
+{
+    uint32_t trigramas[TRIGRAMAS_MAX_TEXTO];
+    size_t n = trigramas_registro(r, cadenas, trigramas);
+    if (agregar_par(p, huella_compuesta, numero) != 0 ||
+        agregar_par(p, huella_cadena(cadenas, r->artista, DELTA_ARTISTA), numero) != 0 ||
+        agregar_par(p, huella_cadena(cadenas, r->album, DELTA_ALBUM), numero) != 0)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+    {
+        char texto[3];
+        delta_texto_trigrama(trigramas[i], texto);
+        if (agregar_par(p, hash_clave(texto, 3, delta_semilla(INDICE_SEMILLA, DELTA_TRIGRAMA)), numero) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Lee las cabeceras de spotify.index y spotify.records y comprueba que
+// corresponden entre sí y que el índice guarda hasta dónde leyó el CSV.
+static int leer_base(IndiceCabecera *indice, RegistrosCabecera *registros)
+{
+    FILE *f = fopen("spotify.index", "rb");
+    int ok = f && fread(indice, sizeof(*indice), 1, f) == 1 && indice_cabecera_valida(indice);
+    if (f)
+        fclose(f);
+    f = fopen("spotify.records", "rb");
+    ok = ok && f && fread(registros, sizeof(*registros), 1, f) == 1 && registros_cabecera_valida(registros);
+    if (f)
+        fclose(f);
+    if (!ok || !indice_mismo_indexado(indice, registros->num_registros, registros->bytes_csv, registros->huella_csv) ||
+        indice->semilla != INDICE_SEMILLA || indice->bytes_csv == 0)
+    {
+        fprintf(stderr, "Error: no hay un índice completo válido (versión %d); ejecute el indexador sin -a\n",
+                INDICE_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+// Generación del delta anterior sobre el mismo índice base (0 si no hay).
+static uint64_t generacion_anterior(uint64_t huella_base, uint64_t *filas_anteriores)
+{
+    DeltaCabecera anterior;
+    FILE *f = fopen("spotify.delta", "rb");
+    int ok = f && fread(&anterior, sizeof(anterior), 1, f) == 1 &&
+             memcmp(anterior.magia, DELTA_MAGIA, sizeof(DELTA_MAGIA)) == 0 &&
+             anterior.version == DELTA_VERSION && anterior.huella_base == huella_base;
+    if (f)
+        fclose(f);
+    *filas_anteriores = ok ? anterior.num_filas : 0;
+    return ok ? anterior.generacion : 0;
+}
+
+/*
+ * Escribe spotify.delta.tmp con las claves de pares (ya ordenados), los
+ * registros de los tramos y el almacén del delta, y lo renombra sobre
+ * spotify.delta.
+ */
+static int escribir_delta(DeltaCabecera *cabecera, const ParesDelta *p, const Tramo *tramos, long num_hilos,
+                          const AlmacenCadenas *cadenas, double carga)
+{
+    uint64_t num_claves = 0;
+    uint64_t *unicas = malloc(sizeof(uint64_t) * p->num + 1);
+    uint64_t *inicio = malloc(sizeof(uint64_t) * (p->num + 1));
+    if (!unicas || !inicio)
+    {
+        free(unicas);
+        free(inicio);
+        return -1;
+    }
+    for (size_t i = 0; i < p->num; i++)
+    {
+        if (i == 0 || p->pares[i].huella != p->pares[i - 1].huella)
         {
-            if (get_campo == field_index)
+            inicio[num_claves] = i;
+            unicas[num_claves++] = p->pares[i].huella;
+        }
+    }
+    inicio[num_claves] = p->num;
+    tam_tabla = indice_tam_para(num_claves, carga);
+    hash_table = malloc(sizeof(uint32_t) * ((size_t)tam_tabla + 1));
+    directorio = malloc(sizeof(ClaveIndice) * (num_claves + 1));
+    uint64_t *primer_par = malloc(sizeof(uint64_t) * num_claves + 1);
+    uint32_t *filas = malloc(sizeof(uint32_t) * p->num + 1);
+    uint8_t *bloque = malloc(TAM_BLOQUE_LISTAS);
+    FILE *f = fopen("spotify.delta.tmp", "wb");
+    int error = !hash_table || !directorio || !primer_par || !filas || !bloque || !f;
+    if (!error)
+    {
+        construir_directorio(unicas, num_claves);
+        // Cada clave del directorio recuerda dónde empiezan sus pares.
+        for (uint64_t j = 0; j < num_claves; j++)
+        {
+            uint32_t c = hash_table[indice_cubeta(unicas[j], tam_tabla)];
+            while (directorio[c].huella != unicas[j])
+                c++;
+            primer_par[c] = j;
+        }
+
+        uint64_t desp_directorio = delta_desp_directorio(tam_tabla);
+        uint64_t desp_listas = desp_directorio + sizeof(ClaveIndice) * (num_claves + 1);
+        uint64_t desp_actual = desp_listas;
+        size_t en_bloque = 0;
+        fseek(f, desp_listas, SEEK_SET);
+        for (uint64_t k = 0; k < num_claves && !error; k++)
+        {
+            // Las filas de la clave sin repetir: una huella de trigrama
+            // podría coincidir con la de otra clave de la misma fila.
+            uint64_t j = primer_par[k];
+            uint32_t num_filas = 0;
+            for (uint64_t i = inicio[j]; i < inicio[j + 1]; i++)
+            {
+                if (num_filas == 0 || p->pares[i].numero != filas[num_filas - 1])
+                    filas[num_filas++] = (uint32_t)p->pares[i].numero;
+            }
+            if (num_filas > INDICE_MAX_FILAS_CLAVE)
             {
-                if (buffer_pos < MAX_LINE_LENGTH - 1)
-                    buffer[buffer_pos++] = *line_ptr;
+                fprintf(stderr, "Error: una clave del delta supera las %u filas; ejecute el indexador sin -a\n",
+                        INDICE_MAX_FILAS_CLAVE);
+                error = 1;
             }
+            directorio[k].lista = indice_lista_empaquetar(desp_actual - desp_listas, num_filas);
+            desp_actual += escribir_lista(f, bloque, &en_bloque, filas, num_filas);
         }
-        line_ptr++;
+        fwrite(bloque, 1, en_bloque, f);
+        directorio[num_claves] = (ClaveIndice){0, indice_lista_empaquetar(desp_actual - desp_listas, 0)};
+        // Los registros empiezan alineados a 8 bytes.
+        static const char relleno[8] = {0};
+        uint64_t desp_registros = (desp_actual + 7) & ~(uint64_t)7;
+        fwrite(relleno, 1, desp_registros - desp_actual, f);
+        for (long t = 0; t < num_hilos; t++)
+            fwrite(tramos[t].registros, sizeof(Registro), tramos[t].num_entradas, f);
+        fwrite(cadenas->datos, 1, cadenas->tam, f);
+
+        cabecera->tam_tabla = tam_tabla;
+        cabecera->num_claves = num_claves;
+        cabecera->desp_directorio = desp_directorio;
+        cabecera->desp_listas = desp_listas;
+        cabecera->desp_registros = desp_registros;
+        cabecera->desp_cadenas = desp_registros + cabecera->num_filas * sizeof(Registro);
+        cabecera->bytes_cadenas = cadenas->tam;
+        fseek(f, 0, SEEK_SET);
+        fwrite(cabecera, sizeof(*cabecera), 1, f);
+        fwrite(hash_table, sizeof(uint32_t), (size_t)tam_tabla + 1, f);
+        fwrite(relleno, 1, desp_directorio - sizeof(*cabecera) - sizeof(uint32_t) * ((uint64_t)tam_tabla + 1), f);
+        fwrite(directorio, sizeof(ClaveIndice), num_claves + 1, f);
+        // El delta nuevo debe estar completo en disco antes de reemplazar al anterior.
+        error = error || fflush(f) != 0 || fsync(fileno(f)) != 0;
     }
-    if (get_campo == field_index)
+    if (f && fclose(f) != 0)
+        error = 1;
+    if (!error && rename("spotify.delta.tmp", "spotify.delta") != 0)
+        error = 1;
+    if (error)
     {
-        if (buffer_pos > 0 && buffer[buffer_pos - 1] == '\n')
-            buffer_pos--;
-        buffer[buffer_pos] = '\0';
-        return buffer;
+        perror("Error al escribir spotify.delta");
+        unlink("spotify.delta.tmp");
     }
-    free(buffer);
-    return NULL;
-}
\ No newline at end of file
+    free(unicas);
+    free(inicio);
+    free(primer_par);
+    free(filas);
+    free(bloque);
+    free(hash_table);
+    free(directorio);
+    return error ? -1 : 0;
+}
+
+/*
+ * Fin de los datos a indexar de inicio .. fin: tras la última línea
+ * completa, de modo que una fila a medio escribir (el CSV se está
+ * ampliando) espera a la próxima actualización con -a. Con --final (el
+ * CSV ya no crece) se indexa también una última línea sin salto. Avisa de
+ * los bytes que quedan sin indexar.
+ */
+static const char *fin_de_datos(const char *inicio, const char *fin, int hasta_el_final)
+{
+    if (hasta_el_final)
+        return fin;
+    const char *ultimo_salto = memrchr(inicio, '\n', fin - inicio);
+    const char *fin_datos = ultimo_salto ? ultimo_salto + 1 : inicio;
+    if (fin_datos < fin)
+        printf("Aviso: los últimos %zu bytes del CSV no terminan en un salto de línea y no se indexan; "
+               "\"indexer -a\" los indexará cuando la línea esté completa (o use --final si el CSV ya no crece)\n",
+               (size_t)(fin - fin_datos));
+    return fin_datos;
+}
+
+/*
+ * Modo -a: indexa solo las filas añadidas al CSV después del índice base
+ * y genera una nueva generación de spotify.delta.
+ */
+static int actualizar_delta(const char *csv, size_t csv_tam, long num_hilos, double carga, int hasta_el_final)
+{
+    IndiceCabecera indice;
+    RegistrosCabecera registros;
+    if (leer_base(&indice, &registros) != 0)
+        return 1;
+    if (csv_tam < indice.bytes_csv || indice_huella_csv(csv, indice.bytes_csv) != indice.huella_csv)
+    {
+        fprintf(stderr, "Error: spotify_data.csv cambió antes del final indexado; ejecute el indexador sin -a\n");
+        return 1;
+    }
+    // La cola empieza en la primera línea que el índice no vio completa y
+    // termina en la última línea completa (ver fin_de_datos).
+    const char *inicio = csv + indice.bytes_csv;
+    const char *fin = csv + csv_tam;
+    if (inicio[-1] != '\n')
+        inicio = siguiente_linea(inicio, fin);
+    fin = fin_de_datos(inicio, fin, hasta_el_final);
+
+    Tramo tramos[MAX_HILOS];
+    repartir_tramos(tramos, num_hilos, inicio, fin);
+    ejecutar_en_hilos(procesar_tramo, tramos, sizeof(Tramo), num_hilos);
+    int error = 0;
+    size_t num_filas = 0;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        error |= tramos[t].error;
+        num_filas += tramos[t].num_entradas;
+    }
+    AlmacenCadenas cadenas;
+    almacen_iniciar(&cadenas);
+    for (long t = 0; t < num_hilos && !error; t++)
+        error |= unir_cadenas(&tramos[t], &cadenas) != 0;
+    if (!error && (indice.num_filas + num_filas > UINT32_MAX ||
+                   registros.bytes_cadenas + cadenas.tam > UINT32_MAX))
+    {
+        fprintf(stderr, "Error: el delta supera las 2^32 filas o los 4 GiB de cadenas; ejecute el indexador sin -a\n");
+        error = 1;
+    }
+
+    // Claves de cada fila nueva; después sus cadenas pasan a continuar las
+    // de spotify.records.
+    ParesDelta pares = {NULL, 0, 0};
+    uint64_t numero = indice.num_filas;
+    for (long t = 0; t < num_hilos && !error; t++)
+    {
+        for (size_t k = 0; k < tramos[t].num_entradas && !error; k++, numero++)
+        {
+            Registro *r = &tramos[t].registros[k];
+            error |= pares_de_registro(&pares, r, tramos[t].entradas[k].huella, numero, &cadenas) != 0;
+            r->album += (uint32_t)registros.bytes_cadenas;
+            r->artista += (uint32_t)registros.bytes_cadenas;
+            if (!(r->banderas & REG_SIN_CANCION))
+                r->cancion += (uint32_t)registros.bytes_cadenas;
+            if (r->banderas & REG_POPULARIDAD_TEXTO)
+                r->popularidad += (uint32_t)registros.bytes_cadenas;
+        }
+    }
+
+    DeltaCabecera cabecera = {0};
+    uint64_t filas_anteriores = 0;
+    if (!error)
+    {
+        qsort(pares.pares, pares.num, sizeof(ParDelta), comparar_pares);
+        memcpy(cabecera.magia, DELTA_MAGIA, sizeof(DELTA_MAGIA));
+        cabecera.version = DELTA_VERSION;
+        cabecera.huella_base = delta_huella_base(&indice);
+        cabecera.generacion = generacion_anterior(cabecera.huella_base, &filas_anteriores) + 1;
+        cabecera.primera_fila = indice.num_filas;
+        cabecera.base_cadenas = registros.bytes_cadenas;
+        cabecera.bytes_csv = fin - csv;
+        cabecera.num_filas = num_filas;
+        error = escribir_delta(&cabecera, &pares, tramos, num_hilos, &cadenas, carga) != 0;
+    }
+    for (long t = 0; t < num_hilos; t++)
+    {
+        free(tramos[t].entradas);
+        free(tramos[t].registros);
+        almacen_liberar(&tramos[t].cadenas);
+    }
+    free(pares.pares);
+    almacen_liberar(&cadenas);
+    if (error)
+    {
+        fprintf(stderr, "Error: no se pudo generar spotify.delta\n");
+        return 1;
+    }
+    printf("Generación %llu de 'spotify.delta': %zu filas añadidas desde el índice (%lld nuevas), %llu claves\n",
+           (unsigned long long)cabecera.generacion, num_filas, (long long)(num_filas - filas_anteriores),
+           (unsigned long long)cabecera.num_claves);
+    return 0;
+}
+
+/*
+ * Informe de --stats: reparto de claves por cubeta (entradas del
+ * directorio que revisa el servidor en cada consulta) y de filas por
+ * clave (largo de las listas que lee), con sus percentiles, y el tamaño
+ * de las listas comprimidas.
+ */
+static void imprimir_estadisticas(uint64_t num_claves, uint64_t num_filas, uint64_t bytes_listas,
+                                  const BloqueFiltro *filtro, uint64_t bloques_filtro)
+{
+    printf("\n--- Estadísticas del índice ---\n");
+    printf("Cubetas: %u  Claves distintas: %llu  Filas: %llu  Carga: %.3f\n", tam_tabla,
+           (unsigned long long)num_claves, (unsigned long long)num_filas, (double)num_claves / tam_tabla);
+
+    uint64_t clases[MAX_HISTOGRAMA] = {0};
+    uint32_t max_claves = 0;
+    for (uint32_t b = 0; b < tam_tabla; b++)
+    {
+        uint32_t n = hash_table[b + 1] - hash_table[b];
+        clases[clase_histograma(n)]++;
+        if (n > max_claves)
+            max_claves = n;
+    }
+    imprimir_histograma("Claves por cubeta:", "cubetas", clases, tam_tabla);
+    printf("  máximo: %u\n", max_claves);
+
+    if (num_claves == 0)
+        return;
+    memset(clases, 0, sizeof(clases));
+    uint32_t *filas = malloc(sizeof(uint32_t) * num_claves);
+    for (uint64_t k = 0; k < num_claves; k++)
+    {
+        clases[clase_histograma(filas_por_clave[k])]++;
+        if (filas)
+            filas[k] = filas_por_clave[k];
+    }
+    imprimir_histograma("Filas por clave (largo de la lista):", "claves", clases, num_claves);
+    if (filas)
+    {
+        qsort(filas, num_claves, sizeof(uint32_t), comparar_u32);
+        printf("  media: %.2f  p50: %u  p99: %u  p999: %u  máximo: %u\n",
+               (double)num_filas / num_claves, filas[num_claves / 2], filas[num_claves * 99 / 100],
+               filas[num_claves * 999 / 1000], filas[num_claves - 1]);
+        free(filas);
+    }
+    printf("Directorio: %llu bytes (%zu por clave)\n", (unsigned long long)((num_claves + 1) * sizeof(ClaveIndice)),
+           sizeof(ClaveIndice));
+    printf("Listas: %llu bytes, %.2f bytes por fila (%zu sin comprimir)\n",
+           (unsigned long long)bytes_listas, num_filas ? (double)bytes_listas / num_filas : 0.0, sizeof(uint32_t));
+
+    // Falsos positivos del filtro medidos con huellas al azar, que casi
+    // nunca son de una clave del índice.
+    uint64_t positivos = 0;
+    for (uint64_t i = 0; i < MUESTRAS_FILTRO; i++)
+        positivos += indice_filtro_contiene(filtro, bloques_filtro, hash_clave((const char *)&i, sizeof(i), 0));
+    printf("Filtro: %llu bytes (%.1f bits por clave), %.3f%% de falsos positivos\n",
+           (unsigned long long)(bloques_filtro * sizeof(BloqueFiltro)),
+           (double)bloques_filtro * sizeof(BloqueFiltro) * 8 / num_claves, 100.0 * positivos / MUESTRAS_FILTRO);
+}
+
+static void uso(const char *programa)
+{
+    fprintf(stderr, "Uso: %s [-j HILOS] [-c CARGA] [--stats] [-a] [--final]\n"
+                    "  -j HILOS  Número de hilos de análisis (por defecto, uno por CPU)\n"
+                    "  -c CARGA  Claves distintas por cubeta al dimensionar la tabla (por defecto %.2f)\n"
+                    "  -s, --stats  Muestra los histogramas de claves por cubeta y filas por clave\n"
+                    "  -a, --append Indexa solo las filas añadidas al CSV en spotify.delta\n"
+                    "  -f, --final  Indexa también una última línea sin salto (el CSV ya no crece)\n",
+            programa, INDICE_CARGA_OBJETIVO);
+}
+
+// Lleva al disco las entradas del directorio actual (los archivos creados
+// o renombrados en él). Devuelve 0 o -1.
+static int sincronizar_directorio(void)
+{
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    int error = fd < 0 || fsync(fd) != 0;
+    if (fd >= 0)
+        close(fd);
+    return error ? -1 : 0;
+}
+
+// Archivos de un indexado completo, en el orden en que se publican.
+static const char *const archivos_indexado[] = {"spotify.records", "spotify.trigrams", "spotify.artists",
+                                                "spotify.albums", "spotify.index"};
+#define NUM_ARCHIVOS_INDEXADO (sizeof(archivos_indexado) / sizeof(archivos_indexado[0]))
+
+// Borra los .tmp que haya dejado un indexado completo que no terminó (tras
+// publicarlos ya no existen). Se registra con atexit.
+static void borrar_temporales(void)
+{
+    char temporal[64];
+    for (size_t i = 0; i < NUM_ARCHIVOS_INDEXADO; i++)
+    {
+        snprintf(temporal, sizeof(temporal), "%s.tmp", archivos_indexado[i]);
+        unlink(temporal);
+    }
+}
+
+// Renombra los archivos de un indexado completo (ya en disco) sobre los
+// anteriores, el índice al final. Un servidor que tenía abiertos (o
+// mapeados) los anteriores los sigue leyendo intactos hasta que recarga.
+// Si se corta a mitad, el servidor reconoce los archivos de otro indexado
+// por los bytes del CSV de su cabecera y no los mezcla.
+static int publicar_archivos(void)
+{
+    char temporal[64];
+    if (sincronizar_directorio() != 0)
+    {
+        perror("Error al sincronizar el directorio");
+        return -1;
+    }
+    for (size_t i = 0; i < NUM_ARCHIVOS_INDEXADO; i++)
+    {
+        snprintf(temporal, sizeof(temporal), "%s.tmp", archivos_indexado[i]);
+        if (rename(temporal, archivos_indexado[i]) != 0)
+        {
+            perror(temporal);
+            return -1;
+        }
+    }
+    if (sincronizar_directorio() != 0)
+    {
+        perror("Error al sincronizar el directorio");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long num_hilos = sysconf(_SC_NPROCESSORS_ONLN);
+    double carga = INDICE_CARGA_OBJETIVO;
+    int estadisticas = 0;
+    int incremental = 0;
+    int hasta_el_final = 0;
+    static const struct option opciones[] = {
+        {"hilos", required_argument, NULL, 'j'},
+        {"carga", required_argument, NULL, 'c'},
+        {"stats", no_argument, NULL, 's'},
+        {"append", no_argument, NULL, 'a'},
+        {"final", no_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}};
+    int opcion;
+    while ((opcion = getopt_long(argc, argv, "j:c:saf", opciones, NULL)) != -1)
+    {
+        switch (opcion)
+        {
+        case 'c':
+            carga = atof(optarg);
+            if (carga >= 0.05 && carga <= 64)
+                break;
+            fprintf(stderr, "La carga debe estar entre 0.05 y 64\n");
+            return 1;
+        case 's':
+            estadisticas = 1;
+            break;
+        case 'a':
+            incremental = 1;
+            break;
+        case 'f':
+            hasta_el_final = 1;
+            break;
+        case 'j':
+            num_hilos = atol(optarg);
+            if (num_hilos >= 1 && num_hilos <= MAX_HILOS)
+                break;
+            fprintf(stderr, "El número de hilos debe estar entre 1 y %d\n", MAX_HILOS);
+            return 1;
+        default:
+            uso(argv[0]);
+            return 1;
+        }
+    }
+    if (num_hilos < 1)
+        num_hilos = 1;
+    if (num_hilos > MAX_HILOS)
+        num_hilos = MAX_HILOS;
+
+    // El CSV se mapea en memoria: cada hilo analiza su tramo sin copiarlo.
+    int csv_fd = open("spotify_data.csv", O_RDONLY);
+    if (csv_fd < 0)
+    {
+        perror("Error al abrir spotify_data.csv");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(csv_fd, &st) < 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "Error: spotify_data.csv está vacío o no se puede leer\n");
+        close(csv_fd);
+        return 1;
+    }
+    size_t csv_tam = st.st_size;
+    const char *csv = mmap(NULL, csv_tam, PROT_READ, MAP_PRIVATE, csv_fd, 0);
+    close(csv_fd);
+    if (csv == MAP_FAILED)
+    {
+        perror("Error al mapear spotify_data.csv");
+        return 1;
+    }
+    madvise((void *)csv, csv_tam, MADV_SEQUENTIAL);
+
+    if (incremental)
+    {
+        int estado = actualizar_delta(csv, csv_tam, num_hilos, carga, hasta_el_final);
+        munmap((void *)csv, csv_tam);
+        return estado;
+    }
+
+    // Un indexado que falla a mitad no deja sus .tmp, ni a medio escribir
+    // ni completos, para un próximo intento.
+    atexit(borrar_temporales);
+    FILE *index_file = fopen("spotify.index.tmp", "wb");
+    if (!index_file)
+    {
+        perror("Error al crear spotify.index");
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+
+    // Se descarta la primera línea del CSV (la cabecera) y el resto se
+    // reparte en tramos de tamaño parecido, cada uno empezando en una línea.
+    // Como en el delta, se indexa hasta la última línea completa salvo con
+    // --final (ver fin_de_datos).
+    const char *fin_csv = fin_de_datos(csv, csv + csv_tam, hasta_el_final);
+    bytes_csv_indexados = fin_csv - csv;
+    huella_csv_indexados = indice_huella_csv(csv, bytes_csv_indexados);
+    Tramo tramos[MAX_HILOS];
+    repartir_tramos(tramos, num_hilos, siguiente_linea(csv, fin_csv), fin_csv);
+
+    printf("Generando index con %ld hilos...\n", num_hilos);
+    fflush(stdout);
+    ejecutar_en_hilos(procesar_tramo, tramos, sizeof(Tramo), num_hilos);
+    long count = 0;
+    int error = 0;
+    size_t total_entradas = 0;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        count += tramos[t].lineas;
+        error |= tramos[t].error;
+        total_entradas += tramos[t].num_entradas;
+    }
+    if (total_entradas > UINT32_MAX)
+        error = 1;
+
+    // Registros: las cadenas de cada tramo se unen, en orden, a un único
+    // almacén sin repetidas y se escribe spotify.records.
+    AlmacenCadenas cadenas;
+    almacen_iniciar(&cadenas);
+    for (long t = 0; t < num_hilos && !error; t++)
+        error |= unir_cadenas(&tramos[t], &cadenas) != 0;
+    if (!error)
+    {
+        printf("Indexando los trigramas de los nombres de canción...\n");
+        fflush(stdout);
+        if (escribir_trigramas(tramos, num_hilos, &cadenas, total_entradas) != 0)
+        {
+            fprintf(stderr, "Error: no se pudo generar spotify.trigrams\n");
+            fclose(index_file);
+            munmap((void *)csv, csv_tam);
+            return 1;
+        }
+        // Índices secundarios de artistas y de álbumes, uno por hilo.
+        TrabajoSecundario secundarios[2] = {
+            {.ruta = "spotify.artists.tmp", .campo = SECUNDARIO_ARTISTA},
+            {.ruta = "spotify.albums.tmp", .campo = SECUNDARIO_ALBUM}};
+        for (int i = 0; i < 2; i++)
+        {
+            secundarios[i].tramos = tramos;
+            secundarios[i].num_tramos = num_hilos;
+            secundarios[i].cadenas = &cadenas;
+            secundarios[i].num_registros = total_entradas;
+        }
+        ejecutar_en_hilos(escribir_secundario, secundarios, sizeof(TrabajoSecundario), 2);
+        if (secundarios[0].error || secundarios[1].error)
+        {
+            fprintf(stderr, "Error: no se pudieron generar los índices de artistas y álbumes\n");
+            fclose(index_file);
+            munmap((void *)csv, csv_tam);
+            return 1;
+        }
+        printf("%llu artistas en 'spotify.artists' y %llu álbumes en 'spotify.albums'\n",
+               (unsigned long long)secundarios[0].num_claves, (unsigned long long)secundarios[1].num_claves);
+        printf("Escribiendo %zu registros y %zu bytes de cadenas en 'spotify.records'...\n",
+               total_entradas, cadenas.tam);
+        fflush(stdout);
+        if (escribir_registros(tramos, num_hilos, total_entradas, &cadenas) != 0)
+        {
+            fclose(index_file);
+            munmap((void *)csv, csv_tam);
+            return 1;
+        }
+    }
+    almacen_liberar(&cadenas);
+
+    // Se cuentan las claves distintas para dimensionar la tabla de una vez,
+    // en lugar de fijar su tamaño o rehacerla al crecer la carga.
+    uint64_t num_claves = 0;
+    uint64_t *unicas = error ? NULL : reunir_claves(tramos, num_hilos, total_entradas, &num_claves);
+    if (unicas)
+    {
+        tam_tabla = indice_tam_para(num_claves, carga);
+        hash_table = malloc(sizeof(uint32_t) * ((size_t)tam_tabla + 1));
+        directorio = malloc(sizeof(ClaveIndice) * (num_claves + 1));
+        filas_por_clave = calloc(num_claves + 1, sizeof(uint32_t));
+    }
+    if (!unicas || !hash_table || !directorio || !filas_por_clave)
+    {
+        fprintf(stderr, "Error: memoria insuficiente para las entradas del índice "
+                        "(o más de 4 GiB de cadenas o de 2^32 filas)\n");
+        fclose(index_file);
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+    printf("Procesadas %ld líneas, %llu claves distintas. Tabla de %u cubetas. Agrupando filas...\n",
+           count, (unsigned long long)num_claves, tam_tabla);
+    fflush(stdout);
+    construir_directorio(unicas, num_claves);
+    free(unicas);
+    ejecutar_en_hilos(resolver_claves, tramos, sizeof(Tramo), num_hilos);
+
+    // Segunda pasada: los números de registro de cada clave se agrupan en un
+    // arreglo contiguo. Las entradas se recorren en el orden del CSV (tramo
+    // a tramo), así que cada lista queda ordenada y el archivo generado es
+    // idéntico byte a byte sea cual sea el número de hilos.
+    for (long t = 0; t < num_hilos; t++)
+        for (size_t k = 0; k < tramos[t].num_entradas; k++)
+            filas_por_clave[tramos[t].entradas[k].clave]++;
+    uint64_t *siguiente = malloc(sizeof(uint64_t) * num_claves + 1);
+    uint32_t *filas = malloc(sizeof(uint32_t) * total_entradas + 1);
+    uint8_t *bloque = malloc(TAM_BLOQUE_LISTAS);
+    if (!siguiente || !filas || !bloque)
+    {
+        perror("malloc");
+        fclose(index_file);
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+    uint64_t acumulado = 0;
+    for (uint64_t k = 0; k < num_claves; k++)
+    {
+        siguiente[k] = acumulado;
+        acumulado += filas_por_clave[k];
+    }
+    uint32_t registro = 0;
+    for (long t = 0; t < num_hilos; t++)
+    {
+        for (size_t k = 0; k < tramos[t].num_entradas; k++)
+            filas[siguiente[tramos[t].entradas[k].clave]++] = registro++;
+        free(tramos[t].entradas);
+    }
+    free(siguiente);
+
+    // --- 4.2: Preparación del Archivo de Índice ---
+    // Mueve el cursor de escritura del archivo de índice hacia adelante.
+    // Deja un espacio en blanco al principio del tamaño de la cabecera,
+    // la tabla hash y el directorio, que se escriben al final.
+    uint64_t desp_directorio = indice_desp_directorio(tam_tabla);
+    uint64_t desp_listas = desp_directorio + sizeof(ClaveIndice) * (num_claves + 1);
+    fseek(index_file, desp_listas, SEEK_SET);
+
+    // Cada lista en bloques de filas con sus diferencias empaquetadas (ver
+    // indice.h); la entrada centinela marca dónde termina la última.
+    uint64_t desp_actual = desp_listas;
+    size_t en_bloque = 0;
+    uint64_t fila = 0;
+    for (uint64_t k = 0; k < num_claves; k++)
+    {
+        if (filas_por_clave[k] > INDICE_MAX_FILAS_CLAVE || desp_actual - desp_listas >= INDICE_MAX_BYTES_LISTAS)
+        {
+            fprintf(stderr, "Error: una clave supera las %u filas o las listas los %llu bytes\n",
+                    INDICE_MAX_FILAS_CLAVE, (unsigned long long)INDICE_MAX_BYTES_LISTAS);
+            fclose(index_file);
+            munmap((void *)csv, csv_tam);
+            return 1;
+        }
+        directorio[k].lista = indice_lista_empaquetar(desp_actual - desp_listas, filas_por_clave[k]);
+        desp_actual += escribir_lista(index_file, bloque, &en_bloque, filas + fila, filas_por_clave[k]);
+        fila += filas_por_clave[k];
+    }
+    directorio[num_claves] = (ClaveIndice){0, indice_lista_empaquetar(desp_actual - desp_listas, 0)};
+    fwrite(bloque, 1, en_bloque, index_file);
+    free(bloque);
+    free(filas);
+
+    // El filtro de claves, tras las listas y alineado al tamaño de sus bloques.
+    static const char relleno[sizeof(BloqueFiltro)] = {0};
+    uint64_t desp_filtro = (desp_actual + sizeof(BloqueFiltro) - 1) & ~(uint64_t)(sizeof(BloqueFiltro) - 1);
+    uint64_t bloques_filtro = indice_filtro_bloques(num_claves);
+    BloqueFiltro *filtro = calloc(bloques_filtro, sizeof(BloqueFiltro));
+    if (!filtro)
+    {
+        perror("calloc");
+        fclose(index_file);
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+    for (uint64_t k = 0; k < num_claves; k++)
+        indice_filtro_agregar(filtro, bloques_filtro, directorio[k].huella);
+    fwrite(relleno, 1, desp_filtro - desp_actual, index_file);
+    fwrite(filtro, sizeof(BloqueFiltro), bloques_filtro, index_file);
+
+    // Volver a donde estaba el espacio el blanco.
+    IndiceCabecera cabecera = {0};
+    memcpy(cabecera.magia, INDICE_MAGIA, sizeof(INDICE_MAGIA));
+    cabecera.version = INDICE_VERSION;
+    cabecera.tam_tabla = tam_tabla;
+    cabecera.num_filas = total_entradas;
+    cabecera.semilla = INDICE_SEMILLA;
+    cabecera.num_claves = num_claves;
+    cabecera.desp_directorio = desp_directorio;
+    cabecera.desp_listas = desp_listas;
+    cabecera.bytes_csv = bytes_csv_indexados;
+    cabecera.huella_csv = huella_csv_indexados;
+    cabecera.desp_filtro = desp_filtro;
+    cabecera.bloques_filtro = bloques_filtro;
+    fseek(index_file, 0, SEEK_SET);
+    fwrite(&cabecera, sizeof(cabecera), 1, index_file);
+    fwrite(hash_table, sizeof(uint32_t), (size_t)tam_tabla + 1, index_file);
+    fwrite(relleno, 1, desp_directorio - sizeof(cabecera) - sizeof(uint32_t) * ((uint64_t)tam_tabla + 1), index_file);
+    fwrite(directorio, sizeof(ClaveIndice), num_claves + 1, index_file);
+    if (cerrar_en_disco(index_file) != 0)
+    {
+        perror("Error al escribir spotify.index");
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+    if (publicar_archivos() != 0)
+    {
+        munmap((void *)csv, csv_tam);
+        return 1;
+    }
+    // Las filas del delta anterior ya están en el índice completo.
+    unlink("spotify.delta");
+    printf("¡Índice final creado exitosamente en 'spotify.index'!\n");
+    if (estadisticas)
+        imprimir_estadisticas(num_claves, total_entradas, desp_actual - desp_listas, filtro, bloques_filtro);
+    free(filtro);
+    free(hash_table);
+    free(directorio);
+    free(filas_por_clave);
+    munmap((void *)csv, csv_tam);
+    return 0;
+}
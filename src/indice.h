@@ -0,0 +1,390 @@
+/*
+ * indice.h: Formato del archivo binario spotify.index.
+ * Lo comparten el indexador (que lo escribe) y el servidor (que lo lee),
+ * de modo que ambos procesos siempre están de acuerdo en la disposición
+ * de la cabecera, la tabla hash, el directorio de claves y las listas.
+ *
+ * Disposición del archivo:
+ *   [IndiceCabecera][uint32_t tabla[tam_tabla + 1]][relleno hasta 8]
+ *   [ClaveIndice directorio[num_claves + 1]][listas de filas]
+ *   [relleno hasta 32][BloqueFiltro filtro[bloques_filtro]]
+ * El directorio está ordenado por cubeta (y por huella dentro de cada una):
+ * las claves de la cubeta b son directorio[tabla[b]] .. directorio[tabla[b + 1] - 1].
+ * Cada entrada ocupa 16 bytes: la huella y, empaquetados en 64 bits, el
+ * desplazamiento de su lista desde desp_listas (40 bits) y su número de
+ * filas (24 bits). Las listas van en el orden del directorio, así que el
+ * tamaño de una es la distancia hasta la siguiente; tras la última clave
+ * hay una entrada centinela que marca el final de las listas.
+ *
+ * Cada lista tiene los números de los registros de su clave en
+ * spotify.records (ver registros.h), en orden creciente, en bloques de
+ * INDICE_TAM_BLOQUE filas (el último puede ser más corto):
+ *   [primera fila en varint][ancho][excepciones]
+ *   [diferencias empaquetadas][excepciones: posición y bits altos en varint]
+ * La primera fila de un bloque va como diferencia con la última del
+ * bloque anterior (absoluta en el primero). Las demás se guardan como
+ * diferencia con la anterior menos 1, empaquetadas con el mismo ancho en
+ * bits; las pocas que no caben en ese ancho dejan sus bits altos como
+ * excepción al final del bloque. Las filas de un álbum suelen ser
+ * consecutivas en el CSV, así que un bloque que cae dentro de una racha
+ * de filas seguidas tiene ancho 0 y ocupa 3 o 4 bytes.
+ *
+ * El filtro es un Bloom por bloques con todas las huellas del directorio,
+ * unos INDICE_BITS_FILTRO bits por clave. Cada huella elige un bloque de
+ * 32 bytes (alineado, nunca cruza dos líneas de caché) con sus 32 bits
+ * altos y marca en él un bit de cada una de sus 8 palabras de 32 bits,
+ * derivado de sus 32 bits bajos. El servidor lo tiene en memoria: una clave que no está en el
+ * filtro no está en el índice, y se descarta sin leer el directorio. Con
+ * 12 bits por clave, alrededor del 0,5 % de las claves ausentes pasan el
+ * filtro y terminan en el directorio como antes.
+ *
+ * El indexador dimensiona la tabla a una potencia de 2 según el número de
+ * claves distintas, y guarda ese tamaño y la semilla del hash en la
+ * cabecera para que el servidor los use. También guarda hasta qué byte
+ * del CSV indexó, para que "indexer -a" analice solo las filas añadidas
+ * después (ver delta.h). Los demás archivos de un indexado completo
+ * (spotify.records, spotify.trigrams, spotify.artists y spotify.albums)
+ * repiten esos bytes y su huella en su cabecera: el servidor no usa un
+ * archivo que salió de otro indexado.
+ */
+#ifndef INDICE_H
+#define INDICE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define INDICE_MAGIA "SPOTIDX"
+#define INDICE_VERSION 7
+#define INDICE_SEMILLA 0x53504f5449445832ULL // Semilla por defecto del hash
+#define INDICE_CARGA_OBJETIVO 0.75          // Claves distintas por cubeta
+#define INDICE_TAM_MINIMO 1024u
+#define INDICE_TAM_MAXIMO (1u << 31)
+#define INDICE_VARINT_MAX 10 // Bytes máximos de un uint64_t en varint
+#define INDICE_TAM_BLOQUE 32 // Filas de cada bloque de una lista
+// Bytes máximos de un bloque: la primera fila, el ancho, las excepciones y
+// diferencias de 32 bits (que nunca dejan excepciones).
+#define INDICE_MAX_BYTES_BLOQUE (INDICE_VARINT_MAX + 2 + (INDICE_TAM_BLOQUE - 1) * 4)
+#define INDICE_BITS_DESP 40 // Bits del desplazamiento de una lista en ClaveIndice
+#define INDICE_MAX_BYTES_LISTAS (1ULL << INDICE_BITS_DESP)
+#define INDICE_MAX_FILAS_CLAVE ((1u << (64 - INDICE_BITS_DESP)) - 1)
+#define INDICE_BITS_FILTRO 12 // Bits del filtro por clave
+
+typedef struct IndiceCabecera {
+    char magia[8];           // "SPOTIDX\0"
+    uint32_t version;        // INDICE_VERSION
+    uint32_t tam_tabla;      // Número de cubetas de la tabla hash (potencia de 2)
+    uint64_t num_filas;      // Total de filas indexadas (registros de spotify.records)
+    uint64_t semilla;        // Semilla de hash_clave() con la que se generó
+    uint64_t num_claves;     // Claves "album|artista" distintas
+    uint64_t desp_directorio; // Desplazamiento del directorio de claves
+    uint64_t desp_listas;    // Desplazamiento de la primera lista de filas
+    uint64_t bytes_csv;      // Bytes del CSV indexados (ver delta.h)
+    uint64_t huella_csv;     // indice_huella_csv() de esos bytes
+    uint64_t desp_filtro;    // Desplazamiento del filtro (múltiplo de 32)
+    uint64_t bloques_filtro; // indice_filtro_bloques(num_claves)
+} IndiceCabecera;
+
+typedef struct ClaveIndice {
+    uint64_t huella;      // hash_clave() de la clave "album|artista" completa
+    uint64_t lista;       // indice_lista_empaquetar() de su lista de filas
+} ClaveIndice;
+
+// Bloque del filtro de claves: 256 bits dentro de una línea de caché.
+typedef struct BloqueFiltro {
+    uint32_t palabras[8];
+} BloqueFiltro;
+
+// Lista de filas de una clave, tal como la usan los lectores.
+typedef struct ListaIndice {
+    uint64_t desp;        // Desplazamiento absoluto en el archivo
+    uint64_t bytes;
+    uint32_t num_filas;
+} ListaIndice;
+
+// Empaqueta el desplazamiento de una lista (desde desp_listas) y sus filas.
+static inline uint64_t indice_lista_empaquetar(uint64_t desp, uint32_t num_filas) {
+    return desp | (uint64_t)num_filas << INDICE_BITS_DESP;
+}
+
+// Lista de la entrada clave[0] del directorio; clave[1] debe ser la entrada
+// siguiente (o la centinela), donde empieza la lista que sigue.
+static inline ListaIndice indice_lista(const ClaveIndice *clave, uint64_t desp_listas) {
+    const uint64_t mascara = INDICE_MAX_BYTES_LISTAS - 1;
+    uint64_t desde = clave[0].lista & mascara, hasta = clave[1].lista & mascara;
+    return (ListaIndice){desp_listas + desde, hasta > desde ? hasta - desde : 0,
+                         (uint32_t)(clave[0].lista >> INDICE_BITS_DESP)};
+}
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_leer64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_leer32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_ronda(uint64_t acc, uint64_t dato) {
+    acc += dato * 0xC2B2AE3D27D4EB4FULL;
+    return xxh64_rotl(acc, 31) * 0x9E3779B185EBCA87ULL;
+}
+
+static inline uint64_t xxh64_mezclar(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_ronda(0, v);
+    return acc * 0x9E3779B185EBCA87ULL + 0x85EBCA77C2B2AE63ULL;
+}
+
+/*
+ * xxHash64 de la clave compuesta (lecturas little-endian, como x86-64).
+ * El mismo valor sirve de huella de la clave en el directorio y, con sus
+ * bits bajos, elige la cubeta, así que cada clave se recorre una sola vez.
+ */
+static inline uint64_t hash_clave(const char *clave, size_t len, uint64_t semilla) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL,
+                   P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL,
+                   P5 = 0x27D4EB2F165667C5ULL;
+    const unsigned char *p = (const unsigned char *)clave;
+    const unsigned char *fin = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = semilla + P1 + P2, v2 = semilla + P2, v3 = semilla, v4 = semilla - P1;
+        do {
+            v1 = xxh64_ronda(v1, xxh64_leer64(p));
+            v2 = xxh64_ronda(v2, xxh64_leer64(p + 8));
+            v3 = xxh64_ronda(v3, xxh64_leer64(p + 16));
+            v4 = xxh64_ronda(v4, xxh64_leer64(p + 24));
+            p += 32;
+        } while (fin - p >= 32);
+        h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+        h = xxh64_mezclar(h, v1);
+        h = xxh64_mezclar(h, v2);
+        h = xxh64_mezclar(h, v3);
+        h = xxh64_mezclar(h, v4);
+    } else {
+        h = semilla + P5;
+    }
+    h += len;
+    for (; fin - p >= 8; p += 8) {
+        h ^= xxh64_ronda(0, xxh64_leer64(p));
+        h = xxh64_rotl(h, 27) * P1 + P4;
+    }
+    if (fin - p >= 4) {
+        h ^= xxh64_leer32(p) * P1;
+        h = xxh64_rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < fin; p++) {
+        h ^= *p * P5;
+        h = xxh64_rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Cubeta de una huella en una tabla de tam_tabla cubetas (potencia de 2).
+static inline uint32_t indice_cubeta(uint64_t huella, uint32_t tam_tabla) {
+    return (uint32_t)(huella & (tam_tabla - 1));
+}
+
+// Bloques del filtro para num_claves claves (al menos uno).
+static inline uint64_t indice_filtro_bloques(uint64_t num_claves) {
+    uint64_t bloques = (num_claves * INDICE_BITS_FILTRO + 255) / 256;
+    return bloques ? bloques : 1;
+}
+
+// Bloque del filtro de una huella y los bits que marca en cada palabra.
+// Las 8 sales son impares y multiplican los 32 bits bajos de la huella;
+// los 5 bits altos de cada producto eligen el bit de su palabra.
+static inline uint64_t indice_filtro_mascara(uint64_t huella, uint64_t bloques, uint32_t mascara[8]) {
+    static const uint32_t sales[8] = {0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+                                      0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u};
+    for (int i = 0; i < 8; i++) mascara[i] = 1u << (((uint32_t)huella * sales[i]) >> 27);
+    return ((huella >> 32) * bloques) >> 32; // bloques < 2^32
+}
+
+static inline void indice_filtro_agregar(BloqueFiltro *filtro, uint64_t bloques, uint64_t huella) {
+    uint32_t mascara[8];
+    BloqueFiltro *b = &filtro[indice_filtro_mascara(huella, bloques, mascara)];
+    for (int i = 0; i < 8; i++) b->palabras[i] |= mascara[i];
+}
+
+// 0 si la huella seguro no está en el índice; 1 si puede estar.
+static inline int indice_filtro_contiene(const BloqueFiltro *filtro, uint64_t bloques, uint64_t huella) {
+    uint32_t mascara[8];
+    const BloqueFiltro *b = &filtro[indice_filtro_mascara(huella, bloques, mascara)];
+    uint32_t faltan = 0;
+    for (int i = 0; i < 8; i++) faltan |= mascara[i] & ~b->palabras[i];
+    return faltan == 0;
+}
+
+// Menor potencia de 2 que deja num_claves por debajo de la carga objetivo.
+static inline uint32_t indice_tam_para(uint64_t num_claves, double carga) {
+    uint32_t tam = INDICE_TAM_MINIMO;
+    while (tam < INDICE_TAM_MAXIMO && (double)num_claves > carga * tam) {
+        tam <<= 1;
+    }
+    return tam;
+}
+
+// Escribe v en varint (7 bits por byte, el bit alto indica que sigue otro).
+// Devuelve los bytes usados (como mucho INDICE_VARINT_MAX).
+static inline size_t indice_varint_escribir(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Lee un varint de *p sin pasar de fin y avanza *p. Devuelve -1 si está cortado.
+static inline int indice_varint_leer(const uint8_t **p, const uint8_t *fin, uint64_t *v) {
+    uint64_t valor = 0;
+    for (int desplazamiento = 0; *p < fin && desplazamiento < 64; desplazamiento += 7) {
+        uint8_t b = *(*p)++;
+        valor |= (uint64_t)(b & 0x7f) << desplazamiento;
+        if (!(b & 0x80)) {
+            *v = valor;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Escribe en p un bloque con las cuantos filas (crecientes, de 1 a
+ * INDICE_TAM_BLOQUE) que siguen a la fila anterior (0 en el primer bloque).
+ * Elige el ancho que deja el bloque más corto contando las excepciones.
+ * Devuelve los bytes usados (como mucho INDICE_MAX_BYTES_BLOQUE).
+ */
+static inline size_t indice_bloque_escribir(uint8_t *p, const uint32_t *filas, uint32_t cuantos, uint32_t anterior) {
+    uint32_t diferencias[INDICE_TAM_BLOQUE];
+    uint32_t por_largo[33] = {0}; // Diferencias según sus bits significativos
+    for (uint32_t i = 1; i < cuantos; i++) {
+        diferencias[i] = filas[i] - filas[i - 1] - 1;
+        por_largo[diferencias[i] ? 32 - __builtin_clz(diferencias[i]) : 0]++;
+    }
+    size_t menor = SIZE_MAX;
+    unsigned ancho = 0, excepciones = 0;
+    for (unsigned b = 0; b <= 32; b++) {
+        size_t tam = ((size_t)(cuantos - 1) * b + 7) / 8;
+        unsigned e = 0;
+        for (unsigned largo = b + 1; largo <= 32; largo++) {
+            tam += por_largo[largo] * (1 + (largo - b + 6) / 7);
+            e += por_largo[largo];
+        }
+        if (tam < menor) {
+            menor = tam;
+            ancho = b;
+            excepciones = e;
+        }
+    }
+
+    size_t n = indice_varint_escribir(p, filas[0] - anterior);
+    p[n++] = (uint8_t)ancho;
+    p[n++] = (uint8_t)excepciones;
+    const uint64_t mascara = (1ULL << ancho) - 1;
+    uint64_t acumulado = 0;
+    unsigned bits = 0;
+    for (uint32_t i = 1; i < cuantos && ancho; i++) {
+        acumulado |= (diferencias[i] & mascara) << bits;
+        for (bits += ancho; bits >= 8; bits -= 8) {
+            p[n++] = (uint8_t)acumulado;
+            acumulado >>= 8;
+        }
+    }
+    if (bits > 0) p[n++] = (uint8_t)acumulado;
+    for (uint32_t i = 1; i < cuantos && excepciones; i++) {
+        uint64_t alto = (uint64_t)diferencias[i] >> ancho;
+        if (!alto) continue;
+        p[n++] = (uint8_t)i;
+        n += indice_varint_escribir(p + n, alto);
+    }
+    return n;
+}
+
+/*
+ * Lee de *p, sin pasar de fin, un bloque de cuantos filas (de 1 a
+ * INDICE_TAM_BLOQUE) que siguen a la fila anterior, las deja en filas y
+ * avanza *p. Devuelve -1 si el bloque está cortado o no es válido.
+ */
+static inline int indice_bloque_leer(const uint8_t **p, const uint8_t *fin, uint32_t cuantos, uint64_t anterior,
+                                     uint64_t *filas) {
+    uint64_t numero;
+    if (indice_varint_leer(p, fin, &numero) != 0 || fin - *p < 2) return -1;
+    unsigned ancho = (*p)[0], excepciones = (*p)[1];
+    *p += 2;
+    size_t bytes = ((size_t)(cuantos - 1) * ancho + 7) / 8;
+    if (ancho > 32 || excepciones >= cuantos || (size_t)(fin - *p) < bytes) return -1;
+
+    // Primero las diferencias (menos 1) en filas[1..], después las filas.
+    const uint8_t *q = *p;
+    const uint64_t mascara = (1ULL << ancho) - 1;
+    uint64_t acumulado = 0;
+    unsigned bits = 0;
+    for (uint32_t i = 1; i < cuantos; i++) {
+        for (; bits < ancho; bits += 8) acumulado |= (uint64_t)*q++ << bits;
+        filas[i] = acumulado & mascara;
+        acumulado >>= ancho;
+        bits -= ancho;
+    }
+    *p += bytes;
+    for (unsigned e = 0; e < excepciones; e++) {
+        uint64_t alto;
+        unsigned i = *p < fin ? *(*p)++ : 0;
+        if (i == 0 || i >= cuantos || indice_varint_leer(p, fin, &alto) != 0) return -1;
+        filas[i] |= alto << ancho;
+    }
+    numero += anterior;
+    filas[0] = numero;
+    for (uint32_t i = 1; i < cuantos; i++) {
+        numero += filas[i] + 1;
+        filas[i] = numero;
+    }
+    return 0;
+}
+
+// Huella de los últimos bytes (hasta 4 KB) de los primeros bytes_csv del
+// CSV: permite comprobar que el archivo solo creció al final.
+static inline uint64_t indice_huella_csv(const char *csv, uint64_t bytes_csv) {
+    uint64_t n = bytes_csv < 4096 ? bytes_csv : 4096;
+    return hash_clave(csv + bytes_csv - n, n, bytes_csv);
+}
+
+// Desplazamiento del directorio: tras la tabla, alineado a 8 bytes.
+static inline uint64_t indice_desp_directorio(uint32_t tam_tabla) {
+    uint64_t desp = sizeof(IndiceCabecera) + sizeof(uint32_t) * ((uint64_t)tam_tabla + 1);
+    return (desp + 7) & ~(uint64_t)7;
+}
+
+// Comprueba que otro archivo del indexado, con las filas y los bytes del
+// CSV de su cabecera, salió del mismo indexado que el índice.
+static inline int indice_mismo_indexado(const IndiceCabecera *indice, uint64_t num_filas, uint64_t bytes_csv,
+                                        uint64_t huella_csv) {
+    return num_filas == indice->num_filas && bytes_csv == indice->bytes_csv && huella_csv == indice->huella_csv;
+}
+
+// Comprueba que la cabecera corresponde a un índice de la versión actual.
+static inline int indice_cabecera_valida(const IndiceCabecera *cab) {
+    return memcmp(cab->magia, INDICE_MAGIA, sizeof(INDICE_MAGIA)) == 0 &&
+           cab->version == INDICE_VERSION &&
+           cab->tam_tabla != 0 && (cab->tam_tabla & (cab->tam_tabla - 1)) == 0 &&
+           cab->desp_directorio == indice_desp_directorio(cab->tam_tabla) &&
+           cab->desp_listas == cab->desp_directorio + (cab->num_claves + 1) * sizeof(ClaveIndice) &&
+           cab->desp_filtro >= cab->desp_listas && cab->desp_filtro % sizeof(BloqueFiltro) == 0 &&
+           cab->bloques_filtro == indice_filtro_bloques(cab->num_claves);
+}
+
+#endif
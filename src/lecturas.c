@@ -0,0 +1,203 @@
+/*
+ * lecturas.c: Motor de lecturas con io_uring y respaldo con pread.
+ * El anillo se maneja con las llamadas al sistema directamente (sin
+ * liburing): io_uring_setup crea la cola de envío y la de terminación,
+ * que se mapean en memoria; cada lectura es una entrada IORING_OP_READ
+ * con su índice como user_data, y un solo io_uring_enter las envía todas
+ * y espera sus terminaciones. Una lectura que falla o queda corta en el
+ * anillo se repite con pread, de modo que el resultado es siempre el
+ * mismo que con el motor bloqueante.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "lecturas.h"
+
+#define PROFUNDIDAD_ANILLO 64 // Lecturas en vuelo a la vez
+
+typedef struct Anillo {
+    pid_t pid;                 // Proceso que lo creó (0: sin crear)
+    int fd;
+    unsigned entradas;
+    void *sq_map, *cq_map;
+    size_t sq_tam, cq_tam;
+    struct io_uring_sqe *sqes;
+    size_t sqes_tam;
+    unsigned *sq_cabeza, *sq_cola, *sq_mascara, *sq_indices;
+    unsigned *cq_cabeza, *cq_cola, *cq_mascara;
+    struct io_uring_cqe *cqes;
+} Anillo;
+
+static int usar_anillo = 0;
+static Anillo anillo = {0, -1, 0, NULL, NULL, 0, 0, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+static int uring_setup(unsigned entradas, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entradas, params);
+}
+
+static int uring_enter(int fd, unsigned enviar, unsigned esperar, unsigned banderas) {
+    return (int)syscall(__NR_io_uring_enter, fd, enviar, esperar, banderas, NULL, 0);
+}
+
+static void cerrar_anillo(Anillo *a) {
+    if (a->sqes) munmap(a->sqes, a->sqes_tam);
+    if (a->cq_map && a->cq_map != a->sq_map) munmap(a->cq_map, a->cq_tam);
+    if (a->sq_map) munmap(a->sq_map, a->sq_tam);
+    if (a->fd >= 0) close(a->fd);
+    memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+// Crea el anillo y mapea sus colas. Devuelve 0 o -1 (con errno).
+static int abrir_anillo(Anillo *a) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(a, 0, sizeof(*a));
+    a->fd = uring_setup(PROFUNDIDAD_ANILLO, &params);
+    if (a->fd < 0) return -1;
+
+    a->sq_tam = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    a->cq_tam = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Desde 5.4 ambas colas comparten un solo mapeo.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (a->cq_tam > a->sq_tam) a->sq_tam = a->cq_tam;
+        a->cq_tam = a->sq_tam;
+    }
+    a->sq_map = mmap(NULL, a->sq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQ_RING);
+    if (a->sq_map == MAP_FAILED) {
+        a->sq_map = NULL;
+        cerrar_anillo(a);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        a->cq_map = a->sq_map;
+    } else {
+        a->cq_map = mmap(NULL, a->cq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_CQ_RING);
+        if (a->cq_map == MAP_FAILED) {
+            a->cq_map = NULL;
+            cerrar_anillo(a);
+            return -1;
+        }
+    }
+    a->sqes_tam = params.sq_entries * sizeof(struct io_uring_sqe);
+    a->sqes = mmap(NULL, a->sqes_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQES);
+    if (a->sqes == MAP_FAILED) {
+        a->sqes = NULL;
+        cerrar_anillo(a);
+        return -1;
+    }
+
+    char *sq = a->sq_map, *cq = a->cq_map;
+    a->sq_cabeza = (unsigned *)(sq + params.sq_off.head);
+    a->sq_cola = (unsigned *)(sq + params.sq_off.tail);
+    a->sq_mascara = (unsigned *)(sq + params.sq_off.ring_mask);
+    a->sq_indices = (unsigned *)(sq + params.sq_off.array);
+    a->cq_cabeza = (unsigned *)(cq + params.cq_off.head);
+    a->cq_cola = (unsigned *)(cq + params.cq_off.tail);
+    a->cq_mascara = (unsigned *)(cq + params.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    a->entradas = params.sq_entries;
+    a->pid = getpid();
+    return 0;
+}
+
+const char *lecturas_configurar(int usar_uring) {
+    usar_anillo = 0;
+    if (usar_uring) {
+        Anillo prueba;
+        if (abrir_anillo(&prueba) == 0) {
+            // Solo era una prueba: los procesos que atienden crean el suyo.
+            cerrar_anillo(&prueba);
+            usar_anillo = 1;
+        } else {
+            fprintf(stderr, "io_uring no está disponible (%s); se lee con pread\n", strerror(errno));
+        }
+    }
+    return usar_anillo ? "io_uring" : "pread";
+}
+
+void lecturas_liberar(void) {
+    if (anillo.pid == getpid()) cerrar_anillo(&anillo);
+}
+
+static void leer_con_pread(Lectura *l) {
+    ssize_t n;
+    do {
+        n = pread(l->fd, l->buffer, l->len, l->desp);
+    } while (n < 0 && errno == EINTR);
+    l->resultado = n < 0 ? -errno : n;
+}
+
+// Envía hasta entradas lecturas al anillo y recoge sus terminaciones.
+// Devuelve -1 si el anillo dejó de funcionar.
+static int leer_con_anillo(Lectura *lecturas, unsigned n) {
+    unsigned cola = *anillo.sq_cola, mascara = *anillo.sq_mascara;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (cola + i) & mascara;
+        struct io_uring_sqe *sqe = &anillo.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = lecturas[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)lecturas[i].buffer;
+        sqe->len = lecturas[i].len;
+        sqe->off = lecturas[i].desp;
+        sqe->user_data = i;
+        anillo.sq_indices[idx] = idx;
+    }
+    __atomic_store_n(anillo.sq_cola, cola + n, __ATOMIC_RELEASE);
+
+    unsigned enviar = n, recibidas = 0;
+    while (recibidas < n) {
+        int r = uring_enter(anillo.fd, enviar, 1, IORING_ENTER_GETEVENTS);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        enviar -= (unsigned)r < enviar ? (unsigned)r : enviar;
+        unsigned cabeza = *anillo.cq_cabeza;
+        unsigned fin = __atomic_load_n(anillo.cq_cola, __ATOMIC_ACQUIRE);
+        for (; cabeza != fin; cabeza++) {
+            const struct io_uring_cqe *cqe = &anillo.cqes[cabeza & *anillo.cq_mascara];
+            if (cqe->user_data < n) {
+                lecturas[cqe->user_data].resultado = cqe->res;
+                recibidas++;
+            }
+        }
+        __atomic_store_n(anillo.cq_cabeza, cabeza, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void lecturas_ejecutar(Lectura *lecturas, size_t n) {
+    if (usar_anillo && anillo.pid != getpid()) {
+        // Un anillo heredado con fork() es del padre: el hijo abre el suyo.
+        if (anillo.pid != 0) cerrar_anillo(&anillo);
+        if (abrir_anillo(&anillo) != 0) {
+            anillo.fd = -1;
+            usar_anillo = 0;
+        }
+    }
+    for (size_t i = 0; i < n; i++) lecturas[i].resultado = -EIO;
+    if (usar_anillo && n > 1) {
+        for (size_t hechas = 0; hechas < n;) {
+            unsigned grupo = n - hechas < anillo.entradas ? (unsigned)(n - hechas) : anillo.entradas;
+            if (leer_con_anillo(lecturas + hechas, grupo) != 0) {
+                cerrar_anillo(&anillo);
+                usar_anillo = 0;
+                break;
+            }
+            hechas += grupo;
+        }
+    }
+    // Sin anillo, o lo que el anillo no completó (núcleo sin IORING_OP_READ,
+    // lectura corta): se lee con pread.
+    for (size_t i = 0; i < n; i++) {
+        if (lecturas[i].resultado != (int64_t)lecturas[i].len) leer_con_pread(&lecturas[i]);
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * lecturas.h: Motor de lecturas del servidor en modo pread.
+ * Resuelve de una vez un grupo de lecturas independientes (registros y
+ * cadenas de varias filas ya conocidas). Con io_uring todas quedan en
+ * vuelo a la vez, así que el disco las atiende en paralelo y una consulta
+ * espera lo que tarda la más lenta y no la suma de todas; sin io_uring
+ * (núcleos anteriores a 5.6, o prohibido por seccomp) se hacen una tras
+ * otra con pread, como antes.
+ */
+#ifndef LECTURAS_H
+#define LECTURAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Lectura {
+    int fd;
+    void *buffer;
+    uint32_t len;
+    uint64_t desp;
+    int64_t resultado;  // Bytes leídos, o -errno si la lectura falló
+} Lectura;
+
+/*
+ * Elige el motor. Con usar_uring distinto de cero comprueba que io_uring
+ * funciona en este núcleo; cada proceso crea su propio anillo la primera
+ * vez que lee, así que puede llamarse antes de fork(). Devuelve el nombre
+ * del motor que quedó elegido.
+ */
+const char *lecturas_configurar(int usar_uring);
+
+// Hace las n lecturas y deja en cada una su resultado.
+void lecturas_ejecutar(Lectura *lecturas, size_t n);
+
+// Libera el anillo del proceso, si lo tiene.
+void lecturas_liberar(void);
+
+#endif
@@ -0,0 +1,425 @@
+/*
+ * metricas.c: Métricas compartidas y registro asíncrono de consultas.
+ * El segmento es memoria anónima compartida creada antes de fork(), como
+ * la caché de respuestas. Los contadores y los histogramas se reparten en
+ * METRICAS_FRANJAS copias, cada una en sus propias líneas de caché; cada
+ * proceso suma en la de su pid con sumas atómicas, sin cerrojos, y al
+ * exportar se suman todas. Los histogramas tienen cubetas de 1 µs · 2^k,
+ * que son también los límites "le" que se exportan.
+ * El anillo del registro admite muchos escritores y un lector: cada
+ * consulta muestreada toma un número con una suma atómica y escribe su
+ * entrada como un seqlock (secuencia a 0, datos, secuencia definitiva). El
+ * registrador, un proceso aparte, imprime las entradas en orden cada
+ * PAUSA_REGISTRADOR_MS; si los escritores le dan la vuelta, las que se
+ * perdieron se cuentan en lugar de bloquear a nadie.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include "cache_consultas.h"
+#include "consulta.h"
+#include "metricas.h"
+
+#define METRICAS_FRANJAS 16
+#define METRICAS_CUBETAS 26          // 1 µs · 2^k para k = 0..24 y +Inf
+#define ENTRADAS_REGISTRO 4096       // Potencia de 2
+#define MAX_CAMPO_REGISTRO 96        // Bytes de cada campo de la consulta que se registran
+#define PAUSA_REGISTRADOR_MS 20
+#define ESPERAS_MAX 50               // Pausas que se espera a una entrada a medio escribir
+
+typedef struct Histograma {
+    uint64_t cubetas[METRICAS_CUBETAS];
+    uint64_t suma_ns;
+    uint64_t cuenta;
+} Histograma;
+
+typedef struct FranjaMetricas {
+    Histograma etapas[NUM_ETAPAS];
+    uint64_t contadores[NUM_CONTADORES];
+    uint64_t consultas[NUM_TIPOS_CONSULTA];
+    uint64_t resultados;
+    uint64_t truncadas;
+    uint64_t errores;
+    uint64_t abandonadas;
+    uint64_t bytes_enviados;
+    uint64_t muestreadas;  // Cuenta para el muestreo del registro
+} __attribute__((aligned(64))) FranjaMetricas;
+
+typedef struct EntradaRegistro {
+    uint64_t secuencia;      // Número de la entrada más 1 (0: a medio escribir)
+    uint64_t nanosegundos;   // Duración de la consulta
+    uint64_t resultados;
+    int32_t tipo;
+    uint32_t banderas;
+    char origen[48];
+    char album[MAX_CAMPO_REGISTRO];
+    char artista[MAX_CAMPO_REGISTRO];
+    char cancion[MAX_CAMPO_REGISTRO];
+} EntradaRegistro;
+
+// Banderas de una entrada del registro.
+#define REGISTRO_CACHE 1
+#define REGISTRO_TRUNCADA 2
+#define REGISTRO_ERROR 4
+#define REGISTRO_ABANDONADA 8
+
+typedef struct SegmentoMetricas {
+    uint64_t cabeza __attribute__((aligned(64))); // Próximo número de entrada del anillo
+    uint64_t registros_perdidos;                  // Entradas que el registrador no llegó a imprimir
+    FranjaMetricas franjas[METRICAS_FRANJAS];
+    EntradaRegistro entradas[ENTRADAS_REGISTRO];
+} SegmentoMetricas;
+
+static const char *const nombres_etapas[NUM_ETAPAS] = {"total", "cache", "indice", "registros", "formato", "envio"};
+static const char *const nombres_tipos[NUM_TIPOS_CONSULTA] = {"compuesta", "cancion", "album", "artista", "invalida"};
+
+int metricas_usar_tsc = 0;
+static double ns_por_tick = 1.0;
+static SegmentoMetricas *segmento;
+static unsigned muestreo_registro;
+
+// Franja del proceso actual; se vuelve a elegir después de un fork().
+static pid_t pid_franja;
+static FranjaMetricas *franja;
+
+static FranjaMetricas *franja_propia(void) {
+    pid_t pid = getpid();
+    if (pid != pid_franja) {
+        pid_franja = pid;
+        franja = &segmento->franjas[(unsigned)pid % METRICAS_FRANJAS];
+    }
+    return franja;
+}
+
+static void sumar(uint64_t *contador, uint64_t n) {
+    if (n) __atomic_fetch_add(contador, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t leer(const uint64_t *contador) {
+    return __atomic_load_n(contador, __ATOMIC_RELAXED);
+}
+
+// Cubeta de una duración: la primera cuyo límite 1 µs · 2^k la alcanza.
+static unsigned cubeta_de(uint64_t ns) {
+    if (ns <= 1000) return 0;
+    unsigned k = 64 - __builtin_clzll((ns - 1) / 1000);
+    return k < METRICAS_CUBETAS - 1 ? k : METRICAS_CUBETAS - 1;
+}
+
+static void observar(Histograma *h, uint64_t ns) {
+    sumar(&h->cubetas[cubeta_de(ns)], 1);
+    sumar(&h->suma_ns, ns);
+    sumar(&h->cuenta, 1);
+}
+
+static uint64_t a_nanosegundos(uint64_t ticks) {
+    return metricas_usar_tsc ? (uint64_t)(ticks * ns_por_tick) : ticks;
+}
+
+// Usa rdtsc si el contador es invariante (no cambia con la frecuencia ni
+// se detiene en reposo) y calcula cuántos nanosegundos dura cada ciclo.
+static void calibrar_reloj(void) {
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) return;
+    struct timespec t0, t1, pausa = {0, 20 * 1000000};
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = __builtin_ia32_rdtsc();
+    nanosleep(&pausa, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t c1 = __builtin_ia32_rdtsc();
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if (c1 <= c0 || ns <= 0) return;
+    ns_por_tick = ns / (double)(c1 - c0);
+    metricas_usar_tsc = 1;
+#endif
+}
+
+static void copiar_campo(char *destino, size_t cap, const char *texto) {
+    size_t len = texto ? strnlen(texto, cap - 1) : 0;
+    memcpy(destino, texto, len);
+    destino[len] = '\0';
+}
+
+static void escribir_entrada(const ResumenConsulta *r, uint64_t ns) {
+    uint64_t numero = __atomic_fetch_add(&segmento->cabeza, 1, __ATOMIC_RELAXED);
+    EntradaRegistro *e = &segmento->entradas[numero & (ENTRADAS_REGISTRO - 1)];
+    __atomic_store_n(&e->secuencia, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->nanosegundos = ns;
+    e->resultados = r->resultados;
+    e->tipo = r->tipo;
+    e->banderas = (r->de_cache ? REGISTRO_CACHE : 0) | (r->truncada ? REGISTRO_TRUNCADA : 0) |
+                  (r->error ? REGISTRO_ERROR : 0) | (r->abandonada ? REGISTRO_ABANDONADA : 0);
+    copiar_campo(e->origen, sizeof(e->origen), r->origen);
+    copiar_campo(e->album, sizeof(e->album), r->album);
+    copiar_campo(e->artista, sizeof(e->artista), r->artista);
+    copiar_campo(e->cancion, sizeof(e->cancion), r->cancion);
+    __atomic_store_n(&e->secuencia, numero + 1, __ATOMIC_RELEASE);
+}
+
+void metricas_registrar(const Medicion *m, const ResumenConsulta *r) {
+    if (!segmento || !m->inicio) return;
+    FranjaMetricas *f = franja_propia();
+    uint64_t total = a_nanosegundos(m->ticks[ETAPA_TOTAL]);
+    for (int etapa = 0; etapa < NUM_ETAPAS; etapa++) {
+        // Una etapa que la consulta no pasó no cuenta como un tiempo de 0.
+        if (etapa == ETAPA_TOTAL || m->ticks[etapa]) observar(&f->etapas[etapa], a_nanosegundos(m->ticks[etapa]));
+    }
+    for (int i = 0; i < NUM_CONTADORES; i++) sumar(&f->contadores[i], m->contadores[i]);
+    if (r->tipo >= 0 && r->tipo < NUM_TIPOS_CONSULTA) sumar(&f->consultas[r->tipo], 1);
+    sumar(&f->resultados, r->resultados);
+    sumar(&f->truncadas, r->truncada != 0);
+    sumar(&f->errores, r->error != 0);
+    sumar(&f->abandonadas, r->abandonada != 0);
+    // El muestreo se cuenta en la franja y no en el proceso: en el modo
+    // fork() por conexión cada proceso atiende muy pocas consultas.
+    if (muestreo_registro == 1 ||
+        (muestreo_registro && __atomic_add_fetch(&f->muestreadas, 1, __ATOMIC_RELAXED) % muestreo_registro == 0)) {
+        escribir_entrada(r, total);
+    }
+}
+
+void metricas_envio(uint64_t inicio, size_t bytes) {
+    if (!segmento) return;
+    FranjaMetricas *f = franja_propia();
+    observar(&f->etapas[ETAPA_ENVIO], a_nanosegundos(metricas_ahora() - inicio));
+    sumar(&f->bytes_enviados, bytes);
+}
+
+static void imprimir_entrada(const EntradaRegistro *e) {
+    char consulta[3 * MAX_CAMPO_REGISTRO + 64];
+    switch (e->tipo) {
+    case CONSULTA_CANCION:
+        snprintf(consulta, sizeof(consulta), "Canción '%s'", e->cancion);
+        break;
+    case CONSULTA_COMPUESTA:
+        snprintf(consulta, sizeof(consulta), "Album '%s' | Artista '%s'", e->album, e->artista);
+        break;
+    case CONSULTA_ALBUM:
+        snprintf(consulta, sizeof(consulta), "Album '%s'", e->album);
+        break;
+    case CONSULTA_ARTISTA:
+        snprintf(consulta, sizeof(consulta), "Artista '%s'", e->artista);
+        break;
+    default:
+        snprintf(consulta, sizeof(consulta), "Consulta inválida");
+        break;
+    }
+    // De una respuesta de la caché no se sabe cuántos resultados tiene.
+    char resultados[48] = "de la caché";
+    if (!(e->banderas & REGISTRO_CACHE)) {
+        snprintf(resultados, sizeof(resultados), "%llu resultados", (unsigned long long)e->resultados);
+    }
+    printf("IP %s : %s (%s, %.3f ms%s%s%s)\n", e->origen, consulta, resultados, e->nanosegundos / 1e6,
+           (e->banderas & REGISTRO_TRUNCADA) ? ", hay más" : "", (e->banderas & REGISTRO_ERROR) ? ", error" : "",
+           (e->banderas & REGISTRO_ABANDONADA) ? ", abandonada" : "");
+}
+
+// Bucle del proceso registrador: imprime las entradas nuevas del anillo.
+// Termina cuando muere el proceso que lo lanzó.
+static void bucle_registrador(pid_t padre) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    uint64_t siguiente = __atomic_load_n(&segmento->cabeza, __ATOMIC_ACQUIRE);
+    int esperas = 0;
+    while (getppid() == padre) {
+        uint64_t cabeza = __atomic_load_n(&segmento->cabeza, __ATOMIC_ACQUIRE);
+        if (cabeza - siguiente > ENTRADAS_REGISTRO) {
+            // Los escritores dieron la vuelta: lo más viejo ya no está.
+            sumar(&segmento->registros_perdidos, cabeza - ENTRADAS_REGISTRO - siguiente);
+            siguiente = cabeza - ENTRADAS_REGISTRO;
+        }
+        while (siguiente < cabeza) {
+            const EntradaRegistro *e = &segmento->entradas[siguiente & (ENTRADAS_REGISTRO - 1)];
+            uint64_t secuencia = __atomic_load_n(&e->secuencia, __ATOMIC_ACQUIRE);
+            if (secuencia != siguiente + 1) {
+                // A medio escribir: se espera un poco. Si otro escritor ya
+                // la reemplazó o el suyo murió, se da por perdida.
+                if (secuencia <= siguiente && ++esperas < ESPERAS_MAX) break;
+                sumar(&segmento->registros_perdidos, 1);
+                siguiente++;
+                esperas = 0;
+                continue;
+            }
+            EntradaRegistro copia;
+            memcpy(&copia, e, sizeof(copia));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&e->secuencia, __ATOMIC_RELAXED) == secuencia) {
+                copia.origen[sizeof(copia.origen) - 1] = '\0';
+                copia.album[MAX_CAMPO_REGISTRO - 1] = copia.artista[MAX_CAMPO_REGISTRO - 1] = '\0';
+                copia.cancion[MAX_CAMPO_REGISTRO - 1] = '\0';
+                imprimir_entrada(&copia);
+            } else {
+                sumar(&segmento->registros_perdidos, 1);
+            }
+            siguiente++;
+            esperas = 0;
+        }
+        fflush(stdout);
+        struct timespec pausa = {0, PAUSA_REGISTRADOR_MS * 1000000L};
+        nanosleep(&pausa, NULL);
+    }
+    exit(0);
+}
+
+int metricas_iniciar(unsigned muestreo) {
+    calibrar_reloj();
+    void *mapa = mmap(NULL, sizeof(SegmentoMetricas), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapa == MAP_FAILED) {
+        fprintf(stderr, "Métricas: no se pudo crear el segmento compartido: %s\n", strerror(errno));
+        return -1;
+    }
+    segmento = mapa;
+    muestreo_registro = muestreo;
+    if (!muestreo) return 0;
+
+    fflush(stdout); // Que el registrador no herede el buffer sin vaciar
+    pid_t padre = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        muestreo_registro = 0;
+        return 0;
+    }
+    if (pid == 0) bucle_registrador(padre);
+    return 0;
+}
+
+int metricas_es_peticion(const char *texto, size_t len) {
+    return len >= 13 && memcmp(texto, "GET /metrics", 12) == 0 && (texto[12] == ' ' || texto[12] == '?');
+}
+
+// Agrega texto con formato a buffer, sin pasar de cap.
+static void agregar(char *buffer, size_t cap, size_t *len, const char *formato, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void agregar(char *buffer, size_t cap, size_t *len, const char *formato, ...) {
+    if (*len >= cap) return;
+    va_list args;
+    va_start(args, formato);
+    int n = vsnprintf(buffer + *len, cap - *len, formato, args);
+    va_end(args);
+    if (n > 0) *len = *len + n < cap ? *len + n : cap;
+}
+
+// Suma de un campo de todas las franjas, dado su desplazamiento.
+static uint64_t total_franjas(size_t desp) {
+    uint64_t total = 0;
+    for (int i = 0; i < METRICAS_FRANJAS; i++) total += leer((const uint64_t *)((const char *)&segmento->franjas[i] + desp));
+    return total;
+}
+
+#define TOTAL(campo) total_franjas(offsetof(FranjaMetricas, campo))
+
+static void agregar_contador(char *buffer, size_t cap, size_t *len, const char *nombre, const char *ayuda, uint64_t valor) {
+    agregar(buffer, cap, len, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", nombre, ayuda, nombre, nombre,
+            (unsigned long long)valor);
+}
+
+// Escribe las métricas en el formato de texto de Prometheus.
+static size_t exportar(char *buffer, size_t cap) {
+    size_t len = 0;
+    agregar(buffer, cap, &len, "# HELP searcher_consultas_total Consultas atendidas, por tipo.\n"
+                               "# TYPE searcher_consultas_total counter\n");
+    for (int t = 0; t < NUM_TIPOS_CONSULTA; t++) {
+        agregar(buffer, cap, &len, "searcher_consultas_total{tipo=\"%s\"} %llu\n", nombres_tipos[t],
+                (unsigned long long)TOTAL(consultas[t]));
+    }
+
+    agregar(buffer, cap, &len, "# HELP searcher_etapa_segundos Tiempo de cada etapa de una consulta (envio: de cada envío).\n"
+                               "# TYPE searcher_etapa_segundos histogram\n");
+    for (int etapa = 0; etapa < NUM_ETAPAS; etapa++) {
+        uint64_t acumulado = 0;
+        for (int k = 0; k < METRICAS_CUBETAS; k++) {
+            acumulado += TOTAL(etapas[etapa].cubetas[k]);
+            if (k < METRICAS_CUBETAS - 1) {
+                agregar(buffer, cap, &len, "searcher_etapa_segundos_bucket{etapa=\"%s\",le=\"%g\"} %llu\n",
+                        nombres_etapas[etapa], 1e-6 * (double)(1u << k), (unsigned long long)acumulado);
+            } else {
+                agregar(buffer, cap, &len, "searcher_etapa_segundos_bucket{etapa=\"%s\",le=\"+Inf\"} %llu\n",
+                        nombres_etapas[etapa], (unsigned long long)acumulado);
+            }
+        }
+        agregar(buffer, cap, &len, "searcher_etapa_segundos_sum{etapa=\"%s\"} %.9f\n", nombres_etapas[etapa],
+                TOTAL(etapas[etapa].suma_ns) / 1e9);
+        agregar(buffer, cap, &len, "searcher_etapa_segundos_count{etapa=\"%s\"} %llu\n", nombres_etapas[etapa],
+                (unsigned long long)TOTAL(etapas[etapa].cuenta));
+    }
+
+    agregar_contador(buffer, cap, &len, "searcher_filtro_descartes_total",
+                     "Claves que el filtro del índice descartó sin leer el directorio.",
+                     TOTAL(contadores[CONTADOR_FILTRADAS]));
+    agregar_contador(buffer, cap, &len, "searcher_filtro_falsos_positivos_total",
+                     "Claves que pasaron el filtro del índice y no estaban en él.",
+                     TOTAL(contadores[CONTADOR_FALSOS_POSITIVOS]));
+    agregar_contador(buffer, cap, &len, "searcher_nodos_cadena_total",
+                     "Entradas de las cadenas de cubetas comparadas al buscar claves.", TOTAL(contadores[CONTADOR_NODOS]));
+    agregar_contador(buffer, cap, &len, "searcher_colisiones_total",
+                     "Huellas que coincidieron con una clave de otro texto.", TOTAL(contadores[CONTADOR_COLISIONES]));
+    agregar_contador(buffer, cap, &len, "searcher_candidatos_descartados_total",
+                     "Candidatos de los trigramas cuyo nombre no contiene el texto buscado.",
+                     TOTAL(contadores[CONTADOR_DESCARTADOS]));
+    agregar(buffer, cap, &len, "# HELP searcher_bytes_leidos_total Bytes leídos (o recorridos en modo mmap) por archivo.\n"
+                               "# TYPE searcher_bytes_leidos_total counter\n"
+                               "searcher_bytes_leidos_total{archivo=\"indice\"} %llu\n"
+                               "searcher_bytes_leidos_total{archivo=\"registros\"} %llu\n",
+            (unsigned long long)TOTAL(contadores[CONTADOR_BYTES_INDICE]),
+            (unsigned long long)TOTAL(contadores[CONTADOR_BYTES_REGISTROS]));
+    agregar_contador(buffer, cap, &len, "searcher_bytes_arena_total",
+                     "Memoria de trabajo que las consultas pidieron a su arena.", TOTAL(contadores[CONTADOR_BYTES_ARENA]));
+    agregar_contador(buffer, cap, &len, "searcher_sin_memoria_total",
+                     "Peticiones de memoria de trabajo rechazadas por el presupuesto (-M).",
+                     TOTAL(contadores[CONTADOR_SIN_MEMORIA]));
+    agregar_contador(buffer, cap, &len, "searcher_resultados_total", "Resultados escritos en las respuestas.", TOTAL(resultados));
+    agregar_contador(buffer, cap, &len, "searcher_truncadas_total",
+                     "Respuestas con más resultados que los de su página o límite.", TOTAL(truncadas));
+    agregar_contador(buffer, cap, &len, "searcher_errores_total", "Respuestas de error.", TOTAL(errores));
+    agregar_contador(buffer, cap, &len, "searcher_abandonadas_total",
+                     "Consultas que el cliente abandonó antes de terminar la respuesta.", TOTAL(abandonadas));
+    agregar_contador(buffer, cap, &len, "searcher_bytes_enviados_total", "Bytes enviados a los clientes.", TOTAL(bytes_enviados));
+    agregar_contador(buffer, cap, &len, "searcher_registro_perdidas_total",
+                     "Consultas muestreadas que el registrador no llegó a imprimir.", leer(&segmento->registros_perdidos));
+
+    CacheEstadisticas cache;
+    cache_estadisticas(&cache);
+    agregar_contador(buffer, cap, &len, "searcher_cache_aciertos_total", "Aciertos de la caché de respuestas.", cache.aciertos);
+    agregar_contador(buffer, cap, &len, "searcher_cache_fallos_total", "Fallos de la caché de respuestas.", cache.fallos);
+    agregar(buffer, cap, &len, "# HELP searcher_cache_bytes Bytes ocupados por las respuestas guardadas.\n"
+                               "# TYPE searcher_cache_bytes gauge\nsearcher_cache_bytes %llu\n"
+                               "# HELP searcher_cache_entradas Respuestas guardadas en la caché.\n"
+                               "# TYPE searcher_cache_entradas gauge\nsearcher_cache_entradas %llu\n",
+            (unsigned long long)cache.bytes, (unsigned long long)cache.entradas);
+    return len;
+}
+
+size_t metricas_respuesta_http(char *buffer, size_t cap) {
+    char cabecera[160];
+    if (!segmento) {
+        const char *texto = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        copiar_campo(buffer, cap, texto);
+        return strlen(buffer);
+    }
+    // El cuerpo se escribe primero, detrás del sitio de la cabecera, para
+    // conocer su longitud.
+    if (cap <= sizeof(cabecera)) return 0;
+    size_t len = exportar(buffer + sizeof(cabecera), cap - sizeof(cabecera));
+    int n = snprintf(cabecera, sizeof(cabecera),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", len);
+    memcpy(buffer, cabecera, n);
+    memmove(buffer + n, buffer + sizeof(cabecera), len);
+    return n + len;
+}
@@ -0,0 +1,107 @@
+/*
+ * metricas.h: Métricas de las consultas del servidor y registro de
+ * consultas.
+ * Cada consulta mide el tiempo de sus etapas y cuenta lo que hizo (nodos
+ * de cadena visitados, colisiones, bytes leídos, resultados) en una
+ * Medicion propia, sin tocar memoria compartida; al terminar la vuelca de
+ * una vez en los histogramas y contadores de un segmento compartido por
+ * todos los procesos, que se suman sin cerrojos. Una de cada N consultas
+ * deja además una entrada en un anillo del mismo segmento que un proceso
+ * registrador imprime aparte, así que ninguna consulta espera a stdout.
+ */
+#ifndef METRICAS_H
+#define METRICAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Etapas de una consulta con su histograma de tiempos. ETAPA_ENVIO no es
+// de una consulta: mide cada envío al cliente.
+enum {
+    ETAPA_TOTAL,     // De iniciar_consulta a la respuesta completa
+    ETAPA_CACHE,     // Buscar y guardar en la caché de respuestas
+    ETAPA_INDICE,    // Buscar la clave y leer su lista de filas
+    ETAPA_REGISTROS, // Leer registros y cadenas de spotify.records
+    ETAPA_FORMATO,   // Dar formato de texto a los resultados
+    ETAPA_ENVIO,
+    NUM_ETAPAS
+};
+
+// Contadores de una consulta.
+enum {
+    CONTADOR_FILTRADAS,        // Claves que el filtro del índice descartó sin leer el directorio
+    CONTADOR_FALSOS_POSITIVOS, // Claves que pasaron el filtro y no estaban en el índice
+    CONTADOR_NODOS,            // Entradas de cadenas de cubetas comparadas
+    CONTADOR_COLISIONES,       // Huellas iguales con texto distinto
+    CONTADOR_DESCARTADOS,      // Candidatos de los trigramas que no contienen el texto
+    CONTADOR_BYTES_INDICE,     // Bytes leídos del índice y de los índices opcionales
+    CONTADOR_BYTES_REGISTROS,  // Bytes leídos de spotify.records
+    CONTADOR_BYTES_ARENA,      // Memoria de trabajo pedida a la arena (ver arena.h)
+    CONTADOR_SIN_MEMORIA,      // Peticiones a la arena que superaron su límite
+    NUM_CONTADORES
+};
+
+typedef struct Medicion {
+    uint64_t inicio;                      // metricas_ahora() al empezar (0: sin medir)
+    uint64_t ticks[NUM_ETAPAS];
+    uint64_t contadores[NUM_CONTADORES];
+} Medicion;
+
+// Resumen de una consulta terminada para metricas_registrar.
+typedef struct ResumenConsulta {
+    int tipo;             // CONSULTA_* (ver consulta.h)
+    const char *origen;
+    const char *album, *artista, *cancion;
+    uint64_t resultados;
+    int de_cache;
+    int truncada;         // Quedaron resultados fuera por la página o el límite
+    int error;
+    int abandonada;       // El cliente se fue antes de terminar la respuesta
+} ResumenConsulta;
+
+extern int metricas_usar_tsc;
+
+/*
+ * Marca de tiempo para medir intervalos: el contador de ciclos (rdtsc) si
+ * la CPU lo tiene invariante, o CLOCK_MONOTONIC en nanosegundos. Solo las
+ * diferencias tienen sentido; metricas_registrar las pasa a nanosegundos.
+ */
+static inline uint64_t metricas_ahora(void) {
+#if defined(__x86_64__)
+    if (metricas_usar_tsc) return __builtin_ia32_rdtsc();
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Suma a la etapa el tiempo transcurrido desde inicio.
+static inline void metricas_medir(Medicion *m, int etapa, uint64_t inicio) {
+    m->ticks[etapa] += metricas_ahora() - inicio;
+}
+
+/*
+ * Crea el segmento compartido y, si muestreo no es 0, lanza el proceso
+ * registrador, que imprime una de cada muestreo consultas. Debe llamarse
+ * antes de cargar los datos y de cualquier otro fork(). Devuelve 0 o -1
+ * (tras informar por stderr); sin segmento no se mide ni se registra nada.
+ */
+int metricas_iniciar(unsigned muestreo);
+
+// Vuelca la medición de una consulta terminada y, si le toca, la registra.
+void metricas_registrar(const Medicion *m, const ResumenConsulta *resumen);
+
+// Cuenta un envío de bytes al cliente que empezó en inicio.
+void metricas_envio(uint64_t inicio, size_t bytes);
+
+// Indica si el texto recibido por el protocolo de texto es "GET /metrics".
+int metricas_es_peticion(const char *texto, size_t len);
+
+/*
+ * Escribe en buffer una respuesta HTTP con todas las métricas en el
+ * formato de texto de Prometheus y devuelve su longitud (como mucho cap).
+ */
+size_t metricas_respuesta_http(char *buffer, size_t cap);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * presupuesto.c: Reparto del presupuesto de memoria del servidor (ver
+ * presupuesto.h).
+ * La memoria de los datos cargados se mide; la de cada proceso y cada
+ * conexión se estima con el peor caso de sus buffers: un proceso hijo o
+ * trabajador ensucia sus propias páginas (pila, variables globales) además
+ * de su salida y su arena, y una conexión con epoll retiene el estado de
+ * sus consultas en curso, su entrada y su salida pendiente, que pueden
+ * crecer hasta una trama de lote y dos veces lo pendiente más una
+ * respuesta.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "consulta.h"
+#include "presupuesto.h"
+#include "protocolo.h"
+#include "trabajadores.h"
+
+#define MIN_SALIDA (32 * 1024)       // Cabe la respuesta de /metrics
+#define MIN_ARENA (64 * 1024)
+#define MAX_ARENA (4 * 1024 * 1024)
+#define COSTE_PROCESO (128 * 1024)   // Pila y páginas copiadas de un proceso, además de sus buffers
+#define PENDIENTE_POR_DEFECTO (1 << 20)
+
+Presupuesto presupuesto = {0, {0, 0, 0, 0, 0}, 0, MAX_RESULTS_BUFFER, PENDIENTE_POR_DEFECTO, 0, 0};
+
+int memoria_medir(MemoriaProceso *m) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return -1;
+    memset(m, 0, sizeof(*m));
+    char linea[256], campo[64];
+    size_t kb;
+    while (fgets(linea, sizeof(linea), f)) {
+        if (sscanf(linea, "%63[^:]: %zu kB", campo, &kb) != 2) continue;
+        size_t bytes = kb * 1024;
+        if (strcmp(campo, "Rss") == 0) m->rss = bytes;
+        else if (strcmp(campo, "Pss") == 0) m->pss = bytes;
+        else if (strcmp(campo, "Private_Clean") == 0 || strcmp(campo, "Private_Dirty") == 0) m->privada += bytes;
+        else if (strcmp(campo, "Shared_Clean") == 0 || strcmp(campo, "Shared_Dirty") == 0) m->compartida += bytes;
+        else if (strcmp(campo, "Anonymous") == 0) m->anonima = bytes;
+    }
+    fclose(f);
+    return m->rss ? 0 : -1;
+}
+
+static size_t acotar(size_t valor, size_t minimo, size_t maximo) {
+    return valor < minimo ? minimo : valor > maximo ? maximo : valor;
+}
+
+// Peor caso de una conexión con epoll (ver trabajadores.c).
+static size_t coste_conexion(void) {
+    return TRABAJADOR_MAX_EN_CURSO * sizeof(Consulta) + 2 * (PROTO_CABECERA_TAM + PROTO_MAX_LOTE) +
+           2 * (presupuesto.pendiente + PROTO_CABECERA_TAM + presupuesto.salida);
+}
+
+int presupuesto_calcular(size_t limite, size_t cache_pedida, int num_trabajadores) {
+    presupuesto.limite = limite;
+    presupuesto.cache = cache_pedida;
+    if (memoria_medir(&presupuesto.inicial) != 0 && limite) {
+        fprintf(stderr, "FATAL: No se pudo medir la memoria del proceso en /proc/self/smaps_rollup.\n");
+        return -1;
+    }
+    if (!limite) return 0;
+
+    size_t base = presupuesto.inicial.anonima;
+    if (base >= limite) {
+        fprintf(stderr, "FATAL: El presupuesto de memoria (%zu KB) no alcanza: los datos cargados ya ocupan %zu KB.\n",
+                limite >> 10, base >> 10);
+        return -1;
+    }
+    // La caché se queda como mucho con un cuarto de lo disponible; del
+    // resto salen los buffers de cada proceso y las conexiones.
+    size_t disponible = limite - base;
+    if (presupuesto.cache > disponible / 4) presupuesto.cache = disponible / 4;
+    size_t resto = disponible - presupuesto.cache;
+    presupuesto.salida = acotar(resto / 32, MIN_SALIDA, MAX_RESULTS_BUFFER);
+    presupuesto.pendiente = presupuesto.salida;
+    presupuesto.arena = acotar(resto / 16, MIN_ARENA, MAX_ARENA);
+
+    size_t por_proceso = COSTE_PROCESO + presupuesto.salida + presupuesto.arena;
+    size_t conexiones;
+    if (num_trabajadores == 0) {
+        conexiones = resto / por_proceso; // Un proceso hijo por conexión
+    } else {
+        size_t fijo = (size_t)num_trabajadores * por_proceso;
+        conexiones = resto > fijo ? (resto - fijo) / coste_conexion() : 0;
+    }
+    if (conexiones < (size_t)(num_trabajadores > 0 ? num_trabajadores : 1)) {
+        fprintf(stderr, "FATAL: El presupuesto de memoria (%zu KB) no alcanza para atender conexiones: "
+                        "los datos ocupan %zu KB y cada %s necesita unos %zu KB.\n",
+                limite >> 10, base >> 10, num_trabajadores ? "trabajador con una conexión" : "conexión",
+                (num_trabajadores ? por_proceso + coste_conexion() : por_proceso) >> 10);
+        return -1;
+    }
+    presupuesto.max_conexiones = conexiones > UINT_MAX ? UINT_MAX : (unsigned)conexiones;
+    return 0;
+}
+
+void presupuesto_informar(void) {
+    const MemoriaProceso *m = &presupuesto.inicial;
+    if (m->rss) {
+        printf("Memoria al arrancar: RSS %zu KB = %zu KB anónimos + %zu KB de archivos mapeados y memoria compartida "
+               "(%zu KB privados y %zu KB compartidos con otros procesos; PSS %zu KB)\n",
+               m->rss >> 10, m->anonima >> 10, (m->rss - m->anonima) >> 10, m->privada >> 10, m->compartida >> 10,
+               m->pss >> 10);
+    }
+    if (presupuesto.limite) {
+        printf("Presupuesto de memoria de %zu KB: %zu KB de datos, %zu KB de caché, %zu KB de salida y %zu KB de arena "
+               "por proceso, hasta %u conexiones a la vez\n",
+               presupuesto.limite >> 10, m->anonima >> 10, presupuesto.cache >> 10, presupuesto.salida >> 10,
+               presupuesto.arena >> 10, presupuesto.max_conexiones);
+    } else {
+        printf("Sin presupuesto de memoria (-M): %zu KB de caché, %zu KB de salida por proceso y conexiones sin límite\n",
+               presupuesto.cache >> 10, presupuesto.salida >> 10);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * presupuesto.h: Presupuesto de memoria del servidor.
+ * Con -M el servidor reparte un límite de bytes entre la memoria anónima
+ * (montículo y pila) que ya ocupa al cargar los datos, medida en
+ * /proc/self/smaps_rollup, la caché de respuestas, los buffers de cada
+ * proceso (la salida de las respuestas y la arena de las consultas) y las
+ * conexiones que atiende a la vez, y ajusta cada parte para no pasarse.
+ * Los archivos mapeados (el delta, o el índice y los registros con -m) no
+ * se cuentan: son caché de páginas del sistema, compartida con otras
+ * instancias y recuperable. Sin -M se usan los tamaños de siempre y solo
+ * se informa de la memoria al arrancar.
+ */
+#ifndef PRESUPUESTO_H
+#define PRESUPUESTO_H
+
+#include <stddef.h>
+
+// Memoria del proceso según /proc/self/smaps_rollup, en bytes.
+typedef struct MemoriaProceso {
+    size_t rss;
+    size_t pss;        // RSS con las páginas compartidas repartidas entre quienes las usan
+    size_t privada;    // Páginas que solo usa este proceso
+    size_t compartida; // Páginas que usa también otro proceso (bibliotecas, mapeos, hijos)
+    size_t anonima;    // Memoria que no viene de un archivo (montículo, pila): la que cuenta el presupuesto
+} MemoriaProceso;
+
+typedef struct Presupuesto {
+    size_t limite;            // Bytes pedidos con -M (0: sin límite)
+    MemoriaProceso inicial;   // Medida tras cargar los datos
+    size_t cache;             // Caché de respuestas compartida
+    size_t salida;            // Buffer de respuesta de cada proceso
+    size_t pendiente;         // Salida sin enviar que acumula una conexión con epoll
+    size_t arena;             // Límite de la arena de cada proceso (0: sin límite)
+    unsigned max_conexiones;  // Conexiones atendidas a la vez (0: sin límite)
+} Presupuesto;
+
+// Los tamaños vigentes. Hasta presupuesto_calcular, los de siempre.
+extern Presupuesto presupuesto;
+
+// Lee la memoria del proceso. Devuelve 0 o -1 si no se pudo leer.
+int memoria_medir(MemoriaProceso *m);
+
+/*
+ * Mide la memoria tras cargar los datos y reparte limite (0: sin límite)
+ * entre la caché, de la que se pidieron cache_pedida bytes, los buffers y
+ * las conexiones, con num_trabajadores procesos con epoll o uno por
+ * conexión si es 0. Devuelve 0 o -1 (tras informar por stderr) si el
+ * límite no alcanza ni para una conexión.
+ */
+int presupuesto_calcular(size_t limite, size_t cache_pedida, int num_trabajadores);
+
+// Imprime la memoria medida al arrancar y el reparto del presupuesto.
+void presupuesto_informar(void);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * protocolo.h: Protocolo binario con tramas entre cliente y servidor.
+ *
+ * Cada mensaje va precedido de una cabecera fija de 12 bytes (en orden de
+ * red) con la longitud de la carga útil y un identificador de petición
+ * elegido por el cliente. Así una misma conexión puede transportar muchas
+ * consultas encadenadas sin esperar cada respuesta, y el cliente empareja
+ * las respuestas por su identificador.
+ * Una respuesta larga llega en varias tramas con el mismo identificador, a
+ * medida que el servidor la produce: todas salvo la última llevan la
+ * bandera PROTO_CONTINUA.
+ * Una trama PROTO_LOTE lleva varias consultas separadas por '\n'; la
+ * consulta i (contando desde 0) se responde con el identificador id + i,
+ * como si hubiera llegado sola.
+ * Con trabajadores (-w) el servidor avanza varias consultas de una
+ * conexión por turnos (ver trabajadores.c): las respuestas pueden llegar
+ * en otro orden y las tramas de respuestas distintas, intercaladas. En el
+ * modo de un proceso por conexión se responden en el orden de llegada.
+ *
+ *   byte 0     PROTO_MAGIA
+ *   byte 1     tipo de trama (PROTO_CONSULTA, PROTO_RESPUESTA, ...)
+ *   bytes 2-3  banderas (PROTO_CONTINUA)
+ *   bytes 4-7  identificador de la petición
+ *   bytes 8-11 longitud de la carga útil
+ *
+ * El primer byte nunca aparece al inicio de una consulta de texto UTF-8,
+ * por lo que el servidor distingue ambos protocolos en el mismo puerto:
+ * si la conexión no empieza con PROTO_MAGIA se atiende con el protocolo de
+ * texto original (una consulta "album|artista|cancion" por conexión).
+ */
+#ifndef PROTOCOLO_H
+#define PROTOCOLO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PROTO_MAGIA 0xF5
+#define PROTO_CABECERA_TAM 12
+#define PROTO_MAX_CONSULTA 1024 // Carga útil máxima de una trama de consulta
+#define PROTO_MAX_LOTE 32768    // Carga útil máxima de una trama de lote
+#define PROTO_MAX_LOTE_CONSULTAS 256
+
+// Tipos de trama
+#define PROTO_CONSULTA  1 // Cliente -> servidor: "album|artista|cancion"
+#define PROTO_RESPUESTA 2 // Servidor -> cliente: texto de resultados
+#define PROTO_ERROR     3 // Servidor -> cliente: trama no reconocida
+#define PROTO_LOTE      4 // Cliente -> servidor: consultas separadas por '\n'
+
+// Banderas
+#define PROTO_CONTINUA 0x0001 // La respuesta sigue en otra trama
+
+typedef struct TramaCabecera {
+    uint8_t tipo;
+    uint16_t banderas;
+    uint32_t id;
+    uint32_t longitud;
+} TramaCabecera;
+
+static inline void proto_poner32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline uint32_t proto_leer32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Escribe la cabecera de una trama en dst (PROTO_CABECERA_TAM bytes).
+static inline void proto_escribir_cabecera(void *dst, uint8_t tipo, uint16_t banderas,
+                                           uint32_t id, uint32_t longitud) {
+    uint8_t *p = dst;
+    p[0] = PROTO_MAGIA;
+    p[1] = tipo;
+    p[2] = banderas >> 8;
+    p[3] = banderas;
+    proto_poner32(p + 4, id);
+    proto_poner32(p + 8, longitud);
+}
+
+// Decodifica una cabecera. Devuelve -1 si no empieza con PROTO_MAGIA.
+static inline int proto_leer_cabecera(const void *src, TramaCabecera *cab) {
+    const uint8_t *p = src;
+    if (p[0] != PROTO_MAGIA) return -1;
+    cab->tipo = p[1];
+    cab->banderas = (uint16_t)((p[2] << 8) | p[3]);
+    cab->id = proto_leer32(p + 4);
+    cab->longitud = proto_leer32(p + 8);
+    return 0;
+}
+
+// Carga útil máxima que se acepta para una trama del tipo dado.
+static inline uint32_t proto_max_carga(uint8_t tipo) {
+    return tipo == PROTO_LOTE ? PROTO_MAX_LOTE : PROTO_MAX_CONSULTA;
+}
+
+/*
+ * Separa en su lugar las consultas de un lote (carga de len bytes con un
+ * byte libre al final): cambia cada '\n' por '\0' y deja en consultas el
+ * inicio de cada una. Un '\n' final no abre otra consulta. Devuelve cuántas
+ * hay, o -1 si son más de max.
+ */
+static inline int proto_dividir_lote(char *carga, size_t len, char **consultas, int max) {
+    int n = 0;
+    carga[len] = '\0';
+    if (len > 0 && carga[len - 1] == '\n') carga[--len] = '\0';
+    char *p = carga;
+    while (1) {
+        if (n == max) return -1;
+        consultas[n++] = p;
+        char *fin = memchr(p, '\n', len - (p - carga));
+        if (!fin) return n;
+        *fin = '\0';
+        p = fin + 1;
+    }
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * registros.h: Formato del archivo binario spotify.records.
+ * Guarda, para cada fila indexada del CSV, solo las columnas que muestra
+ * el servidor: los números en columnas de ancho fijo y los textos (álbum,
+ * artista y canción) como desplazamientos en un almacén de cadenas sin
+ * repetidas. Las listas de spotify.index apuntan a números de registro, de
+ * modo que el servidor responde sin volver a leer el CSV.
+ *
+ * Disposición del archivo:
+ *   [RegistrosCabecera][Registro registros[num_registros]][cadenas]
+ * Cada cadena del almacén es [longitud en varint][bytes][\0]. Un
+ * desplazamiento de cadena se cuenta desde desp_cadenas.
+ */
+#ifndef REGISTROS_H
+#define REGISTROS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "indice.h"
+
+#define REGISTROS_MAGIA "SPOTREG"
+#define REGISTROS_VERSION 2
+#define REGISTRO_MAX_CADENA 2048 // Bytes de una cadena, con el '\0' (se trunca)
+
+// Banderas de Registro
+#define REG_SIN_DURACION       0x1 // La línea no tiene la columna de duración
+#define REG_SIN_CANCION        0x2 // La línea no tiene la columna de canción
+#define REG_SIN_POPULARIDAD    0x4 // La línea no tiene la columna de popularidad
+#define REG_POPULARIDAD_TEXTO  0x8 // popularidad es el desplazamiento de su texto
+
+typedef struct RegistrosCabecera {
+    char magia[8];           // "SPOTREG\0"
+    uint32_t version;        // REGISTROS_VERSION
+    uint32_t tam_registro;   // sizeof(Registro)
+    uint64_t num_registros;
+    uint64_t desp_registros; // Desplazamiento del primer registro
+    uint64_t desp_cadenas;   // Desplazamiento del almacén de cadenas
+    uint64_t bytes_cadenas;
+    uint64_t bytes_csv;      // Los de spotify.index del mismo indexado
+    uint64_t huella_csv;
+} RegistrosCabecera;
+
+typedef struct Registro {
+    uint32_t album;       // Desplazamiento de la cadena en el almacén
+    uint32_t artista;     // Primer artista del campo JSON de artistas
+    uint32_t cancion;
+    int32_t duracion_ms;
+    uint32_t popularidad; // Valor, o desplazamiento si REG_POPULARIDAD_TEXTO
+    uint32_t banderas;    // REG_*
+} Registro;
+
+/*
+ * Decodifica la cadena que empieza en p, con disponible bytes legibles.
+ * Devuelve 0 y deja en *texto y *len el texto (terminado en '\0') si está
+ * completo; si no, devuelve -1 y, si se pudo leer la longitud, la deja en *len.
+ */
+static inline int registro_cadena_leer(const uint8_t *p, size_t disponible, const char **texto, size_t *len) {
+    const uint8_t *q = p;
+    uint64_t n;
+    *len = 0;
+    if (indice_varint_leer(&q, p + disponible, &n) != 0) return -1;
+    *len = n;
+    size_t cabecera = q - p;
+    if (n >= REGISTRO_MAX_CADENA || disponible - cabecera < n + 1) return -1;
+    *texto = (const char *)q;
+    return 0;
+}
+
+// Comprueba que la cabecera corresponde a un almacén de la versión actual.
+static inline int registros_cabecera_valida(const RegistrosCabecera *cab) {
+    return memcmp(cab->magia, REGISTROS_MAGIA, sizeof(REGISTROS_MAGIA)) == 0 &&
+           cab->version == REGISTROS_VERSION &&
+           cab->tam_registro == sizeof(Registro) &&
+           cab->desp_registros == sizeof(RegistrosCabecera) &&
+           cab->desp_cadenas == cab->desp_registros + cab->num_registros * sizeof(Registro);
+}
+
+#endif
@@ -2,7 +2,27 @@
 * searcher_server.c: Proceso SERVIDOR de búsqueda de Spotify.
 * Escucha en un puerto TCP, acepta conexiones de clientes, recibe consultas,
 * busca en el índice local y devuelve los resultados a través del socket.
-* Utiliza fork() para manejar múltiples clientes de forma concurrente.
+* Por defecto utiliza fork() para manejar cada cliente de forma concurrente;
+* con -w N pre-lanza N procesos trabajadores que multiplexan las conexiones
+* con epoll (ver trabajadores.c).
+* Con la opción -m el índice y los registros se sirven mapeados en memoria
+* (mmap de solo lectura) en lugar de leerse con pread. En modo pread los
+* registros y cadenas de cada tanda de filas se leen a la vez con io_uring
+* si el núcleo lo permite (ver lecturas.c); -s fuerza el pread bloqueante.
+* Las respuestas se guardan en una caché compartida por todos los procesos
+* (ver cache_consultas.c); SIGUSR1 imprime sus contadores.
+* Cada consulta mide sus etapas y contadores en un segmento compartido (ver
+* metricas.c) que se exporta en formato Prometheus pidiendo
+* "GET /metrics" al mismo puerto; un proceso registrador imprime una de
+* cada N consultas (-l N) sin que ninguna espere a stdout.
+* SIGHUP recarga el índice y los registros sin cortar conexiones: las
+* consultas nuevas usan los datos nuevos y las que estaban a medias
+* terminan con los anteriores.
+* Las respuestas se envían por partes a medida que se producen, desde un
+* buffer que se reutiliza, así que no tienen tamaño máximo.
+* Con -M MB la memoria de la instancia se ajusta a ese presupuesto: el
+* tamaño de la caché y de los buffers y las conexiones que se atienden a la
+* vez se calculan al arrancar (ver presupuesto.c).
 */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -10,88 +30,127 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <sys/wait.h>
-#include <errno.h> 
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h> // Para inet_ntop
+#include "cache_consultas.h"
+#include "consulta.h"
+#include "lecturas.h"
+#include "metricas.h"
+#include "presupuesto.h"
+#include "protocolo.h"
+#include "trabajadores.h"
 
 #define PORT 8080 // Puerto en el que escucha el servidor
-#define HASH_TABLE_SIZE 500000
-#define MAX_LINE_LENGTH 8192
-#define MAX_KEY_LENGTH 512
-#define MAX_RESULTS_BUFFER 65536
-
-typedef struct Nodo {
-    long csv_puntero;
-    long siguiente_nodo_puntero;
-} Nodo;
-
-// Globales para los archivos y la tabla hash
-long *hash_table;
-FILE *csv_file;
+#define MAX_TRABAJADORES 256
+#define CACHE_MB_POR_DEFECTO 8 // Tamaño de la caché de respuestas
 
 // --- Declaraciones de Funciones ---
-char *buscar_campo(const char *line, int campoABuscar);
-unsigned long hash_function(const char *str);
-char *extraer_artista(const char *json_string);
-void formato_resultado(char *dest, size_t dest_size, const char *csv_line);
+int crear_socket_escucha(int puerto, int backlog);
 void handle_client(int client_socket);
+void atender_tramas(int client_socket, const char *client_ip, const char *inicio, size_t inicio_len);
 void sigchld_handler(int s);
+static void esperar_hueco(void);
+
+// Procesos hijos que atienden una conexión (modo fork() por conexión).
+static volatile sig_atomic_t hijos_vivos;
 
 int main(int argc, char *argv[]) {
-    // --- Carga de datos (índice y CSV) ---
-    FILE *index_file = fopen("spotify.index", "rb");
-    if (!index_file) {
-        perror("FATAL: No se pudo abrir 'spotify.index'. Ejecute el indexador primero.");
-        return 1;
+    int usar_mmap = 0;
+    int usar_uring = 1;
+    int num_trabajadores = 0;
+    long cache_mb = CACHE_MB_POR_DEFECTO;
+    long muestreo = 1;
+    long memoria_mb = 0;
+    int opcion;
+    while ((opcion = getopt(argc, argv, "msw:c:l:M:")) != -1) {
+        switch (opcion) {
+        case 'm':
+            usar_mmap = 1;
+            break;
+        case 's':
+            usar_uring = 0;
+            break;
+        case 'w':
+            num_trabajadores = atoi(optarg);
+            if (num_trabajadores >= 1 && num_trabajadores <= MAX_TRABAJADORES) break;
+            fprintf(stderr, "El número de trabajadores debe estar entre 1 y %d\n", MAX_TRABAJADORES);
+            return 1;
+        case 'c':
+            cache_mb = atol(optarg);
+            if (cache_mb >= 0) break;
+            fprintf(stderr, "El tamaño de la caché no puede ser negativo\n");
+            return 1;
+        case 'l':
+            muestreo = atol(optarg);
+            if (muestreo >= 0 && muestreo <= UINT32_MAX) break;
+            fprintf(stderr, "El muestreo del registro debe ser 0 o un número positivo\n");
+            return 1;
+        case 'M':
+            memoria_mb = atol(optarg);
+            if (memoria_mb >= 0) break;
+            fprintf(stderr, "El presupuesto de memoria no puede ser negativo\n");
+            return 1;
+        default:
+            fprintf(stderr, "Uso: %s [-m] [-s] [-w N] [-c MB] [-l N] [-M MB]\n"
+                            "  -m     Sirve spotify.index y spotify.records mapeados en memoria\n"
+                            "  -s     Lee con pread una lectura tras otra en lugar de io_uring\n"
+                            "  -w N   Usa N procesos trabajadores con epoll en lugar de fork() por conexión\n"
+                            "  -c MB  Tamaño máximo de la caché de respuestas compartida (0 la desactiva, por defecto %d)\n"
+                            "  -l N   Imprime una de cada N consultas (0 no imprime ninguna, por defecto 1)\n"
+                            "  -M MB  Ajusta la caché, los buffers y las conexiones a ese presupuesto de memoria (0: sin límite)\n",
+                    argv[0], CACHE_MB_POR_DEFECTO);
+            return 1;
+        }
     }
-    hash_table = (long *)malloc(sizeof(long) * HASH_TABLE_SIZE);
-    if (!hash_table) {
-        perror("FATAL: No se pudo alocar memoria para la tabla hash");
-        fclose(index_file);
+
+    // --- Métricas y registrador: antes de fork() y de cargar los datos ---
+    metricas_iniciar((unsigned)muestreo);
+
+    // --- Carga de datos (índice y registros) ---
+    if (cargar_datos(usar_mmap) != 0) {
         return 1;
     }
-    fread(hash_table, sizeof(long), HASH_TABLE_SIZE, index_file);
-    fclose(index_file);
+    if (!usar_mmap) printf("Lecturas de registros con %s\n", lecturas_configurar(usar_uring));
+    instalar_senal_recarga();
 
-    csv_file = fopen("spotify_data.csv", "r");
-    if (!csv_file) {
-        free(hash_table);
-        perror("FATAL: No se pudo abrir 'spotify_data.csv'");
+    // --- Presupuesto de memoria y caché de respuestas: con los datos ya
+    // cargados, para medir lo que ocupan, y antes de cualquier fork() ---
+    if (presupuesto_calcular((size_t)memoria_mb << 20, (size_t)cache_mb << 20, num_trabajadores) != 0) {
+        return 1;
+    }
+    if (presupuesto.cache > 0) cache_iniciar(presupuesto.cache);
+    cache_instalar_senal();
+    presupuesto_informar();
+
+    // --- Modo de trabajadores pre-lanzados ---
+    if (num_trabajadores > 0) {
+        // Un socket por trabajador sobre el mismo puerto: SO_REUSEPORT hace
+        // que el núcleo reparta las conexiones entrantes entre ellos.
+        int sockets[MAX_TRABAJADORES];
+        for (int i = 0; i < num_trabajadores; i++) {
+            sockets[i] = crear_socket_escucha(PORT, SOMAXCONN);
+            if (sockets[i] < 0) exit(EXIT_FAILURE);
+            fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+        }
+        printf("Servidor de búsqueda escuchando en el puerto %d con %d trabajadores\n", PORT, num_trabajadores);
+        fflush(stdout);
+        ejecutar_trabajadores(sockets, num_trabajadores);
+        liberar_datos();
         return 1;
     }
 
     // --- Configuración del Servidor Socket ---
     int server_fd, new_socket;
     struct sockaddr_in address;
-    int opt = 1;
     int addrlen = sizeof(address);
 
-    // Creación del descriptor de archivo del socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Adjuntar el socket al puerto 8080
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
-    }
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; // Escuchar en todas las interfaces de red
-    address.sin_port = htons(PORT);
-
-    // Vincular el socket al puerto
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind fallo");
-        exit(EXIT_FAILURE);
-    }
-
-    // Poner el servidor en modo de escucha
-    if (listen(server_fd, 10) < 0) { // Backlog de 10 conexiones
-        perror("listen");
+    server_fd = crear_socket_escucha(PORT, 10); // Backlog de 10 conexiones
+    if (server_fd < 0) {
         exit(EXIT_FAILURE);
     }
 
@@ -106,16 +165,32 @@ int main(int argc, char *argv[]) {
     }
 
     printf("Servidor de búsqueda escuchando en el puerto %d\n", PORT);
+    fflush(stdout); // Que los hijos no hereden el buffer sin vaciar
+
+    // SIGCHLD se bloquea mientras se cuentan los hijos.
+    sigset_t con_sigchld, sin_bloqueo;
+    sigemptyset(&con_sigchld);
+    sigaddset(&con_sigchld, SIGCHLD);
 
-    // aceptar conexiones 
+    // aceptar conexiones
     while (1) {
+        cache_atender_senal();
+        atender_senal_recarga();
+        esperar_hueco();
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
+            if (errno != EINTR) perror("accept");
             continue; // Continuar esperando si accept falla
         }
 
         // Crear un proceso hijo para manejar al cliente
-        if (!fork()) { //proceso hijo
+        actualizar_datos();
+        sigprocmask(SIG_BLOCK, &con_sigchld, &sin_bloqueo);
+        pid_t pid = fork();
+        if (pid > 0) hijos_vivos++;
+        sigprocmask(SIG_SETMASK, &sin_bloqueo, NULL);
+        if (!pid) { //proceso hijo
+            // La recarga es cosa del padre: el hijo termina con los datos que heredó.
+            signal(SIGHUP, SIG_IGN);
             close(server_fd); // Cierra socket de servidor del padre.
             handle_client(new_socket);
             close(new_socket);
@@ -126,23 +201,143 @@ int main(int argc, char *argv[]) {
     }
 
     // --- Limpieza
-    free(hash_table);
-    fclose(csv_file);
+    liberar_datos();
     return 0;
 }
 
+// Crea un socket TCP vinculado al puerto en todas las interfaces y lo pone
+// en modo de escucha. Devuelve el descriptor o -1 si algo falla.
+int crear_socket_escucha(int puerto, int backlog) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    // Creación del descriptor de archivo del socket
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    // Permitir reutilizar el puerto, también desde varios sockets a la vez
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(server_fd);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY; // Escuchar en todas las interfaces de red
+    address.sin_port = htons(puerto);
+
+    // Vincular el socket al puerto
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind fallo");
+        close(server_fd);
+        return -1;
+    }
+
+    // Poner el servidor en modo de escucha
+    if (listen(server_fd, backlog) < 0) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
 // Manejador para limpiar procesos hijos terminados
 void sigchld_handler(int s) {
     int saved_errno = errno;
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+    while(waitpid(-1, NULL, WNOHANG) > 0) {
+        if (hijos_vivos > 0) hijos_vivos--; // El registrador también es hijo
+    }
     errno = saved_errno;
 }
 
+// Con presupuesto de memoria no se atienden más conexiones a la vez que
+// las que admite: se espera a que termine algún hijo, y las conexiones
+// nuevas esperan mientras tanto en la cola de listen().
+static void esperar_hueco(void) {
+    if (!presupuesto.max_conexiones) return;
+    sigset_t con_sigchld, sin_bloqueo;
+    sigemptyset(&con_sigchld);
+    sigaddset(&con_sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &con_sigchld, &sin_bloqueo);
+    while (hijos_vivos >= (sig_atomic_t)presupuesto.max_conexiones) {
+        sigsuspend(&sin_bloqueo);
+        cache_atender_senal();
+        atender_senal_recarga();
+    }
+    sigprocmask(SIG_SETMASK, &sin_bloqueo, NULL);
+}
+
+// Envía todo el contenido de iov aunque sendmsg() lo acepte por partes.
+// Con mas distinto de cero se usa MSG_MORE: el núcleo espera a juntar lo
+// que sigue en lugar de despachar un segmento a medio llenar.
+static int enviar_iov(int fd, struct iovec *iov, int num, int mas) {
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = num;
+    uint64_t inicio = metricas_ahora();
+    size_t enviados = 0;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | (mas ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            metricas_envio(inicio, enviados);
+            return -1;
+        }
+        enviados += n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    metricas_envio(inicio, enviados);
+    return 0;
+}
+
+// Protocolo de texto: lo acumulado se envía tal cual.
+static int vaciar_texto(Salida *salida) {
+    struct iovec iov = {salida->buffer, salida->len};
+    if (enviar_iov(*(int *)salida->ctx, &iov, 1, 1) != 0) return -1;
+    salida->len = 0;
+    return 0;
+}
+
+// Destino de las tramas de una respuesta.
+typedef struct EnvioTramas {
+    int fd;
+    uint32_t id;
+} EnvioTramas;
+
+// Envía una trama: la cabecera y la carga útil salen en un solo sendmsg().
+static int enviar_trama(int fd, uint8_t tipo, uint16_t banderas, uint32_t id, const char *datos, size_t len) {
+    char cabecera[PROTO_CABECERA_TAM];
+    proto_escribir_cabecera(cabecera, tipo, banderas, id, len);
+    struct iovec iov[2] = {{cabecera, PROTO_CABECERA_TAM}, {(void *)datos, len}};
+    return enviar_iov(fd, iov, 2, banderas & PROTO_CONTINUA);
+}
+
+// Protocolo de tramas: lo acumulado sale como una trama que continúa.
+static int vaciar_trama(Salida *salida) {
+    EnvioTramas *envio = salida->ctx;
+    if (enviar_trama(envio->fd, PROTO_RESPUESTA, PROTO_CONTINUA, envio->id, salida->buffer, salida->len) != 0) return -1;
+    salida->len = 0;
+    return 0;
+}
+
 // Función que maneja la lógica de una conexión de cliente
 void handle_client(int client_socket) {
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
-    char client_ip[INET_ADDRSTRLEN];
+    char client_ip[INET_ADDRSTRLEN] = "?";
 
     //Obtener la información de la dirección del cliente desde el socket
     if (getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_len) == 0) {
@@ -153,182 +348,104 @@ void handle_client(int client_socket) {
     }
     char query_buffer[MAX_KEY_LENGTH * 2] = {0};
     ssize_t bytes_read = read(client_socket, query_buffer, sizeof(query_buffer) - 1);
+    if (bytes_read <= 0) return;
+    if ((unsigned char)query_buffer[0] == PROTO_MAGIA) {
+        atender_tramas(client_socket, client_ip, query_buffer, bytes_read);
+        return;
+    }
 
-    if (bytes_read > 0) {
+    // El buffer de respuesta tiene el tamaño que fija el presupuesto de memoria.
+    char *respuesta = malloc(presupuesto.salida);
+    if (!respuesta) return;
+    if (metricas_es_peticion(query_buffer, bytes_read)) {
+        struct iovec iov = {respuesta, metricas_respuesta_http(respuesta, presupuesto.salida)};
+        enviar_iov(client_socket, &iov, 1, 0);
+    } else {
         query_buffer[bytes_read] = '\0';
-        char query_copy[sizeof(query_buffer)];
-        strcpy(query_copy, query_buffer);
-
-        char *album_q = strtok(query_copy, "|");
-        char *artista_q = strtok(NULL, "|");
-        char *cancion_q = strtok(NULL, "|");
-
-        if (!album_q || !artista_q) {
-            char *error_msg = "Error: Consulta inválida.";
-            send(client_socket, error_msg, strlen(error_msg), 0);
-            return;
-        }
-        printf("IP %s : Album '%s' | Artista '%s'\n", client_ip, album_q, artista_q);
-
-        char composite_key[MAX_KEY_LENGTH];
-        snprintf(composite_key, sizeof(composite_key), "%s|%s", album_q, artista_q);
-        
-        char final_result[MAX_RESULTS_BUFFER] = {0};
-        int encontrados_cuenta = 0;
-        unsigned long index = hash_function(composite_key);
-        long campo_nodo_index = hash_table[index];
-        
-        FILE *idx_f = fopen("spotify.index", "rb");
-        char *line_buffer = malloc(MAX_LINE_LENGTH);
-
-        if (idx_f && line_buffer) {
-            while (campo_nodo_index != -1) {
-                fseek(idx_f, campo_nodo_index, SEEK_SET);
-                Nodo current_node;
-                fread(&current_node, sizeof(Nodo), 1, idx_f);
-                fseek(csv_file, current_node.csv_puntero, SEEK_SET);
-                fgets(line_buffer, MAX_LINE_LENGTH, csv_file);
-
-                char *album_from_csv = buscar_campo(line_buffer, 1);
-                char *artista_json_from_csv = buscar_campo(line_buffer, 4);
-                char *artist_from_csv = artista_json_from_csv ? extraer_artista(artista_json_from_csv) : NULL;
-
-                if (album_from_csv && artist_from_csv &&
-                    strcmp(album_from_csv, album_q) == 0 &&
-                    strcmp(artist_from_csv, artista_q) == 0) {
-                    
-                    int match = 0;
-                    if (cancion_q == NULL || strlen(cancion_q) == 0) {
-                        match = 1;
-                    } else {
-                        char *cancion_from_csv = buscar_campo(line_buffer, 8);
-                        if (cancion_from_csv && strcasestr(cancion_from_csv, cancion_q) != NULL) {
-                            match = 1;
-                        }
-                        if (cancion_from_csv) free(cancion_from_csv);
-                    }
-
-                    if (match) {
-                        char formatted_line[MAX_LINE_LENGTH];
-                        formato_resultado(formatted_line, sizeof(formatted_line), line_buffer);
-                        if (strlen(final_result) + strlen(formatted_line) < MAX_RESULTS_BUFFER) {
-                            strcat(final_result, formatted_line);
-                            encontrados_cuenta++;
-                        }
-                    }
-                }
-                if (album_from_csv) free(album_from_csv);
-                if (artista_json_from_csv) free(artista_json_from_csv);
-                if (artist_from_csv) free(artist_from_csv);
-                
-                campo_nodo_index = current_node.siguiente_nodo_puntero;
-            }
-            fclose(idx_f);
-            free(line_buffer);
+        Salida salida = {respuesta, presupuesto.salida, 0, vaciar_texto, &client_socket, 0};
+        Consulta consulta;
+        if (iniciar_consulta(&consulta, query_buffer, client_ip, &salida) == 0) {
+            struct iovec iov = {salida.buffer, salida.len};
+            enviar_iov(client_socket, &iov, 1, 0);
         }
-
-        if (encontrados_cuenta == 0) {
-            strcpy(final_result, "No se encontraron resultados para la búsqueda.");
-        }
-        
-        send(client_socket, final_result, strlen(final_result), 0);
     }
+    free(respuesta);
 }
 
-
-void formato_resultado(char *dest, size_t dest_size, const char *csv_line) {
-    char *album = buscar_campo(csv_line, 1);
-    char *artista_json = buscar_campo(csv_line, 4);
-    char *artist = artista_json ? extraer_artista(artista_json) : NULL;
-    char *cancion = buscar_campo(csv_line, 8);
-    char *duracion_str = buscar_campo(csv_line, 6);
-    char *popularidad_str = buscar_campo(csv_line, 10);
-
-    char duration_formatted[32] = "N/A";
-    if (duracion_str) {
-        long duration_ms = atol(duracion_str);
-        int minutes = duration_ms / 60000;
-        int seconds = (duration_ms % 60000) / 1000;
-        snprintf(duration_formatted, sizeof(duration_formatted), "%d min %d seg", minutes, seconds);
+// Responde una trama de lote: anticipa las lecturas de todas sus consultas
+// y luego responde cada una, en orden, con el identificador cab.id + i.
+static int responder_lote(int client_socket, const char *client_ip, char *carga, TramaCabecera cab,
+                          Consulta *consulta, Salida *salida) {
+    char *consultas[PROTO_MAX_LOTE_CONSULTAS];
+    int n = proto_dividir_lote(carga, cab.longitud, consultas, PROTO_MAX_LOTE_CONSULTAS);
+    if (n < 0) {
+        int len = snprintf(salida->buffer, salida->cap, "Error: Un lote admite como mucho %d consultas.", PROTO_MAX_LOTE_CONSULTAS);
+        return enviar_trama(client_socket, PROTO_ERROR, 0, cab.id, salida->buffer, len);
     }
-
-    snprintf(dest, dest_size,
-             "Álbum: %s\n"
-             "Artista: %s\n"
-             "Canción: %s\n"
-             "Duración: %s\n"
-             "Popularidad: %s\n"
-             "--------------------------------------------------\n",
-             album ? album : "N/A",
-             artist ? artist : "N/A",
-             cancion ? cancion : "N/A",
-             duration_formatted,
-             popularidad_str ? popularidad_str : "N/A");
-
-    if (album) free(album);
-    if (artista_json) free(artista_json);
-    if (artist) free(artist);
-    if (cancion) free(cancion);
-    if (duracion_str) free(duracion_str);
-    if (popularidad_str) free(popularidad_str);
-}
-
-unsigned long hash_function(const char *str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+    anticipar_lote((const char *const *)consultas, n);
+    EnvioTramas *envio = salida->ctx;
+    for (int i = 0; i < n; i++) {
+        envio->id = cab.id + i;
+        int estado = iniciar_consulta(consulta, consultas[i], client_ip, salida);
+        if (estado == 0) estado = enviar_trama(client_socket, PROTO_RESPUESTA, 0, envio->id, salida->buffer, salida->len);
+        if (estado != 0) return -1;
     }
-    return hash % HASH_TABLE_SIZE;
+    return 0;
 }
 
-char *buscar_campo(const char *line, int campoABuscar) {
-    char *buffer = malloc(MAX_LINE_LENGTH);
-    if (!buffer) return NULL;
-    int campoActual = 1, in_quotes = 0, buffer_pos = 0;
-    const char *line_ptr = line;
-    while (*line_ptr) {
-        if (*line_ptr == '"' && *(line_ptr + 1) != '"') {
-            in_quotes = !in_quotes;
-        } else if (*line_ptr == ',' && !in_quotes) {
-            if (campoActual == campoABuscar) {
-                buffer[buffer_pos] = '\0';
-                return buffer;
-            }
-            campoActual++;
-            buffer_pos = 0;
-        } else {
-            if (campoActual == campoABuscar) {
-                if (buffer_pos < MAX_LINE_LENGTH - 1) {
-                    buffer[buffer_pos++] = *line_ptr;
+// Atiende una conexión persistente con el protocolo de tramas: responde
+// cada consulta, en orden, hasta que el cliente cierre la conexión.
+// inicio contiene los bytes que ya se leyeron del socket.
+void atender_tramas(int client_socket, const char *client_ip, const char *inicio, size_t inicio_len) {
+    char entrada[PROTO_CABECERA_TAM + PROTO_MAX_LOTE + 1];
+    char *respuesta = malloc(presupuesto.salida);
+    if (!respuesta) return;
+    memcpy(entrada, inicio, inicio_len);
+    size_t entrada_len = inicio_len;
+    EnvioTramas envio = {client_socket, 0};
+    Salida salida = {respuesta, presupuesto.salida, 0, vaciar_trama, &envio, 0};
+    Consulta consulta;
+
+    while (1) {
+        // Completar al menos la cabecera y luego la carga útil.
+        TramaCabecera cab;
+        size_t necesarios = PROTO_CABECERA_TAM;
+        while (1) {
+            if (entrada_len >= PROTO_CABECERA_TAM) {
+                if (proto_leer_cabecera(entrada, &cab) != 0 || cab.longitud > proto_max_carga(cab.tipo)) {
+                    free(respuesta);
+                    return;
                 }
+                necesarios = PROTO_CABECERA_TAM + cab.longitud;
+            }
+            if (entrada_len >= necesarios) break;
+            ssize_t n = read(client_socket, entrada + entrada_len, sizeof(entrada) - 1 - entrada_len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                free(respuesta);
+                return;
             }
+            entrada_len += n;
         }
-        line_ptr++;
-    }
-    if (campoActual == campoABuscar) {
-        if (buffer_pos > 0 && buffer[buffer_pos - 1] == '\n') buffer_pos--;
-        buffer[buffer_pos] = '\0';
-        return buffer;
-    }
-    free(buffer);
-    return NULL;
-}
 
-char *extraer_artista(const char *json_string) {
-    const char *key = "'artist_name': '";
-    const char *comienzo = strstr(json_string, key);
-    if (!comienzo) return strdup(json_string);
-    
-    comienzo += strlen(key);
-    const char *final = strchr(comienzo, '\'');
-    if (!final) return strdup(json_string);
-    
-    size_t length = final - comienzo;
-    char *nombre = malloc(length + 1);
-    if (nombre) {
-        strncpy(nombre, comienzo, length);
-        nombre[length] = '\0';
+        int estado;
+        if (cab.tipo == PROTO_CONSULTA) {
+            char texto[PROTO_MAX_CONSULTA + 1];
+            memcpy(texto, entrada + PROTO_CABECERA_TAM, cab.longitud);
+            texto[cab.longitud] = '\0';
+            envio.id = cab.id;
+            estado = iniciar_consulta(&consulta, texto, client_ip, &salida);
+            if (estado == 0) estado = enviar_trama(client_socket, PROTO_RESPUESTA, 0, cab.id, salida.buffer, salida.len);
+        } else if (cab.tipo == PROTO_LOTE) {
+            estado = responder_lote(client_socket, client_ip, entrada + PROTO_CABECERA_TAM, cab, &consulta, &salida);
+        } else {
+            int len = snprintf(respuesta, presupuesto.salida, "Error: Tipo de trama desconocido (%u).", cab.tipo);
+            estado = enviar_trama(client_socket, PROTO_ERROR, 0, cab.id, respuesta, len);
+        }
+        if (estado != 0) break;
+
+        memmove(entrada, entrada + necesarios, entrada_len - necesarios);
+        entrada_len -= necesarios;
     }
-    return nombre;
+    free(respuesta);
 }
@@ -0,0 +1,72 @@
+/*
+ * secundarios.h: Formato de los índices secundarios spotify.artists y
+ * spotify.albums.
+ * Permiten listar todas las filas de un artista o de un álbum sin dar la
+ * otra mitad de la clave compuesta. Sus claves no son textos sino los
+ * identificadores del diccionario de cadenas de spotify.records (el
+ * desplazamiento de la cadena en su almacén), el mismo que usan los
+ * registros: la lista de una clave contiene exactamente los registros
+ * cuyo artista (o álbum) es esa cadena, así que basta con comparar el
+ * texto buscado una vez por clave y no una vez por fila.
+ *
+ * Disposición del archivo (igual que spotify.index, ver indice.h):
+ *   [SecundarioCabecera][uint32_t tabla[tam_tabla + 1]][relleno hasta 8]
+ *   [ClaveSecundaria directorio[num_claves]][listas de filas]
+ * La huella de una clave es hash_clave() de su texto con la semilla de la
+ * cabecera; el directorio está ordenado por cubeta y huella, y cada lista
+ * guarda números de registro crecientes en los mismos bloques que las de
+ * spotify.index.
+ */
+#ifndef SECUNDARIOS_H
+#define SECUNDARIOS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "indice.h"
+
+#define SECUNDARIO_MAGIA "SPOTSEC"
+#define SECUNDARIO_VERSION 3
+
+// Columna de spotify.records por la que se indexa
+#define SECUNDARIO_ALBUM 1
+#define SECUNDARIO_ARTISTA 2
+
+typedef struct SecundarioCabecera {
+    char magia[8];            // "SPOTSEC\0"
+    uint32_t version;         // SECUNDARIO_VERSION
+    uint32_t tam_tabla;       // Cubetas de la tabla hash (potencia de 2)
+    uint64_t num_filas;       // Registros de spotify.records
+    uint64_t semilla;
+    uint64_t num_claves;
+    uint64_t desp_directorio;
+    uint64_t desp_listas;
+    uint32_t campo;           // SECUNDARIO_ALBUM o SECUNDARIO_ARTISTA
+    uint32_t reservado;
+    uint64_t bytes_csv;       // Los de spotify.index del mismo indexado
+    uint64_t huella_csv;
+} SecundarioCabecera;
+
+typedef struct ClaveSecundaria {
+    uint64_t huella;      // hash_clave() del texto
+    uint64_t desp_lista;  // Desplazamiento absoluto de su lista de filas
+    uint32_t cadena;      // Identificador del texto en el almacén de spotify.records
+    uint32_t num_filas;
+    uint32_t bytes_lista;
+    uint32_t reservado;
+} ClaveSecundaria;
+
+// Desplazamiento del directorio: tras la tabla, alineado a 8 bytes.
+static inline uint64_t secundario_desp_directorio(uint32_t tam_tabla) {
+    uint64_t desp = sizeof(SecundarioCabecera) + sizeof(uint32_t) * ((uint64_t)tam_tabla + 1);
+    return (desp + 7) & ~(uint64_t)7;
+}
+
+static inline int secundario_cabecera_valida(const SecundarioCabecera *cab, uint32_t campo) {
+    return memcmp(cab->magia, SECUNDARIO_MAGIA, sizeof(SECUNDARIO_MAGIA)) == 0 &&
+           cab->version == SECUNDARIO_VERSION && cab->campo == campo &&
+           cab->tam_tabla != 0 && (cab->tam_tabla & (cab->tam_tabla - 1)) == 0 &&
+           cab->desp_directorio == secundario_desp_directorio(cab->tam_tabla) &&
+           cab->desp_listas == cab->desp_directorio + cab->num_claves * sizeof(ClaveSecundaria);
+}
+
+#endif
@@ -0,0 +1,515 @@
+/*
+ * trabajadores.c: Procesos trabajadores con epoll.
+ * Cada trabajador atiende su propio socket de escucha (SO_REUSEPORT) con un
+ * bucle epoll disparado por flanco, multiplexando muchas conexiones no
+ * bloqueantes en un único proceso. Se evita así el fork() por conexión.
+ * Cada conexión habla el protocolo de tramas (varias consultas encadenadas
+ * por conexión, ver protocolo.h) o el de texto original, según su primer byte.
+ * Una respuesta larga se produce por partes: cuando el buffer de respuesta
+ * se llena se envía y la consulta sigue solo cuando el socket aceptó todo,
+ * así que una conexión nunca retiene más que un buffer de respuesta.
+ * Con tramas, una conexión avanza hasta TRABAJADOR_MAX_EN_CURSO consultas
+ * a la vez, un tramo de cada una por turnos: una consulta corta encadenada
+ * tras una larga responde en cuanto termina, entre las tramas de la otra.
+ * El supervisor reenvía SIGHUP a los trabajadores, que recargan los datos
+ * entre eventos sin cerrar sus conexiones.
+ * Con presupuesto de memoria (-M) cada trabajador atiende a lo sumo su parte
+ * de las conexiones permitidas; las demás esperan en la cola de listen()
+ * hasta que se cierre alguna.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "cache_consultas.h"
+#include "consulta.h"
+#include "metricas.h"
+#include "presupuesto.h"
+#include "protocolo.h"
+#include "trabajadores.h"
+
+#define MAX_EVENTOS 256
+
+enum { PROTO_DESCONOCIDO, PROTO_TEXTO, PROTO_TRAMAS };
+
+// Consulta de una conexión con la respuesta a medias. No se mueve de su
+// lugar: la consulta apunta a su propio texto.
+typedef struct EnCurso {
+    Consulta consulta;
+    uint32_t id;           // Identificador de su trama
+    int activa;
+} EnCurso;
+
+// Estado de una conexión de cliente dentro de un trabajador.
+typedef struct Conexion {
+    int fd;
+    int protocolo;         // Se decide con el primer byte recibido
+    char origen[INET_ADDRSTRLEN];
+    char *entrada;         // Crece hasta el tamaño de una trama de lote si llega una
+    size_t entrada_len;
+    size_t entrada_cap;
+    int respondida;        // Protocolo de texto: ya se procesó la consulta
+    int cerrada;           // El cliente ya no enviará más datos
+    char *salida;          // Respuestas pendientes de enviar
+    size_t salida_len;
+    size_t salida_enviado;
+    size_t salida_cap;
+    EnCurso en_curso[TRABAJADOR_MAX_EN_CURSO]; // Con texto solo se usa la primera
+    int num_en_curso;
+    int turno;             // Próxima consulta en curso que se continúa
+    char *lote;            // Consultas de un lote, separadas por '\0'
+    char *lote_pos;        // Siguiente consulta del lote
+    int lote_restantes;
+    uint32_t lote_id;      // Identificador de la respuesta de lote_pos
+} Conexion;
+
+// Buffer de respuesta reutilizado por todas las consultas del trabajador,
+// del tamaño que fija el presupuesto de memoria. Se reserva espacio delante
+// para la cabecera de la trama. Sin función de vaciado: la consulta se
+// interrumpe cuando se llena.
+static char *respuesta;
+static Salida salida;
+
+// Conexiones abiertas del trabajador y máximo según el presupuesto (0: sin
+// límite). Al llegar al máximo se deja de aceptar hasta que se cierre una.
+static unsigned num_conexiones;
+static unsigned max_conexiones;
+static int aceptacion_en_pausa;
+
+static void cerrar_conexion(int epoll_fd, Conexion *con) {
+    num_conexiones--;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, con->fd, NULL);
+    close(con->fd);
+    for (int i = 0; i < TRABAJADOR_MAX_EN_CURSO; i++) {
+        if (con->en_curso[i].activa) liberar_consulta(&con->en_curso[i].consulta);
+    }
+    free(con->entrada);
+    free(con->lote);
+    free(con->salida);
+    free(con);
+}
+
+// Envía lo que quede pendiente. Devuelve 1 si se envió todo, 0 si el socket
+// está lleno y hay que esperar a EPOLLOUT, o -1 si hubo un error.
+static int enviar_pendiente(Conexion *con) {
+    uint64_t inicio = metricas_ahora();
+    size_t antes = con->salida_enviado;
+    int estado = 1;
+    while (con->salida_enviado < con->salida_len) {
+        ssize_t n = send(con->fd, con->salida + con->salida_enviado,
+                         con->salida_len - con->salida_enviado, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            estado = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            break;
+        }
+        con->salida_enviado += n;
+    }
+    metricas_envio(inicio, con->salida_enviado - antes);
+    if (estado == 1) con->salida_len = con->salida_enviado = 0;
+    return estado;
+}
+
+// Envía datos al cliente. Si no hay nada encolado se intenta el envío
+// directo; solo lo que el socket no acepta se copia a la cola de salida.
+static int encolar_salida(Conexion *con, const char *datos, size_t len) {
+    if (con->salida_len == con->salida_enviado) {
+        con->salida_len = con->salida_enviado = 0;
+        uint64_t inicio = metricas_ahora();
+        size_t total = len;
+        int fallo = 0;
+        while (len > 0) {
+            ssize_t n = send(con->fd, datos, len, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fallo = errno != EAGAIN && errno != EWOULDBLOCK;
+                break;
+            }
+            datos += n;
+            len -= n;
+        }
+        metricas_envio(inicio, total - len);
+        if (fallo) return -1;
+        if (len == 0) return 0;
+    }
+    if (con->salida_len + len > con->salida_cap) {
+        // Compacta lo ya enviado antes de crecer.
+        memmove(con->salida, con->salida + con->salida_enviado, con->salida_len - con->salida_enviado);
+        con->salida_len -= con->salida_enviado;
+        con->salida_enviado = 0;
+        size_t cap = con->salida_cap ? con->salida_cap : 4096;
+        while (cap < con->salida_len + len) cap *= 2;
+        if (cap != con->salida_cap) {
+            char *nueva = realloc(con->salida, cap);
+            if (!nueva) return -1;
+            con->salida = nueva;
+            con->salida_cap = cap;
+        }
+    }
+    memcpy(con->salida + con->salida_len, datos, len);
+    con->salida_len += len;
+    return 0;
+}
+
+static size_t salida_pendiente(const Conexion *con) {
+    return con->salida_len - con->salida_enviado;
+}
+
+// Lugar libre para una consulta nueva (hay que comprobar antes que
+// num_en_curso no llegó al máximo).
+static EnCurso *lugar_libre(Conexion *con) {
+    int i = 0;
+    while (con->en_curso[i].activa) i++;
+    return &con->en_curso[i];
+}
+
+// Encola lo que la consulta e dejó en la salida (estado es lo que devolvió
+// iniciar_consulta o continuar_consulta) y la marca activa si quedó a
+// medias. Con tramas, entonces la trama lleva PROTO_CONTINUA.
+static int entregar_respuesta(Conexion *con, EnCurso *e, int estado) {
+    if (estado < 0) return -1;
+    int activa = estado == 1;
+    con->num_en_curso += activa - e->activa;
+    e->activa = activa;
+    if (con->protocolo == PROTO_TEXTO) return encolar_salida(con, salida.buffer, salida.len);
+    proto_escribir_cabecera(respuesta, PROTO_RESPUESTA, activa ? PROTO_CONTINUA : 0, e->id, salida.len);
+    return encolar_salida(con, respuesta, PROTO_CABECERA_TAM + salida.len);
+}
+
+// Empieza la consulta texto con el identificador id en un lugar libre.
+static int empezar_consulta(Conexion *con, const char *texto, uint32_t id) {
+    EnCurso *e = lugar_libre(con);
+    e->id = id;
+    return entregar_respuesta(con, e, iniciar_consulta(&e->consulta, texto, con->origen, &salida));
+}
+
+// Indica si quedan respuestas a medias o consultas de un lote por responder.
+static int respuesta_pendiente(const Conexion *con) {
+    return con->num_en_curso > 0 || con->lote_restantes > 0;
+}
+
+// Indica si la conexión puede empezar una trama nueva: no queda un lote por
+// empezar, hay lugar para otra consulta y la salida pendiente no es mucha.
+static int admite_tramas(const Conexion *con) {
+    return con->lote_restantes == 0 && con->num_en_curso < TRABAJADOR_MAX_EN_CURSO &&
+           salida_pendiente(con) < presupuesto.pendiente;
+}
+
+// Mientras el socket acepte todo lo producido, empieza las consultas del
+// lote que quepan y sigue un tramo de cada consulta a medias por turnos.
+static int continuar_respuesta(Conexion *con) {
+    while (respuesta_pendiente(con) && salida_pendiente(con) == 0) {
+        salida.len = 0;
+        if (con->lote_restantes > 0 && con->num_en_curso < TRABAJADOR_MAX_EN_CURSO) {
+            const char *texto = con->lote_pos;
+            con->lote_pos += strlen(texto) + 1;
+            int estado = empezar_consulta(con, texto, con->lote_id++);
+            if (--con->lote_restantes == 0) {
+                free(con->lote);
+                con->lote = NULL;
+            }
+            if (estado != 0) return -1;
+            continue;
+        }
+        while (!con->en_curso[con->turno].activa) con->turno = (con->turno + 1) % TRABAJADOR_MAX_EN_CURSO;
+        EnCurso *e = &con->en_curso[con->turno];
+        con->turno = (con->turno + 1) % TRABAJADOR_MAX_EN_CURSO;
+        if (entregar_respuesta(con, e, continuar_consulta(&e->consulta, &salida)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Guarda las consultas de una trama de lote y anticipa sus lecturas; se
+// responden desde continuar_respuesta con los identificadores id, id + 1, ...
+static int recibir_lote(Conexion *con, const char *carga, const TramaCabecera *cab) {
+    char *consultas[PROTO_MAX_LOTE_CONSULTAS];
+    con->lote = malloc(cab->longitud + 1);
+    if (!con->lote) return -1;
+    memcpy(con->lote, carga, cab->longitud);
+    int n = proto_dividir_lote(con->lote, cab->longitud, consultas, PROTO_MAX_LOTE_CONSULTAS);
+    if (n < 0) {
+        free(con->lote);
+        con->lote = NULL;
+        size_t len = snprintf(salida.buffer, salida.cap, "Error: Un lote admite como mucho %d consultas.", PROTO_MAX_LOTE_CONSULTAS);
+        proto_escribir_cabecera(respuesta, PROTO_ERROR, 0, cab->id, len);
+        return encolar_salida(con, respuesta, PROTO_CABECERA_TAM + len);
+    }
+    anticipar_lote((const char *const *)consultas, n);
+    con->lote_pos = con->lote;
+    con->lote_restantes = n;
+    con->lote_id = cab->id;
+    return 0;
+}
+
+// Protocolo de texto: una única consulta por conexión, o una petición
+// "GET /metrics", que recibe las métricas.
+static int responder_texto(Conexion *con) {
+    con->entrada[con->entrada_len] = '\0';
+    con->respondida = 1;
+    if (metricas_es_peticion(con->entrada, con->entrada_len)) {
+        return encolar_salida(con, salida.buffer, metricas_respuesta_http(salida.buffer, salida.cap));
+    }
+    if (empezar_consulta(con, con->entrada, 0) != 0) return -1;
+    return continuar_respuesta(con);
+}
+
+// Protocolo de tramas: empieza las tramas completas del buffer de entrada,
+// en orden, y deja al principio los bytes de una trama incompleta. Se
+// detiene cuando no admite más (ver admite_tramas): las siguientes esperan
+// a que termine alguna de las que están en curso. Todas las empezadas
+// reciben su primer tramo antes de que se continúe ninguna.
+static int responder_tramas(Conexion *con) {
+    size_t pos = 0;
+    while (admite_tramas(con) && con->entrada_len - pos >= PROTO_CABECERA_TAM) {
+        TramaCabecera cab;
+        if (proto_leer_cabecera(con->entrada + pos, &cab) != 0) return -1;
+        if (cab.longitud > proto_max_carga(cab.tipo)) return -1;
+        if (con->entrada_len - pos < PROTO_CABECERA_TAM + cab.longitud) {
+            // Una trama de lote no cabe en el buffer inicial: se agranda.
+            size_t necesario = PROTO_CABECERA_TAM + cab.longitud + 1;
+            if (necesario > con->entrada_cap) {
+                char *nueva = realloc(con->entrada, necesario);
+                if (!nueva) return -1;
+                con->entrada = nueva;
+                con->entrada_cap = necesario;
+            }
+            break;
+        }
+
+        const char *carga = con->entrada + pos + PROTO_CABECERA_TAM;
+        if (cab.tipo == PROTO_CONSULTA) {
+            char texto[PROTO_MAX_CONSULTA + 1];
+            memcpy(texto, carga, cab.longitud);
+            texto[cab.longitud] = '\0';
+            if (empezar_consulta(con, texto, cab.id) != 0) return -1;
+        } else if (cab.tipo == PROTO_LOTE) {
+            if (recibir_lote(con, carga, &cab) != 0) return -1;
+        } else {
+            size_t len = snprintf(salida.buffer, salida.cap, "Error: Tipo de trama desconocido (%u).", cab.tipo);
+            proto_escribir_cabecera(respuesta, PROTO_ERROR, 0, cab.id, len);
+            if (encolar_salida(con, respuesta, PROTO_CABECERA_TAM + len) != 0) return -1;
+        }
+        pos += PROTO_CABECERA_TAM + cab.longitud;
+    }
+    memmove(con->entrada, con->entrada + pos, con->entrada_len - pos);
+    con->entrada_len -= pos;
+    // Las tramas ya empezadas siguen por turnos.
+    return continuar_respuesta(con);
+}
+
+// Lee todo lo disponible (modo disparado por flanco) y responde lo que ya
+// esté completo. En el protocolo de texto el cliente envía una sola consulta
+// y espera, así que la consulta se da por completa cuando el socket se queda
+// sin datos. Con tramas se deja de leer mientras no admita tramas nuevas;
+// la lectura se retoma cuando se vacía la cola o termina alguna respuesta
+// (ver bucle_trabajador).
+// Devuelve 0 si la conexión sigue viva o -1 si hay que cerrarla.
+static int atender_lectura(Conexion *con) {
+    while (!con->cerrada) {
+        if (con->protocolo == PROTO_TRAMAS) {
+            if (responder_tramas(con) != 0) return -1;
+            if (!admite_tramas(con)) return 0;
+        }
+        if (con->entrada_len >= con->entrada_cap - 1) {
+            if (con->protocolo == PROTO_TRAMAS) return -1; // Trama demasiado grande
+            break;
+        }
+        ssize_t n = read(con->fd, con->entrada + con->entrada_len,
+                         con->entrada_cap - 1 - con->entrada_len);
+        if (n > 0) {
+            if (con->protocolo == PROTO_DESCONOCIDO) {
+                con->protocolo = ((unsigned char)con->entrada[0] == PROTO_MAGIA) ? PROTO_TRAMAS : PROTO_TEXTO;
+            }
+            con->entrada_len += n;
+        } else if (n == 0) {
+            con->cerrada = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    if (con->protocolo == PROTO_TRAMAS) {
+        return responder_tramas(con);
+    }
+    if (con->protocolo == PROTO_TEXTO && !con->respondida && con->entrada_len > 0) {
+        return responder_texto(con);
+    }
+    return 0;
+}
+
+// Indica si la conexión ya no tiene nada más que hacer y puede cerrarse.
+static int conexion_terminada(const Conexion *con) {
+    if (salida_pendiente(con) > 0 || respuesta_pendiente(con)) return 0;
+    if (con->protocolo == PROTO_TEXTO) return con->respondida || con->cerrada;
+    return con->cerrada;
+}
+
+static void aceptar_conexiones(int epoll_fd, int server_fd) {
+    aceptacion_en_pausa = 0;
+    while (1) {
+        if (max_conexiones && num_conexiones >= max_conexiones) {
+            aceptacion_en_pausa = 1;
+            return;
+        }
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int fd = accept4(server_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+        Conexion *con = calloc(1, sizeof(Conexion));
+        if (con) {
+            con->entrada_cap = PROTO_CABECERA_TAM + PROTO_MAX_CONSULTA + 1;
+            con->entrada = malloc(con->entrada_cap);
+        }
+        if (!con || !con->entrada) {
+            free(con);
+            close(fd);
+            continue;
+        }
+        con->fd = fd;
+        inet_ntop(AF_INET, &address.sin_addr, con->origen, sizeof(con->origen));
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = con;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(con->entrada);
+            free(con);
+            continue;
+        }
+        num_conexiones++;
+    }
+}
+
+// Bucle principal de un trabajador. No regresa.
+static void bucle_trabajador(int server_fd) {
+    respuesta = malloc(PROTO_CABECERA_TAM + presupuesto.salida);
+    if (!respuesta) {
+        perror("malloc");
+        exit(1);
+    }
+    salida = (Salida){respuesta + PROTO_CABECERA_TAM, presupuesto.salida, 0, NULL, NULL, 0};
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL identifica al socket de escucha
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event eventos[MAX_EVENTOS];
+    while (1) {
+        int n = epoll_wait(epoll_fd, eventos, MAX_EVENTOS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                atender_senal_recarga();
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            Conexion *con = eventos[i].data.ptr;
+            if (!con) {
+                aceptar_conexiones(epoll_fd, server_fd);
+                continue;
+            }
+            int estado = 0;
+            if (eventos[i].events & EPOLLERR) estado = -1;
+            if (estado == 0 && salida_pendiente(con) > 0) {
+                int en_pausa = !admite_tramas(con);
+                estado = enviar_pendiente(con) < 0 ? -1 : 0;
+                // Con la cola vacía siguen las respuestas a medias.
+                if (estado == 0) estado = continuar_respuesta(con);
+                // Si la lectura estaba en pausa porque no admitía tramas y
+                // ya las admite, se retoma.
+                if (estado == 0 && en_pausa && admite_tramas(con)) {
+                    estado = atender_lectura(con);
+                }
+            }
+            if (estado == 0 && (eventos[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                estado = atender_lectura(con);
+            }
+            if (estado != 0 || conexion_terminada(con)) cerrar_conexion(epoll_fd, con);
+        }
+        // La cola de listen() no vuelve a avisar (disparo por flanco): si se
+        // dejó de aceptar por el límite y ya hay sitio, se acepta ahora.
+        if (aceptacion_en_pausa && num_conexiones < max_conexiones) aceptar_conexiones(epoll_fd, server_fd);
+    }
+}
+
+static pid_t lanzar_trabajador(const int *sockets, int num_trabajadores, int indice) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    // Proceso trabajador: termina si muere el supervisor.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    max_conexiones = presupuesto.max_conexiones / num_trabajadores;
+    signal(SIGCHLD, SIG_DFL);
+    for (int i = 0; i < num_trabajadores; i++) {
+        if (i != indice) close(sockets[i]);
+    }
+    bucle_trabajador(sockets[indice]);
+    exit(0);
+}
+
+void ejecutar_trabajadores(const int *sockets, int num_trabajadores) {
+    pid_t *pids = calloc(num_trabajadores, sizeof(pid_t));
+    if (!pids) {
+        perror("calloc");
+        return;
+    }
+    for (int i = 0; i < num_trabajadores; i++) {
+        pids[i] = lanzar_trabajador(sockets, num_trabajadores, i);
+        if (pids[i] < 0) perror("fork");
+    }
+
+    while (1) {
+        int estado;
+        pid_t pid = waitpid(-1, &estado, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                cache_atender_senal();
+                // Cada trabajador recarga sus datos; el supervisor también,
+                // para que los que relance ya nazcan con los nuevos.
+                if (atender_senal_recarga()) {
+                    for (int i = 0; i < num_trabajadores; i++) {
+                        if (pids[i] > 0) kill(pids[i], SIGHUP);
+                    }
+                }
+                continue;
+            }
+            perror("waitpid");
+            break;
+        }
+        for (int i = 0; i < num_trabajadores; i++) {
+            if (pids[i] != pid) continue;
+            fprintf(stderr, "Trabajador %d (pid %d) terminó; se relanza.\n", i, (int)pid);
+            pids[i] = lanzar_trabajador(sockets, num_trabajadores, i);
+            break;
+        }
+    }
+    free(pids);
+}
@@ -0,0 +1,20 @@
+/*
+ * trabajadores.h: Grupo de procesos trabajadores pre-creados del servidor.
+ */
+#ifndef TRABAJADORES_H
+#define TRABAJADORES_H
+
+// Consultas de una misma conexión de tramas que un trabajador avanza a la
+// vez (ver trabajadores.c).
+#define TRABAJADOR_MAX_EN_CURSO 4
+
+/*
+ * Lanza un proceso trabajador por cada socket de escucha y se queda
+ * supervisándolos: si alguno termina, lo vuelve a lanzar sobre el mismo
+ * socket. Cada socket debe haberse creado con SO_REUSEPORT sobre el mismo
+ * puerto para que el núcleo reparta las conexiones entre ellos.
+ * Solo regresa si falla la supervisión.
+ */
+void ejecutar_trabajadores(const int *sockets, int num_trabajadores);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * trigramas.c: Normalización de nombres de canción y extracción de sus
+ * trigramas. Lo comparten el indexador y el servidor, así que ambos
+ * normalizan exactamente igual.
+ */
+#include <stdlib.h>
+#include "trigramas.h"
+
+// Letra base de U+00C0 .. U+00FF; NULL deja el carácter como está (× y ÷).
+static const char *const latin1[64] = {
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", NULL, "o", "u", "u", "u", "u", "y", "th", "ss",
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", NULL, "o", "u", "u", "u", "u", "y", "th", "y",
+};
+
+// Letra base de U+0100 .. U+017F (Latin Extended-A).
+static const char latin_extendido[129] =
+    "aaaaaacccccccc" "dddd" "eeeeeeeeee" "gggggggg" "hhhh" "iiiiiiiiii" "ii" "jj" "kkk"
+    "llllllllll" "nnnnnnnnn" "oooooo" "oo" "rrrrrr" "ssssssss" "tttttt"
+    "uuuuuuuuuuuu" "ww" "yyy" "zzzzzz" "s";
+
+// Longitud de la secuencia UTF-8 que empieza con el byte b (1 si no es válido).
+static size_t longitud_utf8(unsigned char b) {
+    if (b >= 0xF0 && b < 0xF8) return 4;
+    if (b >= 0xE0) return b < 0xF0 ? 3 : 1;
+    if (b >= 0xC0) return 2;
+    return 1;
+}
+
+size_t trigramas_normalizar(const char *texto, size_t len, char *dest, size_t cap) {
+    const unsigned char *p = (const unsigned char *)texto, *fin = p + len;
+    size_t n = 0;
+    while (p < fin) {
+        size_t tam = longitud_utf8(*p);
+        if (tam > (size_t)(fin - p)) tam = 1;
+        const char *reemplazo = NULL;
+        char letra[2] = {0};
+        if (tam == 1) {
+            letra[0] = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+            reemplazo = letra;
+        } else if (tam == 2) {
+            uint32_t cp = ((uint32_t)(p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            if (cp >= 0xC0 && cp <= 0xFF) {
+                reemplazo = latin1[cp - 0xC0];
+            } else if (cp >= 0x100 && cp <= 0x17F) {
+                letra[0] = latin_extendido[cp - 0x100];
+                reemplazo = letra;
+            } else if (cp >= 0x300 && cp <= 0x36F) {
+                reemplazo = ""; // Marca diacrítica combinable
+            }
+        }
+        const char *copia = reemplazo ? reemplazo : (const char *)p;
+        size_t tam_copia = reemplazo ? strlen(reemplazo) : tam;
+        if (n + tam_copia >= cap) break;
+        memcpy(dest + n, copia, tam_copia);
+        n += tam_copia;
+        p += tam;
+    }
+    if (cap > 0) dest[n] = '\0';
+    return n;
+}
+
+static int comparar_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+size_t trigramas_extraer(const char *normalizado, size_t len, uint32_t *trigramas) {
+    if (len < 3) return 0;
+    const unsigned char *p = (const unsigned char *)normalizado;
+    size_t n = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        trigramas[n++] = ((uint32_t)p[i] << 16) | ((uint32_t)p[i + 1] << 8) | p[i + 2];
+    }
+    qsort(trigramas, n, sizeof(uint32_t), comparar_u32);
+    size_t distintos = 1;
+    for (size_t i = 1; i < n; i++) {
+        if (trigramas[i] != trigramas[distintos - 1]) trigramas[distintos++] = trigramas[i];
+    }
+    return distintos;
+}
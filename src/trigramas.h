@@ -0,0 +1,99 @@
+/*
+ * trigramas.h: Formato del archivo binario spotify.trigrams y normalización
+ * de los nombres de canción.
+ * Permite buscar por nombre de canción sin dar álbum ni artista. El
+ * indexador normaliza el nombre de la canción de cada registro (minúsculas
+ * y sin acentos, ver trigramas_normalizar) y, por cada secuencia distinta
+ * de 3 bytes del texto normalizado (trigrama), guarda la lista de los
+ * registros que la contienen. El servidor normaliza igual el texto
+ * buscado, cruza las listas de sus trigramas y confirma cada candidato
+ * comparando el texto completo.
+ *
+ * Disposición del archivo:
+ *   [TrigramasCabecera][uint32_t tabla[TRIGRAMAS_TAM_TABLA + 1]][relleno hasta 8]
+ *   [TrigramaClave directorio[num_trigramas]][listas de filas]
+ * El directorio está ordenado por trigrama; los trigramas cuyos dos
+ * primeros bytes valen p son directorio[tabla[p]] .. directorio[tabla[p + 1] - 1].
+ * Cada lista guarda números de registro en orden creciente, en bloques de
+ * TRIGRAMAS_TAM_BLOQUE. Empieza con un salto por bloque (su primer valor y
+ * dónde empieza, contado desde el inicio de la lista) y sigue con los
+ * bloques: el resto de los valores de cada uno como diferencias con el
+ * anterior en varint. Los saltos permiten avanzar a un valor sin
+ * decodificar los bloques intermedios.
+ */
+#ifndef TRIGRAMAS_H
+#define TRIGRAMAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRIGRAMAS_MAGIA "SPOTTRI"
+#define TRIGRAMAS_VERSION 2
+#define TRIGRAMAS_TAM_BLOQUE 128     // Valores por bloque de una lista
+#define TRIGRAMAS_TAM_TABLA 65536    // Una entrada por prefijo de 2 bytes
+#define TRIGRAMAS_MAX_TEXTO 4096     // Bytes de un texto normalizado
+
+typedef struct TrigramasCabecera {
+    char magia[8];            // "SPOTTRI\0"
+    uint32_t version;         // TRIGRAMAS_VERSION
+    uint32_t tam_bloque;      // TRIGRAMAS_TAM_BLOQUE
+    uint64_t num_filas;       // Registros de spotify.records indexados
+    uint64_t num_trigramas;
+    uint64_t desp_directorio;
+    uint64_t desp_listas;
+    uint64_t bytes_csv;       // Los de spotify.index del mismo indexado
+    uint64_t huella_csv;
+} TrigramasCabecera;
+
+typedef struct TrigramaClave {
+    uint64_t desp_lista;   // Desplazamiento absoluto de su lista
+    uint32_t trigrama;     // Los 3 bytes, el primero en los bits altos
+    uint32_t num_filas;
+    uint32_t bytes_lista;  // Saltos y bloques
+    uint32_t reservado;
+} TrigramaClave;
+
+typedef struct TrigramaSalto {
+    uint32_t primero;      // Primer número de registro del bloque
+    uint32_t desp;         // Inicio de sus diferencias, desde el inicio de la lista
+} TrigramaSalto;
+
+// Número de bloques (y de saltos) de una lista de num_filas valores.
+static inline uint32_t trigramas_num_bloques(uint32_t num_filas) {
+    return (num_filas + TRIGRAMAS_TAM_BLOQUE - 1) / TRIGRAMAS_TAM_BLOQUE;
+}
+
+// Desplazamiento del directorio: tras la tabla, alineado a 8 bytes.
+static inline uint64_t trigramas_desp_directorio(void) {
+    uint64_t desp = sizeof(TrigramasCabecera) + sizeof(uint32_t) * ((uint64_t)TRIGRAMAS_TAM_TABLA + 1);
+    return (desp + 7) & ~(uint64_t)7;
+}
+
+// Comprueba que la cabecera corresponde a un archivo de la versión actual.
+static inline int trigramas_cabecera_valida(const TrigramasCabecera *cab) {
+    return memcmp(cab->magia, TRIGRAMAS_MAGIA, sizeof(TRIGRAMAS_MAGIA)) == 0 &&
+           cab->version == TRIGRAMAS_VERSION &&
+           cab->tam_bloque == TRIGRAMAS_TAM_BLOQUE &&
+           cab->desp_directorio == trigramas_desp_directorio() &&
+           cab->desp_listas == cab->desp_directorio + cab->num_trigramas * sizeof(TrigramaClave);
+}
+
+/*
+ * Normaliza un texto UTF-8 para compararlo sin distinguir mayúsculas ni
+ * acentos: pasa a minúsculas las letras ASCII, cambia las letras latinas
+ * con diacríticos (Latin-1 y Latin Extended-A) por su letra base (ß y æ
+ * por "ss" y "ae") y quita las marcas diacríticas combinables. El resto de
+ * los bytes se copia tal cual. Escribe como mucho cap - 1 bytes en dest,
+ * sin cortar un carácter a la mitad, y termina en '\0'. Devuelve la
+ * longitud escrita.
+ */
+size_t trigramas_normalizar(const char *texto, size_t len, char *dest, size_t cap);
+
+/*
+ * Deja en trigramas los trigramas distintos del texto normalizado, en
+ * orden creciente, y devuelve cuántos son (como mucho len - 2).
+ */
+size_t trigramas_extraer(const char *normalizado, size_t len, uint32_t *trigramas);
+
+#endif
@@ -2,16 +2,28 @@
  * ui_client.c: Proceso CLIENTE con interfaz GTK.
  * Se conecta a un servidor de búsqueda de Spotify a través de un socket TCP/IP.
  * Envía consultas de búsqueda y muestra los resultados recibidos.
+ * Mantiene una única conexión abierta y usa el protocolo de tramas
+ * (ver protocolo.h), así no paga una conexión TCP nueva por búsqueda.
+ * La red la atiende un hilo aparte, de modo que la ventana nunca se queda
+ * esperando al servidor: cada trama de la respuesta se añade a los
+ * resultados en cuanto llega, y una búsqueda nueva (al escribir en los
+ * campos o con el botón) deja sin efecto la que estaba en curso.
  * La IP y el puerto del servidor se pasan como argumentos de línea de comandos.
  */
 #include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "protocolo.h"
 
-#define MAX_RESULTS_BUFFER 65536
+#define RETARDO_ESCRITURA_MS 150 // Pausa al escribir antes de lanzar la búsqueda
+#define RETARDO_BUSCANDO_MS 200  // Espera antes de mostrar "Buscando..."
+#define MAX_CARGA_RESPUESTA (16 * 1024 * 1024)
 
 // Estructura para pasar datos a los callbacks de GTK
 typedef struct {
@@ -21,73 +33,301 @@ typedef struct {
     GtkTextBuffer *buffer_resultado;
     char *server_ip; // IP del servidor
     int server_port; // Puerto del servidor
+    // Solo del hilo principal
+    uint32_t siguiente_id; // Identificador de la próxima petición
+    uint32_t mostrada;     // Última búsqueda con resultados en pantalla
+    guint temporizador;    // Búsqueda programada al escribir (0: ninguna)
+    gint ultima;           // Búsqueda vigente; se lee desde el hilo de red (atómico)
+    // Consulta que el hilo principal deja al hilo de red
+    GMutex cerrojo;
+    char *pendiente;       // Protegida por cerrojo, como pendiente_id y salir
+    uint32_t pendiente_id;
+    gboolean salir;
+    int aviso[2];          // Tubo que despierta al hilo de red
+    GThread *hilo;
 } AppWidgets;
 
-// Función que se ejecuta al presionar el botón de búsqueda
-static void buscar_accion(GtkButton *button, gpointer user_data) {
-    AppWidgets *widgets = (AppWidgets *)user_data;
-
-    const char *album_q = gtk_entry_get_text(GTK_ENTRY(widgets->album_entrada));
-    const char *artista_q = gtk_entry_get_text(GTK_ENTRY(widgets->artista_entrada));
-    const char *cancion_q = gtk_entry_get_text(GTK_ENTRY(widgets->cancion_entrada));
+// Estado del hilo de red: la conexión persistente y la búsqueda en curso.
+typedef struct {
+    int sock;              // -1 si no hay conexión
+    uint32_t en_curso;     // Búsqueda cuya respuesta se espera (0: ninguna)
+    char *consulta;        // Su texto, para reenviarla si se cae la conexión
+    gboolean recibida;     // Ya llegó alguna trama de su respuesta
+    gboolean reintentada;
+    GByteArray *entrada;   // Bytes recibidos que aún no forman una trama
+} Red;
 
-    if (strlen(album_q) == 0 || strlen(artista_q) == 0) {
-        gtk_text_buffer_set_text(widgets->buffer_resultado, "Error: Los campos de Álbum y Artista son obligatorios.", -1);
-        return;
-    }
+// Parte de una respuesta que el hilo de red pasa al principal.
+typedef struct {
+    AppWidgets *widgets;
+    uint32_t id;
+    gboolean error;        // Mensaje que reemplaza los resultados
+    size_t len;
+    char texto[];
+} Trozo;
 
-    char query_string[1024];
-    snprintf(query_string, sizeof(query_string), "%s|%s|%s", album_q, artista_q, cancion_q);
+// Abre la conexión con el servidor si no hay una abierta.
+// Devuelve 0 o -1 dejando en error_msg la causa.
+static int asegurar_conexion(AppWidgets *widgets, Red *red, char *error_msg, size_t error_tam) {
+    if (red->sock >= 0) return 0;
 
-    // --- Lógica de Sockets (Cliente) ---
-    int sock = 0;
     struct sockaddr_in serv_addr;
-    char buffer_resultado[MAX_RESULTS_BUFFER] = {0};
-
-    // Crear socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        gtk_text_buffer_set_text(widgets->buffer_resultado, "Error: Falló la creación del socket.", -1);
-        return;
-    }
-
+    memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(widgets->server_port);
 
     // Convertir dirección IP de texto a binario
     if (inet_pton(AF_INET, widgets->server_ip, &serv_addr.sin_addr) <= 0) {
-        gtk_text_buffer_set_text(widgets->buffer_resultado, "Error: Dirección IP inválida o no soportada.", -1);
-        close(sock);
-        return;
+        snprintf(error_msg, error_tam, "Error: Dirección IP inválida o no soportada.");
+        return -1;
+    }
+
+    // Crear socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        snprintf(error_msg, error_tam, "Error: Falló la creación del socket.");
+        return -1;
     }
 
     // Conectar al servidor
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Error: No se pudo conectar al servidor en %s:%d.", widgets->server_ip, widgets->server_port);
-        gtk_text_buffer_set_text(widgets->buffer_resultado, error_msg, -1);
+        snprintf(error_msg, error_tam, "Error: No se pudo conectar al servidor en %s:%d.", widgets->server_ip, widgets->server_port);
         close(sock);
+        return -1;
+    }
+    red->sock = sock;
+    return 0;
+}
+
+static void cerrar_conexion(Red *red) {
+    if (red->sock >= 0) close(red->sock);
+    red->sock = -1;
+    g_byte_array_set_size(red->entrada, 0);
+}
+
+static int enviar_completo(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Muestra un trozo de respuesta si sigue siendo de la búsqueda vigente. Se
+// ejecuta en el hilo principal.
+static gboolean mostrar_trozo(gpointer datos) {
+    Trozo *trozo = datos;
+    AppWidgets *widgets = trozo->widgets;
+    if (trozo->id == (uint32_t)g_atomic_int_get(&widgets->ultima)) {
+        // El primer trozo reemplaza los resultados anteriores o el "Buscando...".
+        GtkTextIter fin;
+        if (widgets->mostrada != trozo->id || trozo->error) gtk_text_buffer_set_text(widgets->buffer_resultado, "", -1);
+        widgets->mostrada = trozo->id;
+        gtk_text_buffer_get_end_iter(widgets->buffer_resultado, &fin);
+        gtk_text_buffer_insert(widgets->buffer_resultado, &fin, trozo->texto, trozo->len);
+    }
+    g_free(trozo);
+    return G_SOURCE_REMOVE;
+}
+
+// Pasa al hilo principal un trozo de la respuesta de la búsqueda id.
+static void entregar(AppWidgets *widgets, uint32_t id, gboolean error, const char *texto, size_t len) {
+    Trozo *trozo = g_malloc(sizeof(Trozo) + len);
+    trozo->widgets = widgets;
+    trozo->id = id;
+    trozo->error = error;
+    trozo->len = len;
+    memcpy(trozo->texto, texto, len);
+    g_idle_add(mostrar_trozo, trozo);
+}
+
+static void enviar_consulta(AppWidgets *widgets, Red *red);
+
+// La conexión falló: se cierra y, si la búsqueda en curso aún no recibió
+// nada (p. ej. el servidor se reinició), se reenvía una vez por una nueva.
+static void fallo_conexion(AppWidgets *widgets, Red *red) {
+    cerrar_conexion(red);
+    if (!red->en_curso) return;
+    if (!red->recibida && !red->reintentada) {
+        red->reintentada = TRUE;
+        enviar_consulta(widgets, red);
+        return;
+    }
+    const char *mensaje = "No se recibió respuesta del servidor o la conexión se cerró.";
+    entregar(widgets, red->en_curso, TRUE, mensaje, strlen(mensaje));
+    red->en_curso = 0;
+}
+
+// Envía la búsqueda en curso por la conexión persistente. Las respuestas
+// de búsquedas anteriores que sigan llegando se descartan por su id.
+static void enviar_consulta(AppWidgets *widgets, Red *red) {
+    char error_msg[256];
+    if (asegurar_conexion(widgets, red, error_msg, sizeof(error_msg)) != 0) {
+        entregar(widgets, red->en_curso, TRUE, error_msg, strlen(error_msg));
+        red->en_curso = 0;
         return;
     }
+    size_t query_len = strlen(red->consulta);
+    if (query_len > PROTO_MAX_CONSULTA) query_len = PROTO_MAX_CONSULTA;
+    char trama[PROTO_CABECERA_TAM + PROTO_MAX_CONSULTA];
+    proto_escribir_cabecera(trama, PROTO_CONSULTA, 0, red->en_curso, query_len);
+    memcpy(trama + PROTO_CABECERA_TAM, red->consulta, query_len);
+    if (enviar_completo(red->sock, trama, PROTO_CABECERA_TAM + query_len) != 0) fallo_conexion(widgets, red);
+}
+
+// Lee lo que haya llegado y entrega las tramas completas de la búsqueda en curso.
+static void recibir(AppWidgets *widgets, Red *red) {
+    guint8 buffer[65536];
+    ssize_t n = read(red->sock, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) {
+        fallo_conexion(widgets, red);
+        return;
+    }
+    g_byte_array_append(red->entrada, buffer, n);
+
+    size_t usado = 0;
+    while (red->entrada->len - usado >= PROTO_CABECERA_TAM) {
+        TramaCabecera cab;
+        if (proto_leer_cabecera(red->entrada->data + usado, &cab) != 0 || cab.longitud > MAX_CARGA_RESPUESTA) {
+            fallo_conexion(widgets, red);
+            return;
+        }
+        if (red->entrada->len - usado - PROTO_CABECERA_TAM < cab.longitud) break;
+        const char *carga = (const char *)red->entrada->data + usado + PROTO_CABECERA_TAM;
+        usado += PROTO_CABECERA_TAM + cab.longitud;
+        if (cab.id != red->en_curso) continue;
+        red->recibida = TRUE;
+        entregar(widgets, cab.id, FALSE, carga, cab.longitud);
+        if (!(cab.banderas & PROTO_CONTINUA)) red->en_curso = 0;
+    }
+    g_byte_array_remove_range(red->entrada, 0, usado);
+}
+
+// Hilo de red: espera consultas nuevas (avisadas por el tubo) y, mientras
+// hay una en curso, las tramas de su respuesta.
+static gpointer hilo_de_red(gpointer datos) {
+    AppWidgets *widgets = datos;
+    Red red = {-1, 0, NULL, FALSE, FALSE, g_byte_array_new()};
+    while (1) {
+        struct pollfd fds[2] = {{widgets->aviso[0], POLLIN, 0}, {red.sock, POLLIN, 0}};
+        nfds_t n = red.en_curso && red.sock >= 0 ? 2 : 1;
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            char vaciar[64];
+            while (read(widgets->aviso[0], vaciar, sizeof(vaciar)) > 0) {}
+            g_mutex_lock(&widgets->cerrojo);
+            char *consulta = widgets->pendiente;
+            uint32_t id = widgets->pendiente_id;
+            gboolean salir = widgets->salir;
+            widgets->pendiente = NULL;
+            g_mutex_unlock(&widgets->cerrojo);
+            if (salir) {
+                g_free(consulta);
+                break;
+            }
+            if (consulta) {
+                g_free(red.consulta);
+                red.consulta = consulta;
+                red.en_curso = id;
+                red.recibida = FALSE;
+                red.reintentada = FALSE;
+                enviar_consulta(widgets, &red);
+            }
+        }
+        if (n == 2 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) recibir(widgets, &red);
+    }
+    cerrar_conexion(&red);
+    g_byte_array_free(red.entrada, TRUE);
+    g_free(red.consulta);
+    return NULL;
+}
+
+// Muestra "Buscando..." si la búsqueda vigente tarda en responder.
+static gboolean mostrar_buscando(gpointer user_data) {
+    AppWidgets *widgets = user_data;
+    if (widgets->mostrada != (uint32_t)g_atomic_int_get(&widgets->ultima)) {
+        gtk_text_buffer_set_text(widgets->buffer_resultado, "Buscando...", -1);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Da por vigente una búsqueda nueva; lo que llegue de las anteriores ya no
+// se muestra. Devuelve su identificador.
+static uint32_t nueva_busqueda(AppWidgets *widgets) {
+    uint32_t id = widgets->siguiente_id++;
+    g_atomic_int_set(&widgets->ultima, (gint)id);
+    return id;
+}
 
-    // Actualizar UI para mostrar que se está buscando
-    gtk_text_buffer_set_text(widgets->buffer_resultado, "Buscando...", -1);
-    while (gtk_events_pending()) { gtk_main_iteration(); }
+// Pasa la consulta al hilo de red, reemplazando la que no haya enviado aún.
+static void lanzar_busqueda(AppWidgets *widgets, const char *query_string) {
+    uint32_t id = nueva_busqueda(widgets);
+    g_mutex_lock(&widgets->cerrojo);
+    g_free(widgets->pendiente);
+    widgets->pendiente = g_strdup(query_string);
+    widgets->pendiente_id = id;
+    g_mutex_unlock(&widgets->cerrojo);
+    // Si el tubo está lleno, el hilo ya tiene un aviso por leer.
+    if (write(widgets->aviso[1], "", 1) < 0 && errno != EAGAIN) perror("write");
+    g_timeout_add(RETARDO_BUSCANDO_MS, mostrar_buscando, widgets);
+}
 
-    // Enviar la consulta al servidor
-    send(sock, query_string, strlen(query_string), 0);
+// Arma la consulta con los tres campos. Con al_escribir no muestra errores
+// mientras los campos aún no forman una búsqueda válida.
+static void buscar(AppWidgets *widgets, gboolean al_escribir) {
+    const char *album_q = gtk_entry_get_text(GTK_ENTRY(widgets->album_entrada));
+    const char *artista_q = gtk_entry_get_text(GTK_ENTRY(widgets->artista_entrada));
+    const char *cancion_q = gtk_entry_get_text(GTK_ENTRY(widgets->cancion_entrada));
 
-    // Leer la respuesta del servidor
-    ssize_t bytes_read = read(sock, buffer_resultado, sizeof(buffer_resultado) - 1);
+    // Basta con uno de los tres campos: sin álbum ni artista se busca solo
+    // por canción, y con uno solo de ellos, todas sus filas.
+    if (strlen(album_q) == 0 && strlen(artista_q) == 0 && strlen(cancion_q) == 0) {
+        nueva_busqueda(widgets);
+        gtk_text_buffer_set_text(widgets->buffer_resultado,
+                                 al_escribir ? "" : "Error: Escriba al menos el Álbum, el Artista o la Canción.", -1);
+        return;
+    }
+    // La búsqueda solo por canción necesita 3 caracteres; el servidor lo
+    // explica si se pide con el botón.
+    if (al_escribir && strlen(album_q) == 0 && strlen(artista_q) == 0 && g_utf8_strlen(cancion_q, -1) < 3) return;
 
-    if (bytes_read > 0) {
-        buffer_resultado[bytes_read] = '\0';
-        gtk_text_buffer_set_text(widgets->buffer_resultado, buffer_resultado, -1);
-    } else {
-        gtk_text_buffer_set_text(widgets->buffer_resultado, "No se recibió respuesta del servidor o la conexión se cerró.", -1);
+    char query_string[1024];
+    snprintf(query_string, sizeof(query_string), "%s|%s|%s", album_q, artista_q, cancion_q);
+    lanzar_busqueda(widgets, query_string);
+}
+
+// Función que se ejecuta al presionar el botón de búsqueda
+static void buscar_accion(GtkButton *button, gpointer user_data) {
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    (void)button;
+    if (widgets->temporizador) {
+        g_source_remove(widgets->temporizador);
+        widgets->temporizador = 0;
     }
+    buscar(widgets, FALSE);
+}
 
-    // Cerrar el socket
-    close(sock);
+static gboolean buscar_al_escribir(gpointer user_data) {
+    AppWidgets *widgets = user_data;
+    widgets->temporizador = 0;
+    buscar(widgets, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+// Al cambiar un campo se espera una pausa en la escritura antes de buscar.
+static void campo_cambiado(GtkEditable *editable, gpointer user_data) {
+    AppWidgets *widgets = user_data;
+    (void)editable;
+    if (widgets->temporizador) g_source_remove(widgets->temporizador);
+    widgets->temporizador = g_timeout_add(RETARDO_ESCRITURA_MS, buscar_al_escribir, widgets);
 }
 
 int main(int argc, char *argv[]) {
@@ -113,17 +353,26 @@ int main(int argc, char *argv[]) {
     gtk_grid_set_column_spacing(GTK_GRID(grid), 10);
     gtk_container_add(GTK_CONTAINER(window), grid);
 
-    AppWidgets *widgets = g_slice_new(AppWidgets);
+    AppWidgets *widgets = g_slice_new0(AppWidgets);
     widgets->server_ip = server_ip;
     widgets->server_port = server_port;
+    widgets->siguiente_id = 1;
+    g_mutex_init(&widgets->cerrojo);
+    if (pipe(widgets->aviso) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    fcntl(widgets->aviso[0], F_SETFL, O_NONBLOCK);
+    fcntl(widgets->aviso[1], F_SETFL, O_NONBLOCK);
+    widgets->hilo = g_thread_new("red", hilo_de_red, widgets);
 
     // Criterios de búsqueda
     widgets->album_entrada = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->album_entrada), "Criterio 1: Obligatorio");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->album_entrada), "Criterio 1: Álbum exacto");
     widgets->artista_entrada = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->artista_entrada), "Criterio 2: Obligatorio");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->artista_entrada), "Criterio 2: Artista exacto");
     widgets->cancion_entrada = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->cancion_entrada), "Criterio 3: Opcional");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(widgets->cancion_entrada), "Criterio 3: Parte del nombre (opcional)");
 
     // Área de resultados con Scroll
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
@@ -152,11 +401,23 @@ int main(int argc, char *argv[]) {
     gtk_grid_attach(GTK_GRID(grid), scrolled_window, 0, 5, 3, 1);
 
     g_signal_connect(boton_buscar, "clicked", G_CALLBACK(buscar_accion), widgets);
+    g_signal_connect(widgets->album_entrada, "changed", G_CALLBACK(campo_cambiado), widgets);
+    g_signal_connect(widgets->artista_entrada, "changed", G_CALLBACK(campo_cambiado), widgets);
+    g_signal_connect(widgets->cancion_entrada, "changed", G_CALLBACK(campo_cambiado), widgets);
     g_signal_connect(boton_salir, "clicked", G_CALLBACK(gtk_main_quit), NULL);
 
     gtk_widget_show_all(window);
     gtk_main();
 
+    g_mutex_lock(&widgets->cerrojo);
+    widgets->salir = TRUE;
+    g_mutex_unlock(&widgets->cerrojo);
+    if (write(widgets->aviso[1], "", 1) < 0 && errno != EAGAIN) perror("write");
+    g_thread_join(widgets->hilo);
+    close(widgets->aviso[0]);
+    close(widgets->aviso[1]);
+    g_free(widgets->pendiente);
+    g_mutex_clear(&widgets->cerrojo);
     g_slice_free(AppWidgets, widgets);
     return 0;
 }